@@ -0,0 +1,39 @@
+# virtualfpu_add_formulas(<target> <formula file> [FMA] [DEFINES NAME=VALUE ...])
+#
+# Transpile the formulas of a formula file (see virtualfpu --help) to C++ and compile them
+# into the static library <target>. The functions are declared in <target>.h:
+#
+#   virtualfpu_add_formulas(pricing formulas/pricing.vfpu DEFINES rate=0.05)
+#   target_link_libraries(app PRIVATE pricing)
+#
+# The code is compiled without floating point contraction so the results are the same as the interpreter.
+# FMA transpiles the formulas as the interpreter with setFusedMultiplyAdd(true): the multiply-adds are std::fma calls.
+function(virtualfpu_add_formulas target formulas)
+    cmake_parse_arguments(ARG "FMA" "" "DEFINES" ${ARGN})
+
+    get_filename_component(source "${formulas}" ABSOLUTE)
+    set(dir "${CMAKE_CURRENT_BINARY_DIR}/${target}")
+
+    set(defines)
+    foreach(define IN LISTS ARG_DEFINES)
+        list(APPEND defines --define ${define})
+    endforeach()
+    if(ARG_FMA)
+        list(APPEND defines --fma)
+    endif()
+
+    add_custom_command(
+        OUTPUT "${dir}/${target}.cpp" "${dir}/${target}.h"
+        COMMAND ${CMAKE_COMMAND} -E make_directory "${dir}"
+        COMMAND virtualfpu ${defines} --transpile "${source}" -o "${dir}/${target}.cpp" --header "${dir}/${target}.h"
+        DEPENDS "${source}" virtualfpu
+        COMMENT "Transpiling ${formulas}"
+        VERBATIM)
+
+    add_library(${target} STATIC "${dir}/${target}.cpp" "${dir}/${target}.h")
+    target_include_directories(${target} PUBLIC "${dir}")
+
+    if(CMAKE_CXX_COMPILER_ID MATCHES "GNU|Clang")
+        target_compile_options(${target} PRIVATE -ffp-contract=off)
+    endif()
+endfunction()
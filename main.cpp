@@ -3,46 +3,1258 @@
  * Author: Proprietario
  *
  * Created on 8 febbraio 2014, 16.03
+ *
+ * virtualfpu command line evaluator.
+ * Reads rows of column data (CSV or raw little-endian doubles) from stdin or from a file,
+ * evaluates one or more expressions for each row and streams the results to stdout or to a file.
+ * Rows are processed in chunks so the memory used does not depend on the size of the input.
+ *
+ * Example:
+ *   virtualfpu -i data.csv "r=sqrt(x^2+y^2)" "atan(y/x)"
  */
 
 #include <cstdlib>
-#include <iostream>
-#include "virtualfpu.h"
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+#include <cstdint>
+#include <charconv>
+#include <bit>
 #include <cmath>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <algorithm>
+#include "virtualfpu.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define VFPU_HAS_MMAP 1
+#endif
 
 using namespace virtualfpu;
 
-/**
- *
- */
-int main(int argc, char **argv)
+namespace
 {
 
-    try
+    const size_t DEFAULT_CHUNK_ROWS = 4096;
+    const size_t READ_BUFFER_SIZE = 1 << 20;
+    const size_t WRITE_BUFFER_SIZE = 1 << 20;
+
+    enum class Format
+    {
+        CSV, BIN
+    };
+
+    struct Options
+    {
+        const char *input = nullptr;
+        const char *output = nullptr;
+        Format inputFormat = Format::CSV;
+        Format outputFormat = Format::CSV;
+        std::vector<std::string> columns;
+        std::vector<std::pair<std::string, double>> defines;
+        std::vector<std::pair<std::string, std::string>> expressions;
+        char delimiter = ',';
+        size_t chunkRows = DEFAULT_CHUNK_ROWS;
+        bool inputHeader = true;
+        bool outputHeader = true;
+        size_t benchmarkProducers = 0;
+        size_t benchmarkRequests = 100000;
+        size_t benchmarkInFlight = 1;
+        size_t benchmarkLatency = 100;
+        const char *transpile = nullptr;
+        const char *header = nullptr;
+        bool fusedMultiplyAdd = false;
+    };
+
+    class CliError : public std::exception
+    {
+    public:
+
+        explicit CliError(const std::string &msg) : msg(msg)
+        {
+        }
+
+        const char *what() const noexcept override
+        {
+            return msg.c_str();
+        }
+
+    private:
+
+        std::string msg;
+    };
+
+    /**
+     * Window over the input bytes.
+     * Regular files are memory mapped, other inputs (pipes, stdin) are read into a growing buffer.
+     */
+    class InputSource
+    {
+    public:
+
+        explicit InputSource(const char *path)
+        {
+            if (!path || std::string_view(path) == "-")
+            {
+                file = stdin;
+                return;
+            }
+
+#ifdef VFPU_HAS_MMAP
+            fd = ::open(path, O_RDONLY);
+
+            if (fd < 0)
+            {
+                throw CliError(std::string("cannot open ") + path + ": " + std::strerror(errno));
+            }
+
+            struct stat st;
+
+            if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+            {
+                void *p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+                if (p != MAP_FAILED)
+                {
+                    mapped = static_cast<const char *> (p);
+                    mappedSize = st.st_size;
+                    ::madvise(p, mappedSize, MADV_SEQUENTIAL);
+                    begin = mapped;
+                    end = mapped + mappedSize;
+                    return;
+                }
+            }
+
+            ::close(fd);
+            fd = -1;
+#endif
+            file = std::fopen(path, "rb");
+
+            if (!file)
+            {
+                throw CliError(std::string("cannot open ") + path + ": " + std::strerror(errno));
+            }
+        }
+
+        ~InputSource()
+        {
+#ifdef VFPU_HAS_MMAP
+            if (mapped)
+            {
+                ::munmap(const_cast<char *> (mapped), mappedSize);
+            }
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+#endif
+            if (file && file != stdin)
+            {
+                std::fclose(file);
+            }
+        }
+
+        InputSource(const InputSource &) = delete;
+        InputSource &operator=(const InputSource &) = delete;
+
+        const char *data() const
+        {
+            return begin;
+        }
+
+        size_t size() const
+        {
+            return end - begin;
+        }
+
+        void consume(size_t n)
+        {
+            begin += n;
+#ifdef VFPU_HAS_MMAP
+            //drop the pages already processed so the resident memory stays bounded
+            if (mapped)
+            {
+                const size_t page = ::sysconf(_SC_PAGESIZE);
+                const size_t done = (begin - mapped) / page * page;
+                if (done - released >= (64u << 20))
+                {
+                    ::madvise(const_cast<char *> (mapped) + released, done - released, MADV_DONTNEED);
+                    released = done;
+                }
+            }
+#endif
+        }
+
+        /**
+         * Append more input to the window
+         * @return false when no more data is available
+         */
+        bool refill()
+        {
+            if (!file || atEof)
+            {
+                return false;
+            }
+
+            const size_t pending = size();
+
+            if (buffer.empty())
+            {
+                buffer.resize(READ_BUFFER_SIZE);
+            }
+            else if (pending == buffer.size())
+            {
+                //a single record larger than the buffer
+                buffer.resize(buffer.size() * 2);
+            }
+
+            std::memmove(buffer.data(), begin, pending);
+
+            const size_t n = std::fread(buffer.data() + pending, 1, buffer.size() - pending, file);
+
+            if (n == 0)
+            {
+                if (std::ferror(file))
+                {
+                    throw CliError(std::string("read error: ") + std::strerror(errno));
+                }
+                atEof = true;
+            }
+
+            begin = buffer.data();
+            end = begin + pending + n;
+
+            return n > 0;
+        }
+
+        /**
+         * Next line without the line terminator
+         * @return false at the end of the input
+         */
+        bool nextLine(std::string_view &line)
+        {
+            for (;;)
+            {
+                const char *nl = size() ? static_cast<const char *> (std::memchr(begin, '\n', size())) : nullptr;
+
+                if (nl)
+                {
+                    line = std::string_view(begin, nl - begin);
+                    consume(nl - begin + 1);
+                    break;
+                }
+
+                if (!refill())
+                {
+                    if (size() == 0)
+                    {
+                        return false;
+                    }
+                    line = std::string_view(begin, size());
+                    consume(size());
+                    break;
+                }
+            }
+
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.remove_suffix(1);
+            }
+
+            return true;
+        }
+
+    private:
+
+        FILE *file = nullptr;
+        int fd = -1;
+        const char *mapped = nullptr;
+        size_t mappedSize = 0;
+        size_t released = 0;
+        std::vector<char> buffer;
+        const char *begin = nullptr;
+        const char *end = nullptr;
+        bool atEof = false;
+    };
+
+    /**
+     * Buffered output writer
+     */
+    class OutputSink
+    {
+    public:
+
+        explicit OutputSink(const char *path)
+        {
+            if (!path || std::string_view(path) == "-")
+            {
+                file = stdout;
+            }
+            else
+            {
+                file = std::fopen(path, "wb");
+
+                if (!file)
+                {
+                    throw CliError(std::string("cannot create ") + path + ": " + std::strerror(errno));
+                }
+            }
+
+            buffer.resize(WRITE_BUFFER_SIZE);
+        }
+
+        ~OutputSink()
+        {
+            if (file && file != stdout)
+            {
+                std::fclose(file);
+            }
+        }
+
+        OutputSink(const OutputSink &) = delete;
+        OutputSink &operator=(const OutputSink &) = delete;
+
+        void write(const char *p, size_t n)
+        {
+            if (used + n > buffer.size())
+            {
+                flush();
+                if (n > buffer.size())
+                {
+                    writeRaw(p, n);
+                    return;
+                }
+            }
+            std::memcpy(buffer.data() + used, p, n);
+            used += n;
+        }
+
+        void write(std::string_view s)
+        {
+            write(s.data(), s.size());
+        }
+
+        void put(char ch)
+        {
+            if (used == buffer.size())
+            {
+                flush();
+            }
+            buffer[used++] = ch;
+        }
+
+        void writeNumber(double value)
+        {
+            if (buffer.size() - used < 32)
+            {
+                flush();
+            }
+            const auto r = std::to_chars(buffer.data() + used, buffer.data() + buffer.size(), value);
+            used = r.ptr - buffer.data();
+        }
+
+        void flush()
+        {
+            writeRaw(buffer.data(), used);
+            used = 0;
+        }
+
+        void close()
+        {
+            flush();
+            if (std::fflush(file) != 0)
+            {
+                throw CliError(std::string("write error: ") + std::strerror(errno));
+            }
+        }
+
+    private:
+
+        void writeRaw(const char *p, size_t n)
+        {
+            if (n && std::fwrite(p, 1, n, file) != n)
+            {
+                throw CliError(std::string("write error: ") + std::strerror(errno));
+            }
+        }
+
+        FILE *file = nullptr;
+        std::vector<char> buffer;
+        size_t used = 0;
+    };
+
+    double toLittleEndian(double value)
+    {
+        if constexpr (std::endian::native == std::endian::big)
+        {
+            uint64_t bits = std::bit_cast<uint64_t> (value);
+            uint64_t swapped = 0;
+            for (int i = 0; i < 8; ++i)
+            {
+                swapped = (swapped << 8) | ((bits >> (i * 8)) & 0xff);
+            }
+            return std::bit_cast<double> (swapped);
+        }
+        return value;
+    }
+
+    std::string_view trim(std::string_view s)
+    {
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        {
+            s.remove_prefix(1);
+        }
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        {
+            s.remove_suffix(1);
+        }
+        return s;
+    }
+
+    std::string_view unquote(std::string_view s)
+    {
+        s = trim(s);
+        if (s.size() >= 2 && s.front() == '"' && s.back() == '"')
+        {
+            s = s.substr(1, s.size() - 2);
+        }
+        return s;
+    }
+
+    std::vector<std::string_view> splitFields(std::string_view line, char delimiter)
+    {
+        std::vector<std::string_view> fields;
+        size_t start = 0;
+        for (;;)
+        {
+            const size_t pos = line.find(delimiter, start);
+            if (pos == std::string_view::npos)
+            {
+                fields.push_back(line.substr(start));
+                break;
+            }
+            fields.push_back(line.substr(start, pos - start));
+            start = pos + 1;
+        }
+        return fields;
+    }
+
+    bool parseDouble(std::string_view field, double &value)
+    {
+        field = unquote(field);
+
+        if (field.empty())
+        {
+            value = std::numeric_limits<double>::quiet_NaN();
+            return true;
+        }
+
+        if (field.front() == '+')
+        {
+            field.remove_prefix(1);
+        }
+
+        const auto r = std::from_chars(field.data(), field.data() + field.size(), value);
+
+        return r.ec == std::errc() && r.ptr == field.data() + field.size();
+    }
+
+    bool isIdentifier(std::string_view s)
+    {
+        if (s.empty() || !std::isalpha(static_cast<unsigned char> (s[0])))
+        {
+            return false;
+        }
+        for (char ch : s)
+        {
+            if (!std::isalnum(static_cast<unsigned char> (ch)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void printUsage(FILE *out)
+    {
+        std::fputs(
+                "usage: virtualfpu [options] [name=]expression ...\n"
+                "Evaluates the expressions for each row of the input, variables are bound to the columns by name.\n"
+                "\n"
+                "  -i, --input FILE            input file (default stdin), regular files are memory mapped\n"
+                "  -o, --output FILE           output file (default stdout)\n"
+                "  -f, --format csv|bin        input format (default csv)\n"
+                "  -F, --output-format csv|bin output format (default csv)\n"
+                "  -c, --columns a,b,...       column names: required for bin input, replace the csv header\n"
+                "  -d, --delimiter C           csv delimiter (default ,)\n"
+                "  -n, --chunk ROWS            rows evaluated per batch (default 4096)\n"
+                "  -D, --define NAME=VALUE     define a constant variable\n"
+                "      --fma                   contract the multiply-adds into fused multiply-adds (std::fma)\n"
+                "      --no-header             the csv input has no header line (requires --columns)\n"
+                "      --no-output-header      do not write the csv header line\n"
+                "      --queue-benchmark P[,R[,F]]\n"
+                "                              benchmark P producer threads evaluating R single rows each (default 100000)\n"
+                "                              with their own compilers and with a shared EvaluationQueue (F requests in flight,\n"
+                "                              default 1); the variables are the --columns, --chunk is the maximum batch size\n"
+                "      --max-latency US        latency bound of the queue benchmark (default 100)\n"
+                "      --transpile FILE        write the C++ source of the formulas of FILE to the output (see below)\n"
+                "      --header FILE           write the declarations of the transpiled formulas to FILE\n"
+                "  -h, --help                  print this help\n"
+                "\n"
+                "bin input and output are rows of raw little-endian doubles (one value per column).\n"
+                "Empty csv fields are read as NaN.\n"
+                "\n"
+                "A formula file has a formula on each line: name(x, y, ...) = expression. The formula is transpiled to\n"
+                "double name(double x, double y, ...), the other variables are the --define constants.\n"
+                "A line extern name declares a custom function linked with the formulas, # starts a comment.\n", out);
+    }
+
+    Format parseFormat(const std::string &s)
+    {
+        if (s == "csv")
+        {
+            return Format::CSV;
+        }
+        if (s == "bin")
+        {
+            return Format::BIN;
+        }
+        throw CliError("invalid format " + s + " (expected csv or bin)");
+    }
+
+    Options parseOptions(int argc, char **argv)
+    {
+        Options opt;
+
+        for (int i = 1; i < argc; ++i)
+        {
+            const std::string arg = argv[i];
+
+            auto value = [&]() -> const char *
+            {
+                if (i + 1 >= argc)
+                {
+                    throw CliError("missing value for " + arg);
+                }
+                return argv[++i];
+            };
+
+            if (arg == "-h" || arg == "--help")
+            {
+                printUsage(stdout);
+                std::exit(0);
+            }
+            else if (arg == "-i" || arg == "--input")
+            {
+                opt.input = value();
+            }
+            else if (arg == "-o" || arg == "--output")
+            {
+                opt.output = value();
+            }
+            else if (arg == "-f" || arg == "--format")
+            {
+                opt.inputFormat = parseFormat(value());
+            }
+            else if (arg == "-F" || arg == "--output-format")
+            {
+                opt.outputFormat = parseFormat(value());
+            }
+            else if (arg == "-c" || arg == "--columns")
+            {
+                opt.columns.clear();
+                for (auto name : splitFields(value(), ','))
+                {
+                    opt.columns.emplace_back(trim(name));
+                }
+            }
+            else if (arg == "-d" || arg == "--delimiter")
+            {
+                const std::string d = value();
+                if (d == "\\t" || d == "tab")
+                {
+                    opt.delimiter = '\t';
+                }
+                else if (d.size() == 1)
+                {
+                    opt.delimiter = d[0];
+                }
+                else
+                {
+                    throw CliError("the delimiter must be a single character");
+                }
+            }
+            else if (arg == "-n" || arg == "--chunk")
+            {
+                const std::string v = value();
+                const auto r = std::from_chars(v.data(), v.data() + v.size(), opt.chunkRows);
+                if (r.ec != std::errc() || opt.chunkRows == 0)
+                {
+                    throw CliError("invalid chunk size " + v);
+                }
+            }
+            else if (arg == "-D" || arg == "--define")
+            {
+                const std::string def = value();
+                const size_t eq = def.find('=');
+                double v = 0;
+                if (eq == std::string::npos || !parseDouble(std::string_view(def).substr(eq + 1), v))
+                {
+                    throw CliError("invalid definition " + def + " (expected NAME=VALUE)");
+                }
+                opt.defines.emplace_back(def.substr(0, eq), v);
+            }
+            else if (arg == "--queue-benchmark")
+            {
+                const std::string v = value();
+                const auto fields = splitFields(v, ',');
+                size_t *targets[] = {&opt.benchmarkProducers, &opt.benchmarkRequests, &opt.benchmarkInFlight};
+                if (fields.size() > 3)
+                {
+                    throw CliError("invalid queue benchmark " + v + " (expected PRODUCERS[,REQUESTS[,IN_FLIGHT]])");
+                }
+                for (size_t f = 0; f < fields.size(); ++f)
+                {
+                    const auto r = std::from_chars(fields[f].data(), fields[f].data() + fields[f].size(), *targets[f]);
+                    if (r.ec != std::errc() || *targets[f] == 0)
+                    {
+                        throw CliError("invalid queue benchmark " + v + " (expected PRODUCERS[,REQUESTS[,IN_FLIGHT]])");
+                    }
+                }
+            }
+            else if (arg == "--max-latency")
+            {
+                const std::string v = value();
+                const auto r = std::from_chars(v.data(), v.data() + v.size(), opt.benchmarkLatency);
+                if (r.ec != std::errc())
+                {
+                    throw CliError("invalid latency " + v);
+                }
+            }
+            else if (arg == "--transpile")
+            {
+                opt.transpile = value();
+            }
+            else if (arg == "--header")
+            {
+                opt.header = value();
+            }
+            else if (arg == "--fma")
+            {
+                opt.fusedMultiplyAdd = true;
+            }
+            else if (arg == "--no-header")
+            {
+                opt.inputHeader = false;
+            }
+            else if (arg == "--no-output-header")
+            {
+                opt.outputHeader = false;
+            }
+            else if (arg.size() > 1 && arg[0] == '-' && !std::isdigit(static_cast<unsigned char> (arg[1])) && arg[1] != '.' && arg[1] != '(')
+            {
+                throw CliError("unknown option " + arg);
+            }
+            else
+            {
+                //name=expression or expression
+                const size_t eq = arg.find('=');
+                if (eq != std::string::npos && isIdentifier(std::string_view(arg).substr(0, eq)) && (eq + 1 >= arg.size() || arg[eq + 1] != '='))
+                {
+                    opt.expressions.emplace_back(arg.substr(0, eq), arg.substr(eq + 1));
+                }
+                else
+                {
+                    opt.expressions.emplace_back(arg, arg);
+                }
+            }
+        }
+
+        if (opt.transpile)
+        {
+            return opt;
+        }
+
+        if (opt.expressions.empty())
+        {
+            printUsage(stderr);
+            throw CliError("no expression to evaluate");
+        }
+
+        if (opt.inputFormat == Format::BIN && opt.columns.empty())
+        {
+            throw CliError("--columns is required for bin input");
+        }
+
+        if (!opt.inputHeader && opt.columns.empty())
+        {
+            throw CliError("--columns is required with --no-header");
+        }
+
+        return opt;
+    }
+
+    /**
+     * Transpile the formulas of a formula file to C++ functions (see RPNCompiler::generateCpp)
+     */
+    int runTranspile(const Options &opt)
     {
+        InputSource in(opt.transpile);
+        OutputSink out(opt.output);
+        std::string declarations = "#pragma once\n\n";
 
         RPNCompiler fpu;
+        fpu.setFusedMultiplyAdd(opt.fusedMultiplyAdd);
+
+        for (const auto &[name, value] : opt.defines)
+        {
+            fpu.defineVar(name, value);
+        }
+
+        out.write("// Generated by virtualfpu --transpile " + std::string(opt.transpile) + ", do not edit\n\n#include <cmath>\n#include <limits>\n");
+
+        std::string_view line;
+        size_t lineNumber = 0;
+
+        while (in.nextLine(line))
+        {
+            ++lineNumber;
 
-        fpu.compile("4*sin(-1.2)+(-1*(8/9+5/6))");
+            line = trim(line.substr(0, line.find('#')));
 
-        std::cout << fpu.evaluate() << std::endl; // print -5.45038
+            if (line.empty())
+            {
+                continue;
+            }
 
-        fpu.defineVar("x", 2);
-        fpu.defineVar("PI", M_PI);
+            const std::string where = std::string(opt.transpile) + ":" + std::to_string(lineNumber) + ": ";
 
-        fpu.compile("tan(PI/4)+x^2");
+            if (line.starts_with("extern ") && isIdentifier(trim(line.substr(7))))
+            {
+                //only the name matters, the function is linked with the generated code
+                fpu.defineFunction(std::string(trim(line.substr(7))), [](double) {
+                    return std::numeric_limits<double>::quiet_NaN();
+                });
+                continue;
+            }
 
-        std::cout << fpu.evaluate() << std::endl;
+            const size_t open = line.find('(');
+            const size_t close = line.find(')');
+            const size_t eq = line.find('=', close == std::string_view::npos ? 0 : close);
 
-        fpu.compile("-1*(1+5/6-2+3-7/8/9/10-11)*2*(-(3+2)/(-9-3))");
+            if (open == std::string_view::npos || close < open || eq == std::string_view::npos || !trim(line.substr(close + 1, eq - close - 1)).empty()
+                    || !isIdentifier(trim(line.substr(0, open))))
+            {
+                throw CliError(where + "expected name(parameters) = expression");
+            }
+
+            const std::string name(trim(line.substr(0, open)));
+            std::vector<std::string> parameters;
+
+            for (auto p : splitFields(line.substr(open + 1, close - open - 1), ','))
+            {
+                p = trim(p);
+                if (!isIdentifier(p))
+                {
+                    throw CliError(where + "invalid parameter " + std::string(p));
+                }
+                parameters.emplace_back(p);
+                fpu.defineVar(parameters.back(), 0);
+            }
+
+            try
+            {
+                fpu.compile(std::string(line.substr(eq + 1)));
+            }
+            catch (VirtualFPUException &ex)
+            {
+                throw CliError(where + ex.getMessage());
+            }
+
+            out.write("\n// " + std::string(line) + "\n");
+            out.write(fpu.generateCpp(name, parameters));
+
+            declarations += "double " + name + "(";
+            for (size_t i = 0; i < parameters.size(); ++i)
+            {
+                declarations += (i ? ", double " : "double ") + parameters[i];
+            }
+            declarations += ");\n";
+
+            //the parameters are not visible to the next formulas
+            for (const auto &p : parameters)
+            {
+                fpu.undefVar(p);
+            }
+            for (const auto &[def, value] : opt.defines)
+            {
+                fpu.defineVar(def, value);
+            }
+        }
+
+        out.close();
+
+        if (opt.header)
+        {
+            OutputSink header(opt.header);
+            header.write(declarations);
+            header.close();
+        }
+
+        return 0;
+    }
+
+    /**
+     * Percentile of a sorted list of latencies
+     */
+    double percentile(const std::vector<double> &sorted, double p)
+    {
+        if (sorted.empty())
+        {
+            return 0;
+        }
+        return sorted[static_cast<size_t> (std::ceil(p * sorted.size())) - 1];
+    }
+
+    /**
+     * Many producer threads evaluating single rows: each producer evaluates the expressions
+     * with its own compilers (direct), then the producers share an EvaluationQueue.
+     * Prints the throughput and the latency percentiles of both.
+     */
+    int runQueueBenchmark(const Options &opt)
+    {
+        using Clock = std::chrono::steady_clock;
+
+        const size_t producers = opt.benchmarkProducers;
+        const size_t requests = opt.benchmarkRequests;
+
+        //values of the variables of a request
+        auto requestVars = [&opt](size_t producer, size_t r)
+        {
+            std::vector<std::pair<std::string, double>> vars = opt.defines;
+            for (size_t k = 0; k < opt.columns.size(); ++k)
+            {
+                vars.emplace_back(opt.columns[k], 0.5 + static_cast<double> ((producer * 7919 + r * 31 + k * 17) % 1000) / 100.0);
+            }
+            return vars;
+        };
+
+        std::vector<std::vector<double>> latencies(producers);
+        std::vector<double> directSums(producers), queueSums(producers);
+        std::vector<std::thread> threads;
+
+        //direct: one compiler for each expression and producer
+        auto start = Clock::now();
+        for (size_t p = 0; p < producers; ++p)
+        {
+            threads.emplace_back([&, p]()
+            {
+                std::vector<std::unique_ptr<RPNCompiler>> compilers;
+                for (const auto &expr : opt.expressions)
+                {
+                    compilers.push_back(std::make_unique<RPNCompiler>());
+                    for (const auto &[name, value] : requestVars(p, 0))
+                    {
+                        compilers.back()->defineVar(name, value);
+                    }
+                    compilers.back()->compile(expr.second);
+                }
+                latencies[p].reserve(requests);
+                for (size_t r = 0; r < requests; ++r)
+                {
+                    const auto t = Clock::now();
+                    RPNCompiler &fpu = *compilers[r % compilers.size()];
+                    for (const auto &[name, value] : requestVars(p, r))
+                    {
+                        fpu.defineVar(name, value);
+                    }
+                    directSums[p] += fpu.evaluate();
+                    latencies[p].push_back(std::chrono::duration<double, std::micro>(Clock::now() - t).count());
+                }
+            });
+        }
+        for (auto &t : threads)
+        {
+            t.join();
+        }
+        const double directSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        std::vector<double> direct;
+        for (const auto &l : latencies)
+        {
+            direct.insert(direct.end(), l.begin(), l.end());
+        }
+        std::sort(direct.begin(), direct.end());
+
+        //queue: every producer keeps up to inFlight requests submitted
+        QueueStats stats;
+        threads.clear();
+        start = Clock::now();
+        {
+            EvaluationQueue queue(opt.chunkRows, std::chrono::microseconds(opt.benchmarkLatency));
+            for (size_t p = 0; p < producers; ++p)
+            {
+                threads.emplace_back([&, p]()
+                {
+                    std::deque<std::future<double>> pending;
+                    for (size_t r = 0; r < requests; ++r)
+                    {
+                        if (pending.size() == opt.benchmarkInFlight)
+                        {
+                            queueSums[p] += pending.front().get();
+                            pending.pop_front();
+                        }
+                        pending.push_back(queue.submit(opt.expressions[r % opt.expressions.size()].second, requestVars(p, r)));
+                    }
+                    for (auto &f : pending)
+                    {
+                        queueSums[p] += f.get();
+                    }
+                });
+            }
+            for (auto &t : threads)
+            {
+                t.join();
+            }
+            stats = queue.getStats();
+        }
+        const double queueSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        const size_t total = producers * requests;
+        double directSum = 0, queueSum = 0;
+        for (size_t p = 0; p < producers; ++p)
+        {
+            directSum += directSums[p];
+            queueSum += queueSums[p];
+        }
+
+        std::printf("%zu requests from %zu producers, %zu in flight per producer, batch size %zu, latency bound %zu us\n",
+                total, producers, opt.benchmarkInFlight, opt.chunkRows, opt.benchmarkLatency);
+        std::printf("direct: %.0f requests/s  p50 %.2f us  p99 %.2f us  max %.2f us\n",
+                total / directSeconds, percentile(direct, 0.5), percentile(direct, 0.99), direct.empty() ? 0 : direct.back());
+        std::printf("queue:  %.0f requests/s  p50 %.2f us  p99 %.2f us  max %.2f us  mean batch %.1f\n",
+                total / queueSeconds, stats.latencyP50, stats.latencyP99, stats.latencyMax, stats.meanBatchSize);
+
+        if (directSum != queueSum)
+        {
+            std::fprintf(stderr, "virtualfpu: the queue results differ from the direct evaluation\n");
+            return 1;
+        }
+
+        return 0;
+    }
+
+    void writeCsvName(OutputSink &out, const std::string &name, char delimiter)
+    {
+        if (name.find(delimiter) == std::string::npos && name.find('"') == std::string::npos)
+        {
+            out.write(name);
+            return;
+        }
+        out.put('"');
+        for (char ch : name)
+        {
+            if (ch == '"')
+            {
+                out.put('"');
+            }
+            out.put(ch);
+        }
+        out.put('"');
+    }
+
+    int run(const Options &opt)
+    {
+        InputSource in(opt.input);
+        OutputSink out(opt.output);
+
+        //column names
+        std::vector<std::string> names = opt.columns;
+        std::string_view line;
+        size_t lineNumber = 0;
+
+        if (opt.inputFormat == Format::CSV && opt.inputHeader)
+        {
+            if (!in.nextLine(line))
+            {
+                throw CliError("missing csv header");
+            }
+            ++lineNumber;
+            if (names.empty())
+            {
+                for (auto field : splitFields(line, opt.delimiter))
+                {
+                    names.emplace_back(unquote(field));
+                }
+            }
+        }
+
+        //one compiler for each expression, every column is a variable
+        std::vector<std::unique_ptr<RPNCompiler>> compilers;
+
+        for (const auto &[name, expr] : opt.expressions)
+        {
+            auto fpu = std::make_unique<RPNCompiler>();
+            fpu->setFusedMultiplyAdd(opt.fusedMultiplyAdd);
+
+            for (const auto &col : names)
+            {
+                if (isIdentifier(col))
+                {
+                    fpu->defineVar(col, std::numeric_limits<double>::quiet_NaN());
+                }
+            }
+
+            for (const auto &[var, value] : opt.defines)
+            {
+                fpu->defineVar(var, value);
+            }
+
+            fpu->compile(expr);
+            compilers.push_back(std::move(fpu));
+        }
+
+        //parse and store only the columns referenced by the expressions
+        std::vector<int> slotOfColumn(names.size(), -1);
+        std::vector<ColumnBinding> bindings;
+        std::vector<std::vector<double>> columnData;
+
+        auto isDefine = [&](const std::string & var)
+        {
+            for (const auto &d : opt.defines)
+            {
+                if (d.first == var)
+                {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        for (const auto &fpu : compilers)
+        {
+            for (const auto &var : fpu->getVariables())
+            {
+                if (isDefine(var))
+                {
+                    continue;
+                }
+
+                for (size_t c = 0; c < names.size(); ++c)
+                {
+                    if (names[c] == var && slotOfColumn[c] < 0)
+                    {
+                        slotOfColumn[c] = static_cast<int> (columnData.size());
+                        columnData.emplace_back(opt.chunkRows);
+                        bindings.push_back({var, nullptr});
+                        break;
+                    }
+                }
+            }
+        }
+
+        for (size_t k = 0; k < bindings.size(); ++k)
+        {
+            bindings[k].data = columnData[k].data();
+        }
+
+        std::vector<std::vector<double>> results(compilers.size(), std::vector<double>(opt.chunkRows));
+
+        if (opt.outputFormat == Format::CSV && opt.outputHeader)
+        {
+            for (size_t e = 0; e < opt.expressions.size(); ++e)
+            {
+                if (e)
+                {
+                    out.put(opt.delimiter);
+                }
+                writeCsvName(out, opt.expressions[e].first, opt.delimiter);
+            }
+            out.put('\n');
+        }
+
+        const size_t ncols = names.size();
+        const size_t recordSize = ncols * sizeof (double);
+
+        for (;;)
+        {
+            //fill a chunk of rows
+            size_t rows = 0;
+            size_t consumed = 0;
+
+            if (opt.inputFormat == Format::CSV)
+            {
+                while (rows < opt.chunkRows && in.nextLine(line))
+                {
+                    ++lineNumber;
+
+                    if (trim(line).empty())
+                    {
+                        continue;
+                    }
+
+                    //missing trailing fields are read as empty fields
+                    std::string_view rest = line;
+                    bool more = true;
+
+                    for (size_t c = 0; c < ncols; ++c)
+                    {
+                        std::string_view field;
+
+                        if (more)
+                        {
+                            const size_t pos = rest.find(opt.delimiter);
+                            field = rest.substr(0, pos);
+                            more = pos != std::string_view::npos;
+                            rest = more ? rest.substr(pos + 1) : std::string_view();
+                        }
+
+                        const int slot = slotOfColumn[c];
+
+                        if (slot >= 0 && !parseDouble(field, columnData[slot][rows]))
+                        {
+                            throw CliError("line " + std::to_string(lineNumber) + ": invalid number " + std::string(field) + " in column " + names[c]);
+                        }
+                    }
+
+                    ++rows;
+                }
+            }
+            else
+            {
+                while (in.size() < recordSize)
+                {
+                    if (!in.refill())
+                    {
+                        if (in.size() != 0)
+                        {
+                            throw CliError("truncated binary record at the end of the input");
+                        }
+                        break;
+                    }
+                }
+
+                rows = std::min(in.size() / recordSize, opt.chunkRows);
+
+                const bool inPlace = std::endian::native == std::endian::little && reinterpret_cast<uintptr_t> (in.data()) % alignof (double) == 0;
+
+                for (size_t c = 0; c < ncols; ++c)
+                {
+                    const int slot = slotOfColumn[c];
+
+                    if (slot < 0)
+                    {
+                        continue;
+                    }
+
+                    if (inPlace)
+                    {
+                        //bind the column to the records in the input window (no copy)
+                        bindings[slot].data = reinterpret_cast<const double *> (in.data() + c * sizeof (double));
+                        bindings[slot].stride = recordSize;
+                    }
+                    else
+                    {
+                        const char *p = in.data() + c * sizeof (double);
+                        for (size_t r = 0; r < rows; ++r, p += recordSize)
+                        {
+                            double v;
+                            std::memcpy(&v, p, sizeof (double));
+                            columnData[slot][r] = toLittleEndian(v);
+                        }
+                        bindings[slot].data = columnData[slot].data();
+                        bindings[slot].stride = 0;
+                    }
+                }
+
+                consumed = rows * recordSize;
+            }
+
+            if (rows == 0)
+            {
+                break;
+            }
+
+            for (size_t e = 0; e < compilers.size(); ++e)
+            {
+                compilers[e]->evaluateBatch(bindings, rows, results[e].data());
+            }
+
+            in.consume(consumed);
+
+            //write the chunk
+            for (size_t r = 0; r < rows; ++r)
+            {
+                for (size_t e = 0; e < results.size(); ++e)
+                {
+                    if (opt.outputFormat == Format::CSV)
+                    {
+                        if (e)
+                        {
+                            out.put(opt.delimiter);
+                        }
+                        out.writeNumber(results[e][r]);
+                    }
+                    else
+                    {
+                        const double v = toLittleEndian(results[e][r]);
+                        out.write(reinterpret_cast<const char *> (&v), sizeof (double));
+                    }
+                }
+                if (opt.outputFormat == Format::CSV)
+                {
+                    out.put('\n');
+                }
+            }
+        }
+
+        out.close();
+
+        return 0;
+    }
+
+}
+
+/**
+ *
+ */
+int main(int argc, char **argv)
+{
+
+    try
+    {
+
+        const Options opt = parseOptions(argc, argv);
+
+        if (opt.transpile)
+        {
+            return runTranspile(opt);
+        }
+
+        return opt.benchmarkProducers ? runQueueBenchmark(opt) : run(opt);
 
-        std::cout << fpu.evaluate() << std::endl;
     }
     catch (VirtualFPUException &ex)
     {
 
-        std::cerr << ex.getMessage() << std::endl;
+        std::fprintf(stderr, "virtualfpu: %s\n", ex.getMessage().c_str());
+    }
+    catch (std::exception &ex)
+    {
+        std::fprintf(stderr, "virtualfpu: %s\n", ex.what());
     }
 
-    return 0;
+    return 1;
 }
@@ -12,17 +12,33 @@
  */
 
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <exception>
 #include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <thread>
+#include <future>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
 #include "virtualfpu.h"
 #include "tests.h"
+#include "vfpu_test_formulas.h"
+#include "vfpu_test_formulas_fma.h"
 
 using namespace std;
 using namespace virtualfpu;
 
+/**
+ * Custom function of the transpiled formulas (see formulas.vfpu)
+ */
+double twice(double v) {
+    return 2 * v;
+}
+
 static void testStatements(RPNCompiler &fpu, const map<string, double> &statements) {
     for (auto const& [key, val] : statements) {
         fpu.compile(key);
@@ -30,6 +46,48 @@ static void testStatements(RPNCompiler &fpu, const map<string, double> &statemen
     }
 }
 
+/**
+ * Max error of a built-in function of an accuracy tier against a long double reference,
+ * sampled on [lo,hi] (log spaced when logScale is true).
+ * @param metric 0 error in ULP, 1 relative error, 2 absolute error
+ */
+static double maxTierError(Accuracy accuracy, const string &fn, long double (*reference)(long double), double lo, double hi, bool logScale, int metric) {
+    const size_t n = 20001;
+    vector<double> xs(n);
+    vector<double> ys(n);
+    for (size_t i = 0; i < n; i++) {
+        const double t = static_cast<double> (i) / (n - 1);
+        xs[i] = logScale ? exp(log(lo) + t * (log(hi) - log(lo))) : lo + t * (hi - lo);
+    }
+
+    RPNCompiler fpu;
+    fpu.defineVar("x", 0);
+    fpu.compile(fn + "(x)", accuracy);
+    fpu.evaluateBatch({{"x", xs.data()}}, n, ys.data());
+
+    double maxErr = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (i % 97 == 0) {
+            fpu.defineVar("x", xs[i]);
+            tests::expect_true(fpu.evaluate() == ys[i], fn + ": scalar and batch evaluation differ");
+        }
+        const long double r = reference(xs[i]);
+        const long double diff = fabsl(static_cast<long double> (ys[i]) - r);
+        double err;
+        if (metric == 0) {
+            int e;
+            frexp(static_cast<double> (r), &e);
+            err = static_cast<double> (diff / ldexpl(1.0L, e - 53));
+        } else if (metric == 1) {
+            err = static_cast<double> (diff / fabsl(r));
+        } else {
+            err = static_cast<double> (diff);
+        }
+        maxErr = max(maxErr, err);
+    }
+    return maxErr;
+}
+
 /*
  * 
  */
@@ -209,7 +267,1527 @@ int main(int argc, char** argv) {
         };
         testStatements(fpu, statements);
 
+        tests::print_test_title("MEMORY RESOURCE");
+
+        {
+            CountingMemoryResource counter;
+            RPNCompiler cfpu(&counter);
+
+            tests::expect_true(cfpu.getMemoryResource() == &counter, "memory resource not set");
+
+            cfpu.defineVar("x", 1.5);
+            cfpu.defineVar("longvariablename", 2.5);
+            cfpu.defineFunction("cube", [](double v) {
+                return v * v*v;
+            });
+            cfpu.compile("cube(x)*longvariablename-sin(x)/(1+x^2)");
+            tests::expect_true(counter.allocations() > 0, "compiler allocations not routed to the memory resource", "OK allocations routed to the memory resource");
+
+            cfpu.evaluate();
+            const auto allocations = counter.allocations();
+
+            for (int i = 0; i < 1000; i++) {
+                cfpu.defineVar("x", i * 0.01);
+                cfpu.evaluate();
+            }
+
+            tests::expect_equals(counter.allocations(), allocations, "steady state evaluation allocates memory", "OK steady state evaluation does not allocate");
+            tests::expect_num(cfpu.evaluate(), 9.99 * 9.99 * 9.99 * 2.5 - sin(9.99) / (1 + 9.99 * 9.99), "evaluation error using counting resource");
+
+            cfpu.clearStack();
+            cfpu.clearAllVariables();
+            cfpu.clearAllCustomFunctions();
+        }
+
+        {
+            std::pmr::monotonic_buffer_resource arena;
+            RPNCompiler afpu(&arena);
+            afpu.defineVar("x", 3);
+            afpu.compile("2x^2-1");
+            tests::expect_num(afpu.evaluate(), 17.0, "evaluation error using a monotonic arena", "OK monotonic arena");
+        }
+
+        {
+            CountingMemoryResource counter;
+            {
+                RPNCompiler cfpu(&counter);
+                cfpu.compile("1+2*3");
+                tests::expect_throw([&]() {
+                    cfpu.compile("(1+2*(3-1)");
+                }, "error not detected");
+            }
+            tests::expect_equals(counter.bytesInUse(), (size_t) 0, "memory leak detected", "OK all memory released");
+        }
+
+        tests::print_test_title("STACK DEPTH VERIFICATION");
+
+        {
+            RPNCompiler vfpu;
+
+            vfpu.compile("1+(2+(3+(4+5)))");
+            tests::expect_equals(vfpu.getMaxStackDepth(), (size_t) 5, "wrong max stack depth", "OK max stack depth");
+            tests::expect_equals(vfpu.getInstructionCount(), (size_t) 9, "wrong instruction count", "OK instruction count");
+            tests::expect_equals(vfpu.getStackSize(), RPNCompiler::DEFAULT_STACK_SIZE, "wrong stack size");
+            tests::expect_num(vfpu.evaluate(), 15.0, "evaluation error");
+
+            vfpu.compile("1+2+3+4+5");
+            tests::expect_equals(vfpu.getMaxStackDepth(), (size_t) 2, "wrong max stack depth for left associative sum");
+
+            tests::expect_throw([&]() {
+                vfpu.compile("2*");
+            }, "missing operand not detected", "OK missing operand detected at compile time", true);
+            tests::expect_equals(vfpu.getMaxStackDepth(), (size_t) 0, "max stack depth not cleared");
+
+            RPNCompiler small(3);
+            small.compile("1+(2+3)");
+            tests::expect_num(small.evaluate(), 6.0, "evaluation error with small stack");
+            tests::expect_throw([&]() {
+                small.compile("1+(2+(3+(4+5)))");
+            }, "stack overflow not detected", "OK stack overflow detected at compile time", true);
+            tests::expect_true(small.stackIsEmpty(), "stack not cleared after compile error");
+        }
+
+        tests::print_test_title("BATCH EVALUATION");
+
+        {
+            RPNCompiler bfpu;
+            bfpu.defineVar("x", 0);
+            bfpu.defineVar("y", 0);
+            bfpu.defineVar("k", 2.5);
+            bfpu.defineFunction("cube", [](double v) {
+                return v * v*v;
+            });
+            bfpu.compile("k*sin(x)*cube(y)-(x-y)/(1+x^2)");
+
+            const auto vars = bfpu.getVariables();
+            tests::expect_true(vars == vector<string>{"k", "x", "y"}, "wrong referenced variables", "OK referenced variables");
+
+            const size_t rows = 1000;
+            vector<double> xs(rows), ys(rows), out(rows);
+            for (size_t i = 0; i < rows; i++) {
+                xs[i] = i * 0.01 - 3;
+                ys[i] = 2 - i * 0.003;
+            }
+
+            bfpu.evaluateBatch({
+                {"x", xs.data()},
+                {"y", ys.data()}
+            }, rows, out.data());
+
+            bool same = true;
+            for (size_t i = 0; i < rows; i++) {
+                bfpu.defineVar("x", xs[i]);
+                bfpu.defineVar("y", ys[i]);
+                same = same && bfpu.evaluate() == out[i];
+            }
+            tests::expect_true(same, "batch evaluation differs from evaluate", "OK batch evaluation");
+        }
+
+        tests::print_test_title("STRIDED BINDING");
+
+        {
+            struct Particle {
+                int id;
+                double x;
+                double y;
+                double energy;
+            };
+
+            vector<Particle> particles(777);
+            for (size_t i = 0; i < particles.size(); i++) {
+                particles[i] = {(int) i, i * 0.5, 3.0 - i * 0.25, 0};
+            }
+
+            RPNCompiler sfpu;
+            sfpu.defineVar("x", 0);
+            sfpu.defineVar("y", 0);
+            sfpu.compile("x^2+2*x*y-y");
+
+            sfpu.evaluateBatch({bindField("x", particles.data(), &Particle::x), bindField("y", particles.data(), &Particle::y)},
+            particles.size(), &particles[0].energy, sizeof (Particle));
+
+            bool same = true;
+            for (const auto &p : particles) {
+                same = same && p.energy == p.x * p.x + 2 * p.x * p.y - p.y && p.id == (int) (&p - particles.data());
+            }
+            tests::expect_true(same, "strided batch evaluation error", "OK array of structs evaluated in place");
+        }
+
+        tests::print_test_title("REDUCTIONS");
+
+        {
+            RPNCompiler rfpu;
+            rfpu.defineVar("x", 0);
+            rfpu.compile("log(x)*x");
+
+            const size_t rows = 100000;
+            vector<double> xs(rows);
+            for (size_t i = 0; i < rows; i++) {
+                xs[i] = i * 0.001 - 1;
+            }
+
+            double sum = 0, mn = INFINITY, mx = -INFINITY;
+            size_t nan = 0, count = 0;
+            for (double x : xs) {
+                const double v = log(x) * x;
+                if (std::isnan(v)) {
+                    nan++;
+                    continue;
+                }
+                sum += v;
+                mn = std::min(mn, v);
+                mx = std::max(mx, v);
+                count++;
+            }
+
+            auto r = rfpu.reduce(Reduction::SUM, {{"x", xs.data()}}, rows);
+            tests::expect_num(r.value, sum, "wrong sum", "OK sum", 1e-6 * fabs(sum));
+            tests::expect_equals(r.count, count, "wrong reduced rows count");
+            tests::expect_equals(r.nanCount, nan, "wrong NaN count", "OK NaN count");
+            tests::expect_equals(r.infCount, (size_t) 0, "wrong Inf count");
+
+            tests::expect_num(rfpu.reduce(Reduction::MIN, {{"x", xs.data()}}, rows).value, mn, "wrong min", "OK min");
+            tests::expect_num(rfpu.reduce(Reduction::MAX, {{"x", xs.data()}}, rows).value, mx, "wrong max", "OK max");
+            tests::expect_num(rfpu.reduce(Reduction::MEAN, {{"x", xs.data()}}, rows).value, sum / count, "wrong mean", "OK mean");
+
+            const auto r1 = rfpu.reduce(Reduction::SUM, {{"x", xs.data()}}, rows, 1);
+            const auto r3 = rfpu.reduce(Reduction::SUM, {{"x", xs.data()}}, rows, 3);
+            const auto r8 = rfpu.reduce(Reduction::SUM, {{"x", xs.data()}}, rows, 8);
+            tests::expect_true(r1.value == r3.value && r1.value == r8.value && r1.nanCount == r8.nanCount, "parallel reduction is not deterministic", "OK deterministic parallel reduction");
+
+            rfpu.compile("1/x");
+            xs[0] = 0;
+            tests::expect_equals(rfpu.reduce(Reduction::MAX, {{"x", xs.data()}}, 10).infCount, (size_t) 1, "wrong Inf count", "OK Inf count");
+        }
+
+        tests::print_test_title("COMPARISON OPERATORS AND FILTERS");
+
+        fpu.clearAllVariables();
+        fpu.defineVar("x", 3);
+
+        statements = {
+            {"x<4", 1},
+            {"x>4", 0},
+            {"x<=3", 1},
+            {"x>=3.5", 0},
+            {"x==3", 1},
+            {"x!=3", 0},
+            {"2*x+1>x^2-3", 1},
+            {"(x>1)*(x<2)+(x>2)*10", 10},
+            {"x<-1", 0},
+            {"-x<=-3", 1}
+        };
+        testStatements(fpu, statements);
+        tests::expect_equals(fpu.compile("1+x<=2*x").getRPNStack(), "1,x,+,2,x,*,<=,"s, "comparison precedence error", "OK comparison precedence");
+
+        {
+            RPNCompiler ffpu;
+            ffpu.defineVar("x", 0);
+            ffpu.defineVar("y", 0);
+
+            const size_t rows = 5000;
+            vector<double> xs(rows), ys(rows);
+            for (size_t i = 0; i < rows; i++) {
+                xs[i] = i;
+                ys[i] = (i % 7) * 0.5;
+            }
+            const vector<ColumnBinding> cols = {
+                {"x", xs.data()},
+                {"y", ys.data()}
+            };
+
+            ffpu.compile("(x>=1000)*(x<1050)*(y!=0)");
+            vector<size_t> sel;
+            ffpu.select(cols, rows, sel);
+
+            vector<size_t> expected;
+            for (size_t i = 1000; i < 1050; i++) {
+                if (i % 7) expected.push_back(i);
+            }
+            tests::expect_true(sel == expected, "wrong selection vector", "OK selection vector");
+
+            vector<uint64_t> bitmap;
+            tests::expect_equals(ffpu.selectBitmap(cols, rows, bitmap), expected.size(), "wrong bitmap count");
+            bool bitsOk = bitmap.size() == (rows + 63) / 64;
+            for (size_t i = 0; i < rows && bitsOk; i++) {
+                const bool bit = (bitmap[i / 64] >> (i % 64)) & 1;
+                bitsOk = bit == std::binary_search(expected.begin(), expected.end(), i);
+            }
+            tests::expect_true(bitsOk, "wrong selection bitmap", "OK selection bitmap");
+
+            ffpu.compile("x*y");
+            vector<double> out(sel.size());
+            ffpu.evaluateSelected(cols, sel, out.data());
+            bool valuesOk = true;
+            for (size_t k = 0; k < sel.size(); k++) {
+                valuesOk = valuesOk && out[k] == xs[sel[k]] * ys[sel[k]];
+            }
+            tests::expect_true(valuesOk, "wrong evaluation of the selected rows", "OK evaluation of the selected rows");
+        }
+
+        tests::print_test_title("NUMERICAL INTEGRATION");
+
+        {
+            RPNCompiler ifpu;
+            ifpu.defineVar("x", 0);
+            ifpu.defineVar("k", 3);
+
+            ifpu.compile("sin(k*x)*exp(-x)");
+            auto r = ifpu.integrate("x", 0, 10);
+            const double exact = (3 - exp(-10.0)*(sin(30.0) + 3 * cos(30.0))) / 10;
+            tests::expect_num(r.value, exact, "Gauss-Kronrod integration error", "OK Gauss-Kronrod integration", 1e-9);
+            tests::expect_true(r.converged && r.evaluations > 0 && r.evaluations % 15 == 0 && r.batches > 0 && r.batches * 15 <= r.evaluations, "wrong integration counters", "OK integration counters");
+            tests::expect_num(ifpu.getVar("x"), 0.0, "integration changed the variable value");
+
+            r = ifpu.integrate("x", 10, 0);
+            tests::expect_num(r.value, -exact, "reversed limits integration error", "OK reversed limits", 1e-9);
+
+            ifpu.compile("1/sqrt(x)");
+            r = ifpu.integrate("x", 0, 1, QuadratureRule::TANH_SINH);
+            tests::expect_num(r.value, 2.0, "tanh-sinh integration error", "OK tanh-sinh endpoint singularity", 1e-9);
+            tests::expect_true(r.converged, "tanh-sinh did not converge");
+
+            ifpu.compile("4/(1+x^2)");
+            r = ifpu.integrate("x", 0, 1, QuadratureRule::TANH_SINH);
+            tests::expect_num(r.value, M_PI, "tanh-sinh integration error", "OK tanh-sinh", 1e-12);
+
+            ifpu.compile("abs(x-0.3)");
+            r = ifpu.integrate("x", 0, 1, QuadratureRule::GAUSS_KRONROD, 1e-14, 1e-14, 200);
+            tests::expect_false(r.converged, "evaluations budget not respected");
+            tests::expect_true(r.evaluations <= 200, "evaluations budget exceeded", "OK evaluations budget");
+        }
+
+        tests::print_test_title("GRID SAMPLING");
+
+        {
+            RPNCompiler gfpu;
+            gfpu.defineVar("x", 0);
+            gfpu.defineVar("y", 0);
+            gfpu.defineVar("z", 0);
+            gfpu.defineVar("k", 0.5);
+            size_t calls = 0;
+            gfpu.defineFunction("slow", [&calls](double v) {
+                calls++;
+                return v * v;
+            });
+
+            gfpu.compile("slow(sin(x)*2)+x*exp(-y*k)-(2*3)/(1+y^2)+cos(x*y)");
+
+            const GridAxis ax{"x", -1, 2, 300};
+            const GridAxis ay{"y", 0, 3, 37};
+            vector<double> grid(ax.count * ay.count);
+            gfpu.sampleGrid(ax, ay, grid.data());
+            tests::expect_equals(calls, ax.count, "x only subexpression not shared across rows", "OK x only subexpressions computed once");
+
+            bool same = true;
+            for (size_t j = 0; j < ay.count; j++) {
+                for (size_t i = 0; i < ax.count; i++) {
+                    gfpu.defineVar("x", ax.min + (ax.max - ax.min) * i / (ax.count - 1));
+                    gfpu.defineVar("y", ay.min + (ay.max - ay.min) * j / (ay.count - 1));
+                    same = same && gfpu.evaluate() == grid[j * ax.count + i];
+                }
+            }
+            tests::expect_true(same, "2D grid sampling differs from evaluate", "OK 2D grid sampling");
+
+            vector<double> grid4(grid.size());
+            gfpu.sampleGrid(ax, ay, grid4.data(), 4);
+            tests::expect_true(grid == grid4, "multi-threaded grid sampling differs", "OK multi-threaded grid sampling");
+
+            gfpu.compile("x*y-z^2+sin(z)");
+            const GridAxis az{"z", 1, 2, 5};
+            vector<double> cube(ax.count * ay.count * az.count);
+            gfpu.sampleGrid(ax, ay, az, cube.data(), 2);
+            same = true;
+            for (size_t k = 0; k < az.count; k++) {
+                for (size_t j = 0; j < ay.count; j += 5) {
+                    for (size_t i = 0; i < ax.count; i += 7) {
+                        gfpu.defineVar("x", ax.min + (ax.max - ax.min) * i / (ax.count - 1));
+                        gfpu.defineVar("y", ay.min + (ay.max - ay.min) * j / (ay.count - 1));
+                        gfpu.defineVar("z", az.min + (az.max - az.min) * k / (az.count - 1));
+                        same = same && gfpu.evaluate() == cube[(k * ay.count + j) * ax.count + i];
+                    }
+                }
+            }
+            tests::expect_true(same, "3D grid sampling differs from evaluate", "OK 3D grid sampling");
+        }
+
+        tests::print_test_title("ACCURACY TIERS");
+
+        {
+            struct TierCase {
+                string fn;
+                long double (*reference)(long double);
+                double lo;
+                double hi;
+                bool logScale;
+            };
+
+            const vector<TierCase> cases = {
+                {"exp", expl, -700, 700, false},
+                {"exp", expl, -1, 1, false},
+                {"log", logl, 1e-300, 1e300, true},
+                {"log", logl, 0.5, 2, false},
+                {"log2", log2l, 1e-300, 1e300, true},
+                {"log10", log10l, 1e-300, 1e300, true},
+                {"sin", sinl, -1e5, 1e5, false},
+                {"sin", sinl, -4, 4, false},
+                {"cos", cosl, -1e5, 1e5, false},
+                {"cos", cosl, -4, 4, false},
+                {"sinh", sinhl, -20, 20, false},
+                {"cosh", coshl, -20, 20, false},
+                {"tanh", tanhl, -10, 10, false}
+            };
+
+            //ACCURATE: 1 ULP for exp and log, 2 ULP for log2 and log10, 3 ULP for sin and cos
+            const map<string, double> ulpBounds = {{"exp", 1}, {"log", 1}, {"log2", 2}, {"log10", 2}, {"sin", 3}, {"cos", 3}};
+            for (const auto &c : cases) {
+                const auto bound = ulpBounds.find(c.fn);
+                if (bound == ulpBounds.end()) {
+                    //C library function
+                    continue;
+                }
+                const double err = maxTierError(Accuracy::ACCURATE, c.fn, c.reference, c.lo, c.hi, c.logScale, 0);
+                tests::expect_true(err <= bound->second, "ACCURATE " + c.fn + " error " + to_string(err) + " ULP");
+            }
+            tests::print_success("OK accurate tier within the ULP bounds");
+
+            //FAST: relative error 1e-7, absolute error 1e-7 for sin and cos
+            for (const auto &c : cases) {
+                const int metric = c.fn == "sin" || c.fn == "cos" ? 2 : 1;
+                const double err = maxTierError(Accuracy::FAST, c.fn, c.reference, c.lo, c.hi, c.logScale, metric);
+                tests::expect_true(err <= 1e-7, "FAST " + c.fn + " error " + to_string(err));
+            }
+            tests::print_success("OK fast tier within 1e-7");
+
+            RPNCompiler afpu;
+            afpu.defineVar("a", 0);
+            afpu.defineVar("b", 0);
+            afpu.compile("a^b", Accuracy::FAST);
+            double powErr = 0;
+            for (int i = 0; i < 2000; i++) {
+                const double a = exp(-10 + 20 * (i % 41) / 40.0);
+                const double b = -50 + 100 * (i / 41) / 48.0;
+                afpu.defineVar("a", a);
+                afpu.defineVar("b", b);
+                powErr = max(powErr, static_cast<double> (fabsl((afpu.evaluate() - powl(a, b)) / powl(a, b))));
+            }
+            tests::expect_true(powErr <= 1e-7, "FAST pow error " + to_string(powErr), "OK fast pow within 1e-7");
+
+            afpu.defineVar("x", 0);
+            for (Accuracy accuracy :{Accuracy::EXACT, Accuracy::ACCURATE, Accuracy::FAST}) {
+                afpu.setAccuracy(accuracy);
+                const map<string, double> special = {
+                    {"exp(1000)", HUGE_VAL}, {"exp(0-1000)", 0}, {"log(0)", -HUGE_VAL}, {"log(1)", 0},
+                    {"sin(10000000)", sin(1e7)}, {"cos(10000000)", cos(1e7)}, {"tanh(800)", 1}, {"cosh(0)", 1}, {"2^0.5", sqrt(2.0)}
+                };
+                for (const auto &[expr, expected] : special) {
+                    afpu.compile(expr);
+                    tests::expect_true(fabs(afpu.evaluate() - expected) <= 1e-7 * max(1.0, fabs(expected)) || afpu.evaluate() == expected, "special value " + expr);
+                }
+                afpu.compile("log(0-1)+exp(x/0)");
+                tests::expect_true(isnan(afpu.evaluate()), "NaN argument");
+            }
+            tests::print_success("OK special values in all tiers");
+
+            tests::expect_true(afpu.getAccuracy() == Accuracy::FAST, "accuracy not kept", "OK accuracy setting");
+        }
+
+        {
+            tests::print_test_title("PEEPHOLE SUPERINSTRUCTIONS");
+
+            RPNCompiler pfpu;
+            pfpu.defineVar("x", 1.1);
+            pfpu.defineVar("y", -0.7);
+            pfpu.defineVar("z", 3.3);
+
+            pfpu.compile("x*x+2*x+1");
+            const PeepholeStats &stats = pfpu.getPeepholeStats();
+            tests::expect_equals(stats.rpnInstructions, size_t(9), "RPN instructions");
+            tests::expect_equals(stats.programInstructions, size_t(4), "program instructions");
+            tests::expect_equals(stats.immediateOperands, size_t(2), "immediate operands");
+            tests::expect_equals(stats.variableOperands, size_t(3), "variable operands");
+            tests::expect_equals(stats.fusedMultiplyAdds, size_t(0), "fma without contraction");
+            tests::print_success("OK peephole stats");
+
+            //without contraction the result is the same of the separate operations
+            const double x = 1.1, y = -0.7, z = 3.3;
+            volatile double xx = x * x, xy = x * y, yz = y * z, xz = x * z;
+            volatile double a = xx + 2 * x;
+            tests::expect_true(pfpu.evaluate() == a + 1, "x*x+2*x+1 differs from the separate operations");
+            pfpu.compile("3*x*y-2*y*z+x*z-1");
+            volatile double b = 3 * xy;
+            volatile double c = b - 2 * yz;
+            volatile double d = c + xz;
+            tests::expect_true(pfpu.evaluate() == d - 1, "3*x*y-2*y*z+x*z-1 differs from the separate operations", "OK same result of the separate operations");
+
+            pfpu.setFusedMultiplyAdd(true);
+            tests::expect_true(pfpu.getFusedMultiplyAdd(), "fma setting");
+            tests::expect_equals(pfpu.getPeepholeStats().fusedMultiplyAdds, size_t(2), "fma contractions");
+            tests::expect_true(pfpu.evaluate() == std::fma(x, z, std::fma(-2.0, y * z, 3 * x * y)) - 1, "3*x*y-2*y*z+x*z-1 with fma");
+
+            const map<string, double> contracted = {
+                {"x*y+z", std::fma(x, y, z)},
+                {"x*y-z", std::fma(x, y, -z)},
+                {"z+x*y", std::fma(x, y, z)},
+                {"z-x*y", std::fma(-x, y, z)},
+                {"z-x*(y+1)", std::fma(-x, y + 1, z)},
+                {"(x+1)*(y+1)+z", std::fma(x + 1, y + 1, z)},
+                {"(x+1)*y-z", std::fma(x + 1, y, -z)},
+                {"z+(x+1)*y", std::fma(x + 1, y, z)},
+                {"sqrt(x*x+y*y+z*z)", sqrt(std::fma(z, z, std::fma(y, y, x * x)))}
+            };
+
+            const size_t rows = 300;
+            vector<double> xs(rows), ys(rows), zs(rows), out(rows);
+            for (size_t i = 0; i < rows; i++) {
+                xs[i] = 0.37 * i - 50;
+                ys[i] = 1.0 / (i + 1);
+                zs[i] = 10 - 0.011 * i;
+            }
+
+            for (const auto &[expr, expected] : contracted) {
+                pfpu.compile(expr);
+                tests::expect_true(pfpu.getPeepholeStats().fusedMultiplyAdds > 0, expr + " not contracted");
+                tests::expect_true(pfpu.evaluate() == expected, expr + " differs from std::fma");
+                pfpu.evaluateBatch({{"x", xs.data()}, {"y", ys.data()}, {"z", zs.data()}}, rows, out.data());
+                for (size_t i = 0; i < rows; i += 7) {
+                    RPNCompiler sfpu;
+                    sfpu.setFusedMultiplyAdd(true);
+                    sfpu.defineVar("x", xs[i]);
+                    sfpu.defineVar("y", ys[i]);
+                    sfpu.defineVar("z", zs[i]);
+                    sfpu.compile(expr);
+                    tests::expect_true(sfpu.evaluate() == out[i], expr + ": scalar and batch evaluation differ");
+                }
+            }
+            tests::print_success("OK fused multiply-add");
+
+            pfpu.setFusedMultiplyAdd(false);
+            pfpu.defineVar("w", 2);
+            pfpu.compile("x*w+1");
+            tests::expect_num(pfpu.evaluate(), 3.2, "x*w+1");
+            pfpu.undefVar("w");
+            tests::expect_throw([&]() {
+                pfpu.evaluate();
+            }, "removed variable not reported", "OK removed variable");
+            pfpu.defineVar("w", 4);
+            pfpu.defineVar("x", 0.5);
+            tests::expect_num(pfpu.evaluate(), 3.0, "variable redefined after undefVar", "OK variables resolved after the compilation");
+        }
+
+        {
+            tests::print_test_title("REGISTER BACKEND");
+
+            RPNCompiler sfpu;
+            RPNCompiler rfpu;
+            for (RPNCompiler *c : {&sfpu, &rfpu}) {
+                c->defineVar("x", 0.3);
+                c->defineVar("y", -1.7);
+                c->defineVar("z", 2.9);
+                c->defineFunction("twice", [](double v) {
+                    return 2 * v;
+                });
+            }
+            rfpu.setBackend(Backend::REGISTER);
+            tests::expect_true(rfpu.getBackend() == Backend::REGISTER, "backend setting");
+
+            //a value live across 20 operations is spilled out of the 16 registers
+            string nested = "x";
+            for (int i = 1; i <= 20; i++) {
+                nested = "(x+" + to_string(i) + ")*(" + nested + ")";
+            }
+
+            const vector<string> exprs = {
+                "x", "2", "x*x+2*x+1", "3*x*y-2*y*z+x*z-1", "(x-y)*(x+y)/(1+x*x)", "sqrt(x*x+y*y+z*z)*2",
+                "x^y+2^x-z^2", "(x<y)+(z>=x)*2", "twice(x+y)*sin(z)", "exp(-x^2/2)/log(z)", nested
+            };
+
+            for (bool fma : {false, true}) {
+                sfpu.setFusedMultiplyAdd(fma);
+                rfpu.setFusedMultiplyAdd(fma);
+                for (const string &expr : exprs) {
+                    sfpu.compile(expr);
+                    rfpu.compile(expr);
+                    for (double x : {0.3, -2.5, 7.0}) {
+                        sfpu.defineVar("x", x);
+                        rfpu.defineVar("x", x);
+                        const double s = sfpu.evaluate();
+                        const double r = rfpu.evaluate();
+                        tests::expect_true(s == r || (isnan(s) && isnan(r)), expr + ": register and stack results differ");
+                    }
+                }
+            }
+            tests::print_success("OK bit-identical to the stack backend");
+
+            rfpu.setFusedMultiplyAdd(false);
+            rfpu.compile("(x+1)*(y+2)+(z+3)*(x+4)");
+            const RegisterAllocation &allocation = rfpu.getRegisterAllocation();
+            tests::expect_equals(allocation.instructions, size_t(7), "register instructions");
+            tests::expect_equals(allocation.registers, size_t(3), "registers used");
+            tests::expect_equals(allocation.spills, size_t(0), "no spills");
+            rfpu.compile(nested);
+            tests::expect_equals(rfpu.getRegisterAllocation().registers, size_t(16), "register file full");
+            tests::expect_true(rfpu.getRegisterAllocation().spills > 0, "nested expression not spilled", "OK linear scan allocation");
+
+            rfpu.compile("x*y+1", Backend::STACK);
+            tests::expect_true(rfpu.getBackend() == Backend::STACK, "backend selected by compile");
+            tests::expect_equals(rfpu.getRegisterAllocation().instructions, size_t(0), "no register program with the stack backend");
+            rfpu.compile("x*y+1", Backend::REGISTER);
+            rfpu.undefVar("y");
+            tests::expect_throw([&]() {
+                rfpu.evaluate();
+            }, "removed variable not reported");
+            rfpu.defineVar("y", 0.5);
+            tests::expect_num(rfpu.evaluate(), 7.0 * 0.5 + 1, "variable redefined after undefVar", "OK variables resolved by the register backend");
+        }
+
+        {
+            tests::print_test_title("EVALUATION QUEUE");
+
+            const vector<string> formulas = {"sqrt(x^2+y^2)", "x*y+1", "exp(-x)*cos(y)"};
+            const size_t producers = 4;
+            const size_t requests = 2000;
+            vector<vector<double>> results(producers, vector<double>(requests));
+            QueueStats stats;
+
+            {
+                EvaluationQueue queue(64, std::chrono::microseconds(200));
+                vector<std::thread> threads;
+                for (size_t p = 0; p < producers; p++) {
+                    threads.emplace_back([&, p]() {
+                        vector<std::future<double>> futures;
+                        for (size_t r = 0; r < requests; r++) {
+                            futures.push_back(queue.submit(formulas[r % formulas.size()], {{"x", p + r * 0.01}, {"y", 1.0 / (r + 1)}}));
+                        }
+                        for (size_t r = 0; r < requests; r++) {
+                            results[p][r] = futures[r].get();
+                        }
+                    });
+                }
+                for (auto &t : threads) {
+                    t.join();
+                }
+                stats = queue.getStats();
+            }
+
+            bool same = true;
+            RPNCompiler qfpu;
+            qfpu.defineVar("x", 0);
+            qfpu.defineVar("y", 0);
+            for (size_t p = 0; p < producers; p++) {
+                for (size_t r = 0; r < requests; r++) {
+                    qfpu.defineVar("x", p + r * 0.01);
+                    qfpu.defineVar("y", 1.0 / (r + 1));
+                    qfpu.compile(formulas[r % formulas.size()]);
+                    same = same && qfpu.evaluate() == results[p][r];
+                }
+            }
+            tests::expect_true(same, "queue results differ from evaluate", "OK results of the queued requests");
+
+            tests::expect_equals(stats.submitted, producers * requests, "submitted requests");
+            tests::expect_equals(stats.completed, producers * requests, "completed requests");
+            tests::expect_true(stats.meanBatchSize > 1 && stats.meanBatchSize <= 64, "mean batch size " + to_string(stats.meanBatchSize));
+            tests::expect_true(stats.latencyP50 <= stats.latencyP99 && stats.latencyP99 <= stats.latencyMax, "latency percentiles", "OK queue stats");
+
+            EvaluationQueue queue(16, std::chrono::seconds(10));
+            auto bad = queue.submit("x+", {{"x", 1}});
+            auto product = queue.submit("x*y", {{"x", 1}, {"y", 2}});
+            auto noY = queue.submit("x*y", {{"x", 1}});
+            auto extra = queue.submit("x*y", {{"z", 5}, {"y", 3}, {"x", 2}});
+            tests::expect_throw([&]() {
+                bad.get();
+            }, "compile error not reported");
+            tests::expect_throw([&]() {
+                noY.get();
+            }, "missing variable not reported", "OK errors reported through the futures");
+            queue.flush();
+            tests::expect_num(product.get(), 2.0, "x*y");
+            tests::expect_num(extra.get(), 6.0, "variables in any order", "OK flush");
+        }
+
+        {
+            tests::print_test_title("MEMOIZED FUNCTIONS");
+
+            RPNCompiler mfpu;
+            std::atomic<size_t> calls{0};
+            mfpu.defineFunction("slow", [&calls](double v) {
+                ++calls;
+                return std::tgamma(v) + std::erf(v);
+            }, true, 1000);
+            mfpu.defineVar("x", 0);
+            mfpu.compile("slow(x)*2+slow(x+1)");
+
+            bool same = true;
+            for (int i = 0; i < 1000; i++) {
+                const double x = 1 + (i % 20) * 0.25;
+                mfpu.defineVar("x", x);
+                same = same && mfpu.evaluate() == (std::tgamma(x) + std::erf(x)) * 2 + (std::tgamma(x + 1) + std::erf(x + 1));
+            }
+            tests::expect_true(same, "memoized results differ", "OK memoized results");
+
+            MemoStats memo = mfpu.getMemoStats("slow");
+            tests::expect_equals(memo.capacity, size_t(1024), "cache capacity");
+            tests::expect_equals(memo.hits + memo.misses, size_t(2000), "cache lookups");
+            tests::expect_equals(memo.misses, calls.load(), "misses are the calls of the function");
+            tests::expect_true(memo.hitRate() > 0.95, "hit rate " + to_string(memo.hitRate()), "OK hit counters");
+
+            //threads of sampleGrid share the cache
+            vector<double> grid(64 * 64);
+            mfpu.defineVar("y", 0);
+            mfpu.compile("slow(x)+y");
+            mfpu.sampleGrid({"x", 1, 2, 64}, {"y", 0, 1, 64}, grid.data(), 4);
+            tests::expect_num(grid[64 * 63 + 63], std::tgamma(2.0) + std::erf(2.0) + 1, "memoized function in sampleGrid", "OK memoized function shared by threads");
+
+            mfpu.defineFunction("slow", [](double v) {
+                return v;
+            });
+            tests::expect_throw([&]() {
+                mfpu.getMemoStats("slow");
+            }, "cache kept after redefining the function", "OK cache dropped when the function is redefined");
+        }
+
+        {
+            tests::print_test_title("LOOKUP TABLES");
+
+            RPNCompiler tfpu;
+            tfpu.defineVar("x", 0);
+
+            //knots of a uniform grid, of a guide table and of a binary search
+            vector<vector<double>> knots(3);
+            for (int i = 0; i <= 40; i++) {
+                knots[0].push_back(i * 0.25);
+                knots[1].push_back(10 * pow(i / 40.0, 1.5));
+                knots[2].push_back(1e-6 * pow(10.0, i * 0.2));
+            }
+
+            for (const auto &xs : knots) {
+                vector<double> ys;
+                for (double x : xs) {
+                    ys.push_back(sin(x) + x);
+                }
+                for (Interpolation mode : {Interpolation::LINEAR, Interpolation::CUBIC_SPLINE}) {
+                    tfpu.defineTable("tab", xs, ys, mode);
+                    tfpu.compile("tab(x)");
+                    bool knotsOk = true;
+                    for (size_t i = 0; i < xs.size(); i++) {
+                        tfpu.defineVar("x", xs[i]);
+                        knotsOk = knotsOk && fabs(tfpu.evaluate() - ys[i]) <= 1e-12 * max(1.0, fabs(ys[i]));
+                    }
+                    tests::expect_true(knotsOk, "table values at the knots");
+
+                    if (mode == Interpolation::LINEAR) {
+                        tfpu.defineVar("x", (xs[7] + xs[8]) / 2);
+                        tests::expect_num(tfpu.evaluate(), (ys[7] + ys[8]) / 2, "linear interpolation", "", 1e-12);
+                    }
+
+                    const size_t rows = 3000;
+                    vector<double> in(rows), out(rows);
+                    for (size_t i = 0; i < rows; i++) {
+                        in[i] = -1 + (xs.back() + 2) * ((i * 7919) % rows) / rows;
+                    }
+                    in[5] = NAN;
+                    tfpu.evaluateBatch({{"x", in.data()}}, rows, out.data());
+                    bool same = true;
+                    for (size_t i = 0; i < rows; i++) {
+                        tfpu.defineVar("x", in[i]);
+                        const double r = tfpu.evaluate();
+                        same = same && (r == out[i] || (isnan(r) && isnan(out[i])));
+                    }
+                    tests::expect_true(same, "batch and scalar table evaluation differ");
+                    tests::expect_true(isnan(out[5]), "NaN argument");
 
+                    tfpu.defineVar("x", -5);
+                    tests::expect_num(tfpu.evaluate(), ys.front(), "value before the table", "", 1e-12);
+                    tfpu.defineVar("x", xs.back() + 5);
+                    tests::expect_num(tfpu.evaluate(), ys.back(), "value after the table", "", 1e-9);
+                }
+            }
+            tests::print_success("OK table interpolation");
+
+            vector<double> xs, ys;
+            for (int i = 0; i <= 60; i++) {
+                xs.push_back(i * 0.1);
+                ys.push_back(sin(i * 0.1));
+            }
+            tfpu.defineTable("spline", 0, 6, ys, Interpolation::CUBIC_SPLINE);
+            tfpu.compile("spline(x)");
+            double maxErr = 0;
+            for (double x = 0.5; x <= 5.5; x += 0.01) {
+                tfpu.defineVar("x", x);
+                maxErr = max(maxErr, fabs(tfpu.evaluate() - sin(x)));
+            }
+            tests::expect_true(maxErr < 1e-5, "spline error " + to_string(maxErr), "OK cubic spline");
+
+            tfpu.setBackend(Backend::REGISTER);
+            tfpu.compile("spline(x)*2");
+            tfpu.defineVar("x", 1.23);
+            const double r = tfpu.evaluate();
+            tfpu.setBackend(Backend::STACK);
+            tests::expect_true(r == tfpu.evaluate(), "register backend table", "OK table in the register backend");
+
+            tests::expect_throw([&]() {
+                tfpu.defineTable("bad", {0, 1, 1}, {1, 2, 3});
+            }, "knots not increasing");
+            tests::expect_throw([&]() {
+                tfpu.defineTable("bad", {0, 1}, {1, 2}, Interpolation::CUBIC_SPLINE);
+            }, "spline with 2 knots", "OK invalid tables");
+
+            tfpu.defineFunction("spline", [](double v) {
+                return v;
+            });
+            tests::expect_num(tfpu.evaluate(), 2.46, "function replacing a table", "OK table replaced by a function");
+        }
+
+        {
+            tests::print_test_title("TABULATED EXPRESSIONS");
+
+            const string expr = "exp(-t)*tanh(3*t)+log(1+t)+sin(5*t)/(2+cos(t))";
+            const double tolerance = 1e-12;
+
+            RPNCompiler exact;
+            exact.defineVar("t", 0);
+            exact.compile(expr);
+
+            RPNCompiler sfpu;
+            sfpu.defineVar("t", 0.25);
+            sfpu.compileTabulated(expr, "t", 0, 2, tolerance);
+
+            const SurrogateInfo &info = sfpu.getSurrogateInfo();
+            tests::expect_true(info.intervals > 0 && info.maxError <= tolerance, "surrogate not built");
+            tests::expect_num(sfpu.getVar("t"), 0.25, "variable restored after the tabulation");
+
+            double maxErr = 0;
+            for (double t = 0; t <= 2; t += 0.000731) {
+                sfpu.defineVar("t", t);
+                exact.defineVar("t", t);
+                const double e = exact.evaluate();
+                maxErr = max(maxErr, fabs(sfpu.evaluate() - e) / max(1.0, fabs(e)));
+            }
+            tests::expect_true(maxErr <= tolerance, "surrogate error " + to_string(maxErr), "OK surrogate within the tolerance");
+
+            const size_t rows = 3000;
+            vector<double> in(rows), out(rows);
+            for (size_t i = 0; i < rows; i++) {
+                in[i] = 2.0 * i / (rows - 1);
+            }
+            in[rows - 1] = 3;
+            sfpu.evaluateBatch({{"t", in.data()}}, rows, out.data());
+            bool same = true;
+            for (size_t i = 0; i < rows; i++) {
+                sfpu.defineVar("t", in[i]);
+                same = same && out[i] == sfpu.evaluate();
+            }
+            tests::expect_true(same, "batch and scalar surrogate differ", "OK batch surrogate");
+
+            sfpu.defineVar("t", 3);
+            exact.defineVar("t", 3);
+            tests::expect_true(sfpu.evaluate() == exact.evaluate(), "out of range", "OK exact expression out of the range");
+
+            sfpu.setAccuracy(Accuracy::EXACT);
+            tests::expect_true(sfpu.getSurrogateInfo().intervals == 0, "surrogate kept after setAccuracy");
+
+            sfpu.defineVar("u", 0);
+            tests::expect_throw([&]() {
+                sfpu.compileTabulated("t+u", "t", 0, 1, tolerance);
+            }, "two variables");
+            tests::expect_throw([&]() {
+                sfpu.compileTabulated("t>0.3", "t", 0, 1, tolerance);
+            }, "discontinuous expression");
+            tests::expect_throw([&]() {
+                sfpu.compileTabulated("log(t)", "t", 0, 1, tolerance);
+            }, "infinite value");
+            tests::expect_throw([&]() {
+                sfpu.compileTabulated("t", "t", 1, 0, tolerance);
+            }, "empty range", "OK invalid tabulations");
+
+            sfpu.compile("t*2");
+            sfpu.defineVar("t", 0.5);
+            tests::expect_num(sfpu.evaluate(), 1.0, "expression compiled after a failed tabulation", "OK compile drops the surrogate");
+        }
+
+        {
+            tests::print_test_title("METRICS");
+
+            MetricsRegistry metrics(8);
+
+            {
+                RPNCompiler mfpu(metrics.getMemoryResource());
+                mfpu.setMetrics(&metrics);
+                mfpu.defineVar("x", 2);
+                mfpu.compile("x*x+1");
+                tests::expect_throw([&]() {
+                    mfpu.compile("x*(");
+                }, "syntax error");
+                mfpu.compile("x*x+1");
+
+                for (int i = 0; i < 20; i++) {
+                    mfpu.evaluate();
+                }
+
+                MetricsSnapshot m = metrics.snapshot();
+                tests::expect_true(m.compiles == 3 && m.compileErrors == 1 && m.compileLatency.count == 3, "compile metrics");
+                tests::expect_true(m.evaluations == 16 && m.evaluateLatency.count == 2, "sampled evaluations " + to_string(m.evaluations));
+                tests::expect_true(m.allocations > 0 && m.bytesInUse > 0, "allocation metrics");
+
+                vector<double> xs(1000, 1.0), ys(1000);
+                mfpu.evaluateBatch({{"x", xs.data()}}, xs.size(), ys.data());
+                mfpu.undefVar("x");
+                tests::expect_throw([&]() {
+                    mfpu.evaluate();
+                }, "undefined variable");
+            }
+
+            MetricsSnapshot m = metrics.snapshot();
+            tests::expect_true(m.evaluations == 21 && m.evaluateErrors == 1 && m.batchRows == 1000, "evaluations published by the destructor");
+            tests::expect_true(m.bytesInUse == 0 && m.allocations == m.deallocations, "memory released");
+            tests::print_success("OK metrics snapshot");
+
+            const double p50 = m.compileLatency.percentileNs(50);
+            tests::expect_true(p50 > 0 && p50 <= m.compileLatency.percentileNs(100), "latency percentiles");
+
+            const string json = metrics.toJson();
+            tests::expect_true(json.find("\"compiles\":3,") != string::npos && json.find("\"evaluations\":21,") != string::npos, "json " + json, "OK json");
+
+            const string prom = metrics.toPrometheus();
+            tests::expect_true(prom.find("virtualfpu_compiles_total 3\n") != string::npos
+                    && prom.find("# TYPE virtualfpu_compile_duration_seconds histogram") != string::npos
+                    && prom.find("virtualfpu_compile_duration_seconds_bucket{le=\"+Inf\"} 3\n") != string::npos
+                    && prom.find("virtualfpu_evaluate_errors_total 1\n") != string::npos, "prometheus " + prom, "OK prometheus");
+
+            metrics.reset();
+            tests::expect_true(metrics.snapshot().compiles == 0, "reset");
+
+            //threads update their own shards
+            vector<std::thread> threads;
+            for (int t = 0; t < 4; t++) {
+                threads.emplace_back([&metrics]() {
+                    RPNCompiler tfpu;
+                    tfpu.setMetrics(&metrics);
+                    tfpu.defineVar("x", 1);
+                    tfpu.compile("sin(x)");
+                    for (int i = 0; i < 1000; i++) {
+                        tfpu.evaluate();
+                    }
+                });
+            }
+            for (auto &t : threads) {
+                t.join();
+            }
+            m = metrics.snapshot();
+            tests::expect_true(m.compiles == 4 && m.evaluations == 4000 && m.evaluateLatency.count == 4000 / 8, "threads metrics", "OK metrics of many threads");
+        }
+
+        {
+            tests::print_test_title("NON-THROWING COMPILE AND EVALUATE");
+
+            CountingMemoryResource counter;
+            RPNCompiler rfpu(&counter);
+            rfpu.defineVar("x", 3);
+
+            auto compiled = rfpu.tryCompile("x*2+1");
+            tests::expect_true(compiled.hasValue() && compiled.value() == &rfpu, "valid expression");
+            auto evaluated = rfpu.tryEvaluate();
+            tests::expect_true(evaluated && *evaluated == 7, "evaluation result", "OK valid expression");
+
+            struct Case {
+                const char *expression;
+                ErrorCode code;
+                size_t position;
+                const char *token;
+            };
+
+            const vector<Case> cases = {
+                {"", ErrorCode::EMPTY_EXPRESSION, Diagnostic::NO_POSITION, ""},
+                {"2**3", ErrorCode::INVALID_OPERATOR, 2, "*"},
+                {"x+q", ErrorCode::INVALID_TOKEN, 2, "q"},
+                {"2*(x+1", ErrorCode::UNCLOSED_BRACKET, Diagnostic::NO_POSITION, ""},
+                {"(x)(2)", ErrorCode::INVALID_BRACKET, 3, "("},
+                {"2*()", ErrorCode::EMPTY_BRACKETS, 3, ")"},
+                {"sin cos x", ErrorCode::INVALID_FUNCTION_SEQUENCE, 4, "cos"},
+                {"x 2", ErrorCode::CONSECUTIVE_NUMBERS, 2, "2"},
+                {"x+", ErrorCode::MISSING_OPERAND, Diagnostic::NO_POSITION, ""}
+            };
+
+            for (const Case &c : cases) {
+                auto r = rfpu.tryCompile(c.expression);
+                tests::expect_true(!r && r.error().code == c.code && r.error().position == c.position && r.error().getToken() == c.token,
+                        "error of " + string(c.expression) + ": " + r.error().message());
+                string thrown;
+                try {
+                    rfpu.compile(c.expression);
+                } catch (VirtualFPUException &e) {
+                    thrown = e.getMessage();
+                }
+                tests::expect_true(thrown.starts_with(r.error().message()), "message of " + string(c.expression) + ": " + thrown);
+            }
+            tests::print_success("OK syntax errors");
+
+            tests::expect_true(rfpu.tryEvaluate().error().code == ErrorCode::NOT_COMPILED, "evaluate after a failed compile");
+            tests::expect_num(rfpu.tryEvaluate().valueOr(-1), -1.0, "default value");
+            tests::expect_throw([&]() {
+                rfpu.tryCompile("x+q").value();
+            }, "value of an error", "OK missing value");
+
+            //an invalid first token is reported without allocations
+            rfpu.tryCompile("q+1");
+            const size_t allocations = counter.allocations();
+            for (int i = 0; i < 100; i++) {
+                rfpu.tryCompile("q+1");
+            }
+            tests::expect_equals(counter.allocations(), allocations, "allocations of the error path", "OK errors without allocations");
+
+            rfpu.tryCompile("x*2");
+            rfpu.undefVar("x");
+            auto undefined = rfpu.tryEvaluate();
+            tests::expect_true(undefined.error().code == ErrorCode::UNDEFINED_VARIABLE && undefined.error().getToken() == "x", "undefined variable");
+
+            rfpu.defineVar("x", 1);
+            rfpu.defineFunction("fail", [](double) -> double {
+                throw std::runtime_error("out of domain");
+            });
+            rfpu.tryCompile("fail(x)");
+            auto failed = rfpu.tryEvaluate();
+            tests::expect_true(failed.error().code == ErrorCode::FUNCTION_FAILED && failed.error().cause
+                    && failed.error().message().find("out of domain") != string::npos, "custom function failure " + failed.error().message(), "OK evaluation errors");
+        }
+
+        {
+            tests::print_test_title("FUSED KERNELS");
+
+            RPNCompiler kfpu;
+            kfpu.defineVar("x", 0);
+            kfpu.defineVar("y", 0);
+            kfpu.defineVar("k", 2.5);
+            kfpu.defineFunction("half", [](double v) {
+                return v / 2;
+            });
+            kfpu.defineTable("ramp", 0, 10, {0, 10, 20});
+
+            const size_t rows = 1500;
+            vector<double> xs(rows), ys(rows);
+            for (size_t i = 0; i < rows; i++) {
+                xs[i] = i * 0.01;
+                ys[i] = 1 + (i % 11) * 0.3;
+            }
+            const vector<ColumnBinding> cols = {
+                {"x", xs.data()},
+                {"y", ys.data()}
+            };
+
+            const vector<string> formulas = {
+                "sin(x*y)+sqrt(x*y+1)",
+                "cos(x*y)*sqrt(x*y+1)-k",
+                "y*x",
+                "x",
+                "3",
+                "half(x)+ramp(x)",
+                "sin(x*y)+sqrt(x*y+1)",
+                "(x>y)*x^2+(y>=x)*-y"
+            };
+
+            const FusionStats &stats = kfpu.compileFused(formulas);
+            tests::expect_equals(stats.expressions, formulas.size(), "fused expressions");
+            tests::expect_true(stats.operations < stats.instructions, "shared subexpressions", "OK common subexpressions");
+
+            vector<vector<double>> fused(formulas.size(), vector<double>(rows)), separate(formulas.size(), vector<double>(rows));
+            vector<double*> outputs;
+            for (auto &out : fused) {
+                outputs.push_back(out.data());
+            }
+            kfpu.evaluateFused(cols, rows, outputs);
+
+            for (size_t k = 0; k < formulas.size(); k++) {
+                kfpu.compile(formulas[k]);
+                kfpu.evaluateBatch(cols, rows, separate[k].data());
+            }
+            tests::expect_true(fused == separate, "fused results", "OK fused results");
+
+            tests::expect_throw([&]() {
+                kfpu.evaluateFused(cols, rows, {outputs[0]});
+            }, "missing outputs", "OK outputs checked");
+
+            //variables without a column keep their value
+            kfpu.defineVar("z", 0);
+            kfpu.defineVar("x", 4);
+            kfpu.compileFused({"x+z"});
+            kfpu.evaluateFused({{"z", ys.data()}}, rows, {fused[0].data()});
+            tests::expect_num(fused[0][rows - 1], 4 + ys[rows - 1], "unbound variable");
+
+            kfpu.undefVar("x");
+            tests::expect_throw([&]() {
+                kfpu.evaluateFused({{"z", ys.data()}}, rows, {fused[0].data()});
+            }, "undefined variable", "OK undefined variable");
+        }
+
+        {
+            tests::print_test_title("MEMORY MAPPED COLUMNS");
+
+            const size_t rows = 100000;
+            const auto dir = std::filesystem::temp_directory_path();
+            const string xPath = (dir / "vfpu_test_x.bin").string();
+            const string yPath = (dir / "vfpu_test_y.bin").string();
+            const string rPath = (dir / "vfpu_test_r.bin").string();
+
+            vector<double> xs(rows), ys(rows);
+            for (size_t i = 0; i < rows; i++) {
+                xs[i] = i * 0.001;
+                ys[i] = 1 + (i % 17) * 0.25;
+            }
+
+            //y has a header
+            {
+                std::ofstream x(xPath, std::ios::binary);
+                x.write(reinterpret_cast<const char*> (xs.data()), rows * sizeof (double));
+                std::ofstream y(yPath, std::ios::binary);
+                y.write("COLUMN Y", 8);
+                y.write(reinterpret_cast<const char*> (ys.data()), rows * sizeof (double));
+            }
+
+            RPNCompiler mfpu;
+            mfpu.defineVar("x", 0);
+            mfpu.defineVar("y", 0);
+            mfpu.defineVar("k", 3);
+            mfpu.compile("sqrt(x^2+y^2)*k");
+
+            vector<double> expected(rows);
+            mfpu.evaluateBatch({{"x", xs.data()}, {"y", ys.data()}}, rows, expected.data());
+
+            MappedColumn x(xPath), y(yPath, 8);
+            tests::expect_equals(y.size(), rows, "rows of a column with a header");
+
+            {
+                MappedColumnSink r(rPath, rows, "HEADER01");
+                tests::expect_equals(mfpu.evaluateMapped({{"x", &x}, {"y", &y}}, r, 999), rows, "mapped rows");
+                tests::expect_equals(r.size(), rows, "rows written");
+            }
+
+            MappedColumn r(rPath, 8);
+            tests::expect_true(std::equal(expected.begin(), expected.end(), r.data()), "mapped sink", "OK mapped sink");
+
+            std::ostringstream stream;
+            StreamColumnSink sink(stream);
+            mfpu.evaluateMapped({{"x", &x}, {"y", &y}}, sink, 4096);
+            const string bytes = stream.str();
+            tests::expect_true(bytes.size() == rows * sizeof (double) && std::memcmp(bytes.data(), expected.data(), bytes.size()) == 0, "stream sink", "OK stream sink");
+
+            tests::expect_throw([&]() {
+                MappedColumn odd(yPath, 4);
+            }, "header not a multiple of a double", "OK column header checked");
+
+            tests::expect_throw([&]() {
+                MappedColumnSink odd(rPath, 10, "ODD");
+            }, "sink header not a multiple of a double", "OK sink header checked");
+
+            tests::expect_throw([&]() {
+                MappedColumn truncated(yPath, 16);
+                mfpu.evaluateMapped({{"x", &x}, {"y", &truncated}}, sink);
+            }, "columns of different size", "OK column rows checked");
+
+            tests::expect_throw([&]() {
+                MappedColumnSink small(rPath, 10);
+                mfpu.evaluateMapped({{"x", &x}, {"y", &y}}, small);
+            }, "sink too small", "OK sink size checked");
+
+            {
+                std::ofstream odd(rPath, std::ios::binary);
+                odd.write("0123456789AB", 12);
+            }
+            tests::expect_throw([&]() {
+                MappedColumn odd(rPath);
+            }, "size not a multiple of a double", "OK column size checked");
+
+            std::filesystem::remove(xPath);
+            std::filesystem::remove(yPath);
+            std::filesystem::remove(rPath);
+        }
+
+        {
+            tests::print_test_title("C++ TRANSPILATION");
+
+            RPNCompiler tfpu;
+            tfpu.defineVar("x", 0);
+            tfpu.defineVar("y", 0);
+            tfpu.defineVar("t", 0);
+            tfpu.defineVar("k", 2.5);
+            tfpu.defineFunction("twice", twice);
+
+            tfpu.compile("sqrt(x^2+y^2)*k");
+            const string src = tfpu.generateCpp("radius", {"x", "y"});
+            tests::expect_true(src.find("double radius(double x, double y)") != string::npos && src.find("const double k = 2.5;") != string::npos
+                    && src.find("std::sqrt") != string::npos, "generated function " + src, "OK generated function");
+
+            tfpu.compile("twice(x)+k");
+            tests::expect_true(tfpu.generateCpp("f").find("extern double twice(double);") != string::npos
+                    && tfpu.generateCpp("f").find("double f(double k, double x)") != string::npos, "extern functions", "OK extern functions");
+
+            tfpu.defineVar("t0", 0);
+            tfpu.compile("t0*2+1");
+            tests::expect_true(tfpu.generateCpp("g", {"t0"}).find("const double t0 ") == string::npos, "temporary named as a parameter", "OK temporaries");
+            tfpu.undefVar("t0");
+
+            //the functions compiled by virtualfpu_add_formulas compute the same values as the interpreter
+            const map<string, std::function<double(double, double) >> formulas = {
+                {"sqrt(x^2+y^2)*k", radius},
+                {"sign(-x)+twice(0.1*y)+(x>=y)-3^x/(y+1)", mix},
+                {"(x>0)*x*exp(-x/k)", [](double x, double) {
+                        return ramp(x);
+                    }},
+                {"sum(i, 1, 12, x^i/i)+prod(j, 1, 3, y+j)", series},
+                {"sum(i, 1, 3, x*i+y)", [](double x, double y) {
+                        return shadow(y, x);
+                    }},
+                {"x*2+1", [](double x, double) {
+                        return offset(x);
+                    }}
+            };
+
+            bool same = true;
+            for (const auto &[formula, fn] : formulas) {
+                tfpu.compile(formula);
+                for (double x = -3; x <= 3; x += 0.37) {
+                    for (double y = -1.5; y <= 4; y += 0.53) {
+                        tfpu.defineVar("x", x);
+                        tfpu.defineVar("y", y);
+                        const double expected = tfpu.evaluate();
+                        same = same && (fn(x, y) == expected || (std::isnan(expected) && std::isnan(fn(x, y))));
+                    }
+                }
+            }
+            tests::expect_true(same, "transpiled formulas", "OK transpiled formulas");
+
+            //the multiply-adds contracted by the interpreter are std::fma in the generated code
+            tfpu.setFusedMultiplyAdd(true);
+            tfpu.compile("x*y+k-x*3");
+            tests::expect_true(tfpu.generateCpp("f").find("std::fma(") != string::npos, "fma not generated", "OK fma generated");
+
+            const map<string, std::function<double(double, double) >> contracted = {
+                {"((x*y+1.1)*x-2.3)*y-x*0.7", horner},
+                {"y-x*x+x*y*3-(x+y)*(x-y)+sum(i, 1, 5, x*i+y*0.3)", ::contracted}
+            };
+
+            same = true;
+            for (const auto &[formula, fn] : contracted) {
+                tfpu.compile(formula);
+                for (double x = -3; x <= 3; x += 0.37) {
+                    for (double y = -1.5; y <= 4; y += 0.53) {
+                        tfpu.defineVar("x", x);
+                        tfpu.defineVar("y", y);
+                        same = same && fn(x, y) == tfpu.evaluate();
+                    }
+                }
+            }
+            tests::expect_true(same, "transpiled fused formulas", "OK transpiled fused formulas");
+            tfpu.setFusedMultiplyAdd(false);
+        }
+
+        {
+            tests::print_test_title("BULK COMPILATION");
+
+            RPNCompiler bfpu;
+            bfpu.defineVar("x", 0.5);
+            bfpu.defineVar("y", 3);
+            bfpu.defineFunction("twice", twice);
+            bfpu.defineTable("ramp", 0, 10, {0, 10, 20});
+            bfpu.setAccuracy(Accuracy::FAST);
+
+            vector<string> formulas;
+            for (int i = 0; i < 1000; i++) {
+                formulas.push_back(i % 100 == 7 ? "x+*" + std::to_string(i) : "sin(x*" + std::to_string(i) + ")+twice(y)-ramp(x)*" + std::to_string(i % 13));
+            }
+
+            const BulkCompilation all = bfpu.compileAll(formulas, 4);
+            tests::expect_equals(all.failed, size_t(10), "invalid formulas");
+
+            bool same = all.compilers.size() == formulas.size();
+            for (size_t i = 0; i < formulas.size() && same; i++) {
+                if (i % 100 == 7) {
+                    same = !all.compilers[i] && all.errors[i].code != ErrorCode::NONE;
+                } else {
+                    bfpu.compile(formulas[i]);
+                    same = all.compilers[i] && all.errors[i].code == ErrorCode::NONE && all.compilers[i]->evaluate() == bfpu.evaluate()
+                            && all.compilers[i]->getAccuracy() == Accuracy::FAST;
+                }
+            }
+            tests::expect_true(same, "compiled formulas", "OK compileAll");
+
+            //compilers of different threads compile at the same time
+            vector<std::future<bool>> results;
+            for (int t = 0; t < 4; t++) {
+                results.push_back(std::async(std::launch::async, [t]() {
+                    RPNCompiler local;
+                    local.defineVar("x", t);
+                    bool ok = true;
+                    for (int i = 0; i < 200; i++) {
+                        local.compile("cos(x)^2+sin(x)^2+" + std::to_string(i));
+                        ok = ok && std::abs(local.evaluate() - (1.0 + i)) < 1e-12;
+                    }
+                    return ok;
+                }));
+            }
+            bool concurrent = true;
+            for (auto &r : results) {
+                concurrent = r.get() && concurrent;
+            }
+            tests::expect_true(concurrent, "concurrent compile", "OK concurrent compile");
+        }
+
+        {
+            tests::print_test_title("TIERED EXECUTION");
+
+            RPNCompiler tfpu;
+            tfpu.defineVar("x", 0.5);
+            tfpu.defineVar("y", 2);
+            tfpu.setTiering(TieringPolicy{5});
+            tfpu.compile("x*y+sin(x)/y");
+
+            const double expected = 0.5 * 2 + std::sin(0.5) / 2;
+            tests::expect_true(tfpu.getTier() == Tier::INTERPRETER, "interpreter tier", "OK interpreter tier");
+            for (int i = 0; i < 4; i++) {
+                tests::expect_num(tfpu.evaluate(), expected, "wrong tiered result");
+            }
+            tests::expect_true(tfpu.getTier() == Tier::INTERPRETER, "below threshold", "OK below threshold");
+            tests::expect_num(tfpu.evaluate(), expected, "wrong tiered result");
+            tests::expect_true(tfpu.getTier() == Tier::REGISTER, "register tier", "OK register tier");
+            tests::expect_equals(tfpu.getEvaluationCount(), (size_t) 5, "wrong evaluation count", "OK evaluation count");
+            tests::expect_num(tfpu.evaluate(), expected, "wrong tiered result");
+
+            tfpu.compile("x-y");
+            tests::expect_true(tfpu.getTier() == Tier::INTERPRETER && tfpu.getEvaluationCount() == 0, "count restarts on compile", "OK count restarts on compile");
+
+            //an expression of one variable is tabulated over the values evaluated
+            RPNCompiler sfpu;
+            sfpu.defineVar("t", 0);
+            sfpu.setTiering(TieringPolicy{0, 20, 1e-10, true});
+            sfpu.compile("exp(-t)*cos(3*t)");
+            for (int i = 0; i <= 20; i++) {
+                sfpu.defineVar("t", i / 20.0);
+                tests::expect_num(sfpu.evaluate(), std::exp(-i / 20.0) * std::cos(3 * i / 20.0), "wrong result before tabulation");
+            }
+            for (int i = 0; i < 1000000 && sfpu.getTier() != Tier::TABULATED; i++) {
+                sfpu.evaluate();
+                std::this_thread::yield();
+            }
+            tests::expect_true(sfpu.getTier() == Tier::TABULATED, "tabulated tier", "OK tabulated tier");
+            sfpu.defineVar("t", 0.37);
+            tests::expect_true(std::abs(sfpu.evaluate() - std::exp(-0.37) * std::cos(3 * 0.37)) < 1e-9, "tabulated value", "OK tabulated value");
+
+            //two variables are never tabulated
+            tfpu.setTiering(TieringPolicy{0, 3});
+            tfpu.compile("x*y");
+            for (int i = 0; i < 10; i++) {
+                tfpu.defineVar("x", i);
+                tfpu.evaluate();
+            }
+            tests::expect_true(tfpu.getTier() == Tier::INTERPRETER, "two variables not tabulated", "OK two variables not tabulated");
+
+            tfpu.disableTiering();
+            tests::expect_equals(tfpu.getEvaluationCount(), (size_t) 0, "tiering not disabled", "OK tiering disabled");
+
+            //a pending tabulation is dropped by a new compile
+            sfpu.setTiering(TieringPolicy{0, 2, 1e-10, true});
+            sfpu.compile("sqrt(t+1)");
+            sfpu.defineVar("t", 0);
+            sfpu.evaluate();
+            sfpu.defineVar("t", 4);
+            sfpu.evaluate();
+            sfpu.compile("t*2");
+            sfpu.defineVar("t", 3);
+            tests::expect_num(sfpu.evaluate(), 6.0, "wrong result after compile");
+            tests::expect_true(sfpu.getTier() == Tier::INTERPRETER, "pending tabulation dropped", "OK pending tabulation dropped");
+
+            //the thread of a pending tabulation is joined with the compiler, it does not call the functions after
+            std::atomic<size_t> calls{0};
+            std::atomic<int> running{0};
+            {
+                RPNCompiler bfpu;
+                bfpu.defineVar("t", 0);
+                bfpu.defineFunction("slow", [&calls, &running](double v) {
+                    ++running;
+                    ++calls;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    --running;
+                    return v * v;
+                });
+                bfpu.setTiering(TieringPolicy{0, 2, 1e-10, true});
+                bfpu.compile("slow(t)");
+                bfpu.evaluate();
+                bfpu.defineVar("t", 4);
+                bfpu.evaluate();
+                //wait for the tabulation to call the function
+                while (calls.load() < 4) {
+                    std::this_thread::yield();
+                }
+            }
+            tests::expect_equals(running.load(), 0, "tabulation running after the compiler", "OK tabulation joined");
+        }
+
+        {
+            tests::print_test_title("SUM AND PROD");
+
+            RPNCompiler lfpu;
+            lfpu.defineVar("a", 2);
+            lfpu.defineVar("n", 1000);
+            lfpu.defineVar("x", 0.3);
+            lfpu.defineVar("i", 100);
+
+            double expected = 0;
+            for (int i = 1; i <= 1000; i++) {
+                expected += 2.0 * i * i / (1 + i);
+            }
+
+            tests::expect_num(lfpu.compile("sum(i,1,10,i)").evaluate(), 55.0, "wrong sum");
+            tests::expect_num(lfpu.compile("prod(k, 1, 5, k)").evaluate(), 120.0, "wrong prod");
+            tests::expect_num(lfpu.compile("sum(i,1,n,a*i^2/(1+i))").evaluate(), expected, "wrong series");
+            tests::expect_num(lfpu.compile("sum(i,1,3,sum(j,1,i,i*j))").evaluate(), 25.0, "wrong nested loops");
+            tests::expect_num(lfpu.compile("i+2sum(i,1,3,i)").evaluate(), 112.0, "wrong index scope");
+            tests::expect_num(lfpu.compile("sum(i,1,2,sum(i,1,3,i))").evaluate(), 12.0, "wrong inner index");
+            tests::expect_num(lfpu.compile("sum(i,5,1,i)+prod(i,1,0,i)").evaluate(), 1.0, "wrong empty ranges");
+            tests::expect_num(lfpu.compile("sum(i,0.5,2.7,i)").evaluate(), 4.5, "wrong fractional bounds");
+            tests::expect_num(lfpu.compile("sum(i,1,n,x^i/i)").evaluate(), -std::log(1 - 0.3), "wrong log series");
+            tests::expect_true(std::isnan(lfpu.compile("sum(i,1,1/0,i)").evaluate()), "infinite range", "OK infinite range");
+
+            //the invariant subexpressions of the body are evaluated once
+            size_t calls = 0;
+            lfpu.defineFunction("f", [&calls](double v) {
+                ++calls;
+                return v * 2;
+            });
+            tests::expect_num(lfpu.compile("sum(i,1,100,f(x)*i+sum(j,1,10,f(a)))").evaluate(), 0.6 * 5050 + 100 * 40.0, "wrong hoisted sum");
+            tests::expect_equals(calls, (size_t) 2, "invariants not hoisted", "OK invariants hoisted");
+
+            //the variables of the loops are read at every evaluation
+            lfpu.compile("sum(i,1,n,a)");
+            lfpu.defineVar("n", 10);
+            lfpu.defineVar("a", 0.5);
+            tests::expect_num(lfpu.evaluate(), 5.0, "wrong loop after defineVar");
+            tests::expect_true(lfpu.getVariables() == vector<string>{"n", "a"}, "loop variables", "OK loop variables");
+
+            lfpu.compile("x*sum(i,1,n,a*i)-1", Backend::REGISTER);
+            tests::expect_num(lfpu.evaluate(), 0.3 * 27.5 - 1, "wrong register loop");
+            lfpu.setBackend(Backend::STACK);
+
+            //a loop not using the rows is evaluated once for the batch
+            lfpu.defineVar("y", 0);
+            lfpu.compile("y+sum(i,1,n,i)");
+            vector<double> ys = {1, 2, 3};
+            vector<double> out(3);
+            lfpu.evaluateBatch({{"y", ys.data()}}, 3, out.data());
+            tests::expect_true(out == vector<double>{56, 57, 58}, "batch loop", "OK batch loop");
+            lfpu.compile("sum(i,1,n,y*i)");
+            tests::expect_throw([&]() {
+                lfpu.evaluateBatch({{"y", ys.data()}}, 3, out.data());
+            }, "loop over a column", "OK loop over a column");
+
+            for (const string bad : {"sum(i,1,2)", "prod(1,1,2,3)", "sum(i,1,2,i", "sum(i,,2,i)", "sum(sin,1,2,3)"}) {
+                const auto result = lfpu.tryCompile(bad);
+                tests::expect_true(!result && result.error().code == ErrorCode::INVALID_LOOP, "invalid loop " + bad, "OK invalid loop " + bad);
+            }
+            tests::expect_true(lfpu.tryCompile("sum(i,1,2,z)").error().position == 10, "loop error position", "OK loop error position");
+
+            //a function or a variable named sum or prod is not a loop
+            lfpu.defineFunction("sum", [](double v) {
+                return v + 100;
+            });
+            lfpu.defineVar("prod", 3);
+            tests::expect_num(lfpu.compile("sum(x)").evaluate(), 100.3, "wrong custom function named sum");
+            tests::expect_num(lfpu.compile("2*prod+sum(x)").evaluate(), 106.3, "wrong variable named prod");
+            tests::expect_true(lfpu.tryCompile("prod(x+1)").error().code == lfpu.tryCompile("a(x+1)").error().code, "variable named prod", "OK variable named prod");
+            lfpu.undefFunction("sum");
+            lfpu.undefVar("prod");
+            tests::expect_num(lfpu.compile("sum(i,1,4,i)*prod(i,1,3,i)").evaluate(), 60.0, "wrong loops after undefine");
+        }
+
+        {
+            tests::print_test_title("MONTE CARLO");
+
+            RPNCompiler mfpu;
+            mfpu.defineVar("u", 0);
+            mfpu.defineVar("z", 0);
+            mfpu.defineVar("k", 3);
+
+            MonteCarloResult uniform = mfpu.compile("k*u").monteCarlo({{"u", Distribution::UNIFORM, 2, 4}}, 200000, 7);
+            tests::expect_equals(uniform.count, (size_t) 200000, "wrong count", "OK count");
+            tests::expect_true(std::abs(uniform.mean - 9) < 5 * uniform.standardError, "uniform mean", "OK uniform mean");
+            tests::expect_true(std::abs(uniform.variance - 3) < 0.05, "uniform variance", "OK uniform variance");
+            tests::expect_true(uniform.min >= 6 && uniform.max <= 12, "uniform range", "OK uniform range");
+            tests::expect_true(std::abs(uniform.quantiles.quantile(0.25) - 7.5) < 7.5 * 0.02, "uniform quartile", "OK uniform quartile");
+
+            //the samples depend only on the seed: same results with any number of threads
+            mfpu.compile("exp(0.2*z)*u");
+            const vector<RandomVariable> vars = {{"z", Distribution::NORMAL, 0, 1}, {"u", Distribution::LOGNORMAL, 0, 0.5}};
+            MonteCarloResult one = mfpu.monteCarlo(vars, 50000, 42, 1);
+            MonteCarloResult four = mfpu.monteCarlo(vars, 50000, 42, 4);
+            tests::expect_true(one.mean == four.mean && one.variance == four.variance && one.max == four.max, "thread independent moments", "OK thread independent moments");
+            tests::expect_true(one.quantiles.quantile(0.9) == four.quantiles.quantile(0.9), "thread independent quantiles", "OK thread independent quantiles");
+            tests::expect_true(one.mean != mfpu.monteCarlo(vars, 50000, 43).mean, "seed ignored", "OK seed");
+            tests::expect_true(std::abs(one.quantiles.quantile(0.5) - 1) < 0.03, "lognormal median", "OK lognormal median");
+
+            //the non finite values are counted apart
+            MonteCarloResult logs = mfpu.compile("log(z)").monteCarlo({{"z", Distribution::NORMAL, 0, 1}}, 10000, 1);
+            tests::expect_equals(logs.count + logs.nanCount + logs.infCount, (size_t) 10000, "wrong non finite counts", "OK non finite counts");
+            tests::expect_true(logs.nanCount > 4500 && logs.nanCount < 5500, "nan count", "OK nan count");
+
+            tests::expect_throw([&]() {
+                mfpu.monteCarlo({{"z", Distribution::NORMAL, 0, -1}}, 10);
+            }, "negative deviation", "OK negative deviation");
+            tests::expect_throw([&]() {
+                mfpu.monteCarlo({{"u", Distribution::UNIFORM, 2, 1}}, 10);
+            }, "empty uniform range", "OK empty uniform range");
+            tests::expect_throw([&]() {
+                mfpu.monteCarlo({{"z", Distribution::NORMAL, 0, 1}}, 10, 0, 1, 1.5);
+            }, "invalid accuracy", "OK invalid accuracy");
+        }
+
+        {
+            tests::print_test_title("FORMULA STORE");
+
+            RPNCompiler sfpu;
+            sfpu.defineVar("x", 0.5);
+            sfpu.defineVar("y", 2);
+            sfpu.defineFunction("twice", [](double v) {
+                return v * 2;
+            });
+
+            const vector<string> formulas = {"sqrt(x^2+y^2)*3", "sqrt(x^2+y^2)*4", "-x+twice(y)*0.1", "(x<=y)*sqrt(x^2+y^2)-exp(-x*y)", "sqrt(x^2+y^2)*3"};
+
+            FormulaStore store;
+            vector<size_t> ids;
+            vector<double> expected;
+            for (const string &f : formulas) {
+                expected.push_back(sfpu.compile(f).evaluate());
+                ids.push_back(sfpu.intern(store));
+            }
+
+            const StoreFootprint footprint = store.getFootprint();
+            tests::expect_equals(footprint.formulas, (size_t) 5, "wrong formulas", "OK formulas");
+            tests::expect_equals(footprint.names, (size_t) 3, "wrong names", "OK names");
+            tests::expect_true(footprint.nodes < footprint.instructions / 2, "shared subexpressions", "OK shared subexpressions");
+            tests::expect_true(footprint.bytes < footprint.instructionBytes, "store footprint", "OK store footprint");
+
+            //a formula already stored adds no nodes
+            sfpu.compile("sqrt(x^2+y^2)*4").intern(store);
+            tests::expect_equals(store.getFootprint().nodes, footprint.nodes, "duplicate formula stored", "OK duplicate formula");
+
+            for (size_t i = 0; i < formulas.size(); i++) {
+                tests::expect_num(sfpu.compile(store, ids[i]).evaluate(), expected[i], "wrong stored formula " + formulas[i]);
+                tests::expect_num(sfpu.compile(store.toString(ids[i])).evaluate(), expected[i], "wrong text of formula " + formulas[i]);
+            }
+            tests::expect_true(store.toString(ids[0]) == "(sqrt(((x^2)+(y^2)))*3)", "formula text", "OK formula text");
+
+            //a stored formula reads the variables of the compiler compiling it
+            RPNCompiler other;
+            other.defineVar("x", 3);
+            other.defineVar("y", 4);
+            tests::expect_num(other.compile(store, ids[1]).evaluate(), 20.0, "wrong formula of another compiler");
+            tests::expect_true(other.getLastCompiledStatement() == store.toString(ids[1]), "stored statement", "OK stored statement");
+
+            tests::expect_throw([&]() {
+                sfpu.compile("sum(i,1,3,x*i)").intern(store);
+            }, "loop interned", "OK loop not interned");
+            tests::expect_throw([&]() {
+                sfpu.compile(store, store.size());
+            }, "missing formula", "OK missing formula");
+        }
 
         cout << "TESTS SUCCESS!" << endl;
 
@@ -42,12 +42,31 @@
 #include <vector>
 #include <cmath>
 #include <functional>
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <exception>
+#include <bit>
+#include <charconv>
+#include <set>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define VFPU_HAS_MMAP 1
+#endif
 
 
 
 namespace virtualfpu {
 
-    static std::vector<Instruction> functionsOp = {
+    static const std::vector<Instruction> functionsOp = {
         Instruction::ABS, Instruction::ACOS, Instruction::ACOSH, Instruction::ASIN,
         Instruction::ASINH, Instruction::ATAN, Instruction::ATANH, Instruction::COS,
         Instruction::COSH, Instruction::EXP,
@@ -56,76 +75,544 @@ namespace virtualfpu {
         Instruction::SINH, Instruction::SQRT, Instruction::TAN, Instruction::TANH
     };
 
-    static std::map<Instruction, std::function<double(double) >> oneArgFunctions = {
-        {Instruction::UNARY_MINUS, [](double val) {
-                return -val;
-            }},
-        {Instruction::SIGN, [](double val) {
-                if (val > 0) {
-                    return 1.0;
-                } else if (val < 0) {
-                    return -1.0;
-                } else {
-                    return 0.0;
-                }
-            }},
-        {Instruction::ABS, [](double val) {
-                return fabs(val);
-            }},
-        {Instruction::COS, [](double val) {
-                return cos(val);
-            }},
-        {Instruction::SIN, [](double val) {
-                return sin(val);
-            }},
-        {Instruction::TAN, [](double val) {
-                return tan(val);
-            }},
-        {Instruction::ACOS, [](double val) {
-                return acos(val);
-            }},
-        {Instruction::ASIN, [](double val) {
-                return asin(val);
-            }},
-        {Instruction::ATAN, [](double val) {
-                return atan(val);
-            }},
-        {Instruction::COSH, [](double val) {
-                return cosh(val);
-            }},
-        {Instruction::SINH, [](double val) {
-                return sinh(val);
-            }},
-        {Instruction::TANH, [](double val) {
-                return tanh(val);
-            }},
-        {Instruction::ASINH, [](double val) {
-                return asinh(val);
-            }},
-        {Instruction::ACOSH, [](double val) {
-                return acosh(val);
-            }},
-        {Instruction::ATANH, [](double val) {
-                return atanh(val);
-            }},
-        {Instruction::EXP, [](double val) {
-                return exp(val);
-            }},
-        {Instruction::LOG, [](double val) {
-                return log(val);
-            }},
-        {Instruction::LOG10, [](double val) {
-                return log10(val);
-            }},
-        {Instruction::LOG2, [](double val) {
-                return log2(val);
-            }},
-        {Instruction::SQRT, [](double val) {
-                return sqrt(val);
-            }}
+    /**
+     * Scalar and block implementation of a one argument built-in function
+     */
+    struct UnaryKernel {
+        double (*scalar)(double);
+        void (*block)(double *values, size_t len);
+    };
+
+    /**
+     * Apply a function to a block of values (the function is inlined in the loop)
+     */
+    template<double (*F)(double)>
+    static void applyToBlock(double *values, size_t len) {
+        for (size_t j = 0; j < len; ++j) values[j] = F(values[j]);
+    }
+
+    template<double (*F)(double)>
+    static constexpr UnaryKernel unaryKernel() {
+        return {F, applyToBlock<F>};
+    }
+
+    template<double (*F)(double, double)>
+    static void applyToBlock(double *a, const double *b, size_t len) {
+        for (size_t j = 0; j < len; ++j) a[j] = F(a[j], b[j]);
+    }
+
+    ////////////////////// exact tier: libm ////////////////////////////////////////
+
+    static double exactUnaryMinus(double val) {
+        return -val;
+    }
+
+    static double exactSign(double val) {
+        if (val > 0) {
+            return 1.0;
+        } else if (val < 0) {
+            return -1.0;
+        } else {
+            return 0.0;
+        }
+    }
+
+    static double exactAbs(double val) {
+        return fabs(val);
+    }
+
+    static double exactCos(double val) {
+        return cos(val);
+    }
+
+    static double exactSin(double val) {
+        return sin(val);
+    }
+
+    static double exactTan(double val) {
+        return tan(val);
+    }
+
+    static double exactAcos(double val) {
+        return acos(val);
+    }
+
+    static double exactAsin(double val) {
+        return asin(val);
+    }
+
+    static double exactAtan(double val) {
+        return atan(val);
+    }
+
+    static double exactCosh(double val) {
+        return cosh(val);
+    }
+
+    static double exactSinh(double val) {
+        return sinh(val);
+    }
+
+    static double exactTanh(double val) {
+        return tanh(val);
+    }
+
+    static double exactAsinh(double val) {
+        return asinh(val);
+    }
+
+    static double exactAcosh(double val) {
+        return acosh(val);
+    }
+
+    static double exactAtanh(double val) {
+        return atanh(val);
+    }
+
+    static double exactExp(double val) {
+        return exp(val);
+    }
+
+    static double exactLog(double val) {
+        return log(val);
+    }
+
+    static double exactLog10(double val) {
+        return log10(val);
+    }
+
+    static double exactLog2(double val) {
+        return log2(val);
+    }
+
+    static double exactSqrt(double val) {
+        return sqrt(val);
+    }
+
+    static double exactPow(double base, double exponent) {
+        return pow(base, exponent);
+    }
+
+    static const std::map<Instruction, UnaryKernel> oneArgFunctions = {
+        {Instruction::UNARY_MINUS, unaryKernel<exactUnaryMinus>()},
+        {Instruction::SIGN, unaryKernel<exactSign>()},
+        {Instruction::ABS, unaryKernel<exactAbs>()},
+        {Instruction::COS, unaryKernel<exactCos>()},
+        {Instruction::SIN, unaryKernel<exactSin>()},
+        {Instruction::TAN, unaryKernel<exactTan>()},
+        {Instruction::ACOS, unaryKernel<exactAcos>()},
+        {Instruction::ASIN, unaryKernel<exactAsin>()},
+        {Instruction::ATAN, unaryKernel<exactAtan>()},
+        {Instruction::COSH, unaryKernel<exactCosh>()},
+        {Instruction::SINH, unaryKernel<exactSinh>()},
+        {Instruction::TANH, unaryKernel<exactTanh>()},
+        {Instruction::ASINH, unaryKernel<exactAsinh>()},
+        {Instruction::ACOSH, unaryKernel<exactAcosh>()},
+        {Instruction::ATANH, unaryKernel<exactAtanh>()},
+        {Instruction::EXP, unaryKernel<exactExp>()},
+        {Instruction::LOG, unaryKernel<exactLog>()},
+        {Instruction::LOG10, unaryKernel<exactLog10>()},
+        {Instruction::LOG2, unaryKernel<exactLog2>()},
+        {Instruction::SQRT, unaryKernel<exactSqrt>()}
+    };
+
+    ////////////////////// range reduction /////////////////////////////////////////
+
+    /*
+     * Constants of the fdlibm kernels (Sun Microsystems, freely distributable):
+     * the high parts have trailing zero bits so that k*HI is exact for the reduction multipliers used here.
+     *
+     * The kernels below are valid on a reduced domain and have no branches: the selects are done on
+     * integer masks, so the block loops are vectorized also with the default -ftrapping-math.
+     * Arguments out of the domain are evaluated by the C library.
+     */
+    static const double LN2_HI = 6.93147180369123816490e-01;
+    static const double LN2_LO = 1.90821492927058770002e-10;
+    static const double LN2 = 6.93147180559945286227e-01;
+    static const double INV_LN2 = 1.44269504088896338700e+00;
+    static const double INV_LN10 = 4.34294481903251816668e-01;
+    static const double LOG10_2_HI = 3.01029995663611771306e-01;
+    static const double LOG10_2_LO = 3.69423907715893078616e-13;
+    static const double PIO2_1 = 1.57079632673412561417e+00;
+    static const double PIO2_1T = 6.07710050650619224932e-11;
+    static const double PIO2_2 = 6.07710050630396597660e-11;
+    static const double PIO2_2T = 2.02226624879595063154e-21;
+    static const double TWO_OVER_PI = 6.36619772367581382433e-01;
+
+    /**
+     * Adding and subtracting 1.5*2^52 rounds a double below 2^51 to the nearest integer,
+     * the sum holds the integer in its low mantissa bits
+     */
+    static const double ROUND_SHIFTER = 6755399441055744.0;
+
+    /**
+     * Domain of the exp kernels: the result is a normal number
+     */
+    static const double EXP_LIMIT = 708.0;
+
+    /**
+     * Domain of the sinh, cosh and tanh kernels
+     */
+    static const double HYPERBOLIC_LIMIT = 700.0;
+
+    /**
+     * Domain of the sin and cos kernels, beyond this magnitude libm is used (Payne-Hanek reduction)
+     */
+    static const double TRIG_LIMIT = 4.0e5;
+
+    static inline double roundToInt(double x) {
+        return (x + ROUND_SHIFTER) - ROUND_SHIFTER;
+    }
+
+    /**
+     * @return 2^k for an integer -1022 <= k <= 1023
+     */
+    static inline double pow2(double k) {
+        return std::bit_cast<double>(std::bit_cast<uint64_t>(k + (1023.0 + ROUND_SHIFTER)) << 52);
+    }
+
+    /**
+     * @return a if mask is all ones, b if mask is zero
+     */
+    static inline double selectBits(uint64_t mask, double a, double b) {
+        return std::bit_cast<double>((std::bit_cast<uint64_t>(a) & mask) | (std::bit_cast<uint64_t>(b) & ~mask));
+    }
+
+    /**
+     * @return all ones if |x| < limit (limit positive), zero otherwise
+     */
+    static inline uint64_t belowMask(double x, double limit) {
+        const uint64_t ax = std::bit_cast<uint64_t>(x) & 0x7fffffffffffffffULL;
+        return 0 - ((ax - std::bit_cast<uint64_t>(limit)) >> 63);
+    }
+
+    /**
+     * Split a positive normal x into 2^k*(1+f) with sqrt(2)/2 <= 1+f < sqrt(2)
+     * @return f
+     */
+    static inline double splitLog(double x, double &k) {
+        //offsetting by the bits of sqrt(2)/2 moves the mantissas above sqrt(2) to the next exponent
+        const uint64_t bits = std::bit_cast<uint64_t>(x) + (0x3ff0000000000000ULL - 0x3fe6a09e667f3bcdULL);
+        k = std::bit_cast<double>(0x4330000000000000ULL | (bits >> 52)) - (4503599627370496.0 + 1023.0);
+        return std::bit_cast<double>((bits & 0x000fffffffffffffULL) + 0x3fe6a09e667f3bcdULL) - 1.0;
+    }
+
+    /**
+     * Combine the sine and the cosine of the reduced argument
+     * @param k multiple of pi/2 subtracted from the argument
+     * @return the sine of the argument
+     */
+    static inline double sinQuadrant(double s, double c, double k) {
+        const uint64_t q = std::bit_cast<uint64_t>(k + ROUND_SHIFTER);
+        const double v = selectBits(0 - (q & 1), c, s);
+        return std::bit_cast<double>(std::bit_cast<uint64_t>(v) ^ ((q & 2) << 62));
+    }
+
+    static inline bool expInRange(double x) {
+        return fabs(x) < EXP_LIMIT;
+    }
+
+    static inline bool logInRange(double x) {
+        return x >= std::numeric_limits<double>::min() && x <= std::numeric_limits<double>::max();
+    }
+
+    static inline bool trigInRange(double x) {
+        return fabs(x) < TRIG_LIMIT;
+    }
+
+    static inline bool hyperbolicInRange(double x) {
+        return fabs(x) < HYPERBOLIC_LIMIT;
+    }
+
+    /**
+     * Apply F to the values where IN_RANGE holds, the C library function G elsewhere
+     */
+    template<double (*F)(double), double (*G)(double), bool (*IN_RANGE)(double)>
+    static double applyInRange(double x) {
+        return IN_RANGE(x) ? F(x) : G(x);
+    }
+
+    /**
+     * The kernel F is applied in a branch free loop when all the values of the block are in range
+     */
+    template<double (*F)(double), double (*G)(double), bool (*IN_RANGE)(double)>
+    static void applyInRangeToBlock(double *values, size_t len) {
+        bool inRange = true;
+        for (size_t j = 0; j < len; ++j) inRange &= IN_RANGE(values[j]);
+        if (inRange) {
+            for (size_t j = 0; j < len; ++j) values[j] = F(values[j]);
+        } else {
+            for (size_t j = 0; j < len; ++j) values[j] = applyInRange<F, G, IN_RANGE>(values[j]);
+        }
+    }
+
+    template<double (*F)(double), double (*G)(double), bool (*IN_RANGE)(double)>
+    static constexpr UnaryKernel rangedKernel() {
+        return {applyInRange<F, G, IN_RANGE>, applyInRangeToBlock<F, G, IN_RANGE>};
+    }
+
+    ////////////////////// accurate tier: about 1 ULP ////////////////////////////
+
+    static inline double accurateExp(double x) {
+        const double k = roundToInt(x * INV_LN2);
+        const double hi = x - k * LN2_HI;
+        const double lo = k * LN2_LO;
+        const double r = hi - lo;
+        const double t = r * r;
+        const double c = r - t * (1.66666666666666019037e-01 + t * (-2.77777777770155933842e-03 + t * (6.61375632143793436117e-05
+                + t * (-1.65339022054652515390e-06 + t * 4.13813679705723846039e-08))));
+        const double y = 1.0 - ((lo - (r * c) / (2.0 - c)) - hi);
+        return y * pow2(k);
+    }
+
+    /**
+     * Remez polynomial of log(1+f) = f - (hfsq - s*(hfsq+R)), s = f/(2+f)
+     * @return s*(hfsq+R)
+     */
+    static inline double accurateLogTail(double f, double hfsq) {
+        const double s = f / (2.0 + f);
+        const double z = s * s;
+        const double w = z * z;
+        const double t1 = w * (3.999999999940941908e-01 + w * (2.222219843214978396e-01 + w * 1.531383769920937332e-01));
+        const double t2 = z * (6.666666666666735130e-01 + w * (2.857142874366239149e-01 + w * (1.818357216161805012e-01 + w * 1.479819860511658591e-01)));
+        return s * (hfsq + t1 + t2);
+    }
+
+    static inline double accurateLog(double x) {
+        double k;
+        const double f = splitLog(x, k);
+        const double hfsq = 0.5 * f * f;
+        return k * LN2_HI - ((hfsq - (accurateLogTail(f, hfsq) + k * LN2_LO)) - f);
+    }
+
+    static inline double accurateLog2(double x) {
+        double k;
+        const double f = splitLog(x, k);
+        const double hfsq = 0.5 * f * f;
+        return k + (f - (hfsq - accurateLogTail(f, hfsq))) * INV_LN2;
+    }
+
+    static inline double accurateLog10(double x) {
+        double k;
+        const double f = splitLog(x, k);
+        const double hfsq = 0.5 * f * f;
+        return k * LOG10_2_HI + ((f - (hfsq - accurateLogTail(f, hfsq))) * INV_LN10 + k * LOG10_2_LO);
+    }
+
+    static inline double accurateSinKernel(double r) {
+        const double z = r * r;
+        const double v = z * r;
+        const double p = 8.33333333332248946124e-03 + z * (-1.98412698298579493134e-04 + z * (2.75573137070700676789e-06
+                + z * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10)));
+        return r + v * (-1.66666666666666324348e-01 + z * p);
+    }
+
+    static inline double accurateCosKernel(double r) {
+        const double z = r * r;
+        const double p = z * (4.16666666666666019037e-02 + z * (-1.38888888888741095749e-03 + z * (2.48015872894767294178e-05
+                + z * (-2.75573143513906633035e-07 + z * (2.08757232129817482790e-09 + z * -1.13596475577881948265e-11)))));
+        //for |r| >= 0.3 1-qx is exact and qx is about r/4
+        const uint64_t ar = std::bit_cast<uint64_t>(r) & 0x7fffffffffffffffULL;
+        const double quarter = std::bit_cast<double>((ar - 0x0020000000000000ULL) & 0xffffffff00000000ULL);
+        const double qx = selectBits(belowMask(r, 0.3), 0.0, selectBits(belowMask(r, 0.78125), quarter, 0.28125));
+        return (1.0 - qx) - ((0.5 * z - qx) - z * p);
+    }
+
+    /**
+     * sin for |x| < TRIG_LIMIT, three parts reduction
+     */
+    static inline double accurateSin(double x) {
+        const double k = roundToInt(x * TWO_OVER_PI);
+        const double r = ((x - k * PIO2_1) - k * PIO2_2) - k * PIO2_2T;
+        return sinQuadrant(accurateSinKernel(r), accurateCosKernel(r), k);
+    }
+
+    static inline double accurateCos(double x) {
+        const double k = roundToInt(x * TWO_OVER_PI);
+        const double r = ((x - k * PIO2_1) - k * PIO2_2) - k * PIO2_2T;
+        return sinQuadrant(accurateSinKernel(r), accurateCosKernel(r), k + 1.0);
+    }
+
+    /**
+     * Functions of the ACCURATE tier, the other functions use libm
+     */
+    static const std::map<Instruction, UnaryKernel> accurateFunctions = {
+        {Instruction::EXP, rangedKernel<accurateExp, exactExp, expInRange>()},
+        {Instruction::LOG, rangedKernel<accurateLog, exactLog, logInRange>()},
+        {Instruction::LOG2, rangedKernel<accurateLog2, exactLog2, logInRange>()},
+        {Instruction::LOG10, rangedKernel<accurateLog10, exactLog10, logInRange>()},
+        {Instruction::SIN, rangedKernel<accurateSin, exactSin, trigInRange>()},
+        {Instruction::COS, rangedKernel<accurateCos, exactCos, trigInRange>()}
+    };
+
+    ////////////////////// fast tier: 1e-7 /////////////////////////////////////////
+
+    static inline double fastExp(double x) {
+        const double k = roundToInt(x * INV_LN2);
+        const double r = x - k * LN2;
+        //Taylor polynomial of degree 7, |r| <= ln(2)/2: truncation error below 6e-9
+        const double p = 1.0 + r * (1.0 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 + r * (1.0 / 120 + r * (1.0 / 720 + r * (1.0 / 5040)))))));
+        return p * pow2(k);
+    }
+
+    static inline double fastLog(double x) {
+        double k;
+        const double f = splitLog(x, k);
+        //log(1+f)=2*atanh(s), |s| <= 0.1716: truncation error below 3e-9
+        const double s = f / (2.0 + f);
+        const double z = s * s;
+        return k * LN2 + 2.0 * s * (1.0 + z * (1.0 / 3 + z * (1.0 / 5 + z * (1.0 / 7 + z * (1.0 / 9)))));
+    }
+
+    static inline double fastLog2(double x) {
+        return fastLog(x) * INV_LN2;
+    }
+
+    static inline double fastLog10(double x) {
+        return fastLog(x) * INV_LN10;
+    }
+
+    static inline double fastSinKernel(double r) {
+        //Taylor polynomial of degree 9, |r| <= pi/4: truncation error below 2e-9
+        const double z = r * r;
+        return r + r * z * (-1.0 / 6 + z * (1.0 / 120 + z * (-1.0 / 5040 + z * (1.0 / 362880))));
+    }
+
+    static inline double fastCosKernel(double r) {
+        //Taylor polynomial of degree 10, |r| <= pi/4: truncation error below 2e-10
+        const double z = r * r;
+        return 1.0 + z * (-1.0 / 2 + z * (1.0 / 24 + z * (-1.0 / 720 + z * (1.0 / 40320 + z * (-1.0 / 3628800)))));
+    }
+
+    /**
+     * sin for |x| < TRIG_LIMIT, two parts reduction
+     */
+    static inline double fastSin(double x) {
+        const double k = roundToInt(x * TWO_OVER_PI);
+        const double r = (x - k * PIO2_1) - k * PIO2_1T;
+        return sinQuadrant(fastSinKernel(r), fastCosKernel(r), k);
+    }
+
+    static inline double fastCos(double x) {
+        const double k = roundToInt(x * TWO_OVER_PI);
+        const double r = (x - k * PIO2_1) - k * PIO2_1T;
+        return sinQuadrant(fastSinKernel(r), fastCosKernel(r), k + 1.0);
+    }
+
+    static inline double fastSinh(double x) {
+        const double z = x * x;
+        const double small = x + x * z * (1.0 / 6 + z * (1.0 / 120 + z * (1.0 / 5040 + z * (1.0 / 362880))));
+        //h = exp(|x|)/2
+        const double h = fastExp(fabs(x) - LN2);
+        const double large = copysign(h - 0.25 / h, x);
+        return selectBits(belowMask(x, 0.3), small, large);
+    }
+
+    static inline double fastCosh(double x) {
+        const double h = fastExp(fabs(x) - LN2);
+        return h + 0.25 / h;
+    }
+
+    static inline double fastTanh(double x) {
+        const double z = x * x;
+        const double small = x + x * z * (-1.0 / 3 + z * (2.0 / 15 + z * (-17.0 / 315 + z * (62.0 / 2835 + z * (-1382.0 / 155925)))));
+        //saturates to 1 when exp(2|x|) overflows the polynomial domain
+        const double e = fastExp(fmin(2.0 * fabs(x), EXP_LIMIT));
+        const double large = copysign(1.0 - 2.0 / (e + 1.0), x);
+        return selectBits(belowMask(x, 0.3), small, large);
+    }
+
+    static inline bool fastPowInRange(double base, double exponent) {
+        return logInRange(base) && fabs(exponent) <= 50.0;
+    }
+
+    /**
+     * exp(exponent*log(base)) for a positive normal base and |exponent| <= 50 when the result is normal, libm otherwise
+     */
+    static double fastPow(double base, double exponent) {
+        if (fastPowInRange(base, exponent)) {
+            const double e = exponent * fastLog(base);
+            if (expInRange(e)) {
+                return fastExp(e);
+            }
+        }
+        return pow(base, exponent);
+    }
+
+    static void fastPowBlock(double *a, const double *b, size_t len) {
+        bool inRange = true;
+        for (size_t j = 0; j < len; ++j) inRange &= fastPowInRange(a[j], b[j]) && expInRange(b[j] * fastLog(a[j]));
+        if (inRange) {
+            for (size_t j = 0; j < len; ++j) a[j] = fastExp(b[j] * fastLog(a[j]));
+        } else {
+            for (size_t j = 0; j < len; ++j) a[j] = fastPow(a[j], b[j]);
+        }
+    }
+
+    /**
+     * Functions of the FAST tier, the other functions use libm
+     */
+    static const std::map<Instruction, UnaryKernel> fastFunctions = {
+        {Instruction::EXP, rangedKernel<fastExp, exactExp, expInRange>()},
+        {Instruction::LOG, rangedKernel<fastLog, exactLog, logInRange>()},
+        {Instruction::LOG2, rangedKernel<fastLog2, exactLog2, logInRange>()},
+        {Instruction::LOG10, rangedKernel<fastLog10, exactLog10, logInRange>()},
+        {Instruction::SIN, rangedKernel<fastSin, exactSin, trigInRange>()},
+        {Instruction::COS, rangedKernel<fastCos, exactCos, trigInRange>()},
+        {Instruction::SINH, rangedKernel<fastSinh, exactSinh, hyperbolicInRange>()},
+        {Instruction::COSH, rangedKernel<fastCosh, exactCosh, hyperbolicInRange>()},
+        {Instruction::TANH, rangedKernel<fastTanh, exactTanh, hyperbolicInRange>()}
+    };
+
+    /**
+     * Number of entries of a dense table indexed by Instruction
+     */
+    static const size_t INSTRUCTION_TABLE_SIZE = 64;
+
+    static_assert(static_cast<size_t> (Instruction::NE) < INSTRUCTION_TABLE_SIZE, "INSTRUCTION_TABLE_SIZE too small");
+
+    /**
+     * Built-in functions of an accuracy tier, indexed by Instruction
+     */
+    struct RPNCompiler::FunctionTable {
+        UnaryKernel unary[INSTRUCTION_TABLE_SIZE];
+        double (*pow)(double, double);
+        void (*powBlock)(double *a, const double *b, size_t len);
     };
 
-    static std::map<Instruction, string> symToStr = {
+    const RPNCompiler::FunctionTable* RPNCompiler::functionTable(Accuracy accuracy) {
+
+        const auto makeTable = [](const std::map<Instruction, UnaryKernel> &tier, double (*powFn)(double, double), void (*powBlock)(double*, const double*, size_t)) {
+            FunctionTable table{};
+            for (const auto &fn : oneArgFunctions) {
+                table.unary[static_cast<size_t> (fn.first)] = fn.second;
+            }
+            for (const auto &fn : tier) {
+                table.unary[static_cast<size_t> (fn.first)] = fn.second;
+            }
+            table.pow = powFn;
+            table.powBlock = powBlock;
+            return table;
+        };
+
+        static const FunctionTable exactTable = makeTable({}, exactPow, applyToBlock<exactPow>);
+        static const FunctionTable accurateTable = makeTable(accurateFunctions, exactPow, applyToBlock<exactPow>);
+        static const FunctionTable fastTable = makeTable(fastFunctions, fastPow, fastPowBlock);
+
+        switch (accuracy) {
+            case Accuracy::ACCURATE:
+                return &accurateTable;
+            case Accuracy::FAST:
+                return &fastTable;
+            default:
+                return &exactTable;
+        }
+    }
+
+    /**
+     * The symbol tables are read only: they are shared by the compilers of all the threads
+     */
+    static const std::map<Instruction, string> symToStr = {
         {Instruction::UNARY_MINUS, "[-]"},
         {Instruction::ADD, "+"},
         {Instruction::SUB, "-"},
@@ -150,10 +637,16 @@ namespace virtualfpu {
         {Instruction::ASINH, "asinh"},
         {Instruction::ACOSH, "acosh"},
         {Instruction::ATANH, "atanh"},
-        {Instruction::SIGN, "sign"}
+        {Instruction::SIGN, "sign"},
+        {Instruction::LT, "<"},
+        {Instruction::GT, ">"},
+        {Instruction::LE, "<="},
+        {Instruction::GE, ">="},
+        {Instruction::EQ, "=="},
+        {Instruction::NE, "!="}
     };
 
-    static std::map<string, Instruction> strToSymbol = {
+    static const std::map<string, Instruction, std::less<>> strToSymbol = {
         {"[-]", Instruction::UNARY_MINUS},
         {"(", Instruction::PAR_OPEN},
         {")", Instruction::PAR_CLOSE},
@@ -180,7 +673,13 @@ namespace virtualfpu {
         {"asinh", Instruction::ASINH},
         {"acosh", Instruction::ACOSH},
         {"atanh", Instruction::ATANH},
-        {"sign", Instruction::SIGN}
+        {"sign", Instruction::SIGN},
+        {"<", Instruction::LT},
+        {">", Instruction::GT},
+        {"<=", Instruction::LE},
+        {">=", Instruction::GE},
+        {"==", Instruction::EQ},
+        {"!=", Instruction::NE}
 
     };
 
@@ -194,8 +693,8 @@ namespace virtualfpu {
             } else {
                 ostr << item.value;
             }
-        } else if (symToStr.contains(item.instr)) {
-            ostr << symToStr[item.instr];
+        } else if (const auto sym = symToStr.find(item.instr); sym != symToStr.end()) {
+            ostr << sym->second;
         } else if (item.instr==Instruction::DEF_FUNCTION)
         {
             ostr<<(item.defVar != "" ? item.defVar:"<custom fn?>");
@@ -210,8 +709,10 @@ namespace virtualfpu {
 
     void StackItem::fromString(const string & opstr) {
 
-        if (strToSymbol.contains(opstr)) {
-            instr = strToSymbol[opstr];
+        const auto sym = strToSymbol.find(opstr);
+
+        if (sym != strToSymbol.end()) {
+            instr = sym->second;
 
         } else {
             throw VirtualFPUException(opstr + ": invalid operator or function.");
@@ -219,6 +720,14 @@ namespace virtualfpu {
 
     }
 
+    StackItem::StackItem(const allocator_type& alloc) : defVar(alloc) {
+
+    }
+
+    StackItem::StackItem(const StackItem& other, const allocator_type& alloc) : instr(other.instr), value(other.value), defVar(other.defVar, alloc) {
+
+    }
+
     StackItem * StackItem::clone() {
         StackItem *s = new StackItem();
         s->value = this->value;
@@ -244,889 +753,6722 @@ namespace virtualfpu {
         return msg.c_str();
     }
 
-    ////////////////////// VirtualFPU //////////////////////////////////////////////
+    ////////////////////// CountingMemoryResource ///////////////////////////////
+
+    CountingMemoryResource::CountingMemoryResource(std::pmr::memory_resource *upstream) : upstream(upstream) {
 
-    RPNCompiler::RPNCompiler() : instrVector(0) {
-        init(DEFAULT_STACK_SIZE);
     }
 
-    RPNCompiler::~RPNCompiler() {
+    size_t CountingMemoryResource::allocations() const noexcept {
+        return allocCount.load(std::memory_order_relaxed);
+    }
 
-        clearStack();
+    size_t CountingMemoryResource::deallocations() const noexcept {
+        return deallocCount.load(std::memory_order_relaxed);
+    }
 
-        if (instrVector) {
-            delete instrVector;
-            instrVector = nullptr;
-        }
+    size_t CountingMemoryResource::bytesInUse() const noexcept {
+        return inUseBytes.load(std::memory_order_relaxed);
+    }
 
-        if (defVars) {
+    size_t CountingMemoryResource::bytesAllocated() const noexcept {
+        return totalBytes.load(std::memory_order_relaxed);
+    }
 
-            defVars->clear();
-            delete defVars;
-            defVars = nullptr;
+    void CountingMemoryResource::reset() noexcept {
+        allocCount.store(0, std::memory_order_relaxed);
+        deallocCount.store(0, std::memory_order_relaxed);
+        totalBytes.store(0, std::memory_order_relaxed);
+    }
 
-        }
+    void* CountingMemoryResource::do_allocate(size_t bytes, size_t alignment) {
+        void *p = upstream->allocate(bytes, alignment);
+        allocCount.fetch_add(1, std::memory_order_relaxed);
+        totalBytes.fetch_add(bytes, std::memory_order_relaxed);
+        inUseBytes.fetch_add(bytes, std::memory_order_relaxed);
+        return p;
+    }
 
-        if (defFunctions) {
-            defFunctions->clear();
-            delete defFunctions;
-            defFunctions = nullptr;
-        }
+    void CountingMemoryResource::do_deallocate(void *p, size_t bytes, size_t alignment) {
+        upstream->deallocate(p, bytes, alignment);
+        deallocCount.fetch_add(1, std::memory_order_relaxed);
+        inUseBytes.fetch_sub(bytes, std::memory_order_relaxed);
+    }
 
+    bool CountingMemoryResource::do_is_equal(const std::pmr::memory_resource &other) const noexcept {
+        return this == &other;
     }
 
-    bool RPNCompiler::isBuiltinFunction(const Instruction & instr) noexcept {
-        return std::find(functionsOp.begin(), functionsOp.end(), instr) != functionsOp.end();
+    ////////////////////// Diagnostic //////////////////////////////////////////////
+
+    const size_t Diagnostic::MAX_TOKEN;
+
+    Diagnostic::Diagnostic(ErrorCode code, size_t position, std::string_view token) noexcept : code(code), position(position) {
+        tokenLength = std::min(token.size(), MAX_TOKEN);
+        std::copy_n(token.data(), tokenLength, this->token);
     }
 
-    int RPNCompiler::getOperatorPrecedence(const Instruction & instr) noexcept {
+    std::string_view Diagnostic::getToken() const noexcept {
+        return std::string_view(token, tokenLength);
+    }
 
-        switch (instr) {
-            case Instruction::VALUE:
-                return 0;
-            case Instruction::ADD:
-                return 2;
-            case Instruction::SUB:
-                return 3;
-            case Instruction::MUL:
-                return 4;
-            case Instruction::DIV:
-                return 5;
-            case Instruction::POW:
-                return 6;
-            case Instruction::UNARY_MINUS:
-                return 7;
-            case Instruction::DEF_FUNCTION:
-                return 8;
-            default:
-                if (isFunction(instr)) {
-                    return 8;
-                } else {
-                    return -1;
-                }
+    string Diagnostic::message() const {
+
+        ostringstream ss;
 
+        switch (code) {
+            case ErrorCode::NONE:
+                break;
+            case ErrorCode::EMPTY_EXPRESSION:
+                ss << "Syntax error:expression is empty";
+                break;
+            case ErrorCode::CONSECUTIVE_NUMBERS:
+                ss << "Found two consecutive numbers at position " << position;
+                break;
+            case ErrorCode::INVALID_BRACKET:
+                ss << "Invalid bracket " << getToken() << " at index " << position << " (missing operator or function)";
+                break;
+            case ErrorCode::EMPTY_BRACKETS:
+                ss << "Empty brackets at index " << position;
+                break;
+            case ErrorCode::INVALID_OPERATOR:
+                ss << "Invalid operator " << getToken() << " at index " << position;
+                break;
+            case ErrorCode::UNEXPECTED_OPERATOR:
+                ss << "Unexpected operator " << getToken() << " at index " << position;
+                break;
+            case ErrorCode::INVALID_FUNCTION_SEQUENCE:
+                ss << "Invalid function sequence " << getToken() << " at index " << position;
+                break;
+            case ErrorCode::INVALID_TOKEN:
+                ss << "Invalid token " << getToken() << " at index " << position;
+                break;
+            case ErrorCode::INVALID_NUMBER:
+                ss << "Error parsing double value:" << getToken();
+                break;
+            case ErrorCode::UNCLOSED_BRACKET:
+                ss << "Unclosed bracket found in expression.";
+                break;
+            case ErrorCode::MISSING_OPERAND:
+                ss << "Invalid stack:missing second operand";
+                break;
+            case ErrorCode::MISSING_ARGUMENT:
+                ss << "Invalid stack:found operation without operand.Reached end of stack";
+                break;
+            case ErrorCode::UNHANDLED_INSTRUCTION:
+                ss << "Unhandled instruction";
+                break;
+            case ErrorCode::NOT_REDUCIBLE:
+                ss << "Invalid stack:the expression does not reduce to a single value";
+                break;
+            case ErrorCode::STACK_OVERFLOW:
+                ss << "Stack overflow:the expression requires " << required << " stack slots, stack size is " << available;
+                break;
+            case ErrorCode::NOT_COMPILED:
+                ss << "Compile an expression before evaluating";
+                break;
+            case ErrorCode::UNDEFINED_VARIABLE:
+                ss << "Variabile " << getToken() << " is not defined!";
+                break;
+            case ErrorCode::UNDEFINED_FUNCTION:
+                ss << "Cannot find custom function " << getToken();
+                break;
+            case ErrorCode::INVALID_LOOP:
+                ss << "Invalid " << getToken() << " at index " << position << " (expected " << getToken() << "(index,from,to,expression))";
+                break;
+            case ErrorCode::FUNCTION_FAILED:
+                ss << "Custom function failed";
+                try {
+                    if (cause) {
+                        std::rethrow_exception(cause);
+                    }
+                } catch (const std::exception &e) {
+                    ss << ":" << e.what();
+                } catch (...) {
+                }
+                break;
         }
 
+        return ss.str();
     }
 
-    RPNCompiler & RPNCompiler::compile(const string & statement) {
+    ////////////////////// Metrics //////////////////////////////////////////////
 
-        const string err = "Syntax error:";
+    double LatencyHistogram::percentileNs(double p) const noexcept {
 
-        clearStack();
+        if (count == 0) {
+            return 0;
+        }
 
-        last_compiled_statement = statement;
+        const double rank = std::max(1.0, std::ceil(count * p / 100));
+        size_t seen = 0;
 
-        int idx = 0;
-        int next = 0;
+        for (size_t i = 0; i + 1 < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return upperBoundNs(i);
+            }
+        }
 
-        const int lu = statement.length();
+        return std::numeric_limits<double>::infinity();
+    }
 
-        /**   const int TK_NIL = 0;
-           const int TK_NUM = 1;
-           const int TK_OPERATOR = 2;
-           const int TK_FUNCTION = 3;
-           const int TK_OPEN_BRK = 4;
-           const int TK_CLOSE_BRK = 5;
-           const int TK_OTHER = 255;*/
+    /**
+     * Counters updated by the threads mapped to a shard (a cache line apart from the other shards)
+     */
+    struct alignas(64) MetricsRegistry::Shard {
+        std::atomic<size_t> compiles{0};
+        std::atomic<size_t> compileErrors{0};
+        std::atomic<size_t> compileLatency[LatencyHistogram::BUCKETS] = {};
+        std::atomic<size_t> compileLatencySum{0};
+        std::atomic<size_t> evaluations{0};
+        std::atomic<size_t> evaluateErrors{0};
+        std::atomic<size_t> evaluateLatency[LatencyHistogram::BUCKETS] = {};
+        std::atomic<size_t> evaluateLatencySum{0};
+        std::atomic<size_t> batchRows{0};
+    };
 
-        if (lu == 0) {
-            throwError(err + "expression is empty");
+    static void recordLatency(std::atomic<size_t> *buckets, std::atomic<size_t> &sum, std::chrono::nanoseconds latency) noexcept {
+        const uint64_t ns = latency.count() > 0 ? static_cast<uint64_t> (latency.count()) : 0;
+        buckets[std::min<size_t>(std::bit_width(ns), LatencyHistogram::BUCKETS - 1)].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    static void addLatencies(LatencyHistogram &h, const std::atomic<size_t> *buckets, const std::atomic<size_t> &sum) noexcept {
+        for (size_t i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+            const size_t n = buckets[i].load(std::memory_order_relaxed);
+            h.counts[i] += n;
+            h.count += n;
         }
+        h.sumNs += sum.load(std::memory_order_relaxed);
+    }
 
-        string token = "";
+    MetricsRegistry::MetricsRegistry(unsigned sampling, std::pmr::memory_resource *upstream) : counter(upstream), allocator(upstream), sampling(std::max(1u, sampling)), shards(nullptr) {
 
-        int state = 0;
+        shards = allocator.allocate_object<Shard>(SHARDS);
 
-        stack<StackItem*> temp;
-
-        //last token type processed
-        int last = TK_NIL;
-
-        //convert from infix to postfix notation (RPN)
-        while (idx < lu) {
+        for (size_t i = 0; i < SHARDS; ++i) {
+            allocator.construct(shards + i);
+        }
+    }
 
-            //estrae il token
-            token = getToken(statement, idx, &next);
+    MetricsRegistry::~MetricsRegistry() {
 
-            if (isNumber(token)) {
+        std::destroy_n(shards, SHARDS);
+        allocator.deallocate_object(shards, SHARDS);
+        shards = nullptr;
+    }
 
-                if (last == TK_NUM) {
-                    ostringstream ss;
-                    ss << "Found two consecutive numbers at position " << idx;
-                    throwError(ss.str());
-                }
+    std::pmr::memory_resource* MetricsRegistry::getMemoryResource() noexcept {
+        return &counter;
+    }
 
-                StackItem *s = new StackItem();
+    unsigned MetricsRegistry::getSampling() const noexcept {
+        return sampling;
+    }
 
-                s->instr = Instruction::VALUE;
-                s->value = toDouble(token);
+    MetricsRegistry::Shard& MetricsRegistry::shard() noexcept {
+        //the threads are assigned to the shards in turn
+        static std::atomic<size_t> threads{0};
+        thread_local const size_t index = threads.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+        return shards[index];
+    }
 
-                last = TK_NUM;
+    void MetricsRegistry::recordCompile(std::chrono::nanoseconds latency, bool failed) noexcept {
+        Shard &sh = shard();
+        sh.compiles.fetch_add(1, std::memory_order_relaxed);
+        if (failed) {
+            sh.compileErrors.fetch_add(1, std::memory_order_relaxed);
+        }
+        recordLatency(sh.compileLatency, sh.compileLatencySum, latency);
+    }
 
-                instrVector->push_back(s);
+    void MetricsRegistry::recordEvaluations(size_t count, std::chrono::nanoseconds latency) noexcept {
+        Shard &sh = shard();
+        sh.evaluations.fetch_add(count, std::memory_order_relaxed);
+        recordLatency(sh.evaluateLatency, sh.evaluateLatencySum, latency);
+    }
 
-            } else if (token == "(") {
+    void MetricsRegistry::recordEvaluations(size_t count) noexcept {
+        shard().evaluations.fetch_add(count, std::memory_order_relaxed);
+    }
 
-                if (last == TK_CLOSE_BRK) {
-                    ostringstream ss;
-                    ss << "Invalid bracket " << token << " at index " << idx << " (missing operator or function)";
-                    throwError(ss.str());
-                }
+    void MetricsRegistry::recordEvaluateError() noexcept {
+        shard().evaluateErrors.fetch_add(1, std::memory_order_relaxed);
+    }
 
-                last = TK_OPEN_BRK;
+    void MetricsRegistry::recordBatch(size_t rows, bool failed) noexcept {
+        Shard &sh = shard();
+        sh.batchRows.fetch_add(rows, std::memory_order_relaxed);
+        if (failed) {
+            sh.evaluateErrors.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
 
-                StackItem *s = new StackItem();
-                s->instr = Instruction::PAR_OPEN;
-                s->value = 0;
+    MetricsSnapshot MetricsRegistry::snapshot() const {
 
-                temp.push(s);
+        MetricsSnapshot m{};
 
-            } else if (token == ")") {
+        for (size_t i = 0; i < SHARDS; ++i) {
+            const Shard &sh = shards[i];
+            m.compiles += sh.compiles.load(std::memory_order_relaxed);
+            m.compileErrors += sh.compileErrors.load(std::memory_order_relaxed);
+            addLatencies(m.compileLatency, sh.compileLatency, sh.compileLatencySum);
+            m.evaluations += sh.evaluations.load(std::memory_order_relaxed);
+            m.evaluateErrors += sh.evaluateErrors.load(std::memory_order_relaxed);
+            addLatencies(m.evaluateLatency, sh.evaluateLatency, sh.evaluateLatencySum);
+            m.batchRows += sh.batchRows.load(std::memory_order_relaxed);
+        }
 
-                if (last == TK_OPEN_BRK) {
-                    ostringstream ss;
-                    ss << "Empty brackets at index " << idx;
-                    throwError(ss.str());
-                }
+        m.allocations = counter.allocations();
+        m.deallocations = counter.deallocations();
+        m.bytesAllocated = counter.bytesAllocated();
+        m.bytesInUse = counter.bytesInUse();
 
-                last = TK_CLOSE_BRK;
+        return m;
+    }
 
-                /**  if (temp.empty()) {
+    void MetricsRegistry::reset() noexcept {
 
-                      ostringstream ss;
-                      ss << err << ") not expected at position " << idx;
-                      throwError(ss.str());
-                  }*/
+        for (size_t i = 0; i < SHARDS; ++i) {
+            Shard &sh = shards[i];
+            for (auto *counters : {&sh.compiles, &sh.compileErrors, &sh.compileLatencySum, &sh.evaluations, &sh.evaluateErrors, &sh.evaluateLatencySum, &sh.batchRows}) {
+                counters->store(0, std::memory_order_relaxed);
+            }
+            for (size_t b = 0; b < LatencyHistogram::BUCKETS; ++b) {
+                sh.compileLatency[b].store(0, std::memory_order_relaxed);
+                sh.evaluateLatency[b].store(0, std::memory_order_relaxed);
+            }
+        }
 
-                if (!temp.empty()) {
+        counter.reset();
+    }
 
-                    bool matchingParFound = false;
+    static void writeJsonHistogram(ostream &os, const LatencyHistogram &h) {
 
-                    for (;;) {
+        //percentiles in the last bucket are unbounded
+        auto percentile = [&](double p) {
+            const double v = h.percentileNs(p);
+            if (std::isinf(v)) {
+                os << "null";
+            } else {
+                os << v;
+            }
+        };
+
+        os << "{\"count\":" << h.count << ",\"sum_ns\":" << h.sumNs << ",\"p50_ns\":";
+        percentile(50);
+        os << ",\"p99_ns\":";
+        percentile(99);
+        os << ",\"buckets\":[";
+        for (size_t i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+            os << (i ? "," : "") << h.counts[i];
+        }
+        os << "]}";
+    }
 
-                        StackItem *s = temp.top();
+    string MetricsRegistry::toJson() const {
+
+        const MetricsSnapshot m = snapshot();
+        ostringstream os;
+
+        os << "{\"compiles\":" << m.compiles
+                << ",\"compile_errors\":" << m.compileErrors
+                << ",\"compile_latency\":";
+        writeJsonHistogram(os, m.compileLatency);
+        os << ",\"evaluations\":" << m.evaluations
+                << ",\"evaluate_errors\":" << m.evaluateErrors
+                << ",\"evaluate_latency\":";
+        writeJsonHistogram(os, m.evaluateLatency);
+        os << ",\"batch_rows\":" << m.batchRows
+                << ",\"allocations\":" << m.allocations
+                << ",\"deallocations\":" << m.deallocations
+                << ",\"bytes_allocated\":" << m.bytesAllocated
+                << ",\"bytes_in_use\":" << m.bytesInUse
+                << "}";
+
+        return os.str();
+    }
 
-                        if (s->instr == Instruction::PAR_OPEN) {
-                            matchingParFound = true;
-                            temp.pop();
-                            break;
-                        } else {
-                            instrVector->push_back(s);
-                            temp.pop();
-                        }
+    string MetricsRegistry::toPrometheus(const string &prefix) const {
 
-                        if (temp.empty()) {
-                            break;
-                        }
-                    }
-                }
+        const MetricsSnapshot m = snapshot();
+        ostringstream os;
 
+        auto metric = [&](const char *name, const char *type, const char *help, size_t value) {
+            os << "# HELP " << prefix << '_' << name << ' ' << help << '\n';
+            os << "# TYPE " << prefix << '_' << name << ' ' << type << '\n';
+            os << prefix << '_' << name << ' ' << value << '\n';
+        };
 
-            } else if (isOperator(token)) {
+        auto histogram = [&](const char *name, const char *help, const LatencyHistogram &h) {
+            os << "# HELP " << prefix << '_' << name << ' ' << help << '\n';
+            os << "# TYPE " << prefix << '_' << name << " histogram\n";
+            size_t cumulative = 0;
+            for (size_t i = 0; i + 1 < LatencyHistogram::BUCKETS; ++i) {
+                cumulative += h.counts[i];
+                os << prefix << '_' << name << "_bucket{le=\"" << LatencyHistogram::upperBoundNs(i) * 1e-9 << "\"} " << cumulative << '\n';
+            }
+            os << prefix << '_' << name << "_bucket{le=\"+Inf\"} " << h.count << '\n';
+            os << prefix << '_' << name << "_sum " << h.sumNs * 1e-9 << '\n';
+            os << prefix << '_' << name << "_count " << h.count << '\n';
+        };
+
+        metric("compiles_total", "counter", "Expressions compiled.", m.compiles);
+        metric("compile_errors_total", "counter", "Compilations failed with an exception.", m.compileErrors);
+        histogram("compile_duration_seconds", "Latency of compile.", m.compileLatency);
+        metric("evaluations_total", "counter", "Calls of evaluate.", m.evaluations);
+        metric("evaluate_errors_total", "counter", "Evaluations failed with an exception.", m.evaluateErrors);
+        histogram("evaluate_duration_seconds", "Latency of the sampled calls of evaluate.", m.evaluateLatency);
+        metric("batch_rows_total", "counter", "Rows evaluated by evaluateBatch.", m.batchRows);
+        metric("allocations_total", "counter", "Allocations of the compilers.", m.allocations);
+        metric("deallocations_total", "counter", "Deallocations of the compilers.", m.deallocations);
+        metric("allocated_bytes_total", "counter", "Bytes allocated by the compilers.", m.bytesAllocated);
+        metric("memory_in_use_bytes", "gauge", "Bytes currently allocated by the compilers.", m.bytesInUse);
+
+        return os.str();
+    }
 
-                if ((last == TK_OPERATOR || last == TK_FUNCTION) && token != "-") {
+    ////////////////////// VirtualFPU //////////////////////////////////////////////
 
-                    ostringstream ss;
+    /**
+     * Piecewise Chebyshev approximation of an expression of one variable: the range is bisected into pieces,
+     * the cells of the finest bisection level give the piece of an argument without searching
+     */
+    struct RPNCompiler::Surrogate {
+
+        /**
+         * Chebyshev coefficients of each piece (interpolation at as many Chebyshev nodes)
+         */
+        static const unsigned COEFFICIENTS = 16;
+
+        /**
+         * Deepest bisection of the range, pieces are at least (hi-lo)/2^MAX_DEPTH wide
+         */
+        static const unsigned MAX_DEPTH = 12;
+
+        /**
+         * Equally spaced samples verifying each piece
+         */
+        static const unsigned CHECK_SAMPLES = 64;
+
+        /**
+         * values of each piece: center, inverse half width and the coefficients
+         */
+        static const size_t STRIDE = COEFFICIENTS + 2;
+
+        /**
+         * the variable, its instruction in the RPN program and its value (set when the program is resolved)
+         */
+        std::pmr::string var;
+        size_t source;
+        const double *variable;
+        double lo;
+        double hi;
+        /**
+         * cells of the finest bisection level
+         */
+        double cellScale;
+        std::pmr::vector<uint32_t> cells;
+        std::pmr::vector<double> coef;
+        SurrogateInfo info;
+
+        explicit Surrogate(std::pmr::memory_resource *resource) : var(resource), source(0), variable(nullptr), lo(0), hi(0), cellScale(0),
+        cells(resource), coef(resource), info{} {
+        }
 
-                    ss << "Invalid operator " << token << " at index " << idx;
-                    //due operatori successivi
-                    throwError(ss.str());
-                }
+        bool active() const noexcept {
+            return info.intervals > 0;
+        }
 
-                StackItem *opItem = new StackItem();
-                opItem->fromString(token);
+        void clear() {
+            cells.clear();
+            coef.clear();
+            info = SurrogateInfo{};
+            variable = nullptr;
+        }
 
-                if (!temp.empty()) {
+        /**
+         * Clenshaw recurrence of the piece at t in [-1,1]
+         */
+        static double chebyshev(const double *c, double t) {
+            double b1 = 0;
+            double b2 = 0;
+            for (unsigned k = COEFFICIENTS - 1; k > 0; --k) {
+                const double b0 = 2 * t * b1 - b2 + c[k];
+                b2 = b1;
+                b1 = b0;
+            }
+            return t * b1 - b2 + c[0];
+        }
 
-                    if (opItem->instr == Instruction::SUB && (temp.top()->instr == Instruction::PAR_OPEN || isOperator(temp.top()->instr)) && last != TK_NUM && last != TK_CLOSE_BRK) {
-                        opItem->instr = Instruction::UNARY_MINUS;
-                    }
+        /**
+         * @return the piece of x, with lo <= x <= hi
+         */
+        size_t locate(double x) const {
+            const double p = (x - lo) * cellScale;
+            return cells[std::min(p > 0 ? static_cast<size_t> (p) : 0, cells.size() - 1)];
+        }
 
-                    for (;;) {
+        /**
+         * @return the value at x, with lo <= x <= hi
+         */
+        double eval(double x) const {
+            const double *k = coef.data() + locate(x) * STRIDE;
+            return chebyshev(k + 2, (x - k[0]) * k[1]);
+        }
 
-                        //gestione precedenza operatori
-                        StackItem* topOp = temp.top();
+        /**
+         * Evaluate the surrogate over a block of values in place, with lo <= a[j] <= hi
+         */
+        void evalBlock(double *a, size_t len) const {
 
-                        if (topOp->instr == Instruction::PAR_OPEN) {
-                            break;
-                        }
+            const size_t chunk = RPNCompiler::BATCH_BLOCK_SIZE;
 
-                        if (getOperatorPrecedence(topOp->instr) >= getOperatorPrecedence(opItem->instr)) {
+            const double *piece[chunk];
+            double t[chunk];
+            double b1[chunk];
+            double b2[chunk];
 
-                            instrVector->push_back(topOp);
-                            temp.pop();
+            for (size_t first = 0; first < len; first += chunk) {
 
-                        } else {
-                            break;
-                        }
+                double *v = a + first;
+                const size_t n = std::min(chunk, len - first);
 
-                        if (temp.empty()) break;
-                    }
+                for (size_t j = 0; j < n; ++j) {
+                    piece[j] = coef.data() + locate(v[j]) * STRIDE;
+                    t[j] = 2 * (v[j] - piece[j][0]) * piece[j][1];
+                    b1[j] = 0;
+                    b2[j] = 0;
+                }
 
-                } else {
-                    if (opItem->instr == Instruction::SUB && last != TK_NUM && last != TK_CLOSE_BRK) {
-                        //se lo stack è vuoto ed è un meno allora è un meno unario
-                        opItem->instr = Instruction::UNARY_MINUS;
+                //the recurrence advances all the values of the chunk at each step: the steps of different values overlap
+                for (unsigned k = COEFFICIENTS - 1; k > 0; --k) {
+                    for (size_t j = 0; j < n; ++j) {
+                        const double b0 = t[j] * b1[j] - b2[j] + piece[j][2 + k];
+                        b2[j] = b1[j];
+                        b1[j] = b0;
                     }
                 }
 
-                temp.push(opItem);
-
-                if ((last == TK_OPEN_BRK || last == TK_NIL) && opItem->instr != Instruction::UNARY_MINUS) {
-                    ostringstream ss;
-                    ss << "Unexpected operator " << token << " at index " << idx;
-                    throwError(ss.str());
+                for (size_t j = 0; j < n; ++j) {
+                    v[j] = t[j] / 2 * b1[j] - b2[j] + piece[j][2];
                 }
+            }
+        }
 
-                last = TK_OPERATOR;
-
-            } else if (isFunction(token)) {
-
-                if (last == TK_FUNCTION) {
-
-                    ostringstream ss;
+        /**
+         * Fit the pieces to a function
+         * @param f the exact function
+         * @return false if a piece of the deepest level does not reach the tolerance, at is its first sample out of tolerance
+         */
+        template<typename F>
+        bool fit(F f, double tolerance, double &at) {
 
-                    ss << "Invalid function sequence " << token << " at index " << idx;
-                    //due operatori successivi
-                    throwError(ss.str());
-                }
+            const unsigned n = COEFFICIENTS;
+            const double pi = std::acos(-1.0);
 
-                if (last == TK_NUM) {
-                    addImpliedMul(temp, last);
-                    last = TK_OPERATOR;
-                }
+            //pieces in increasing order: depth and position in the bisection level
+            struct Piece {
+                unsigned depth;
+                size_t pos;
+            };
 
+            vector<Piece> pending{Piece{0, 0}};
+            vector<Piece> pieces;
+            double values[COEFFICIENTS];
+            double c[COEFFICIENTS];
 
-                StackItem *opItem = new StackItem();
-                opItem->fromString(token);
+            clear();
 
-                addItemToTempStack(opItem, temp, last);
+            while (!pending.empty()) {
 
-                last = TK_FUNCTION;
+                const Piece piece = pending.back();
+                pending.pop_back();
 
+                const double width = (hi - lo) / static_cast<double> (size_t(1) << piece.depth);
+                const double left = lo + width * piece.pos;
+                const double center = left + width / 2;
+                const double half = width / 2;
 
-            } else if (isVarDefined(token)) {
+                bool fits = true;
 
-                if (last == TK_NUM) {
-                    addImpliedMul(temp, last);
-                    last = TK_OPERATOR;
+                for (unsigned i = 0; i < n && fits; ++i) {
+                    values[i] = f(center + half * std::cos(pi * (i + 0.5) / n));
+                    fits = std::isfinite(values[i]);
+                    ++info.samples;
                 }
 
-                //variable defined in the lookup table
-
-                StackItem *s = new StackItem();
-                s->instr = Instruction::VALUE;
-                s->value = getVar(token);
-                s->defVar = token;
-                instrVector->push_back(s);
-
-
-                last = TK_NUM;
+                double error = 0;
 
-            } else if (isFnDefined(token)) {
-                if (last == TK_FUNCTION) {
-
-                    ostringstream ss;
+                if (fits) {
+                    for (unsigned k = 0; k < n; ++k) {
+                        double sum = 0;
+                        for (unsigned i = 0; i < n; ++i) {
+                            sum += values[i] * std::cos(pi * k * (i + 0.5) / n);
+                        }
+                        c[k] = (k == 0 ? 1.0 : 2.0) * sum / n;
+                    }
 
-                    ss << "Invalid function sequence " << token << " at index " << idx;
-                    //due operatori successivi
-                    throwError(ss.str());
+                    for (unsigned i = 0; i <= CHECK_SAMPLES && fits; ++i) {
+                        const double x = std::min(hi, left + width * i / CHECK_SAMPLES);
+                        const double exact = f(x);
+                        const double e = std::fabs(chebyshev(c, (x - center) / half) - exact) / std::max(1.0, std::fabs(exact));
+                        ++info.samples;
+                        if (!(e <= tolerance)) {
+                            fits = false;
+                            at = x;
+                        } else {
+                            error = std::max(error, e);
+                        }
+                    }
+                } else {
+                    at = center;
                 }
 
-                if (last == TK_NUM) {
-                    addImpliedMul(temp, last);
-                    last = TK_OPERATOR;
+                if (fits) {
+                    pieces.push_back(piece);
+                    coef.push_back(center);
+                    coef.push_back(1 / half);
+                    coef.insert(coef.end(), c, c + n);
+                    info.maxError = std::max(info.maxError, error);
+                } else if (piece.depth < MAX_DEPTH) {
+                    pending.push_back(Piece{piece.depth + 1, 2 * piece.pos + 1});
+                    pending.push_back(Piece{piece.depth + 1, 2 * piece.pos});
+                } else {
+                    clear();
+                    return false;
                 }
-
-
-                StackItem *opItem = new StackItem();
-                opItem->instr = Instruction::DEF_FUNCTION;
-                opItem->defVar = token;
-
-                addItemToTempStack(opItem, temp, last);
-
-                last = TK_FUNCTION;
-
             }
-            else {
-
-                ostringstream ss;
 
-                ss << "Invalid token " << token << " at index " << idx;
+            unsigned depth = 0;
+            for (const Piece &piece : pieces) {
+                depth = std::max(depth, piece.depth);
+            }
 
-                throwError(ss.str());
+            cells.resize(size_t(1) << depth);
+            cellScale = cells.size() / (hi - lo);
+            for (size_t i = 0; i < pieces.size(); ++i) {
+                const unsigned shift = depth - pieces[i].depth;
+                std::fill(cells.begin() + (pieces[i].pos << shift), cells.begin() + ((pieces[i].pos + 1) << shift), static_cast<uint32_t> (i));
             }
 
-            idx = next;
+            info.intervals = pieces.size();
+            info.coefficients = n;
+            return true;
         }
+    };
 
-        while (!temp.empty()) {
-
-            StackItem *item = temp.top();
+    /**
+     * Operations of the evaluated program: the RPN instructions and the superinstructions built by the peephole pass.
+     * The *_OPERAND operations take their right operand (a constant or a variable) from the instruction instead of the stack,
+     * the *_OPERANDS operations take both operands from the instruction
+     */
+    enum class OpCode : uint8_t {
+        PUSH,
+        ADD, SUB, MUL, DIV, POW,
+        ADD_OPERAND, SUB_OPERAND, MUL_OPERAND, DIV_OPERAND, POW_OPERAND,
+        ADD_OPERANDS, SUB_OPERANDS, MUL_OPERANDS, DIV_OPERANDS, POW_OPERANDS,
+        //c+a*b, c-a*b
+        FMA, FNMA,
+        //c+a*x, c-a*x
+        FMA_MUL_OPERAND, FNMA_MUL_OPERAND,
+        //c+x*y, c-x*y
+        FMA_MUL_OPERANDS, FNMA_MUL_OPERANDS,
+        //a*b+x, a*b-x
+        FMA_ADD_OPERAND, FMS_ADD_OPERAND,
+        //a*x+y, a*x-y
+        FMA_OPERANDS, FMS_OPERANDS,
+        COMPARE, FUNCTION, CUSTOM_FUNCTION, TABLE
+    };
 
-            if (item->instr == Instruction::PAR_OPEN) {
-                throwError("Unclosed bracket found in expression.");
-            }
+    static const size_t NO_SOURCE = std::numeric_limits<size_t>::max();
+
+    struct RPNCompiler::Op {
+        OpCode code;
+        /**
+         * RPN instruction of the operation (the last fused arithmetic operation, the comparison, the function)
+         */
+        const StackItem *item;
+        /**
+         * constants or variables taken by the operation, in the RPN order
+         */
+        const StackItem *operandItem[2];
+        /**
+         * index of the operands in the RPN program, used to bind the columns
+         */
+        size_t source[2];
+        double value[2];
+        /**
+         * resolved operands: &value for a constant, the variable otherwise (nullptr if not defined)
+         */
+        const double *operand[2];
+        /**
+         * resolved custom function
+         */
+        const std::function<double(double)> *fn;
+        /**
+         * resolved table (TABLE operations)
+         */
+        const Table *table;
+    };
 
-            instrVector->push_back(item);
-            temp.pop();
+    /**
+     * @return the local slot of an instruction of a loop, NO_SOURCE for the other instructions
+     */
+    static size_t slotOf(const StackItem *item) {
+        if (item->instr != Instruction::VALUE || item->defVar.empty() || item->defVar[0] != '#') {
+            return NO_SOURCE;
         }
-
-        return *this;
+        size_t slot = NO_SOURCE;
+        std::from_chars(item->defVar.data() + 1, item->defVar.data() + item->defVar.size(), slot);
+        return slot;
     }
 
-    void RPNCompiler::addItemToTempStack(StackItem *opItem, stack<StackItem*> &temp, const int last) {
+    /**
+     * sum or prod loop: the index takes the values from, from+1, ... up to to
+     */
+    struct RPNCompiler::Loop {
 
-        if (!temp.empty()) {
+        /**
+         * Expression of a loop: its RPN instructions, their program and its evaluation stack
+         */
+        struct Block {
+            std::pmr::vector<StackItem*> rpn;
+            std::pmr::vector<Op> program;
+            std::pmr::vector<double> stack;
 
-            if (opItem->instr == Instruction::SUB && (temp.top()->instr == Instruction::PAR_OPEN || isOperator(temp.top()->instr)) && last != TK_NUM && last != TK_CLOSE_BRK) {
-                opItem->instr = Instruction::UNARY_MINUS;
+            explicit Block(std::pmr::memory_resource *resource) : rpn(resource), program(resource), stack(resource) {
             }
+        };
+
+        bool product;
+        /**
+         * local slots of the index and of the result
+         */
+        size_t index;
+        size_t result;
+        Block from;
+        Block to;
+        Block body;
+        /**
+         * subexpressions of the body not depending on the index, evaluated once before the iterations
+         * into the slots hoisted (the body reads the slots)
+         */
+        Block invariant;
+        std::pmr::vector<size_t> hoisted;
+        /**
+         * loops of the body not depending on the index, evaluated once before the iterations
+         */
+        std::pmr::vector<Loop*> before;
+        /**
+         * loops of the body evaluated at every iteration
+         */
+        std::pmr::vector<Loop*> inner;
+
+        Loop(bool product, std::pmr::memory_resource *resource) : product(product), index(0), result(0), from(resource), to(resource), body(resource), invariant(resource),
+        hoisted(resource), before(resource), inner(resource) {
+        }
 
-            for (;;) {
+        /**
+         * @return true if the expressions of the loop, or of its inner loops, read one of the slots
+         */
+        bool reads(const std::pmr::vector<size_t> &slots) const {
+            for (const Block *block : {&from, &to, &body, &invariant}) {
+                for (const StackItem *item : block->rpn) {
+                    if (std::find(slots.begin(), slots.end(), slotOf(item)) != slots.end()) {
+                        return true;
+                    }
+                }
+            }
+            return std::any_of(before.begin(), before.end(), [&slots](const Loop *loop) {
+                return loop->reads(slots);
+            }) || std::any_of(inner.begin(), inner.end(), [&slots](const Loop *loop) {
+                return loop->reads(slots);
+            });
+        }
+    };
 
-                //gestione precedenza operatori
-                StackItem* topOp = temp.top();
+    struct RPNCompiler::Loops {
+        /**
+         * all the loops of the expression, in parse order
+         */
+        std::pmr::vector<Loop*> all;
+        /**
+         * loops evaluated before the program
+         */
+        std::pmr::vector<Loop*> top;
+        /**
+         * indexes, results and hoisted subexpressions of the loops, named #slot in the instructions
+         */
+        std::pmr::vector<double> slots;
+        /**
+         * parsing: the indexes of the enclosing loops with their slots, the list receiving the loops parsed
+         */
+        std::pmr::vector<std::pair<std::pmr::string, size_t>> scope;
+        std::pmr::vector<Loop*> *target;
+
+        explicit Loops(std::pmr::memory_resource *resource) : all(resource), top(resource), slots(resource), scope(resource), target(&top) {
+        }
 
-                if (topOp->instr == Instruction::PAR_OPEN) {
-                    break;
-                }
+        size_t newSlot() {
+            slots.push_back(0);
+            return slots.size() - 1;
+        }
+    };
 
-                if (getOperatorPrecedence(topOp->instr) >= getOperatorPrecedence(opItem->instr)) {
+    /**
+     * Tabulation running on a background thread, shared with the thread
+     */
+    struct TieringPromotion {
+        /**
+         * compiler of the same expression fitting its surrogate
+         */
+        std::unique_ptr<RPNCompiler> compiler;
+        bool fits = false;
+        std::atomic<bool> ready{false};
+        std::atomic<bool> cancelled{false};
+        /**
+         * thread fitting the surrogate, joined before the promotion is dropped
+         */
+        std::thread worker;
+    };
 
-                    instrVector->push_back(topOp);
-                    temp.pop();
+    struct RPNCompiler::Tiering {
+        TieringPolicy policy;
+        size_t evaluations;
+        /**
+         * the only variable of the expression (empty if it cannot be tabulated), its value and the range of its values
+         */
+        std::pmr::string var;
+        const double *variable;
+        double lo;
+        double hi;
+        /**
+         * true if the backend was switched to REGISTER by the policy
+         */
+        bool promoted;
+        std::unique_ptr<TieringPromotion> pending;
+
+        Tiering(const TieringPolicy &policy, std::pmr::memory_resource *resource) : policy(policy), evaluations(0), var(resource), variable(nullptr), lo(0), hi(0), promoted(false) {
+        }
 
-                } else {
-                    break;
-                }
+        ~Tiering() {
+            cancel();
+        }
 
-                if (temp.empty()) break;
+        /**
+         * Drop the tabulation running in background: the thread stops at the next evaluation and is joined
+         */
+        void cancel() noexcept {
+            if (pending) {
+                pending->cancelled.store(true, std::memory_order_relaxed);
+                finish();
             }
+        }
 
-        } else {
-
-            if (opItem->instr == Instruction::SUB && last != TK_NUM && last != TK_CLOSE_BRK) {
-                //se lo stack è vuoto ed è un meno allora è un meno unario
-                opItem->instr = Instruction::UNARY_MINUS;
+        /**
+         * Join the thread of the tabulation and drop it
+         */
+        void finish() noexcept {
+            if (pending->worker.joinable()) {
+                pending->worker.join();
             }
+            pending.reset();
+        }
 
+        void restart() noexcept {
+            cancel();
+            evaluations = 0;
+            var.clear();
+            variable = nullptr;
+            promoted = false;
         }
+    };
 
-        temp.push(opItem);
+    /**
+     * Operation of a fused kernel: an input (constant or variable) or an operation applied to the results of other operations
+     */
+    struct RPNCompiler::FusedOp {
+        /**
+         * VALUE for the inputs
+         */
+        Instruction instr;
+        /**
+         * variable of an input, custom function
+         */
+        std::pmr::string name;
+        /**
+         * constant input
+         */
+        double value;
+        uint32_t arg[2];
+        /**
+         * block of the scratch holding the result
+         */
+        uint32_t buffer;
+        /**
+         * outputs written from the result: scatter[firstOutput, firstOutput+outputs)
+         */
+        uint32_t firstOutput;
+        uint32_t outputs;
+        /**
+         * the buffer is filled once for each evaluation (constants and variables not bound to a column)
+         */
+        bool resident;
+        /**
+         * resolved by evaluateFused
+         */
+        const ColumnBinding *column;
+        const std::function<double(double) > *fn;
+        const Table *table;
+
+        explicit FusedOp(std::pmr::memory_resource *resource) : instr(Instruction::VALUE), name(resource), value(0), arg{0, 0}, buffer(0),
+        firstOutput(0), outputs(0), resident(false), column(nullptr), fn(nullptr), table(nullptr) {
+        }
+    };
 
-    }
+    struct RPNCompiler::FusedKernel {
+        std::pmr::vector<FusedOp> ops;
+        /**
+         * index of the output array of each output of the operations
+         */
+        std::pmr::vector<uint32_t> scatter;
+        std::pmr::vector<double> scratch;
+        FusionStats stats;
 
-    void RPNCompiler::addImpliedMul(stack<StackItem*> &temp, const int last) {
-        StackItem *mulItem = new StackItem();
-        mulItem->instr = Instruction::MUL;
-        mulItem->value = 0;
-        mulItem->defVar = "";
-        addItemToTempStack(mulItem, temp, last);
+        explicit FusedKernel(std::pmr::memory_resource *resource) : ops(resource), scatter(resource), scratch(resource), stats{} {
+        }
+    };
 
-    }
+    RPNCompiler::RPNCompiler() : RPNCompiler(DEFAULT_STACK_SIZE) {
 
-    const string & RPNCompiler::getLastCompiledStatement() {
-        return last_compiled_statement;
     }
 
-    bool RPNCompiler::isOperator(const string & token) {
-
-        StackItem item;
+    RPNCompiler::RPNCompiler(std::pmr::memory_resource *resource) : RPNCompiler(DEFAULT_STACK_SIZE, resource) {
 
-        try {
-            item.fromString(token);
-            return isOperator(item.instr);
-        } catch (VirtualFPUException &ex) {
-            return false;
-        }
     }
 
-    bool RPNCompiler::isOperator(const Instruction instr) {
-        return instr == Instruction::MUL || instr == Instruction::DIV || instr == Instruction::SUB || instr == Instruction::ADD || instr == Instruction::UNARY_MINUS || instr == Instruction::POW;
+    RPNCompiler::RPNCompiler(size_t stackSize, std::pmr::memory_resource *resource) : allocator(resource), instrVector(nullptr), executeStack(nullptr), batchStack(nullptr), batchSources(nullptr), defVars(nullptr), defFunctions(nullptr), memoCaches(nullptr), tables(nullptr), output(0), stackSize(0), maxStackDepth(0), accuracy(Accuracy::EXACT), fusedMultiplyAdd(false), backend(Backend::STACK), metrics(nullptr), metricsPending(0), program(nullptr), peepholeStats{}, programResolved(false), unresolvedOperands(0), registerProgram(nullptr), registerFile(nullptr), registerResult(nullptr), registerAllocation{}, surrogate(nullptr), tiering(nullptr), loops(nullptr), fusedKernel(nullptr), functions(functionTable(Accuracy::EXACT)) {
+        init(stackSize);
     }
 
-    bool RPNCompiler::isFunction(const string & token) {
+    RPNCompiler::~RPNCompiler() {
 
-        StackItem item;
+        publishMetrics();
 
-        try {
-            item.fromString(token);
-            return isFunction(item.instr) || defFunctions->contains(token);
-        } catch (VirtualFPUException &ex) {
-            return false;
+        clearStack();
+
+        if (tiering) {
+            allocator.delete_object(tiering);
+            tiering = nullptr;
         }
 
-    }
+        if (loops) {
+            allocator.delete_object(loops);
+            loops = nullptr;
+        }
 
-    bool RPNCompiler::isFunction(const Instruction & instr) {
-        return RPNCompiler::isBuiltinFunction(instr);
-    }
+        if (instrVector) {
+            allocator.delete_object(instrVector);
+            instrVector = nullptr;
+        }
 
-    bool RPNCompiler::isFunction(const StackItem* item) {
-        return isFunction(item->instr) || (item->defVar != "" && defFunctions->contains(item->defVar));
-    }
+        if (executeStack) {
+            allocator.delete_object(executeStack);
+            executeStack = nullptr;
+        }
 
-    bool RPNCompiler::isCustomFunction(const StackItem* item) {
-        return item->defVar != "" && defFunctions->contains(item->defVar);
-    }
+        if (program) {
+            allocator.delete_object(program);
+            program = nullptr;
+        }
 
-    bool RPNCompiler::isNumber(const string & token) {
+        if (registerProgram) {
+            allocator.delete_object(registerProgram);
+            registerProgram = nullptr;
+        }
 
-        int idx = 0;
-        const int lu = token.length();
+        if (registerFile) {
+            allocator.delete_object(registerFile);
+            registerFile = nullptr;
+        }
 
-        bool hasSign = false;
-        bool hasDigit = false;
-        bool decPoint = false;
-        bool decExpected = false;
-        bool trailing = false;
+        if (batchStack) {
+            allocator.delete_object(batchStack);
+            batchStack = nullptr;
+        }
 
-        while (idx < lu) {
-            char ch = token[idx];
+        if (batchSources) {
+            allocator.delete_object(batchSources);
+            batchSources = nullptr;
+        }
 
-            if (isdigit(ch)) {
-                if (ch == '0' && !hasDigit) {
-                    decExpected = true;
-                }
+        if (defVars) {
 
-                if (trailing) {
-                    return false;
-                }
+            defVars->clear();
+            allocator.delete_object(defVars);
+            defVars = nullptr;
 
-                hasDigit = true;
-            } else if (ch == '-') {
-                if (hasDigit || hasSign || trailing) {
-                    return false;
-                }
+        }
 
-                hasSign = true;
-            } else if (ch == '.') {
-                if (!hasDigit || decPoint || trailing) {
-                    return false;
-                }
+        if (defFunctions) {
+            defFunctions->clear();
+            allocator.delete_object(defFunctions);
+            defFunctions = nullptr;
+        }
 
-                decPoint = true;
-            } else if (ch == ' ') {
-                if (hasDigit || decPoint || hasSign) {
-                    trailing = true;
-                }
-            } else {
-                return false;
-            }
+        if (memoCaches) {
+            allocator.delete_object(memoCaches);
+            memoCaches = nullptr;
+        }
 
-            ++idx;
+        if (tables) {
+            allocator.delete_object(tables);
+            tables = nullptr;
         }
 
-        if (!hasDigit) {
-            return false;
+        if (surrogate) {
+            allocator.delete_object(surrogate);
+            surrogate = nullptr;
         }
 
-        return true;
+        if (fusedKernel) {
+            allocator.delete_object(fusedKernel);
+            fusedKernel = nullptr;
+        }
 
     }
 
-    double RPNCompiler::toDouble(const string & token) {
-        double r = 0;
+    void RPNCompiler::setAccuracy(Accuracy accuracy) noexcept {
+        this->accuracy = accuracy;
+        functions = functionTable(accuracy);
+        surrogate->clear();
+        if (tiering) {
+            tiering->cancel();
+        }
+    }
 
-        istringstream ss(token);
+    Accuracy RPNCompiler::getAccuracy() const noexcept {
+        return accuracy;
+    }
 
-        ss >> r;
+    void RPNCompiler::setFusedMultiplyAdd(bool enabled) {
+        fusedMultiplyAdd = enabled;
+        buildProgram();
+    }
 
-        if (ss.rdstate() & std::istringstream::failbit) {
-            throwError(string("Error parsing double value:") + token);
-        }
+    bool RPNCompiler::getFusedMultiplyAdd() const noexcept {
+        return fusedMultiplyAdd;
+    }
 
-        return r;
+    const PeepholeStats& RPNCompiler::getPeepholeStats() const noexcept {
+        return peepholeStats;
+    }
 
+    void RPNCompiler::setBackend(Backend backend) {
+        this->backend = backend;
+        buildRegisterProgram();
+        programResolved = false;
     }
 
-    string RPNCompiler::getToken(const string& statement, int fromIndex, int *nextIndex) {
+    Backend RPNCompiler::getBackend() const noexcept {
+        return backend;
+    }
 
-        const size_t lu = statement.length();
+    const RegisterAllocation& RPNCompiler::getRegisterAllocation() const noexcept {
+        return registerAllocation;
+    }
 
-        if (fromIndex > lu) return "";
-        int idx = fromIndex;
-        ostringstream ss;
-        int state = 0;
-        bool last_num = false;
-        bool last_alpha = false;
+    std::pmr::memory_resource* RPNCompiler::getMemoryResource() const noexcept {
+        return allocator.resource();
+    }
 
-        while (idx < lu) {
+    StackItem* RPNCompiler::newItem() {
+        return allocator.new_object<StackItem>();
+    }
 
-            char ch = statement[idx];
+    void RPNCompiler::deleteItem(StackItem *item) {
+        allocator.delete_object(item);
+    }
 
-            if (ch == '(' || ch == ')' || ch == '+' || ch == '-' || ch == '/' || ch == '*' || ch == '^') {
+    bool RPNCompiler::isBuiltinFunction(const Instruction & instr) noexcept {
+        return std::find(functionsOp.begin(), functionsOp.end(), instr) != functionsOp.end();
+    }
 
-                last_num = last_alpha = false;
+    int RPNCompiler::getOperatorPrecedence(const Instruction & instr) noexcept {
 
-                if (state == 1) {
-                    break;
+        switch (instr) {
+            case Instruction::VALUE:
+                return 0;
+            case Instruction::LT:
+            case Instruction::GT:
+            case Instruction::LE:
+            case Instruction::GE:
+            case Instruction::EQ:
+            case Instruction::NE:
+                return 1;
+            case Instruction::ADD:
+                return 2;
+            case Instruction::SUB:
+                return 3;
+            case Instruction::MUL:
+                return 4;
+            case Instruction::DIV:
+                return 5;
+            case Instruction::POW:
+                return 6;
+            case Instruction::UNARY_MINUS:
+                return 7;
+            case Instruction::DEF_FUNCTION:
+                return 8;
+            default:
+                if (isFunction(instr)) {
+                    return 8;
                 } else {
-                    ++idx;
-                    ss << ch;
-                    break;
+                    return -1;
+                }
+
+        }
+
+    }
+
+    RPNCompiler & RPNCompiler::compile(const string & statement, Accuracy accuracy) {
+        setAccuracy(accuracy);
+        return compile(statement);
+    }
+
+    RPNCompiler & RPNCompiler::compile(const string & statement, Backend backend) {
+        this->backend = backend;
+        return compile(statement);
+    }
+
+    RPNCompiler & RPNCompiler::compileTabulated(const string &statement, const string &var, double lo, double hi, double tolerance) {
+
+        if (!(std::isfinite(lo) && std::isfinite(hi) && lo < hi)) {
+            throw VirtualFPUException("Invalid range of tabulation");
+        }
+
+        if (!(tolerance > 0)) {
+            throw VirtualFPUException("The tolerance of tabulation must be greater than 0");
+        }
+
+        compile(statement);
+
+        if (getVariables() != vector<string>{var}) {
+            clearStack();
+            throw VirtualFPUException("Only an expression of the variable "s + var + " can be tabulated");
+        }
+
+        double at = 0;
+        bool fits = false;
+
+        try {
+            fits = fitSurrogate(var, lo, hi, tolerance, at);
+        } catch (...) {
+            clearStack();
+            throw;
+        }
+
+        if (!fits) {
+            clearStack();
+            stringstream ss;
+            ss << "Cannot tabulate " << statement << " within " << tolerance << " near " << var << "=" << at;
+            throw VirtualFPUException(ss.str());
+        }
+
+        return *this;
+    }
+
+    bool RPNCompiler::fitSurrogate(const string &var, double lo, double hi, double tolerance, double &at, const std::atomic<bool> *cancelled) {
+
+        //the exact expression is evaluated setting the variable, its value is restored at the end
+        double &x = defVars->find(std::string_view(var))->second;
+        const double saved = x;
+
+        bool fits = false;
+
+        surrogate->clear();
+        surrogate->lo = lo;
+        surrogate->hi = hi;
+
+        try {
+            fits = surrogate->fit([&](double t) {
+                if (cancelled && cancelled->load(std::memory_order_relaxed)) {
+                    throw VirtualFPUException("Tabulation cancelled");
                 }
+                x = t;
+                return evaluateProgram();
+            }, tolerance, at);
+        } catch (...) {
+            x = saved;
+            surrogate->clear();
+            throw;
+        }
+
+        x = saved;
+
+        if (!fits) {
+            surrogate->clear();
+            return false;
+        }
+
+        surrogate->var = var;
+
+        for (size_t i = 0; i < instrVector->size(); ++i) {
+            if ((*instrVector)[i]->instr == Instruction::VALUE && std::string_view((*instrVector)[i]->defVar) == std::string_view(var)) {
+                surrogate->source = i;
+                break;
+            }
+        }
+
+        programResolved = false;
+
+        return true;
+    }
+
+    void RPNCompiler::setTiering(const TieringPolicy &policy) {
+        if (tiering) {
+            tiering->policy = policy;
+        } else {
+            tiering = allocator.new_object<Tiering>(policy, allocator.resource());
+        }
+    }
+
+    void RPNCompiler::disableTiering() noexcept {
+        if (tiering) {
+            allocator.delete_object(tiering);
+            tiering = nullptr;
+        }
+    }
+
+    Tier RPNCompiler::getTier() const noexcept {
+        if (surrogate->active()) {
+            return Tier::TABULATED;
+        }
+        return backend == Backend::REGISTER ? Tier::REGISTER : Tier::INTERPRETER;
+    }
+
+    size_t RPNCompiler::getEvaluationCount() const noexcept {
+        return tiering ? tiering->evaluations : 0;
+    }
+
+    void RPNCompiler::countEvaluation() {
+
+        Tiering &t = *tiering;
+        const TieringPolicy &policy = t.policy;
+
+        if (t.variable) {
+            t.lo = std::min(t.lo, *t.variable);
+            t.hi = std::max(t.hi, *t.variable);
+        }
+
+        //install the surrogate fitted in background
+        if (t.pending && t.pending->ready.load(std::memory_order_acquire)) {
+            const Surrogate &fitted = *t.pending->compiler->surrogate;
+            if (t.pending->fits) {
+                surrogate->var = fitted.var;
+                surrogate->source = fitted.source;
+                surrogate->lo = fitted.lo;
+                surrogate->hi = fitted.hi;
+                surrogate->cellScale = fitted.cellScale;
+                surrogate->cells.assign(fitted.cells.begin(), fitted.cells.end());
+                surrogate->coef.assign(fitted.coef.begin(), fitted.coef.end());
+                surrogate->info = fitted.info;
+                programResolved = false;
+            }
+            t.finish();
+        }
+
+        const size_t n = ++t.evaluations;
+
+        //the range of the variable is tracked from the first evaluation
+        if (n == 1 && policy.tabulateThreshold > 0) {
+            const vector<string> vars = getVariables();
+            const auto it = vars.size() == 1 ? defVars->find(std::string_view(vars.front())) : defVars->end();
+            if (it != defVars->end()) {
+                t.var = it->first;
+                t.variable = &it->second;
+                t.lo = t.hi = it->second;
+            }
+        }
+
+        if (n == policy.registerThreshold && backend == Backend::STACK && !surrogate->active()) {
+            setBackend(Backend::REGISTER);
+            t.promoted = true;
+        }
+
+        if (n != policy.tabulateThreshold || t.var.empty() || !(t.lo < t.hi) || surrogate->active()) {
+            return;
+        }
+
+        const string var(t.var);
+        double at = 0;
+
+        if (!policy.background) {
+            try {
+                fitSurrogate(var, t.lo, t.hi, policy.tabulateTolerance, at);
+            } catch (VirtualFPUException&) {
+                //the expression keeps the previous tier
+            }
+            return;
+        }
+
+        //the copy of the expression is made on this thread, only the fit runs in background
+        auto promotion = std::make_unique<TieringPromotion>();
+        promotion->compiler = std::make_unique<RPNCompiler>(stackSize);
+        promotion->compiler->copyDefinitions(*this);
+        promotion->compiler->compile(last_compiled_statement);
+
+        //the thread is owned by the promotion and joined by Tiering::cancel or when the surrogate is installed
+        promotion->worker = std::thread([p = promotion.get(), var, lo = t.lo, hi = t.hi, tolerance = policy.tabulateTolerance]() {
+            try {
+                double worst = 0;
+                p->fits = p->compiler->fitSurrogate(var, lo, hi, tolerance, worst, &p->cancelled);
+            } catch (...) {
+                p->fits = false;
+            }
+            p->ready.store(true, std::memory_order_release);
+        });
+
+        t.pending = std::move(promotion);
+    }
+
+    const SurrogateInfo& RPNCompiler::getSurrogateInfo() const noexcept {
+        return surrogate->info;
+    }
+
+    RPNCompiler & RPNCompiler::compile(const string & statement) {
+
+        Diagnostic error;
+
+        if (!compileStatement(statement, error)) {
+            throwError(error.message());
+        }
+
+        return *this;
+    }
+
+    Result<RPNCompiler*> RPNCompiler::tryCompile(const string & statement) {
+
+        Diagnostic error;
+
+        if (!compileStatement(statement, error)) {
+            return error;
+        }
+
+        return this;
+    }
+
+    bool RPNCompiler::compileStatement(const string & statement, Diagnostic & error) {
+
+        if (!metrics) {
+            return parseStatement(statement, error);
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        bool valid = false;
+
+        try {
+            valid = parseStatement(statement, error);
+        } catch (...) {
+            metrics->recordCompile(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start), true);
+            throw;
+        }
+
+        metrics->recordCompile(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start), !valid);
+
+        return valid;
+    }
+
+    bool RPNCompiler::parseStatement(const string & statement, Diagnostic & error) {
+
+        clearStack();
+
+        last_compiled_statement = statement;
+
+        if (statement.empty()) {
+            error = Diagnostic(ErrorCode::EMPTY_EXPRESSION);
+            return false;
+        }
+
+        try {
+
+            if (!parseTokens(statement, error)) {
+                clearStack();
+                return false;
+            }
+
+            maxStackDepth = verifyProgram(error);
+
+            if (maxStackDepth == 0) {
+                clearStack();
+                return false;
+            }
+
+            executeStack->resize(maxStackDepth);
+
+            buildProgram();
+
+        } catch (...) {
+            clearStack();
+            throw;
+        }
+
+        return true;
+    }
+
+    bool RPNCompiler::parseTokens(const string & statement, Diagnostic & error) {
+
+        int idx = 0;
+        int next = 0;
+
+        const int lu = statement.length();
+
+        /**   const int TK_NIL = 0;
+           const int TK_NUM = 1;
+           const int TK_OPERATOR = 2;
+           const int TK_FUNCTION = 3;
+           const int TK_OPEN_BRK = 4;
+           const int TK_CLOSE_BRK = 5;
+           const int TK_OTHER = 255;*/
+
+        string token = "";
+
+        TempStack temp{std::pmr::vector<StackItem*>(allocator)};
+
+        //syntax errors are returned without throwing, the items not moved to the instructions stack yet are released
+        auto release = [&]() {
+            while (!temp.empty()) {
+                deleteItem(temp.top());
+                temp.pop();
+            }
+            return false;
+        };
+
+        auto fail = [&](ErrorCode code, size_t position = Diagnostic::NO_POSITION) {
+            error = Diagnostic(code, position, token);
+            return release();
+        };
+
+        if (lu == 0) {
+            return fail(ErrorCode::EMPTY_EXPRESSION);
+        }
+
+        //last token type processed
+        int last = TK_NIL;
+
+        try {
+
+            //convert from infix to postfix notation (RPN)
+            while (idx < lu) {
+
+                //estrae il token
+                token = getToken(statement, idx, &next);
+
+                if (isNumber(token)) {
+
+                    double value = 0;
+
+                    if (last == TK_NUM) {
+                        return fail(ErrorCode::CONSECUTIVE_NUMBERS, idx);
+                    }
+
+                    if (!toDouble(token, value)) {
+                        return fail(ErrorCode::INVALID_NUMBER, idx);
+                    }
+
+                    StackItem *s = newItem();
+
+                    s->instr = Instruction::VALUE;
+                    s->value = value;
+
+                    last = TK_NUM;
+
+                    instrVector->push_back(s);
+
+                } else if (token == "(") {
+
+                    if (last == TK_CLOSE_BRK) {
+                        return fail(ErrorCode::INVALID_BRACKET, idx);
+                    }
+
+                    last = TK_OPEN_BRK;
+
+                    StackItem *s = newItem();
+                    s->instr = Instruction::PAR_OPEN;
+                    s->value = 0;
+
+                    temp.push(s);
+
+                } else if (token == ")") {
+
+                    if (last == TK_OPEN_BRK) {
+                        return fail(ErrorCode::EMPTY_BRACKETS, idx);
+                    }
+
+                    last = TK_CLOSE_BRK;
+
+                    /**  if (temp.empty()) {
+
+                          ostringstream ss;
+                          ss << err << ") not expected at position " << idx;
+                          throwError(ss.str());
+                      }*/
+
+                    if (!temp.empty()) {
+
+                        bool matchingParFound = false;
+
+                        for (;;) {
+
+                            StackItem *s = temp.top();
+
+                            if (s->instr == Instruction::PAR_OPEN) {
+                                matchingParFound = true;
+                                temp.pop();
+                                deleteItem(s);
+                                break;
+                            } else {
+                                instrVector->push_back(s);
+                                temp.pop();
+                            }
+
+                            if (temp.empty()) {
+                                break;
+                            }
+                        }
+                    }
+
+
+                } else if (isOperator(token)) {
+
+                    if ((last == TK_OPERATOR || last == TK_FUNCTION) && token != "-") {
+                        //due operatori successivi
+                        return fail(ErrorCode::INVALID_OPERATOR, idx);
+                    }
+
+                    StackItem *opItem = newItem();
+                    opItem->fromString(token);
+
+                    if (!temp.empty()) {
+
+                        if (opItem->instr == Instruction::SUB && (temp.top()->instr == Instruction::PAR_OPEN || isOperator(temp.top()->instr)) && last != TK_NUM && last != TK_CLOSE_BRK) {
+                            opItem->instr = Instruction::UNARY_MINUS;
+                        }
+
+                        for (;;) {
+
+                            //gestione precedenza operatori
+                            StackItem* topOp = temp.top();
+
+                            if (topOp->instr == Instruction::PAR_OPEN) {
+                                break;
+                            }
+
+                            if (getOperatorPrecedence(topOp->instr) >= getOperatorPrecedence(opItem->instr)) {
+
+                                instrVector->push_back(topOp);
+                                temp.pop();
+
+                            } else {
+                                break;
+                            }
+
+                            if (temp.empty()) break;
+                        }
+
+                    } else {
+                        if (opItem->instr == Instruction::SUB && last != TK_NUM && last != TK_CLOSE_BRK) {
+                            //se lo stack è vuoto ed è un meno allora è un meno unario
+                            opItem->instr = Instruction::UNARY_MINUS;
+                        }
+                    }
+
+                    temp.push(opItem);
+
+                    if ((last == TK_OPEN_BRK || last == TK_NIL) && opItem->instr != Instruction::UNARY_MINUS) {
+                        return fail(ErrorCode::UNEXPECTED_OPERATOR, idx);
+                    }
+
+                    last = TK_OPERATOR;
+
+                } else if ((token == "sum" || token == "prod") && statement.find_first_not_of(' ', next) != string::npos && statement[statement.find_first_not_of(' ', next)] == '('
+                        && !defFunctions->contains(std::string_view(token)) && !defVars->contains(std::string_view(token))) {
+
+                    //a function or a variable defined by the user with the same name is not a loop
+
+                    if (last == TK_NUM) {
+                        addImpliedMul(temp, last);
+                        last = TK_OPERATOR;
+                    }
+
+                    //the loop is evaluated before the program, the program reads its result from a local slot
+                    const size_t end = parseLoop(statement, statement.find_first_not_of(' ', next), token == "prod", error);
+
+                    if (end == 0) {
+                        return release();
+                    }
+
+                    last = TK_NUM;
+                    next = static_cast<int> (end);
+
+                } else if (isFunction(token)) {
+
+                    if (last == TK_FUNCTION) {
+                        //due operatori successivi
+                        return fail(ErrorCode::INVALID_FUNCTION_SEQUENCE, idx);
+                    }
+
+                    if (last == TK_NUM) {
+                        addImpliedMul(temp, last);
+                        last = TK_OPERATOR;
+                    }
+
+
+                    StackItem *opItem = newItem();
+                    opItem->fromString(token);
+
+                    addItemToTempStack(opItem, temp, last);
+
+                    last = TK_FUNCTION;
+
+
+                } else if (std::any_of(loops->scope.begin(), loops->scope.end(), [&token](const auto &index) {
+                        return std::string_view(index.first) == std::string_view(token);
+                    })) {
+
+                    if (last == TK_NUM) {
+                        addImpliedMul(temp, last);
+                        last = TK_OPERATOR;
+                    }
+
+                    //index of an enclosing loop (the innermost one with this name)
+                    const auto index = std::find_if(loops->scope.rbegin(), loops->scope.rend(), [&token](const auto &index) {
+                        return std::string_view(index.first) == std::string_view(token);
+                    });
+
+                    StackItem *s = newItem();
+                    s->instr = Instruction::VALUE;
+                    s->defVar = "#" + std::to_string(index->second);
+                    instrVector->push_back(s);
+
+                    last = TK_NUM;
+
+                } else if (isVarDefined(token)) {
+
+                    if (last == TK_NUM) {
+                        addImpliedMul(temp, last);
+                        last = TK_OPERATOR;
+                    }
+
+                    //variable defined in the lookup table
+
+                    StackItem *s = newItem();
+                    s->instr = Instruction::VALUE;
+                    s->value = getVar(token);
+                    s->defVar = token;
+                    instrVector->push_back(s);
+
+
+                    last = TK_NUM;
+
+                } else if (isFnDefined(token)) {
+                    if (last == TK_FUNCTION) {
+                        //due operatori successivi
+                        return fail(ErrorCode::INVALID_FUNCTION_SEQUENCE, idx);
+                    }
+
+                    if (last == TK_NUM) {
+                        addImpliedMul(temp, last);
+                        last = TK_OPERATOR;
+                    }
+
+
+                    StackItem *opItem = newItem();
+                    opItem->instr = Instruction::DEF_FUNCTION;
+                    opItem->defVar = token;
+
+                    addItemToTempStack(opItem, temp, last);
+
+                    last = TK_FUNCTION;
+
+                }
+                else {
+                    return fail(ErrorCode::INVALID_TOKEN, idx);
+                }
+
+                idx = next;
+            }
+
+            while (!temp.empty()) {
+
+                StackItem *item = temp.top();
+
+                if (item->instr == Instruction::PAR_OPEN) {
+                    token.clear();
+                    return fail(ErrorCode::UNCLOSED_BRACKET);
+                }
+
+                instrVector->push_back(item);
+                temp.pop();
+            }
+
+        } catch (...) {
+            //release the items not moved to the instructions stack yet
+            release();
+            throw;
+        }
+
+        return true;
+    }
+
+    void RPNCompiler::addItemToTempStack(StackItem *opItem, TempStack &temp, const int last) {
+
+        if (!temp.empty()) {
+
+            if (opItem->instr == Instruction::SUB && (temp.top()->instr == Instruction::PAR_OPEN || isOperator(temp.top()->instr)) && last != TK_NUM && last != TK_CLOSE_BRK) {
+                opItem->instr = Instruction::UNARY_MINUS;
+            }
+
+            for (;;) {
+
+                //gestione precedenza operatori
+                StackItem* topOp = temp.top();
+
+                if (topOp->instr == Instruction::PAR_OPEN) {
+                    break;
+                }
+
+                if (getOperatorPrecedence(topOp->instr) >= getOperatorPrecedence(opItem->instr)) {
+
+                    instrVector->push_back(topOp);
+                    temp.pop();
+
+                } else {
+                    break;
+                }
+
+                if (temp.empty()) break;
+            }
+
+        } else {
+
+            if (opItem->instr == Instruction::SUB && last != TK_NUM && last != TK_CLOSE_BRK) {
+                //se lo stack è vuoto ed è un meno allora è un meno unario
+                opItem->instr = Instruction::UNARY_MINUS;
+            }
+
+        }
+
+        temp.push(opItem);
+
+    }
+
+    void RPNCompiler::addImpliedMul(TempStack &temp, const int last) {
+        StackItem *mulItem = newItem();
+        mulItem->instr = Instruction::MUL;
+        mulItem->value = 0;
+        mulItem->defVar = "";
+        addItemToTempStack(mulItem, temp, last);
+
+    }
+
+    const string & RPNCompiler::getLastCompiledStatement() {
+        return last_compiled_statement;
+    }
+
+    bool RPNCompiler::isOperator(const string & token) {
+        const auto it = strToSymbol.find(token);
+        return it != strToSymbol.end() && isOperator(it->second);
+    }
+
+    bool RPNCompiler::isOperator(const Instruction instr) {
+        return instr == Instruction::MUL || instr == Instruction::DIV || instr == Instruction::SUB || instr == Instruction::ADD || instr == Instruction::UNARY_MINUS || instr == Instruction::POW || isComparison(instr);
+    }
+
+    bool RPNCompiler::isComparison(const Instruction instr) {
+        return instr == Instruction::LT || instr == Instruction::GT || instr == Instruction::LE || instr == Instruction::GE || instr == Instruction::EQ || instr == Instruction::NE;
+    }
+
+    bool RPNCompiler::isFunction(const string & token) {
+        const auto it = strToSymbol.find(token);
+        return it != strToSymbol.end() && (isFunction(it->second) || defFunctions->contains(std::string_view(token)));
+    }
+
+    bool RPNCompiler::isFunction(const Instruction & instr) {
+        return RPNCompiler::isBuiltinFunction(instr);
+    }
+
+    bool RPNCompiler::isFunction(const StackItem* item) {
+        return isFunction(item->instr) || (item->defVar != "" && defFunctions->contains(std::string_view(item->defVar)));
+    }
+
+    bool RPNCompiler::isCustomFunction(const StackItem* item) {
+        return item->defVar != "" && defFunctions->contains(std::string_view(item->defVar));
+    }
+
+    bool RPNCompiler::isNumber(const string & token) {
+
+        int idx = 0;
+        const int lu = token.length();
+
+        bool hasSign = false;
+        bool hasDigit = false;
+        bool decPoint = false;
+        bool decExpected = false;
+        bool trailing = false;
+
+        while (idx < lu) {
+            char ch = token[idx];
+
+            if (isdigit(ch)) {
+                if (ch == '0' && !hasDigit) {
+                    decExpected = true;
+                }
+
+                if (trailing) {
+                    return false;
+                }
+
+                hasDigit = true;
+            } else if (ch == '-') {
+                if (hasDigit || hasSign || trailing) {
+                    return false;
+                }
+
+                hasSign = true;
+            } else if (ch == '.') {
+                if (!hasDigit || decPoint || trailing) {
+                    return false;
+                }
+
+                decPoint = true;
+            } else if (ch == ' ') {
+                if (hasDigit || decPoint || hasSign) {
+                    trailing = true;
+                }
+            } else {
+                return false;
+            }
+
+            ++idx;
+        }
+
+        if (!hasDigit) {
+            return false;
+        }
+
+        return true;
+
+    }
+
+    double RPNCompiler::toDouble(const string & token) {
+        double r = 0;
+
+        if (!toDouble(token, r)) {
+            throwError(Diagnostic(ErrorCode::INVALID_NUMBER, Diagnostic::NO_POSITION, token).message());
+        }
+
+        return r;
+
+    }
+
+    bool RPNCompiler::toDouble(const string & token, double &value) noexcept {
+        const auto r = std::from_chars(token.data(), token.data() + token.size(), value);
+        return r.ec == std::errc();
+    }
+
+    string RPNCompiler::getToken(const string& statement, int fromIndex, int *nextIndex) {
+
+        const size_t lu = statement.length();
+
+        if (fromIndex > lu) return "";
+        int idx = fromIndex;
+        //the token is the characters from begin to end, the spaces before it are skipped
+        int begin = -1;
+        int end = idx;
+        int state = 0;
+        bool last_num = false;
+        bool last_alpha = false;
+
+        while (idx < lu) {
+
+            char ch = statement[idx];
+
+            if (ch == '(' || ch == ')' || ch == '+' || ch == '-' || ch == '/' || ch == '*' || ch == '^' || ch == '<' || ch == '>' || ch == '=' || ch == '!') {
+
+                last_num = last_alpha = false;
+
+                if (state == 1) {
+                    break;
+                } else {
+                    begin = idx;
+                    ++idx;
+                    //two chars comparison operators <= >= == !=
+                    if ((ch == '<' || ch == '>' || ch == '=' || ch == '!') && static_cast<size_t> (idx) < lu && statement[idx] == '=') {
+                        ++idx;
+                    }
+                    end = idx;
+                    break;
+                }
+
+            } else if (ch == ' ') {
+
+                last_num = last_alpha = false;
+
+                //skip
+                ++idx;
+                if (state == 1) {
+                    break;
+                }
+            } else if (isalpha(ch)) {
+
+                if (last_num && !last_alpha) {
+                    break;
+                }
+
+                last_num = false;
+                last_alpha = isalpha(ch);
+
+                state = 1;
+                if (begin < 0) begin = idx;
+                ++idx;
+                end = idx;
+
+            } else if (ch == '.') {
+                last_num = false;
+                last_alpha = false;
+
+                state = 1;
+                if (begin < 0) begin = idx;
+                ++idx;
+                end = idx;
+            } else if (isdigit(ch)) {
+                last_num = true;
+                last_alpha = false;
+                state = 1;
+                if (begin < 0) begin = idx;
+                ++idx;
+                end = idx;
+            } else {
+
+                last_num = false;
+                last_alpha = false;
+
+                //invalid
+                if (begin < 0) begin = idx;
+                ++idx;
+                end = idx;
+                break;
+
+            }
+        }
+
+        *nextIndex = idx;
+        return begin < 0 ? string() : statement.substr(begin, end - begin);
+    }
+
+    size_t RPNCompiler::verifyProgram(Diagnostic &error) {
+
+        size_t depth = 0;
+        size_t maxDepth = 0;
+
+        for (const StackItem *item : *instrVector) {
+
+            switch (item->instr) {
+                case Instruction::VALUE:
+                    ++depth;
+                    break;
+                case Instruction::ADD:
+                case Instruction::SUB:
+                case Instruction::DIV:
+                case Instruction::MUL:
+                case Instruction::POW:
+                case Instruction::LT:
+                case Instruction::GT:
+                case Instruction::LE:
+                case Instruction::GE:
+                case Instruction::EQ:
+                case Instruction::NE:
+                    if (depth < 2) {
+                        error = Diagnostic(ErrorCode::MISSING_OPERAND);
+                        return 0;
+                    }
+                    --depth;
+                    break;
+                default:
+                    if (!isFunction(item->instr) && item->instr != Instruction::UNARY_MINUS && item->instr != Instruction::DEF_FUNCTION) {
+                        error = Diagnostic(ErrorCode::UNHANDLED_INSTRUCTION);
+                        return 0;
+                    }
+                    if (depth < 1) {
+                        error = Diagnostic(ErrorCode::MISSING_ARGUMENT);
+                        return 0;
+                    }
+                    break;
+            }
+
+            if (depth > maxDepth) {
+                maxDepth = depth;
+            }
+        }
+
+        if (depth != 1) {
+            error = Diagnostic(ErrorCode::NOT_REDUCIBLE);
+            return 0;
+        }
+
+        if (maxDepth > stackSize) {
+            error = Diagnostic(ErrorCode::STACK_OVERFLOW);
+            error.required = maxDepth;
+            error.available = stackSize;
+            return 0;
+        }
+
+        return maxDepth;
+    }
+
+    /**
+     * Tabulated function: the knots and the polynomial coefficients of the segments, stored contiguously
+     */
+    struct RPNCompiler::Table {
+
+        /**
+         * Buckets of the guide table for each segment
+         */
+        static const size_t GUIDE_BUCKETS = 4;
+
+        /**
+         * Maximum number of segments stepped from a bucket of the guide table, tables with denser clusters of knots are searched
+         */
+        static const unsigned MAX_GUIDE_STEPS = 5;
+
+        Interpolation mode;
+        /**
+         * knots (strictly increasing)
+         */
+        std::pmr::vector<double> xs;
+        /**
+         * coefficients of the segment i in t=x-xs[i], stride values for each segment:
+         * y, slope for LINEAR, y, b, c, d of y+t*(b+t*(c+t*d)) for CUBIC_SPLINE
+         */
+        std::pmr::vector<double> coef;
+        size_t stride;
+        size_t segments;
+        double lo;
+        double hi;
+        /**
+         * equally spaced knots: the segment is computed from the argument
+         */
+        bool uniform;
+        double invStep;
+        /**
+         * guide table of unevenly spaced knots: segment of the left end of equally spaced buckets,
+         * the segment of an argument is found stepping at most guideSteps knots from its bucket
+         */
+        std::pmr::vector<uint32_t> guide;
+        double guideScale;
+        unsigned guideSteps;
+
+        explicit Table(std::pmr::memory_resource *resource) : mode(Interpolation::LINEAR), xs(resource), coef(resource), stride(2), segments(0),
+        lo(0), hi(0), uniform(false), invStep(0), guide(resource), guideScale(0), guideSteps(0) {
+        }
+
+        /**
+         * @return the segment of x by binary search, with lo <= x <= hi (0 for NaN)
+         */
+        size_t search(double x) const {
+            const double *base = xs.data();
+            for (size_t n = segments; n > 1;) {
+                const size_t half = n / 2;
+                base += (base[half] <= x) * half;
+                n -= half;
+            }
+            return base - xs.data();
+        }
+
+        /**
+         * Build the guide table of unevenly spaced knots (not used if a bucket holds more than MAX_GUIDE_STEPS knots)
+         */
+        void buildGuide() {
+            const size_t buckets = GUIDE_BUCKETS * segments;
+            guideScale = buckets / (hi - lo);
+            guide.resize(buckets);
+            guideSteps = 0;
+            for (size_t g = 0; g < buckets; ++g) {
+                //one segment before the left end: the rounding of the bucket of an argument cannot skip its segment
+                const size_t first = search(lo + g / guideScale);
+                guide[g] = static_cast<uint32_t> (first > 0 ? first - 1 : 0);
+                const size_t last = search(std::min(hi, lo + (g + 1) / guideScale));
+                guideSteps = std::max(guideSteps, static_cast<unsigned> (last - guide[g]));
+            }
+            if (guideSteps > MAX_GUIDE_STEPS) {
+                guide.clear();
+            }
+        }
+
+        /**
+         * @return the bucket of the uniform grid or of the guide table, with lo <= x <= hi (0 for NaN)
+         */
+        static size_t bucket(double x, double origin, double scale, size_t count) {
+            const double p = (x - origin) * scale;
+            return std::min(p > 0 ? static_cast<size_t> (p) : 0, count - 1);
+        }
+
+        /**
+         * @return the segment of x, with lo <= x <= hi (0 for NaN)
+         */
+        size_t segment(double x) const {
+            if (uniform) {
+                return bucket(x, lo, invStep, segments);
+            }
+            if (guide.empty()) {
+                return search(x);
+            }
+            size_t i = guide[bucket(x, lo, guideScale, guide.size())];
+            while (i + 1 < segments && xs[i + 1] <= x) {
+                ++i;
+            }
+            return i;
+        }
+
+        double eval(double x) const {
+            //outside of the table the end values are kept, NaN is propagated
+            const double c = std::clamp(x, lo, hi);
+            const size_t i = segment(c);
+            const double t = c - xs[i];
+            const double *k = coef.data() + i * stride;
+            if (mode == Interpolation::LINEAR) {
+                return k[0] + t * k[1];
+            }
+            return k[0] + t * (k[1] + t * (k[2] + t * k[3]));
+        }
+
+        /**
+         * Evaluate the table over a block of values in place
+         */
+        void evalBlock(double *a, size_t len) const {
+
+            const size_t chunk = RPNCompiler::BATCH_BLOCK_SIZE;
+            const double *x = xs.data();
+            const double *k = coef.data();
+
+            size_t index[chunk];
+
+            for (size_t first = 0; first < len; first += chunk) {
+
+                double *v = a + first;
+                const size_t n = std::min(chunk, len - first);
+
+                for (size_t j = 0; j < n; ++j) {
+                    v[j] = std::clamp(v[j], lo, hi);
+                }
+
+                //segments: each pass is applied to the whole block
+                if (uniform) {
+                    for (size_t j = 0; j < n; ++j) {
+                        index[j] = bucket(v[j], lo, invStep, segments);
+                    }
+                } else if (!guide.empty()) {
+                    for (size_t j = 0; j < n; ++j) {
+                        index[j] = guide[bucket(v[j], lo, guideScale, guide.size())];
+                    }
+                    for (unsigned step = 0; step < guideSteps; ++step) {
+                        for (size_t j = 0; j < n; ++j) {
+                            index[j] += (index[j] + 1 < segments) & (x[index[j] + 1] <= v[j]);
+                        }
+                    }
+                } else {
+                    std::fill(index, index + n, 0);
+                    for (size_t m = segments; m > 1;) {
+                        const size_t half = m / 2;
+                        for (size_t j = 0; j < n; ++j) {
+                            index[j] += (x[index[j] + half] <= v[j]) * half;
+                        }
+                        m -= half;
+                    }
+                }
+
+                if (mode == Interpolation::LINEAR) {
+                    for (size_t j = 0; j < n; ++j) {
+                        const size_t i = index[j];
+                        const double t = v[j] - x[i];
+                        v[j] = k[2 * i] + t * k[2 * i + 1];
+                    }
+                } else {
+                    for (size_t j = 0; j < n; ++j) {
+                        const size_t i = index[j];
+                        const double t = v[j] - x[i];
+                        const double *c = k + 4 * i;
+                        v[j] = c[0] + t * (c[1] + t * (c[2] + t * c[3]));
+                    }
+                }
+            }
+        }
+    };
+
+    static bool isArithmetic(Instruction instr) {
+        return instr == Instruction::ADD || instr == Instruction::SUB || instr == Instruction::MUL
+                || instr == Instruction::DIV || instr == Instruction::POW;
+    }
+
+    /**
+     * @return the operation of an arithmetic instruction taking 0, 1 (the right one) or 2 operands from the instruction
+     */
+    static OpCode arithmeticOp(Instruction instr, int operands) {
+        static const OpCode codes[3][5] = {
+            {OpCode::ADD, OpCode::SUB, OpCode::MUL, OpCode::DIV, OpCode::POW},
+            {OpCode::ADD_OPERAND, OpCode::SUB_OPERAND, OpCode::MUL_OPERAND, OpCode::DIV_OPERAND, OpCode::POW_OPERAND},
+            {OpCode::ADD_OPERANDS, OpCode::SUB_OPERANDS, OpCode::MUL_OPERANDS, OpCode::DIV_OPERANDS, OpCode::POW_OPERANDS}
+        };
+        switch (instr) {
+            case Instruction::ADD:
+                return codes[operands][0];
+            case Instruction::SUB:
+                return codes[operands][1];
+            case Instruction::MUL:
+                return codes[operands][2];
+            case Instruction::DIV:
+                return codes[operands][3];
+            default:
+                return codes[operands][4];
+        }
+    }
+
+    size_t RPNCompiler::parseLoop(const string &statement, size_t open, bool product, Diagnostic &error) {
+
+        const char *keyword = product ? "prod" : "sum";
+
+        //the arguments are separated by the commas outside brackets
+        size_t commas[3] = {0, 0, 0};
+        size_t count = 0;
+        size_t close = string::npos;
+        int depth = 0;
+
+        for (size_t p = open + 1; p < statement.length() && close == string::npos; ++p) {
+            if (statement[p] == '(') {
+                ++depth;
+            } else if (statement[p] == ')' && depth-- == 0) {
+                close = p;
+            } else if (statement[p] == ',' && depth == 0) {
+                if (count < 3) {
+                    commas[count] = p;
+                }
+                ++count;
+            }
+        }
+
+        auto blank = [&statement](size_t from, size_t to) {
+            return statement.find_first_not_of(' ', from) >= to;
+        };
+
+        if (close == string::npos || count != 3 || blank(commas[0] + 1, commas[1]) || blank(commas[1] + 1, commas[2]) || blank(commas[2] + 1, close)) {
+            error = Diagnostic(ErrorCode::INVALID_LOOP, open, keyword);
+            return 0;
+        }
+
+        string index = statement.substr(open + 1, commas[0] - open - 1);
+        index.erase(0, index.find_first_not_of(' '));
+        index.erase(index.find_last_not_of(' ') + 1);
+
+        if (index.empty() || !isalpha(index[0]) || !std::all_of(index.begin(), index.end(), [](char ch) {
+                return isalnum(ch);
+            }) || isFunction(index)) {
+            error = Diagnostic(ErrorCode::INVALID_LOOP, open, keyword);
+            return 0;
+        }
+
+        Loop *loop = allocator.new_object<Loop>(product, allocator.resource());
+        loops->all.push_back(loop);
+        loop->index = loops->newSlot();
+        loop->result = loops->newSlot();
+
+        //an argument is parsed into a block of the loop, the loops in the argument go to the current list
+        auto parseBlock = [&](size_t from, size_t to, Loop::Block &block) {
+            std::pmr::vector<StackItem*> *outer = instrVector;
+            instrVector = &block.rpn;
+            bool valid = false;
+            try {
+                valid = parseTokens(statement.substr(from, to - from), error);
+                if (!valid && error.position != Diagnostic::NO_POSITION) {
+                    error.position += from;
+                }
+                if (valid) {
+                    const size_t depth = verifyProgram(error);
+                    block.stack.resize(depth);
+                    valid = depth > 0;
+                }
+            } catch (...) {
+                instrVector = outer;
+                throw;
+            }
+            instrVector = outer;
+            return valid;
+        };
+
+        if (!parseBlock(commas[0] + 1, commas[1], loop->from) || !parseBlock(commas[1] + 1, commas[2], loop->to)) {
+            return 0;
+        }
+
+        //the index is visible only in the body, the loops of the body are nested in this loop
+        std::pmr::vector<Loop*> *target = loops->target;
+        loops->scope.emplace_back(index, loop->index);
+        loops->target = &loop->inner;
+
+        const bool valid = parseBlock(commas[2] + 1, close, loop->body);
+
+        loops->scope.pop_back();
+        loops->target = target;
+
+        if (!valid) {
+            return 0;
+        }
+
+        hoistInvariants(*loop);
+
+        target->push_back(loop);
+
+        StackItem *s = newItem();
+        s->instr = Instruction::VALUE;
+        s->defVar = "#" + std::to_string(loop->result);
+        instrVector->push_back(s);
+
+        return close + 1;
+    }
+
+    void RPNCompiler::hoistInvariants(Loop &loop) {
+
+        //slots changing at every iteration: the index and the results of the inner loops reading it
+        std::pmr::vector<size_t> variant(1, loop.index, allocator);
+
+        std::pmr::vector<Loop*> nested(allocator);
+        nested.swap(loop.inner);
+
+        for (Loop *inner : nested) {
+            if (inner->reads(variant)) {
+                variant.push_back(inner->result);
+                loop.inner.push_back(inner);
+            } else {
+                loop.before.push_back(inner);
+            }
+        }
+
+        //subexpressions of the body reading a variant slot, first instruction and parent of each subexpression
+        auto &rpn = loop.body.rpn;
+        const size_t n = rpn.size();
+        std::pmr::vector<char> varies(n, 0, allocator);
+        std::pmr::vector<size_t> start(n, 0, allocator);
+        std::pmr::vector<size_t> parent(n, NO_SOURCE, allocator);
+        std::pmr::vector<size_t> roots(allocator);
+
+        for (size_t i = 0; i < n; ++i) {
+            const StackItem *si = rpn[i];
+            start[i] = i;
+            if (si->instr == Instruction::VALUE) {
+                varies[i] = std::find(variant.begin(), variant.end(), slotOf(si)) != variant.end();
+            } else {
+                const int operands = isOperator(si->instr) && si->instr != Instruction::UNARY_MINUS ? 2 : 1;
+                for (int k = 0; k < operands; ++k) {
+                    const size_t child = roots.back();
+                    roots.pop_back();
+                    varies[i] |= varies[child];
+                    start[i] = start[child];
+                    parent[child] = i;
+                }
+            }
+            roots.push_back(i);
+        }
+
+        //the largest invariant subexpressions with an operation are evaluated once into a slot
+        std::pmr::vector<size_t> hoistAt(n, NO_SOURCE, allocator);
+        bool hoisting = false;
+
+        for (size_t i = 0; i < n; ++i) {
+            if (!varies[i] && rpn[i]->instr != Instruction::VALUE && (parent[i] == NO_SOURCE || varies[parent[i]])) {
+                hoistAt[start[i]] = i;
+                hoisting = true;
+            }
+        }
+
+        if (!hoisting) {
+            return;
+        }
+
+        auto depthOf = [](const std::pmr::vector<StackItem*> &items) {
+            size_t depth = 0;
+            size_t maxDepth = 0;
+            for (const StackItem *si : items) {
+                if (si->instr == Instruction::VALUE) {
+                    maxDepth = std::max(maxDepth, ++depth);
+                } else if (isOperator(si->instr) && si->instr != Instruction::UNARY_MINUS) {
+                    --depth;
+                }
+            }
+            return maxDepth;
+        };
+
+        std::pmr::vector<StackItem*> body(allocator);
+
+        for (size_t i = 0; i < n;) {
+            if (hoistAt[i] == NO_SOURCE) {
+                body.push_back(rpn[i++]);
+                continue;
+            }
+            const size_t last = hoistAt[i];
+            loop.invariant.rpn.insert(loop.invariant.rpn.end(), rpn.begin() + i, rpn.begin() + last + 1);
+            loop.hoisted.push_back(loops->newSlot());
+            StackItem *s = newItem();
+            s->instr = Instruction::VALUE;
+            s->defVar = "#" + std::to_string(loop.hoisted.back());
+            body.push_back(s);
+            i = last + 1;
+        }
+
+        rpn.swap(body);
+
+        loop.body.stack.resize(depthOf(rpn));
+        loop.invariant.stack.resize(depthOf(loop.invariant.rpn));
+    }
+
+    void RPNCompiler::runLoops(const std::pmr::vector<Loop*> &list) {
+
+        double *slots = loops->slots.data();
+
+        for (Loop *loop : list) {
+
+            const double from = runOps(loop->from.program, loop->from.stack.data());
+            const double to = runOps(loop->to.program, loop->to.stack.data());
+
+            if (!loop->before.empty()) {
+                runLoops(loop->before);
+            }
+
+            if (!loop->hoisted.empty()) {
+                double *stack = loop->invariant.stack.data();
+                runOps(loop->invariant.program, stack);
+                for (size_t k = 0; k < loop->hoisted.size(); ++k) {
+                    slots[loop->hoisted[k]] = stack[k];
+                }
+            }
+
+            //the index takes the values from, from+1, ... <= to, the result of an empty range is 0 or 1
+            const double count = std::floor(to - from) + 1;
+            double *stack = loop->body.stack.data();
+            double &index = slots[loop->index];
+            double result = loop->product ? 1.0 : 0.0;
+
+            if (!std::isfinite(from) || !std::isfinite(to)) {
+                result = std::numeric_limits<double>::quiet_NaN();
+            } else if (loop->product) {
+                for (double k = 0; k < count; ++k) {
+                    index = from + k;
+                    if (!loop->inner.empty()) {
+                        runLoops(loop->inner);
+                    }
+                    result *= runOps(loop->body.program, stack);
+                }
+            } else {
+                for (double k = 0; k < count; ++k) {
+                    index = from + k;
+                    if (!loop->inner.empty()) {
+                        runLoops(loop->inner);
+                    }
+                    result += runOps(loop->body.program, stack);
+                }
+            }
+
+            slots[loop->result] = result;
+        }
+    }
+
+    void RPNCompiler::evaluateLoopsForRows(const vector<std::string_view> &bound) {
+
+        for (std::string_view name : bound) {
+            if (loopsReference(name)) {
+                throwError("sum and prod cannot use the variable " + string(name) + " bound to the rows");
+            }
+        }
+
+        for (Loop *loop : loops->all) {
+            for (Loop::Block *block : {&loop->from, &loop->to, &loop->body, &loop->invariant}) {
+                if (resolveOps(block->program) == 0) {
+                    continue;
+                }
+                for (const Op &op : block->program) {
+                    for (int k = 0; k < 2; ++k) {
+                        if (op.operandItem[k] && !op.operand[k]) {
+                            throwError(Diagnostic(ErrorCode::UNDEFINED_VARIABLE, Diagnostic::NO_POSITION, op.operandItem[k]->defVar).message());
+                        }
+                    }
+                    if (op.code == OpCode::CUSTOM_FUNCTION && !op.fn) {
+                        throwError(Diagnostic(ErrorCode::UNDEFINED_FUNCTION, Diagnostic::NO_POSITION, op.item->defVar).message());
+                    }
+                }
+            }
+        }
+
+        runLoops(loops->top);
+    }
+
+    bool RPNCompiler::loopsReference(std::string_view name) const {
+        for (const Loop *loop : loops->all) {
+            for (const Loop::Block *block : {&loop->from, &loop->to, &loop->body, &loop->invariant}) {
+                for (const StackItem *item : block->rpn) {
+                    if (item->instr == Instruction::VALUE && std::string_view(item->defVar) == name) {
+                        return true;
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+    void RPNCompiler::buildProgram() {
+
+        programResolved = false;
+        peepholeStats = PeepholeStats{};
+        peepholeStats.rpnInstructions = instrVector->size();
+
+        buildOps(*instrVector, *program);
+
+        peepholeStats.programInstructions = program->size();
+
+        //the statistics describe the program, not the loops
+        const PeepholeStats stats = peepholeStats;
+
+        for (Loop *loop : loops->all) {
+            for (Loop::Block *block : {&loop->from, &loop->to, &loop->body, &loop->invariant}) {
+                buildOps(block->rpn, block->program);
+            }
+        }
+
+        peepholeStats = stats;
+
+        buildRegisterProgram();
+    }
+
+    void RPNCompiler::buildOps(const std::pmr::vector<StackItem*> &rpn, std::pmr::vector<Op> &prog) {
+
+        const size_t n = rpn.size();
+
+        prog.clear();
+
+        auto instrAt = [&rpn, n](size_t i) {
+            return i < n ? rpn[i]->instr : Instruction::VALUE;
+        };
+
+        auto isValueAt = [&rpn, n](size_t i) {
+            return i < n && rpn[i]->instr == Instruction::VALUE;
+        };
+
+        auto isAddSub = [](Instruction instr) {
+            return instr == Instruction::ADD || instr == Instruction::SUB;
+        };
+
+        auto setOperand = [this, &rpn](Op &op, int k, size_t i) {
+            op.operandItem[k] = rpn[i];
+            op.source[k] = i;
+            op.value[k] = rpn[i]->value;
+            if (rpn[i]->defVar.empty()) {
+                ++peepholeStats.immediateOperands;
+            } else {
+                ++peepholeStats.variableOperands;
+            }
+        };
+
+        for (size_t i = 0; i < n; ++i) {
+
+            const StackItem *si = rpn[i];
+            const Instruction next = instrAt(i + 1);
+            Op *back = prog.empty() ? nullptr : &prog.back();
+
+            if (si->instr == Instruction::VALUE && fusedMultiplyAdd && isAddSub(next) && back
+                    && (back->code == OpCode::MUL || back->code == OpCode::MUL_OPERAND)) {
+                //a b MUL x ADD -> fma(a,b,x), a y MUL x ADD -> fma(a,y,x)
+                const bool add = next == Instruction::ADD;
+                if (back->code == OpCode::MUL) {
+                    back->code = add ? OpCode::FMA_ADD_OPERAND : OpCode::FMS_ADD_OPERAND;
+                    setOperand(*back, 0, i);
+                } else {
+                    back->code = add ? OpCode::FMA_OPERANDS : OpCode::FMS_OPERANDS;
+                    setOperand(*back, 1, i);
+                }
+                back->item = rpn[i + 1];
+                ++peepholeStats.fusedMultiplyAdds;
+                ++i;
+                continue;
+            }
+
+            if (fusedMultiplyAdd && isAddSub(si->instr) && back
+                    && (back->code == OpCode::MUL || back->code == OpCode::MUL_OPERAND || back->code == OpCode::MUL_OPERANDS)) {
+                //c a b MUL ADD -> fma(a,b,c)
+                const bool add = si->instr == Instruction::ADD;
+                if (back->code == OpCode::MUL) {
+                    back->code = add ? OpCode::FMA : OpCode::FNMA;
+                } else if (back->code == OpCode::MUL_OPERAND) {
+                    back->code = add ? OpCode::FMA_MUL_OPERAND : OpCode::FNMA_MUL_OPERAND;
+                } else {
+                    back->code = add ? OpCode::FMA_MUL_OPERANDS : OpCode::FNMA_MUL_OPERANDS;
+                }
+                back->item = si;
+                ++peepholeStats.fusedMultiplyAdds;
+                continue;
+            }
+
+            Op op{};
+            op.item = si;
+            op.source[0] = NO_SOURCE;
+            op.source[1] = NO_SOURCE;
+
+            if (si->instr == Instruction::VALUE) {
+                //a x y MUL z ADD is left to the multiply-add fusion
+                const bool multiplyAdd = fusedMultiplyAdd && instrAt(i + 2) == Instruction::MUL && isValueAt(i + 3) && isAddSub(instrAt(i + 4));
+                if (next == Instruction::VALUE && isArithmetic(instrAt(i + 2)) && !multiplyAdd) {
+                    //x y OP -> OP_OPERANDS
+                    op.code = arithmeticOp(instrAt(i + 2), 2);
+                    op.item = rpn[i + 2];
+                    setOperand(op, 0, i);
+                    setOperand(op, 1, i + 1);
+                    i += 2;
+                } else if (isArithmetic(next)) {
+                    //x OP -> OP_OPERAND
+                    op.code = arithmeticOp(next, 1);
+                    op.item = rpn[i + 1];
+                    setOperand(op, 0, i);
+                    ++i;
+                } else {
+                    op.code = OpCode::PUSH;
+                    op.operandItem[0] = si;
+                    op.source[0] = i;
+                    op.value[0] = si->value;
+                }
+            } else if (isArithmetic(si->instr)) {
+                op.code = arithmeticOp(si->instr, 0);
+            } else if (isComparison(si->instr)) {
+                op.code = OpCode::COMPARE;
+            } else if (si->instr == Instruction::DEF_FUNCTION) {
+                op.code = OpCode::CUSTOM_FUNCTION;
+            } else {
+                op.code = OpCode::FUNCTION;
+            }
+
+            prog.push_back(op);
+        }
+    }
+
+    void RPNCompiler::resolveProgram() {
+
+        unresolvedOperands = resolveOps(*program);
+
+        for (Loop *loop : loops->all) {
+            for (Loop::Block *block : {&loop->from, &loop->to, &loop->body, &loop->invariant}) {
+                unresolvedOperands += resolveOps(block->program);
+            }
+        }
+
+        if (backend == Backend::REGISTER) {
+            resolveRegisterProgram();
+        }
+
+        if (surrogate->active()) {
+            const auto it = defVars->find(std::string_view(surrogate->var));
+            surrogate->variable = it == defVars->end() ? nullptr : &it->second;
+        }
+
+        programResolved = true;
+    }
+
+    size_t RPNCompiler::resolveOps(std::pmr::vector<Op> &ops) {
+
+        size_t unresolved = 0;
+
+        for (Op &op : ops) {
+            for (int k = 0; k < 2; ++k) {
+                const StackItem *item = op.operandItem[k];
+                if (!item) {
+                    continue;
+                }
+                if (item->defVar.empty()) {
+                    op.operand[k] = &op.value[k];
+                } else {
+                    op.operand[k] = findOperand(item->defVar);
+                    unresolved += op.operand[k] == nullptr;
+                }
+            }
+            if (op.code == OpCode::CUSTOM_FUNCTION || op.code == OpCode::TABLE) {
+                const auto it = defFunctions->find(std::string_view(op.item->defVar));
+                op.fn = it == defFunctions->end() || !it->second ? nullptr : &it->second;
+                unresolved += op.fn == nullptr;
+                //a table is evaluated natively, its function is used only by the generic paths
+                const auto table = tables->find(std::string_view(op.item->defVar));
+                op.table = table == tables->end() ? nullptr : table->second.get();
+                op.code = op.table ? OpCode::TABLE : OpCode::CUSTOM_FUNCTION;
+            }
+        }
+
+        return unresolved;
+    }
+
+    const double* RPNCompiler::findOperand(std::string_view name) const {
+
+        if (!name.empty() && name[0] == '#') {
+            size_t slot = 0;
+            std::from_chars(name.data() + 1, name.data() + name.size(), slot);
+            return &loops->slots[slot];
+        }
+
+        const auto it = defVars->find(name);
+
+        return it == defVars->end() ? nullptr : &it->second;
+    }
+
+    Diagnostic RPNCompiler::findUnresolved(const std::pmr::vector<const ColumnBinding*> *sources) const {
+
+        //the columns are bound only to the operands of the program
+        auto find = [](const std::pmr::vector<Op> &ops, const std::pmr::vector<const ColumnBinding*> *sources) {
+            for (const Op &op : ops) {
+                for (int k = 0; k < 2; ++k) {
+                    if (op.operandItem[k] && !op.operand[k] && !(sources && (*sources)[op.source[k]])) {
+                        return Diagnostic(ErrorCode::UNDEFINED_VARIABLE, Diagnostic::NO_POSITION, op.operandItem[k]->defVar);
+                    }
+                }
+                if (op.code == OpCode::CUSTOM_FUNCTION && !op.fn) {
+                    return Diagnostic(ErrorCode::UNDEFINED_FUNCTION, Diagnostic::NO_POSITION, op.item->defVar);
+                }
+            }
+            return Diagnostic();
+        };
+
+        Diagnostic error = find(*program, sources);
+
+        for (const Loop *loop : loops->all) {
+            for (const Loop::Block *block : {&loop->from, &loop->to, &loop->body, &loop->invariant}) {
+                if (error.code == ErrorCode::NONE) {
+                    error = find(block->program, nullptr);
+                }
+            }
+        }
+
+        return error;
+    }
+
+    void RPNCompiler::reportUnresolved(const std::pmr::vector<const ColumnBinding*> *sources) {
+
+        const Diagnostic error = findUnresolved(sources);
+
+        if (error.code != ErrorCode::NONE) {
+            throwError(error.message());
+        }
+    }
+
+    /**
+     * Operations of the three-address code of the REGISTER backend
+     */
+    enum class RegisterCode : uint8_t {
+        ADD, SUB, MUL, DIV, POW,
+        //a*b+c, c-a*b, a*b-c
+        FMA, FNMA, FMS,
+        COMPARE, FUNCTION, CUSTOM_FUNCTION, TABLE
+    };
+
+    /**
+     * Size of the register file of the REGISTER backend
+     */
+    static const int REGISTER_FILE_SIZE = 16;
+
+    /**
+     * Argument of a three-address instruction: a register or the operand k of a program operation
+     */
+    struct RegisterArg {
+        /**
+         * virtual register, then its location in the register file after the allocation (-1 for an operand)
+         */
+        int reg;
+        size_t op;
+        int k;
+    };
+
+    struct RPNCompiler::RegisterOp {
+        RegisterCode code;
+        const StackItem *item;
+        /**
+         * program operation lowered into this instruction
+         */
+        size_t op;
+        /**
+         * virtual register of the result, then its location in the register file
+         */
+        int dstLocation;
+        RegisterArg arg[3];
+        double *dst;
+        const double *src[3];
+        const std::function<double(double)> *fn;
+        const Table *table;
+    };
+
+    static RegisterCode registerCode(Instruction instr) {
+        switch (instr) {
+            case Instruction::ADD:
+                return RegisterCode::ADD;
+            case Instruction::SUB:
+                return RegisterCode::SUB;
+            case Instruction::MUL:
+                return RegisterCode::MUL;
+            case Instruction::DIV:
+                return RegisterCode::DIV;
+            default:
+                return RegisterCode::POW;
+        }
+    }
+
+    void RPNCompiler::buildRegisterProgram() {
+
+        auto &code = *registerProgram;
+
+        code.clear();
+        registerResult = nullptr;
+        registerAllocation = RegisterAllocation{};
+
+        if (backend != Backend::REGISTER || program->empty()) {
+            return;
+        }
+
+        const auto &prog = *program;
+
+        //lowering: the stack of the program holds the arguments of the next instructions,
+        //every instruction defines a new virtual register (the index of the instruction)
+        std::pmr::vector<RegisterArg> values(allocator);
+
+        auto pop = [&values]() {
+            const RegisterArg arg = values.back();
+            values.pop_back();
+            return arg;
+        };
+
+        auto operand = [](size_t op, int k) {
+            return RegisterArg{-1, op, k};
+        };
+
+        auto emit = [&code, &values](RegisterCode rc, const Op &op, size_t index, RegisterArg a, RegisterArg b, RegisterArg c) {
+            RegisterOp r{};
+            r.code = rc;
+            r.item = op.item;
+            r.op = index;
+            r.dstLocation = static_cast<int> (code.size());
+            r.arg[0] = a;
+            r.arg[1] = b;
+            r.arg[2] = c;
+            code.push_back(r);
+            values.push_back(RegisterArg{r.dstLocation, NO_SOURCE, 0});
+        };
+
+        const RegisterArg none{-1, NO_SOURCE, 0};
+
+        for (size_t i = 0; i < prog.size(); ++i) {
+
+            const Op &op = prog[i];
+            RegisterArg a, b, c;
+
+            switch (op.code) {
+                case OpCode::PUSH:
+                    values.push_back(operand(i, 0));
+                    break;
+                case OpCode::ADD:
+                case OpCode::SUB:
+                case OpCode::MUL:
+                case OpCode::DIV:
+                case OpCode::POW:
+                    b = pop();
+                    a = pop();
+                    emit(registerCode(op.item->instr), op, i, a, b, none);
+                    break;
+                case OpCode::ADD_OPERAND:
+                case OpCode::SUB_OPERAND:
+                case OpCode::MUL_OPERAND:
+                case OpCode::DIV_OPERAND:
+                case OpCode::POW_OPERAND:
+                    a = pop();
+                    emit(registerCode(op.item->instr), op, i, a, operand(i, 0), none);
+                    break;
+                case OpCode::ADD_OPERANDS:
+                case OpCode::SUB_OPERANDS:
+                case OpCode::MUL_OPERANDS:
+                case OpCode::DIV_OPERANDS:
+                case OpCode::POW_OPERANDS:
+                    emit(registerCode(op.item->instr), op, i, operand(i, 0), operand(i, 1), none);
+                    break;
+                case OpCode::FMA:
+                case OpCode::FNMA:
+                    b = pop();
+                    a = pop();
+                    c = pop();
+                    emit(op.code == OpCode::FMA ? RegisterCode::FMA : RegisterCode::FNMA, op, i, a, b, c);
+                    break;
+                case OpCode::FMA_MUL_OPERAND:
+                case OpCode::FNMA_MUL_OPERAND:
+                    a = pop();
+                    c = pop();
+                    emit(op.code == OpCode::FMA_MUL_OPERAND ? RegisterCode::FMA : RegisterCode::FNMA, op, i, a, operand(i, 0), c);
+                    break;
+                case OpCode::FMA_MUL_OPERANDS:
+                case OpCode::FNMA_MUL_OPERANDS:
+                    c = pop();
+                    emit(op.code == OpCode::FMA_MUL_OPERANDS ? RegisterCode::FMA : RegisterCode::FNMA, op, i, operand(i, 0), operand(i, 1), c);
+                    break;
+                case OpCode::FMA_ADD_OPERAND:
+                case OpCode::FMS_ADD_OPERAND:
+                    b = pop();
+                    a = pop();
+                    emit(op.code == OpCode::FMA_ADD_OPERAND ? RegisterCode::FMA : RegisterCode::FMS, op, i, a, b, operand(i, 0));
+                    break;
+                case OpCode::FMA_OPERANDS:
+                case OpCode::FMS_OPERANDS:
+                    a = pop();
+                    emit(op.code == OpCode::FMA_OPERANDS ? RegisterCode::FMA : RegisterCode::FMS, op, i, a, operand(i, 0), operand(i, 1));
+                    break;
+                case OpCode::COMPARE:
+                    b = pop();
+                    a = pop();
+                    emit(RegisterCode::COMPARE, op, i, a, b, none);
+                    break;
+                case OpCode::CUSTOM_FUNCTION:
+                case OpCode::TABLE:
+                    a = pop();
+                    emit(RegisterCode::CUSTOM_FUNCTION, op, i, a, none, none);
+                    break;
+                default:
+                    a = pop();
+                    emit(RegisterCode::FUNCTION, op, i, a, none, none);
+                    break;
+            }
+        }
+
+        //linear scan: the live interval of a virtual register starts at its instruction and ends at its (single) use,
+        //a register read by an instruction can hold its result
+        const int virtualRegisters = static_cast<int> (code.size());
+        std::pmr::vector<size_t> end(virtualRegisters, code.size(), allocator);
+        for (size_t j = 0; j < code.size(); ++j) {
+            for (const RegisterArg &arg : code[j].arg) {
+                if (arg.reg >= 0) {
+                    end[arg.reg] = j;
+                }
+            }
+        }
+
+        std::pmr::vector<int> location(virtualRegisters, -1, allocator);
+        std::pmr::vector<int> active(allocator);
+        std::pmr::vector<int> spilled(allocator);
+        std::pmr::vector<int> freeRegisters(allocator);
+        std::pmr::vector<int> freeSlots(allocator);
+        int slots = 0;
+        int usedRegisters = 0;
+
+        for (int r = REGISTER_FILE_SIZE - 1; r >= 0; --r) {
+            freeRegisters.push_back(r);
+        }
+
+        auto newSlot = [&freeSlots, &slots]() {
+            if (freeSlots.empty()) {
+                return REGISTER_FILE_SIZE + slots++;
+            }
+            const int slot = freeSlots.back();
+            freeSlots.pop_back();
+            return slot;
+        };
+
+        for (int v = 0; v < virtualRegisters; ++v) {
+
+            //expire the intervals ended by the instruction v
+            const auto expire = [&end, &location, v](std::pmr::vector<int> &intervals, std::pmr::vector<int> &freed) {
+                for (size_t j = 0; j < intervals.size();) {
+                    if (end[intervals[j]] <= static_cast<size_t> (v)) {
+                        freed.push_back(location[intervals[j]]);
+                        intervals[j] = intervals.back();
+                        intervals.pop_back();
+                    } else {
+                        ++j;
+                    }
+                }
+            };
+
+            expire(active, freeRegisters);
+            expire(spilled, freeSlots);
+
+            if (!freeRegisters.empty()) {
+                location[v] = freeRegisters.back();
+                freeRegisters.pop_back();
+                usedRegisters = std::max(usedRegisters, location[v] + 1);
+                active.push_back(v);
+                continue;
+            }
+
+            //spill the interval ending last
+            auto last = std::max_element(active.begin(), active.end(), [&end](int x, int y) {
+                return end[x] < end[y];
+            });
+
+            if (end[*last] > end[v]) {
+                location[v] = location[*last];
+                location[*last] = newSlot();
+                spilled.push_back(*last);
+                *last = v;
+            } else {
+                location[v] = newSlot();
+                spilled.push_back(v);
+            }
+            ++registerAllocation.spills;
+        }
+
+        for (RegisterOp &r : code) {
+            r.dstLocation = location[r.dstLocation];
+            for (RegisterArg &arg : r.arg) {
+                if (arg.reg >= 0) {
+                    arg.reg = location[arg.reg];
+                }
+            }
+        }
+
+        registerFile->assign(REGISTER_FILE_SIZE + slots, 0.0);
+
+        registerAllocation.instructions = code.size();
+        registerAllocation.virtualRegisters = code.size();
+        registerAllocation.registers = usedRegisters;
+    }
+
+    void RPNCompiler::resolveRegisterProgram() {
+
+        const auto &prog = *program;
+        double *file = registerFile->data();
+
+        auto resolve = [&prog, file](const RegisterArg &arg) -> const double* {
+            if (arg.reg >= 0) {
+                return file + arg.reg;
+            }
+            return arg.op == NO_SOURCE ? nullptr : prog[arg.op].operand[arg.k];
+        };
+
+        for (RegisterOp &r : *registerProgram) {
+            r.dst = file + r.dstLocation;
+            for (int k = 0; k < 3; ++k) {
+                r.src[k] = resolve(r.arg[k]);
+            }
+            r.fn = prog[r.op].fn;
+            r.table = prog[r.op].table;
+            if (r.code == RegisterCode::CUSTOM_FUNCTION || r.code == RegisterCode::TABLE) {
+                r.code = r.table ? RegisterCode::TABLE : RegisterCode::CUSTOM_FUNCTION;
+            }
+        }
+
+        //the last instruction computes the result, a program without instructions pushes an operand
+        registerResult = registerProgram->empty() ? prog[0].operand[0] : registerProgram->back().dst;
+    }
+
+    double RPNCompiler::evaluateRegisters() {
+
+        for (const RegisterOp &r : *registerProgram) {
+            switch (r.code) {
+                case RegisterCode::ADD:
+                    *r.dst = *r.src[0] + *r.src[1];
+                    break;
+                case RegisterCode::SUB:
+                    *r.dst = *r.src[0] - *r.src[1];
+                    break;
+                case RegisterCode::MUL:
+                    *r.dst = *r.src[0] * *r.src[1];
+                    break;
+                case RegisterCode::DIV:
+                    *r.dst = *r.src[0] / *r.src[1];
+                    break;
+                case RegisterCode::POW:
+                    *r.dst = functions->pow(*r.src[0], *r.src[1]);
+                    break;
+                case RegisterCode::FMA:
+                    *r.dst = std::fma(*r.src[0], *r.src[1], *r.src[2]);
+                    break;
+                case RegisterCode::FNMA:
+                    *r.dst = std::fma(-*r.src[0], *r.src[1], *r.src[2]);
+                    break;
+                case RegisterCode::FMS:
+                    *r.dst = std::fma(*r.src[0], *r.src[1], -*r.src[2]);
+                    break;
+                case RegisterCode::COMPARE:
+                    *r.dst = evaluateOperation(*r.src[0], *r.src[1], r.item);
+                    break;
+                case RegisterCode::CUSTOM_FUNCTION:
+                    *r.dst = (*r.fn)(*r.src[0]);
+                    break;
+                case RegisterCode::TABLE:
+                    *r.dst = r.table->eval(*r.src[0]);
+                    break;
+                default:
+                    *r.dst = functions->unary[static_cast<size_t> (r.item->instr)].scalar(*r.src[0]);
+                    break;
+            }
+        }
+
+        return *registerResult;
+    }
+
+    double RPNCompiler::evaluate() {
+
+        if (tiering) {
+            countEvaluation();
+        }
+
+        if (!metrics) {
+            return evaluateProgram();
+        }
+
+        //one evaluation every sampling is timed, the others are only counted
+        if (++metricsPending < metrics->getSampling()) {
+            try {
+                return evaluateProgram();
+            } catch (...) {
+                metrics->recordEvaluateError();
+                throw;
+            }
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+
+        try {
+            const double result = evaluateProgram();
+            metrics->recordEvaluations(metricsPending, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start));
+            metricsPending = 0;
+            return result;
+        } catch (...) {
+            metrics->recordEvaluateError();
+            publishMetrics();
+            throw;
+        }
+    }
+
+    Result<double> RPNCompiler::tryEvaluate() {
+
+        Diagnostic error;
+
+        if (!instrVector || instrVector->empty()) {
+            error = Diagnostic(ErrorCode::NOT_COMPILED);
+        } else if (!programResolved || unresolvedOperands > 0) {
+            resolveProgram();
+            error = findUnresolved(nullptr);
+        }
+
+        if (error.code != ErrorCode::NONE) {
+            if (metrics) {
+                metrics->recordEvaluations(1);
+                metrics->recordEvaluateError();
+            }
+            return error;
+        }
+
+        //the program is resolved: only a custom function can throw
+        try {
+            return evaluate();
+        } catch (...) {
+            error = Diagnostic(ErrorCode::FUNCTION_FAILED);
+            error.cause = std::current_exception();
+            return error;
+        }
+    }
+
+    void RPNCompiler::setMetrics(MetricsRegistry *metrics) {
+        publishMetrics();
+        this->metrics = metrics;
+    }
+
+    MetricsRegistry* RPNCompiler::getMetrics() const noexcept {
+        return metrics;
+    }
+
+    void RPNCompiler::publishMetrics() noexcept {
+        if (metrics && metricsPending > 0) {
+            metrics->recordEvaluations(metricsPending);
+        }
+        metricsPending = 0;
+    }
+
+    double RPNCompiler::evaluateProgram() {
+
+
+        if (!instrVector || instrVector->empty()) {
+            throw VirtualFPUException("Compile an expression before evaluating");
+        }
+
+        try {
+            if (!programResolved || unresolvedOperands > 0) {
+                resolveProgram();
+                if (unresolvedOperands > 0) {
+                    reportUnresolved(nullptr);
+                }
+            }
+
+            if (surrogate->variable) {
+                const double x = *surrogate->variable;
+                if (x >= surrogate->lo && x <= surrogate->hi) {
+                    output = surrogate->eval(x);
+                    return output;
+                }
+            }
+
+            if (!loops->top.empty()) {
+                runLoops(loops->top);
+            }
+
+            if (backend == Backend::REGISTER) {
+                output = evaluateRegisters();
+                return output;
+            }
+
+            output = runOps(*program, executeStack->data());
+            return output;
+
+        } catch (VirtualFPUException &e) {
+            stringstream ss;
+            ss << "Error:" << e.getMessage();
+            throw VirtualFPUException(ss.str());
+        }
+    }
+
+    double RPNCompiler::runOps(const std::pmr::vector<Op> &ops, double *stack) {
+
+        //the program was verified by compile: the stack cannot overflow and every operation has its operands
+        size_t sp = 0;
+
+        for (const Op &op : ops) {
+            switch (op.code) {
+                case OpCode::PUSH:
+                    stack[sp++] = *op.operand[0];
+                    break;
+                case OpCode::ADD:
+                    --sp;
+                    stack[sp - 1] = stack[sp - 1] + stack[sp];
+                    break;
+                case OpCode::SUB:
+                    --sp;
+                    stack[sp - 1] = stack[sp - 1] - stack[sp];
+                    break;
+                case OpCode::MUL:
+                    --sp;
+                    stack[sp - 1] = stack[sp - 1] * stack[sp];
+                    break;
+                case OpCode::DIV:
+                    --sp;
+                    stack[sp - 1] = stack[sp - 1] / stack[sp];
+                    break;
+                case OpCode::POW:
+                    --sp;
+                    stack[sp - 1] = functions->pow(stack[sp - 1], stack[sp]);
+                    break;
+                case OpCode::ADD_OPERAND:
+                    stack[sp - 1] = stack[sp - 1] + *op.operand[0];
+                    break;
+                case OpCode::SUB_OPERAND:
+                    stack[sp - 1] = stack[sp - 1] - *op.operand[0];
+                    break;
+                case OpCode::MUL_OPERAND:
+                    stack[sp - 1] = stack[sp - 1] * *op.operand[0];
+                    break;
+                case OpCode::DIV_OPERAND:
+                    stack[sp - 1] = stack[sp - 1] / *op.operand[0];
+                    break;
+                case OpCode::POW_OPERAND:
+                    stack[sp - 1] = functions->pow(stack[sp - 1], *op.operand[0]);
+                    break;
+                case OpCode::ADD_OPERANDS:
+                    stack[sp++] = *op.operand[0] + *op.operand[1];
+                    break;
+                case OpCode::SUB_OPERANDS:
+                    stack[sp++] = *op.operand[0] - *op.operand[1];
+                    break;
+                case OpCode::MUL_OPERANDS:
+                    stack[sp++] = *op.operand[0] * *op.operand[1];
+                    break;
+                case OpCode::DIV_OPERANDS:
+                    stack[sp++] = *op.operand[0] / *op.operand[1];
+                    break;
+                case OpCode::POW_OPERANDS:
+                    stack[sp++] = functions->pow(*op.operand[0], *op.operand[1]);
+                    break;
+                case OpCode::FMA:
+                    sp -= 2;
+                    stack[sp - 1] = std::fma(stack[sp], stack[sp + 1], stack[sp - 1]);
+                    break;
+                case OpCode::FNMA:
+                    sp -= 2;
+                    stack[sp - 1] = std::fma(-stack[sp], stack[sp + 1], stack[sp - 1]);
+                    break;
+                case OpCode::FMA_MUL_OPERAND:
+                    --sp;
+                    stack[sp - 1] = std::fma(stack[sp], *op.operand[0], stack[sp - 1]);
+                    break;
+                case OpCode::FNMA_MUL_OPERAND:
+                    --sp;
+                    stack[sp - 1] = std::fma(-stack[sp], *op.operand[0], stack[sp - 1]);
+                    break;
+                case OpCode::FMA_MUL_OPERANDS:
+                    stack[sp - 1] = std::fma(*op.operand[0], *op.operand[1], stack[sp - 1]);
+                    break;
+                case OpCode::FNMA_MUL_OPERANDS:
+                    stack[sp - 1] = std::fma(-*op.operand[0], *op.operand[1], stack[sp - 1]);
+                    break;
+                case OpCode::FMA_OPERANDS:
+                    stack[sp - 1] = std::fma(stack[sp - 1], *op.operand[0], *op.operand[1]);
+                    break;
+                case OpCode::FMS_OPERANDS:
+                    stack[sp - 1] = std::fma(stack[sp - 1], *op.operand[0], -*op.operand[1]);
+                    break;
+                case OpCode::FMA_ADD_OPERAND:
+                    --sp;
+                    stack[sp - 1] = std::fma(stack[sp - 1], stack[sp], *op.operand[0]);
+                    break;
+                case OpCode::FMS_ADD_OPERAND:
+                    --sp;
+                    stack[sp - 1] = std::fma(stack[sp - 1], stack[sp], -*op.operand[0]);
+                    break;
+                case OpCode::COMPARE:
+                    --sp;
+                    stack[sp - 1] = evaluateOperation(stack[sp - 1], stack[sp], op.item);
+                    break;
+                case OpCode::CUSTOM_FUNCTION:
+                    stack[sp - 1] = (*op.fn)(stack[sp - 1]);
+                    break;
+                case OpCode::TABLE:
+                    stack[sp - 1] = op.table->eval(stack[sp - 1]);
+                    break;
+                default:
+                    stack[sp - 1] = functions->unary[static_cast<size_t> (op.item->instr)].scalar(stack[sp - 1]);
+                    break;
+            }
+        }
+
+
+        return stack[0];
+    }
+
+    /**
+     * Copy len values of a column starting from row to dst
+     */
+    static void gatherColumn(const ColumnBinding &col, size_t row, size_t len, double *dst) {
+        if (col.stride == 0 || col.stride == sizeof (double)) {
+            std::memcpy(dst, col.data + row, len * sizeof (double));
+        } else {
+            const char *src = reinterpret_cast<const char*> (col.data) + row * col.stride;
+            for (size_t j = 0; j < len; ++j, src += col.stride) {
+                std::memcpy(dst + j, src, sizeof (double));
+            }
+        }
+    }
+
+    /**
+     * Copy the values of a column at the rows rowIndex[0..len) to dst
+     */
+    static void gatherRows(const ColumnBinding &col, const size_t *rowIndex, size_t len, double *dst) {
+        const size_t stride = col.stride == 0 ? sizeof (double) : col.stride;
+        const char *src = reinterpret_cast<const char*> (col.data);
+        for (size_t j = 0; j < len; ++j) {
+            std::memcpy(dst + j, src + rowIndex[j] * stride, sizeof (double));
+        }
+    }
+
+    /**
+     * Copy len values to a strided output starting from row
+     */
+    static void scatterColumn(const double *src, size_t row, size_t len, double *out, size_t stride) {
+        if (stride == 0 || stride == sizeof (double)) {
+            std::memcpy(out + row, src, len * sizeof (double));
+        } else {
+            char *dst = reinterpret_cast<char*> (out) + row * stride;
+            for (size_t j = 0; j < len; ++j, dst += stride) {
+                std::memcpy(dst, src + j, sizeof (double));
+            }
+        }
+    }
+
+    /**
+     * Bytes of a mapped column released (or flushed) at once
+     */
+    static const size_t MAPPED_RELEASE_BYTES = 8 << 20;
+
+#ifdef VFPU_HAS_MMAP
+
+    /**
+     * Round down to the page size
+     */
+    static size_t pageFloor(size_t offset) {
+        static const size_t page = static_cast<size_t> (::sysconf(_SC_PAGESIZE));
+        return offset / page * page;
+    }
+#endif
+
+    MappedColumn::MappedColumn(const string &path, size_t headerBytes) : mapped(nullptr), mappedSize(0), headerBytes(headerBytes), released(0) {
+#ifdef VFPU_HAS_MMAP
+        //the mapping starts on a page, the values are aligned when the header is
+        if (headerBytes % sizeof (double) != 0) {
+            throw VirtualFPUException("Error:Header of column file " + path + " is not a multiple of sizeof(double)");
+        }
+
+        const int fd = ::open(path.c_str(), O_RDONLY);
+
+        if (fd < 0) {
+            throw VirtualFPUException("Error:Cannot open column file " + path + ": " + std::strerror(errno));
+        }
+
+        struct stat st;
+
+        if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ::close(fd);
+            throw VirtualFPUException("Error:Column " + path + " is not a regular file");
+        }
+
+        mappedSize = static_cast<size_t> (st.st_size);
+
+        if (mappedSize < headerBytes || (mappedSize - headerBytes) % sizeof (double) != 0) {
+            ::close(fd);
+            throw VirtualFPUException("Error:Size of column file " + path + " is not a multiple of sizeof(double)");
+        }
+
+        if (mappedSize > 0) {
+            void *p = ::mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw VirtualFPUException("Error:Cannot map column file " + path + ": " + std::strerror(errno));
+            }
+            mapped = static_cast<const char*> (p);
+            ::madvise(p, mappedSize, MADV_SEQUENTIAL);
+        }
+
+        //the mapping keeps the file open
+        ::close(fd);
+#else
+        throw VirtualFPUException("Error:Memory mapped columns are not supported on this platform");
+#endif
+    }
+
+    MappedColumn::~MappedColumn() {
+#ifdef VFPU_HAS_MMAP
+        if (mapped) {
+            ::munmap(const_cast<char*> (mapped), mappedSize);
+        }
+#endif
+    }
+
+    size_t MappedColumn::size() const noexcept {
+        return (mappedSize - std::min(mappedSize, headerBytes)) / sizeof (double);
+    }
+
+    const double* MappedColumn::data() const noexcept {
+        return mapped ? reinterpret_cast<const double*> (mapped + headerBytes) : nullptr;
+    }
+
+    ColumnBinding MappedColumn::bind(const string &name) const {
+        return ColumnBinding{name, data()};
+    }
+
+    void MappedColumn::willNeed(size_t row, size_t count) const noexcept {
+#ifdef VFPU_HAS_MMAP
+        if (mapped && row < size()) {
+            const size_t from = pageFloor(headerBytes + row * sizeof (double));
+            const size_t to = std::min(mappedSize, headerBytes + (row + count) * sizeof (double));
+            ::madvise(const_cast<char*> (mapped) + from, to - from, MADV_WILLNEED);
+        }
+#endif
+    }
+
+    void MappedColumn::release(size_t row) noexcept {
+#ifdef VFPU_HAS_MMAP
+        const size_t done = pageFloor(std::min(mappedSize, headerBytes + row * sizeof (double)));
+        if (mapped && done - released >= MAPPED_RELEASE_BYTES) {
+            ::madvise(const_cast<char*> (mapped) + released, done - released, MADV_DONTNEED);
+            released = done;
+        }
+#endif
+    }
+
+    MappedColumnSink::MappedColumnSink(const string &path, size_t rows, const string &header) : mapped(nullptr), mappedSize(header.size() + rows * sizeof (double)),
+    headerBytes(header.size()), rows(rows), written(0), released(0) {
+#ifdef VFPU_HAS_MMAP
+        if (headerBytes % sizeof (double) != 0) {
+            throw VirtualFPUException("Error:Header of column file " + path + " is not a multiple of sizeof(double)");
+        }
+
+        const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+        if (fd < 0) {
+            throw VirtualFPUException("Error:Cannot create column file " + path + ": " + std::strerror(errno));
+        }
+
+        if (::ftruncate(fd, static_cast<off_t> (mappedSize)) != 0) {
+            const string reason = std::strerror(errno);
+            ::close(fd);
+            throw VirtualFPUException("Error:Cannot resize column file " + path + ": " + reason);
+        }
+
+        if (mappedSize > 0) {
+            void *p = ::mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw VirtualFPUException("Error:Cannot map column file " + path + ": " + std::strerror(errno));
+            }
+            mapped = static_cast<char*> (p);
+            ::madvise(p, mappedSize, MADV_SEQUENTIAL);
+            std::memcpy(mapped, header.data(), headerBytes);
+        }
+
+        ::close(fd);
+#else
+        throw VirtualFPUException("Error:Memory mapped columns are not supported on this platform");
+#endif
+    }
+
+    MappedColumnSink::~MappedColumnSink() {
+#ifdef VFPU_HAS_MMAP
+        if (mapped) {
+            ::msync(mapped, mappedSize, MS_SYNC);
+            ::munmap(mapped, mappedSize);
+        }
+#endif
+    }
+
+    double* MappedColumnSink::reserve(size_t count) {
+        if (written + count > rows) {
+            throw VirtualFPUException("Error:Column sink is full");
+        }
+        return reinterpret_cast<double*> (mapped + headerBytes) + written;
+    }
+
+    void MappedColumnSink::commit(size_t count) {
+        written += count;
+#ifdef VFPU_HAS_MMAP
+        //write back the pages already filled and drop them from the process
+        const size_t done = pageFloor(headerBytes + written * sizeof (double));
+        if (done - released >= MAPPED_RELEASE_BYTES) {
+            ::msync(mapped + released, done - released, MS_ASYNC);
+            ::madvise(mapped + released, done - released, MADV_DONTNEED);
+            released = done;
+        }
+#endif
+    }
+
+    size_t MappedColumnSink::size() const noexcept {
+        return written;
+    }
+
+    StreamColumnSink::StreamColumnSink(std::ostream &out, std::pmr::memory_resource *resource) : out(out), buffer(resource) {
+    }
+
+    double* StreamColumnSink::reserve(size_t count) {
+        if (buffer.size() < count) {
+            buffer.resize(count);
+        }
+        return buffer.data();
+    }
+
+    void StreamColumnSink::commit(size_t count) {
+        out.write(reinterpret_cast<const char*> (buffer.data()), static_cast<std::streamsize> (count * sizeof (double)));
+        if (!out) {
+            throw VirtualFPUException("Error:Cannot write the column stream");
+        }
+    }
+
+    void RPNCompiler::evaluateBatch(const vector<ColumnBinding> &columns, size_t rows, double *out) {
+        evaluateBatch(columns, rows, out, 0);
+    }
+
+    void RPNCompiler::evaluateBatch(const vector<ColumnBinding> &columns, size_t rows, double *out, size_t outStride) {
+
+        if (!instrVector || instrVector->empty()) {
+            throw VirtualFPUException("Compile an expression before evaluating");
+        }
+
+        const size_t block = BATCH_BLOCK_SIZE;
+
+        try {
+
+            bindColumns(columns);
+
+            batchStack->resize(maxStackDepth * block);
+
+            double *scratch = batchStack->data();
+
+            for (size_t row = 0; row < rows; row += block) {
+
+                const size_t len = std::min(block, rows - row);
+
+                evaluateBlock(row, len, scratch);
+
+                scatterColumn(scratch, row, len, out, outStride);
+            }
+
+        } catch (VirtualFPUException &e) {
+            if (metrics) {
+                metrics->recordBatch(0, true);
+            }
+            stringstream ss;
+            ss << "Error:" << e.getMessage();
+            throw VirtualFPUException(ss.str());
+        }
+
+        if (metrics) {
+            metrics->recordBatch(rows, false);
+        }
+    }
+
+    size_t RPNCompiler::evaluateMapped(const vector<std::pair<string, MappedColumn*>> &columns, ColumnSink &sink, size_t chunkRows) {
+
+        if (columns.empty()) {
+            throw VirtualFPUException("evaluateMapped requires at least a column");
+        }
+
+        const size_t rows = columns.front().second->size();
+
+        vector<ColumnBinding> bindings;
+        for (const auto &col : columns) {
+            if (col.second->size() != rows) {
+                throw VirtualFPUException("Error:Column " + col.first + " has " + std::to_string(col.second->size()) + " rows, expected " + std::to_string(rows));
+            }
+            bindings.push_back(col.second->bind(col.first));
+        }
+
+        chunkRows = std::max(chunkRows, size_t(1));
+
+        for (size_t row = 0; row < rows; row += chunkRows) {
+
+            const size_t len = std::min(chunkRows, rows - row);
+
+            //read ahead the next chunk while evaluating this one
+            for (const auto &col : columns) {
+                col.second->willNeed(row + len, chunkRows);
+            }
+
+            //the bindings are moved to the chunk, the rows are counted from 0
+            for (size_t k = 0; k < columns.size(); ++k) {
+                bindings[k].data = columns[k].second->data() + row;
+            }
+
+            evaluateBatch(bindings, len, sink.reserve(len));
+
+            sink.commit(len);
+
+            for (const auto &col : columns) {
+                col.second->release(row + len);
+            }
+        }
+
+        return rows;
+    }
+
+    void RPNCompiler::bindColumns(const vector<ColumnBinding> &columns) {
+
+        const size_t n = instrVector->size();
+
+        auto &sources = *batchSources;
+
+        sources.assign(n, nullptr);
+
+        //bind the columns once for all the rows
+        for (size_t i = 0; i < n; ++i) {
+            const StackItem *si = (*instrVector)[i];
+            if (si->instr == Instruction::VALUE && !si->defVar.empty()) {
+                for (const auto &col : columns) {
+                    if (std::string_view(col.name) == std::string_view(si->defVar)) {
+                        sources[i] = &col;
+                        break;
+                    }
+                }
+            }
+        }
+
+        //the variables not bound to a column must be defined
+        if (!programResolved || unresolvedOperands > 0) {
+            resolveProgram();
+            if (unresolvedOperands > 0) {
+                reportUnresolved(&sources);
+            }
+        }
+
+        if (!loops->all.empty()) {
+            vector<std::string_view> names;
+            for (const auto &col : columns) {
+                names.push_back(col.name);
+            }
+            evaluateLoopsForRows(names);
+        }
+    }
+
+    void RPNCompiler::evaluateBlock(size_t row, size_t len, double *base, const size_t *rowIndex) {
+
+        const size_t block = BATCH_BLOCK_SIZE;
+        const auto &sources = *batchSources;
+
+        //right operand of the *_OPERAND and *_OPERANDS operations
+        double operand[BATCH_BLOCK_SIZE];
+
+        auto load = [&](const Op &op, int k, double *dst) {
+            const ColumnBinding *col = sources[op.source[k]];
+            if (col && rowIndex) {
+                gatherRows(*col, rowIndex, len, dst);
+            } else if (col) {
+                gatherColumn(*col, row, len, dst);
+            } else {
+                std::fill(dst, dst + len, *op.operand[k]);
+            }
+        };
+
+        //rows in the range of the surrogate, the program runs only for blocks with rows out of the range
+        double argument[BATCH_BLOCK_SIZE];
+        size_t inside = 0;
+
+        if (surrogate->active()) {
+            const ColumnBinding *col = sources[surrogate->source];
+            if (col && rowIndex) {
+                gatherRows(*col, rowIndex, len, argument);
+            } else if (col) {
+                gatherColumn(*col, row, len, argument);
+            } else {
+                std::fill(argument, argument + len, *surrogate->variable);
+            }
+            for (size_t j = 0; j < len; ++j) {
+                inside += argument[j] >= surrogate->lo && argument[j] <= surrogate->hi;
+            }
+            if (inside == len) {
+                std::copy(argument, argument + len, base);
+                surrogate->evalBlock(base, len);
+                return;
+            }
+        }
+
+        size_t sp = 0;
+
+        for (const Op &op : *program) {
+
+            switch (op.code) {
+                case OpCode::PUSH:
+                    load(op, 0, base + sp * block);
+                    ++sp;
+                    break;
+                case OpCode::ADD_OPERAND:
+                case OpCode::SUB_OPERAND:
+                case OpCode::MUL_OPERAND:
+                case OpCode::DIV_OPERAND:
+                case OpCode::POW_OPERAND:
+                    load(op, 0, operand);
+                    applyBinaryBlock(op.item->instr, base + (sp - 1) * block, operand, len);
+                    break;
+                case OpCode::ADD_OPERANDS:
+                case OpCode::SUB_OPERANDS:
+                case OpCode::MUL_OPERANDS:
+                case OpCode::DIV_OPERANDS:
+                case OpCode::POW_OPERANDS:
+                    //the left operand is loaded into the free stack slot
+                    load(op, 0, base + sp * block);
+                    load(op, 1, operand);
+                    applyBinaryBlock(op.item->instr, base + sp * block, operand, len);
+                    ++sp;
+                    break;
+                case OpCode::FMA:
+                case OpCode::FNMA:
+                {
+                    sp -= 2;
+                    double *c = base + (sp - 1) * block;
+                    const double *a = base + sp * block;
+                    const double *b = base + (sp + 1) * block;
+                    if (op.code == OpCode::FMA) {
+                        for (size_t j = 0; j < len; ++j) c[j] = std::fma(a[j], b[j], c[j]);
+                    } else {
+                        for (size_t j = 0; j < len; ++j) c[j] = std::fma(-a[j], b[j], c[j]);
+                    }
+                }
+                    break;
+                case OpCode::FMA_MUL_OPERAND:
+                case OpCode::FNMA_MUL_OPERAND:
+                {
+                    load(op, 0, operand);
+                    --sp;
+                    double *c = base + (sp - 1) * block;
+                    const double *a = base + sp * block;
+                    if (op.code == OpCode::FMA_MUL_OPERAND) {
+                        for (size_t j = 0; j < len; ++j) c[j] = std::fma(a[j], operand[j], c[j]);
+                    } else {
+                        for (size_t j = 0; j < len; ++j) c[j] = std::fma(-a[j], operand[j], c[j]);
+                    }
+                }
+                    break;
+                case OpCode::FMA_MUL_OPERANDS:
+                case OpCode::FNMA_MUL_OPERANDS:
+                {
+                    double *c = base + (sp - 1) * block;
+                    double *a = base + sp * block;
+                    load(op, 0, a);
+                    load(op, 1, operand);
+                    if (op.code == OpCode::FMA_MUL_OPERANDS) {
+                        for (size_t j = 0; j < len; ++j) c[j] = std::fma(a[j], operand[j], c[j]);
+                    } else {
+                        for (size_t j = 0; j < len; ++j) c[j] = std::fma(-a[j], operand[j], c[j]);
+                    }
+                }
+                    break;
+                case OpCode::FMA_OPERANDS:
+                case OpCode::FMS_OPERANDS:
+                {
+                    double *a = base + (sp - 1) * block;
+                    double *b = base + sp * block;
+                    load(op, 0, b);
+                    load(op, 1, operand);
+                    if (op.code == OpCode::FMA_OPERANDS) {
+                        for (size_t j = 0; j < len; ++j) a[j] = std::fma(a[j], b[j], operand[j]);
+                    } else {
+                        for (size_t j = 0; j < len; ++j) a[j] = std::fma(a[j], b[j], -operand[j]);
+                    }
+                }
+                    break;
+                case OpCode::FMA_ADD_OPERAND:
+                case OpCode::FMS_ADD_OPERAND:
+                {
+                    load(op, 0, operand);
+                    --sp;
+                    double *a = base + (sp - 1) * block;
+                    const double *b = base + sp * block;
+                    if (op.code == OpCode::FMA_ADD_OPERAND) {
+                        for (size_t j = 0; j < len; ++j) a[j] = std::fma(a[j], b[j], operand[j]);
+                    } else {
+                        for (size_t j = 0; j < len; ++j) a[j] = std::fma(a[j], b[j], -operand[j]);
+                    }
+                }
+                    break;
+                case OpCode::TABLE:
+                    op.table->evalBlock(base + (sp - 1) * block, len);
+                    break;
+                default:
+                    applyBlock(op.item, base, sp, len);
+                    break;
+            }
+        }
+
+        for (size_t j = 0; j < len && inside > 0; ++j) {
+            if (argument[j] >= surrogate->lo && argument[j] <= surrogate->hi) {
+                base[j] = surrogate->eval(argument[j]);
+            }
+        }
+    }
+
+    void RPNCompiler::applyBinaryBlock(Instruction instr, double *a, const double *b, size_t len) {
+
+        switch (instr) {
+            case Instruction::ADD:
+                for (size_t j = 0; j < len; ++j) a[j] = a[j] + b[j];
+                break;
+            case Instruction::SUB:
+                for (size_t j = 0; j < len; ++j) a[j] = a[j] - b[j];
+                break;
+            case Instruction::MUL:
+                for (size_t j = 0; j < len; ++j) a[j] = a[j] * b[j];
+                break;
+            case Instruction::DIV:
+                for (size_t j = 0; j < len; ++j) a[j] = a[j] / b[j];
+                break;
+            case Instruction::POW:
+                functions->powBlock(a, b, len);
+                break;
+            case Instruction::LT:
+                for (size_t j = 0; j < len; ++j) a[j] = a[j] < b[j] ? 1.0 : 0.0;
+                break;
+            case Instruction::GT:
+                for (size_t j = 0; j < len; ++j) a[j] = a[j] > b[j] ? 1.0 : 0.0;
+                break;
+            case Instruction::LE:
+                for (size_t j = 0; j < len; ++j) a[j] = a[j] <= b[j] ? 1.0 : 0.0;
+                break;
+            case Instruction::GE:
+                for (size_t j = 0; j < len; ++j) a[j] = a[j] >= b[j] ? 1.0 : 0.0;
+                break;
+            case Instruction::EQ:
+                for (size_t j = 0; j < len; ++j) a[j] = a[j] == b[j] ? 1.0 : 0.0;
+                break;
+            default:
+                for (size_t j = 0; j < len; ++j) a[j] = a[j] != b[j] ? 1.0 : 0.0;
+                break;
+        }
+    }
+
+    void RPNCompiler::applyBlock(const StackItem *si, double *base, size_t &sp, size_t len) {
+
+        const size_t block = BATCH_BLOCK_SIZE;
+
+        switch (si->instr) {
+            case Instruction::ADD:
+            case Instruction::SUB:
+            case Instruction::MUL:
+            case Instruction::DIV:
+            case Instruction::POW:
+            case Instruction::LT:
+            case Instruction::GT:
+            case Instruction::LE:
+            case Instruction::GE:
+            case Instruction::EQ:
+            case Instruction::NE:
+                --sp;
+                applyBinaryBlock(si->instr, base + (sp - 1) * block, base + sp * block, len);
+                break;
+            case Instruction::DEF_FUNCTION:
+            {
+                const auto table = tables->find(std::string_view(si->defVar));
+                if (table != tables->end()) {
+                    table->second->evalBlock(base + (sp - 1) * block, len);
+                    break;
+                }
+                const auto fn = defFunctions->find(std::string_view(si->defVar));
+                if (fn == defFunctions->end() || !fn->second) {
+                    throwError("Cannot find custom function "s + string(si->defVar));
+                }
+                double *a = base + (sp - 1) * block;
+                for (size_t j = 0; j < len; ++j) a[j] = fn->second(a[j]);
+            }
+                break;
+            default:
+            {
+                functions->unary[static_cast<size_t> (si->instr)].block(base + (sp - 1) * block, len);
+            }
+                break;
+        }
+    }
+
+    /**
+     * A predicate selects a row when its value is not zero and not NaN
+     */
+    static inline bool isSelected(double v) {
+        return (v != 0.0) & (v == v);
+    }
+
+    size_t RPNCompiler::select(const vector<ColumnBinding> &columns, size_t rows, vector<size_t> &selection) {
+
+        if (!instrVector || instrVector->empty()) {
+            throw VirtualFPUException("Compile an expression before evaluating");
+        }
+
+        const size_t block = BATCH_BLOCK_SIZE;
+
+        selection.clear();
+
+        try {
+
+            bindColumns(columns);
+
+            batchStack->resize(maxStackDepth * block);
+
+            double *scratch = batchStack->data();
+
+            size_t selected[BATCH_BLOCK_SIZE];
+
+            for (size_t row = 0; row < rows; row += block) {
+
+                const size_t len = std::min(block, rows - row);
+
+                evaluateBlock(row, len, scratch);
+
+                //branch free compaction: only the selected indices are appended to the selection
+                size_t k = 0;
+                for (size_t j = 0; j < len; ++j) {
+                    selected[k] = row + j;
+                    k += isSelected(scratch[j]);
+                }
+
+                selection.insert(selection.end(), selected, selected + k);
+            }
+
+        } catch (VirtualFPUException &e) {
+            stringstream ss;
+            ss << "Error:" << e.getMessage();
+            throw VirtualFPUException(ss.str());
+        }
+
+        return selection.size();
+    }
+
+    size_t RPNCompiler::selectBitmap(const vector<ColumnBinding> &columns, size_t rows, vector<uint64_t> &bitmap) {
+
+        if (!instrVector || instrVector->empty()) {
+            throw VirtualFPUException("Compile an expression before evaluating");
+        }
+
+        const size_t block = BATCH_BLOCK_SIZE;
+
+        static_assert(BATCH_BLOCK_SIZE % 64 == 0, "the batch block must contain whole bitmap words");
+
+        bitmap.assign((rows + 63) / 64, 0);
+
+        size_t count = 0;
+
+        try {
+
+            bindColumns(columns);
+
+            batchStack->resize(maxStackDepth * block);
+
+            double *scratch = batchStack->data();
+
+            for (size_t row = 0; row < rows; row += block) {
+
+                const size_t len = std::min(block, rows - row);
+
+                evaluateBlock(row, len, scratch);
+
+                for (size_t w = 0; w * 64 < len; ++w) {
+                    uint64_t word = 0;
+                    const size_t bits = std::min<size_t>(64, len - w * 64);
+                    for (size_t b = 0; b < bits; ++b) {
+                        word |= static_cast<uint64_t> (isSelected(scratch[w * 64 + b])) << b;
+                    }
+                    bitmap[row / 64 + w] = word;
+                    count += std::popcount(word);
+                }
+            }
+
+        } catch (VirtualFPUException &e) {
+            stringstream ss;
+            ss << "Error:" << e.getMessage();
+            throw VirtualFPUException(ss.str());
+        }
+
+        return count;
+    }
+
+    void RPNCompiler::evaluateSelected(const vector<ColumnBinding> &columns, const vector<size_t> &selection, double *out) {
+
+        if (!instrVector || instrVector->empty()) {
+            throw VirtualFPUException("Compile an expression before evaluating");
+        }
+
+        const size_t block = BATCH_BLOCK_SIZE;
+        const size_t rows = selection.size();
+
+        try {
+
+            bindColumns(columns);
+
+            batchStack->resize(maxStackDepth * block);
+
+            double *scratch = batchStack->data();
+
+            for (size_t k = 0; k < rows; k += block) {
+
+                const size_t len = std::min(block, rows - k);
+
+                evaluateBlock(0, len, scratch, selection.data() + k);
+
+                std::memcpy(out + k, scratch, len * sizeof (double));
+            }
+
+        } catch (VirtualFPUException &e) {
+            stringstream ss;
+            ss << "Error:" << e.getMessage();
+            throw VirtualFPUException(ss.str());
+        }
+    }
+
+    /**
+     * Partial result of a reduction over a segment of rows
+     */
+    struct ReductionPartial {
+        double value;
+        size_t count;
+        size_t nanCount;
+        size_t infCount;
+    };
+
+    static ReductionPartial emptyPartial(Reduction op) {
+        switch (op) {
+            case Reduction::MIN:
+                return {std::numeric_limits<double>::infinity(), 0, 0, 0};
+            case Reduction::MAX:
+                return {-std::numeric_limits<double>::infinity(), 0, 0, 0};
+            default:
+                return {0.0, 0, 0, 0};
+        }
+    }
+
+    static ReductionPartial combinePartials(Reduction op, const ReductionPartial &a, const ReductionPartial &b) {
+        ReductionPartial r{0.0, a.count + b.count, a.nanCount + b.nanCount, a.infCount + b.infCount};
+        switch (op) {
+            case Reduction::MIN:
+                r.value = std::min(a.value, b.value);
+                break;
+            case Reduction::MAX:
+                r.value = std::max(a.value, b.value);
+                break;
+            default:
+                r.value = a.value + b.value;
+                break;
+        }
+        return r;
+    }
+
+    /**
+     * Fold a block of values, NaN values are counted and skipped
+     */
+    static void foldBlock(Reduction op, const double *v, size_t len, ReductionPartial &p) {
+
+        //four independent accumulators: the fold order depends only on the block
+        double acc[4];
+        const ReductionPartial e = emptyPartial(op);
+        acc[0] = acc[1] = acc[2] = acc[3] = e.value;
+        size_t nan = 0;
+        size_t inf = 0;
+
+        for (size_t j = 0; j < len; ++j) {
+            const double x = v[j];
+            if (std::isnan(x)) {
+                ++nan;
+                continue;
+            }
+            if (std::isinf(x)) {
+                ++inf;
+            }
+            double &a = acc[j & 3];
+            switch (op) {
+                case Reduction::MIN:
+                    a = x < a ? x : a;
+                    break;
+                case Reduction::MAX:
+                    a = x > a ? x : a;
+                    break;
+                default:
+                    a += x;
+                    break;
+            }
+        }
+
+        ReductionPartial b{0.0, len - nan, nan, inf};
+        ReductionPartial l{acc[0], 0, 0, 0}, r{acc[2], 0, 0, 0};
+        l = combinePartials(op, l, {acc[1], 0, 0, 0});
+        r = combinePartials(op, r, {acc[3], 0, 0, 0});
+        b.value = combinePartials(op, l, r).value;
+
+        p = combinePartials(op, p, b);
+    }
+
+    /**
+     * Run worker(0..threads-1) on separate threads (on the calling thread if threads is 1),
+     * the first exception thrown by a worker is rethrown after all the workers completed
+     */
+    static void runWorkers(unsigned threads, const std::function<void(unsigned) > &worker) {
+
+        if (threads <= 1) {
+            worker(0);
+            return;
+        }
+
+        vector<std::thread> pool;
+        vector<std::exception_ptr> errors(threads);
+
+        for (unsigned t = 0; t < threads; ++t) {
+            pool.emplace_back([&, t]() {
+                try {
+                    worker(t);
+                } catch (...) {
+                    errors[t] = std::current_exception();
+                }
+            });
+        }
+
+        for (auto &th : pool) {
+            th.join();
+        }
+
+        for (auto &e : errors) {
+            if (e) {
+                std::rethrow_exception(e);
+            }
+        }
+    }
+
+    BulkCompilation RPNCompiler::compileAll(std::span<const string> statements, unsigned threads) const {
+
+        const size_t n = statements.size();
+
+        //the statements are taken in small slices so that slow statements do not leave the other threads idle
+        const size_t slice = 64;
+
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        threads = static_cast<unsigned> (std::min<size_t>(threads, std::max<size_t>((n + slice - 1) / slice, 1)));
+
+        BulkCompilation result{vector<std::unique_ptr<RPNCompiler>>(n), vector<Diagnostic>(n), 0};
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> failed{0};
+
+        runWorkers(threads, [&](unsigned) {
+            for (size_t first = next.fetch_add(slice); first < n; first = next.fetch_add(slice)) {
+                for (size_t i = first; i < std::min(n, first + slice); ++i) {
+                    auto compiler = std::make_unique<RPNCompiler>(stackSize);
+                    compiler->copyDefinitions(*this);
+                    compiler->setMetrics(metrics);
+                    if (compiler->compileStatement(statements[i], result.errors[i])) {
+                        result.compilers[i] = std::move(compiler);
+                    } else {
+                        failed.fetch_add(1, std::memory_order_relaxed);
+                    }
+                }
+            }
+        });
+
+        result.failed = failed.load();
+
+        return result;
+    }
+
+    void RPNCompiler::copyDefinitions(const RPNCompiler &other) {
+        for (const auto &var : *other.defVars) {
+            defVars->emplace(var.first, var.second);
+        }
+        for (const auto &fn : *other.defFunctions) {
+            defFunctions->emplace(fn.first, fn.second);
+        }
+        for (const auto &cache : *other.memoCaches) {
+            memoCaches->emplace(cache.first, cache.second);
+        }
+        for (const auto &table : *other.tables) {
+            tables->emplace(table.first, table.second);
+        }
+        //nothing is compiled yet, the settings apply to the next compile
+        accuracy = other.accuracy;
+        functions = other.functions;
+        fusedMultiplyAdd = other.fusedMultiplyAdd;
+        backend = other.backend;
+    }
+
+    ReductionResult RPNCompiler::reduce(Reduction op, const vector<ColumnBinding> &columns, size_t rows, unsigned threads) {
+
+        if (!instrVector || instrVector->empty()) {
+            throw VirtualFPUException("Compile an expression before evaluating");
+        }
+
+        const size_t block = BATCH_BLOCK_SIZE;
+        const size_t segmentSize = REDUCTION_SEGMENT_SIZE;
+        const size_t segments = (rows + segmentSize - 1) / segmentSize;
+
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        threads = static_cast<unsigned> (std::min<size_t>(threads, std::max<size_t>(segments, 1)));
+
+        std::pmr::vector<ReductionPartial> partials(segments, emptyPartial(op), allocator);
+
+        try {
+
+            bindColumns(columns);
+
+            //each worker has its own evaluation stack
+            std::pmr::vector<std::pmr::vector<double>> scratch(allocator);
+            for (unsigned t = 0; t < threads; ++t) {
+                scratch.emplace_back(maxStackDepth * block);
+            }
+
+            auto worker = [&](unsigned t) {
+                double *base = scratch[t].data();
+                for (size_t s = t; s < segments; s += threads) {
+                    const size_t end = std::min(rows, (s + 1) * segmentSize);
+                    for (size_t row = s * segmentSize; row < end; row += block) {
+                        const size_t len = std::min(block, end - row);
+                        evaluateBlock(row, len, base);
+                        foldBlock(op, base, len, partials[s]);
+                    }
+                }
+            };
+
+            runWorkers(threads, worker);
+
+        } catch (VirtualFPUException &e) {
+            stringstream ss;
+            ss << "Error:" << e.getMessage();
+            throw VirtualFPUException(ss.str());
+        }
+
+        //pairwise combine in segment order: the result does not depend on the number of threads
+        for (size_t width = 1; width < segments; width *= 2) {
+            for (size_t i = 0; i + width < segments; i += 2 * width) {
+                partials[i] = combinePartials(op, partials[i], partials[i + width]);
+            }
+        }
+
+        const ReductionPartial total = segments ? partials[0] : emptyPartial(op);
+
+        ReductionResult result{total.value, total.count, total.nanCount, total.infCount};
+
+        if (total.count == 0) {
+            result.value = std::numeric_limits<double>::quiet_NaN();
+        } else if (op == Reduction::MEAN) {
+            result.value = total.value / total.count;
+        }
+
+        return result;
+    }
+
+    ////////////////////// Monte Carlo //////////////////////////////////////////////
+
+    QuantileSketch::QuantileSketch(double accuracy) : accuracy(accuracy), gamma((1 + accuracy) / (1 - accuracy)), logGamma(std::log(gamma)), zeros(0), total(0),
+    min(std::numeric_limits<double>::infinity()), max(-std::numeric_limits<double>::infinity()) {
+        if (!(accuracy > 0 && accuracy < 1)) {
+            throw VirtualFPUException("Error:The accuracy of a quantile sketch must be in (0,1)");
+        }
+    }
+
+    void QuantileSketch::Buckets::add(int index, uint64_t n) {
+        if (counts.empty()) {
+            offset = index;
+        }
+        if (index < offset) {
+            counts.insert(counts.begin(), static_cast<size_t> (offset - index), 0);
+            offset = index;
+        }
+        if (static_cast<size_t> (index - offset) >= counts.size()) {
+            counts.resize(static_cast<size_t> (index - offset) + 1, 0);
+        }
+        counts[static_cast<size_t> (index - offset)] += n;
+    }
+
+    int QuantileSketch::bucketOf(double magnitude) const {
+        return static_cast<int> (std::ceil(std::log(magnitude) / logGamma));
+    }
+
+    double QuantileSketch::valueOf(int bucket) const {
+        //middle of the bucket (gamma^(k-1), gamma^k] in relative terms
+        return 2 * std::pow(gamma, bucket) / (gamma + 1);
+    }
+
+    void QuantileSketch::add(double value) {
+        if (!std::isfinite(value)) {
+            return;
+        }
+        if (value > 0) {
+            positive.add(bucketOf(value), 1);
+        } else if (value < 0) {
+            negative.add(bucketOf(-value), 1);
+        } else {
+            ++zeros;
+        }
+        ++total;
+        min = std::min(min, value);
+        max = std::max(max, value);
+    }
+
+    void QuantileSketch::merge(const QuantileSketch &other) {
+        if (other.accuracy != accuracy) {
+            throw VirtualFPUException("Error:Cannot merge quantile sketches with different accuracy");
+        }
+        for (size_t i = 0; i < other.positive.counts.size(); ++i) {
+            if (other.positive.counts[i]) {
+                positive.add(other.positive.offset + static_cast<int> (i), other.positive.counts[i]);
+            }
+        }
+        for (size_t i = 0; i < other.negative.counts.size(); ++i) {
+            if (other.negative.counts[i]) {
+                negative.add(other.negative.offset + static_cast<int> (i), other.negative.counts[i]);
+            }
+        }
+        zeros += other.zeros;
+        total += other.total;
+        min = std::min(min, other.min);
+        max = std::max(max, other.max);
+    }
+
+    double QuantileSketch::quantile(double q) const {
+
+        if (total == 0) {
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+
+        if (q <= 0) {
+            return min;
+        }
+
+        if (q >= 1) {
+            return max;
+        }
+
+        //the values are visited in ascending order: negative from the largest magnitude, zeros, positive
+        const double rank = q * static_cast<double> (total - 1);
+        double seen = 0;
+        double value = max;
+
+        for (size_t i = negative.counts.size(); i-- > 0;) {
+            seen += static_cast<double> (negative.counts[i]);
+            if (seen > rank) {
+                value = -valueOf(negative.offset + static_cast<int> (i));
+                return std::clamp(value, min, max);
+            }
+        }
+
+        seen += static_cast<double> (zeros);
+        if (seen > rank) {
+            return 0.0;
+        }
+
+        for (size_t i = 0; i < positive.counts.size(); ++i) {
+            seen += static_cast<double> (positive.counts[i]);
+            if (seen > rank) {
+                value = valueOf(positive.offset + static_cast<int> (i));
+                break;
+            }
+        }
+
+        return std::clamp(value, min, max);
+    }
+
+    size_t QuantileSketch::count() const noexcept {
+        return total;
+    }
+
+    double QuantileSketch::getAccuracy() const noexcept {
+        return accuracy;
+    }
+
+    /**
+     * Philox4x32-10 counter based generator: 128 random bits for a counter and a key
+     */
+    static void philox(uint32_t (&counter)[4], uint64_t seed) {
+        uint32_t k0 = static_cast<uint32_t> (seed);
+        uint32_t k1 = static_cast<uint32_t> (seed >> 32);
+        for (int round = 0; round < 10; ++round) {
+            const uint64_t p0 = uint64_t(0xD2511F53) * counter[0];
+            const uint64_t p1 = uint64_t(0xCD9E8D57) * counter[2];
+            const uint32_t c1 = counter[1];
+            const uint32_t c3 = counter[3];
+            counter[0] = static_cast<uint32_t> (p1 >> 32) ^ c1 ^ k0;
+            counter[1] = static_cast<uint32_t> (p1);
+            counter[2] = static_cast<uint32_t> (p0 >> 32) ^ c3 ^ k1;
+            counter[3] = static_cast<uint32_t> (p0);
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+    }
+
+    /**
+     * Uniform in (0,1) from 64 random bits
+     */
+    static double openUnit(uint32_t lo, uint32_t hi) {
+        return (static_cast<double> (((uint64_t(hi) << 32) | lo) >> 11) + 0.5) * 0x1p-53;
+    }
+
+    /**
+     * Draw the samples first..first+len-1 (first is even) of a random variable, a counter gives two samples
+     */
+    static void drawSamples(const RandomVariable &var, uint32_t stream, uint64_t seed, size_t first, size_t len, double *out) {
+
+        const double pi2 = 6.283185307179586476925286766559;
+
+        for (size_t j = 0; j < len; j += 2) {
+            const uint64_t pair = (first + j) / 2;
+            uint32_t counter[4] = {static_cast<uint32_t> (pair), static_cast<uint32_t> (pair >> 32), stream, 0};
+            philox(counter, seed);
+            const double u0 = openUnit(counter[0], counter[1]);
+            const double u1 = openUnit(counter[2], counter[3]);
+
+            double x0;
+            double x1;
+
+            if (var.distribution == Distribution::UNIFORM) {
+                x0 = var.a + (var.b - var.a) * u0;
+                x1 = var.a + (var.b - var.a) * u1;
+            } else {
+                //Box-Muller: two independent normals
+                const double r = std::sqrt(-2 * std::log(u0));
+                x0 = var.a + var.b * r * std::cos(pi2 * u1);
+                x1 = var.a + var.b * r * std::sin(pi2 * u1);
+                if (var.distribution == Distribution::LOGNORMAL) {
+                    x0 = std::exp(x0);
+                    x1 = std::exp(x1);
+                }
+            }
+
+            out[j] = x0;
+            if (j + 1 < len) {
+                out[j + 1] = x1;
+            }
+        }
+    }
+
+    /**
+     * Moments of the finite results of a segment of samples
+     */
+    struct MonteCarloPartial {
+        size_t count;
+        size_t nanCount;
+        size_t infCount;
+        double mean;
+        /**
+         * sum of the squared differences from the mean
+         */
+        double m2;
+        double min;
+        double max;
+    };
+
+    static MonteCarloPartial emptyMonteCarloPartial() {
+        return {0, 0, 0, 0.0, 0.0, std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity()};
+    }
+
+    static MonteCarloPartial combineMonteCarloPartials(const MonteCarloPartial &a, const MonteCarloPartial &b) {
+        MonteCarloPartial r{a.count + b.count, a.nanCount + b.nanCount, a.infCount + b.infCount, 0.0, 0.0, std::min(a.min, b.min), std::max(a.max, b.max)};
+        if (r.count == 0) {
+            return r;
+        }
+        //parallel update of the mean and of the squared differences
+        const double na = static_cast<double> (a.count);
+        const double nb = static_cast<double> (b.count);
+        const double delta = b.mean - a.mean;
+        r.mean = a.mean + delta * nb / (na + nb);
+        r.m2 = a.m2 + b.m2 + delta * delta * na * nb / (na + nb);
+        return r;
+    }
+
+    MonteCarloResult RPNCompiler::monteCarlo(const vector<RandomVariable> &variables, size_t samples, uint64_t seed, unsigned threads, double quantileAccuracy) {
+
+        if (!instrVector || instrVector->empty()) {
+            throw VirtualFPUException("Compile an expression before evaluating");
+        }
+
+        for (const RandomVariable &var : variables) {
+            const bool valid = std::isfinite(var.a) && std::isfinite(var.b) && (var.distribution == Distribution::UNIFORM ? var.a <= var.b : var.b >= 0);
+            if (!valid) {
+                throw VirtualFPUException("Error:Invalid parameters of the random variable " + var.name);
+            }
+        }
+
+        const size_t block = BATCH_BLOCK_SIZE;
+        const size_t segmentSize = REDUCTION_SEGMENT_SIZE;
+        const size_t segments = (samples + segmentSize - 1) / segmentSize;
+        const size_t n = variables.size();
+
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        threads = static_cast<unsigned> (std::min<size_t>(threads, std::max<size_t>(segments, 1)));
+
+        std::pmr::vector<MonteCarloPartial> partials(segments, emptyMonteCarloPartial(), allocator);
+        vector<QuantileSketch> sketches(threads, QuantileSketch(quantileAccuracy));
+
+        //the random columns: thread t draws its block into the rows t*block..t*block+block-1
+        std::pmr::vector<double> draws(n * threads * block, allocator);
+        vector<ColumnBinding> columns;
+        for (size_t v = 0; v < n; ++v) {
+            columns.push_back({variables[v].name, draws.data() + v * threads * block});
+        }
+
+        try {
+
+            bindColumns(columns);
+
+            //each worker has its own evaluation stack
+            std::pmr::vector<std::pmr::vector<double>> scratch(allocator);
+            for (unsigned t = 0; t < threads; ++t) {
+                scratch.emplace_back(maxStackDepth * block);
+            }
+
+            auto worker = [&](unsigned t) {
+                double *base = scratch[t].data();
+                QuantileSketch &sketch = sketches[t];
+                for (size_t s = t; s < segments; s += threads) {
+                    MonteCarloPartial &partial = partials[s];
+                    const size_t end = std::min(samples, (s + 1) * segmentSize);
+                    for (size_t first = s * segmentSize; first < end; first += block) {
+                        const size_t len = std::min(block, end - first);
+                        for (size_t v = 0; v < n; ++v) {
+                            drawSamples(variables[v], static_cast<uint32_t> (v), seed, first, len, draws.data() + (v * threads + t) * block);
+                        }
+                        evaluateBlock(t * block, len, base);
+
+                        MonteCarloPartial blockPartial = emptyMonteCarloPartial();
+                        double sum = 0;
+                        for (size_t j = 0; j < len; ++j) {
+                            const double x = base[j];
+                            if (std::isnan(x)) {
+                                ++blockPartial.nanCount;
+                            } else if (std::isinf(x)) {
+                                ++blockPartial.infCount;
+                            } else {
+                                ++blockPartial.count;
+                                sum += x;
+                                blockPartial.min = std::min(blockPartial.min, x);
+                                blockPartial.max = std::max(blockPartial.max, x);
+                                sketch.add(x);
+                            }
+                        }
+                        if (blockPartial.count > 0) {
+                            blockPartial.mean = sum / static_cast<double> (blockPartial.count);
+                            for (size_t j = 0; j < len; ++j) {
+                                if (std::isfinite(base[j])) {
+                                    blockPartial.m2 += (base[j] - blockPartial.mean) * (base[j] - blockPartial.mean);
+                                }
+                            }
+                        }
+                        partial = combineMonteCarloPartials(partial, blockPartial);
+                    }
+                }
+            };
+
+            runWorkers(threads, worker);
+
+        } catch (VirtualFPUException &e) {
+            stringstream ss;
+            ss << "Error:" << e.getMessage();
+            throw VirtualFPUException(ss.str());
+        }
+
+        //pairwise combine in segment order: the result does not depend on the number of threads
+        for (size_t width = 1; width < segments; width *= 2) {
+            for (size_t i = 0; i + width < segments; i += 2 * width) {
+                partials[i] = combineMonteCarloPartials(partials[i], partials[i + width]);
+            }
+        }
+
+        const MonteCarloPartial total = segments ? partials[0] : emptyMonteCarloPartial();
+
+        MonteCarloResult result{total.count, total.nanCount, total.infCount, total.mean, 0.0, 0.0, total.min, total.max, QuantileSketch(quantileAccuracy)};
+
+        for (const QuantileSketch &sketch : sketches) {
+            result.quantiles.merge(sketch);
+        }
+
+        if (total.count == 0) {
+            result.mean = result.min = result.max = std::numeric_limits<double>::quiet_NaN();
+        }
+
+        result.variance = total.count > 1 ? total.m2 / static_cast<double> (total.count - 1) : std::numeric_limits<double>::quiet_NaN();
+        result.standardError = std::sqrt(result.variance / static_cast<double> (total.count));
+
+        return result;
+    }
+
+    /**
+     * Operation of a grid sampling program: the subexpressions depending only on the x axis are replaced by
+     * vectors computed once for the whole grid, the ones not depending on x by scalars computed once for each row
+     */
+    struct RPNCompiler::GridOp {
+
+        enum Kind {
+            CONSTANT, SCALAR, VECTOR, APPLY
+        };
+
+        Kind kind;
+        /**
+         * APPLY: operation applied to the stack
+         */
+        const StackItem *item;
+        /**
+         * CONSTANT: value
+         */
+        double value;
+        /**
+         * SCALAR: index of the row scalar (0 y, 1 z, 2.. row invariant subexpressions)
+         * VECTOR: index of the x vector (0 x axis, 1.. x only subexpressions)
+         */
+        size_t index;
+    };
+
+    static double axisValue(const GridAxis &axis, size_t i) {
+        return axis.count < 2 ? axis.min : axis.min + (axis.max - axis.min) * static_cast<double> (i) / static_cast<double> (axis.count - 1);
+    }
+
+    void RPNCompiler::runGridOps(const GridOp *ops, size_t count, const double * const *vectors, const double *scalars, size_t offset, size_t len, double *base) {
+
+        const size_t block = BATCH_BLOCK_SIZE;
+        size_t sp = 0;
+
+        for (size_t i = 0; i < count; ++i) {
+            const GridOp &op = ops[i];
+            double *dst = base + sp * block;
+            switch (op.kind) {
+                case GridOp::CONSTANT:
+                    std::fill(dst, dst + len, op.value);
+                    ++sp;
+                    break;
+                case GridOp::SCALAR:
+                    std::fill(dst, dst + len, scalars[op.index]);
+                    ++sp;
+                    break;
+                case GridOp::VECTOR:
+                    std::memcpy(dst, vectors[op.index] + offset, len * sizeof (double));
+                    ++sp;
+                    break;
+                default:
+                    applyBlock(op.item, base, sp, len);
+                    break;
+            }
+        }
+    }
+
+    void RPNCompiler::sampleGrid(const GridAxis &x, const GridAxis &y, double *out, unsigned threads) {
+        const GridAxis axes[2] = {x, y};
+        sampleGrid(axes, 2, out, threads);
+    }
+
+    void RPNCompiler::sampleGrid(const GridAxis &x, const GridAxis &y, const GridAxis &z, double *out, unsigned threads) {
+        const GridAxis axes[3] = {x, y, z};
+        sampleGrid(axes, 3, out, threads);
+    }
+
+    void RPNCompiler::sampleGrid(const GridAxis *axes, size_t dims, double *out, unsigned threads) {
+
+        if (!instrVector || instrVector->empty()) {
+            throw VirtualFPUException("Compile an expression before evaluating");
+        }
+
+        const size_t block = BATCH_BLOCK_SIZE;
+        const size_t n = instrVector->size();
+        const size_t nx = axes[0].count;
+        const size_t ny = axes[1].count;
+        const size_t nz = dims > 2 ? axes[2].count : 1;
+        const size_t rows = ny * nz;
+
+        if (nx == 0 || rows == 0) {
+            return;
+        }
+
+        try {
+
+            if (!loops->all.empty()) {
+                vector<std::string_view> names;
+                for (size_t d = 0; d < dims; ++d) {
+                    names.push_back(axes[d].var);
+                }
+                evaluateLoopsForRows(names);
+            }
+
+            //dependency of each subexpression on the axes (bit 0 x, bit 1 y, bit 2 z) and first instruction of its subtree
+            std::pmr::vector<unsigned> mask(n, 0, allocator);
+            std::pmr::vector<size_t> start(n, 0, allocator);
+            std::pmr::vector<size_t> roots(allocator);
+
+            for (size_t i = 0; i < n; ++i) {
+                const StackItem *si = (*instrVector)[i];
+                if (si->instr == Instruction::VALUE) {
+                    for (size_t d = 0; d < dims; ++d) {
+                        if (!si->defVar.empty() && std::string_view(si->defVar) == std::string_view(axes[d].var)) {
+                            mask[i] = 1u << d;
+                            break;
+                        }
+                    }
+                    start[i] = i;
+                } else if (isComparison(si->instr) || si->instr == Instruction::ADD || si->instr == Instruction::SUB || si->instr == Instruction::MUL || si->instr == Instruction::DIV || si->instr == Instruction::POW) {
+                    const size_t right = roots.back();
+                    roots.pop_back();
+                    const size_t left = roots.back();
+                    roots.pop_back();
+                    mask[i] = mask[left] | mask[right];
+                    start[i] = start[left];
+                } else {
+                    const size_t child = roots.back();
+                    roots.pop_back();
+                    mask[i] = mask[child];
+                    start[i] = start[child];
+                }
+                roots.push_back(i);
+            }
+
+            std::pmr::vector<GridOp> mainOps(allocator);
+            std::pmr::vector<std::pmr::vector < GridOp>> vectorOps(allocator);
+            std::pmr::vector<std::pmr::vector < GridOp>> scalarOps(allocator);
+
+            //plain translation of the subtree [first,last]
+            auto emitRange = [&](size_t first, size_t last, std::pmr::vector<GridOp> &ops) {
+                for (size_t i = first; i <= last; ++i) {
+                    const StackItem *si = (*instrVector)[i];
+                    if (si->instr != Instruction::VALUE) {
+                        ops.push_back({GridOp::APPLY, si, 0.0, 0});
+                    } else if (mask[i] == 1) {
+                        ops.push_back({GridOp::VECTOR, nullptr, 0.0, 0});
+                    } else if (mask[i] == 2) {
+                        ops.push_back({GridOp::SCALAR, nullptr, 0.0, 0});
+                    } else if (mask[i] == 4) {
+                        ops.push_back({GridOp::SCALAR, nullptr, 0.0, 1});
+                    } else {
+                        ops.push_back({GridOp::CONSTANT, nullptr, getValue(si), 0});
+                    }
+                }
+            };
+
+            batchStack->resize(maxStackDepth * block);
+            double *scratch = batchStack->data();
+
+            std::function<void(size_t) > emit = [&](size_t node) {
+                const StackItem *si = (*instrVector)[node];
+                if (si->instr == Instruction::VALUE) {
+                    emitRange(node, node, mainOps);
+                } else if (mask[node] == 0) {
+                    //constant subexpression: folded once
+                    std::pmr::vector<GridOp> ops(allocator);
+                    emitRange(start[node], node, ops);
+                    runGridOps(ops.data(), ops.size(), nullptr, nullptr, 0, 1, scratch);
+                    mainOps.push_back({GridOp::CONSTANT, nullptr, scratch[0], 0});
+                } else if ((mask[node] & 1) == 0) {
+                    //does not depend on x: computed once for each row
+                    scalarOps.emplace_back();
+                    emitRange(start[node], node, scalarOps.back());
+                    mainOps.push_back({GridOp::SCALAR, nullptr, 0.0, 1 + scalarOps.size()});
+                } else if (mask[node] == 1) {
+                    //depends only on x: computed once for the whole grid
+                    vectorOps.emplace_back();
+                    emitRange(start[node], node, vectorOps.back());
+                    mainOps.push_back({GridOp::VECTOR, nullptr, 0.0, vectorOps.size()});
+                } else {
+                    //operands: the right operand root precedes the operation, the left one precedes the right subtree
+                    const bool binary = si->instr == Instruction::ADD || si->instr == Instruction::SUB || si->instr == Instruction::MUL ||
+                            si->instr == Instruction::DIV || si->instr == Instruction::POW || isComparison(si->instr);
+                    if (binary) {
+                        emit(start[node - 1] - 1);
+                    }
+                    emit(node - 1);
+                    mainOps.push_back({GridOp::APPLY, si, 0.0, 0});
+                }
+            };
+
+            emit(n - 1);
+
+            //x axis and x only subexpressions
+            std::pmr::vector<std::pmr::vector<double>> vectors(allocator);
+            vectors.emplace_back(nx);
+            for (size_t i = 0; i < nx; ++i) {
+                vectors[0][i] = axisValue(axes[0], i);
+            }
+
+            std::pmr::vector<const double*> vectorPtrs(allocator);
+            vectorPtrs.push_back(vectors[0].data());
+
+            for (const auto &ops : vectorOps) {
+                vectors.emplace_back(nx);
+                for (size_t x0 = 0; x0 < nx; x0 += block) {
+                    const size_t len = std::min(block, nx - x0);
+                    runGridOps(ops.data(), ops.size(), vectorPtrs.data(), nullptr, x0, len, scratch);
+                    std::memcpy(vectors.back().data() + x0, scratch, len * sizeof (double));
+                }
+            }
+
+            for (size_t k = 1; k < vectors.size(); ++k) {
+                vectorPtrs.push_back(vectors[k].data());
+            }
+
+            //tiles of GRID_TILE_ROWS rows and BATCH_BLOCK_SIZE columns
+            const size_t xTiles = (nx + block - 1) / block;
+            const size_t rowTiles = (rows + GRID_TILE_ROWS - 1) / GRID_TILE_ROWS;
+            const size_t tiles = xTiles * rowTiles;
+
+            if (threads == 0) {
+                threads = std::max(1u, std::thread::hardware_concurrency());
+            }
+
+            threads = static_cast<unsigned> (std::min<size_t>(threads, tiles));
+
+            std::pmr::vector<std::pmr::vector<double>> stacks(allocator);
+            for (unsigned t = 0; t < threads; ++t) {
+                stacks.emplace_back(maxStackDepth * block);
+            }
+
+            std::pmr::vector<std::pmr::vector<double>> scalars(allocator);
+            for (unsigned t = 0; t < threads; ++t) {
+                scalars.emplace_back(2 + scalarOps.size());
+            }
+
+            auto worker = [&](unsigned t) {
+                double *base = stacks[t].data();
+                double *rowScalars = scalars[t].data();
+                for (size_t tile = t; tile < tiles; tile += threads) {
+                    const size_t x0 = (tile % xTiles) * block;
+                    const size_t len = std::min(block, nx - x0);
+                    const size_t r0 = (tile / xTiles) * GRID_TILE_ROWS;
+                    const size_t r1 = std::min(rows, r0 + GRID_TILE_ROWS);
+                    for (size_t r = r0; r < r1; ++r) {
+                        rowScalars[0] = axisValue(axes[1], r % ny);
+                        rowScalars[1] = dims > 2 ? axisValue(axes[2], r / ny) : 0.0;
+                        for (size_t k = 0; k < scalarOps.size(); ++k) {
+                            runGridOps(scalarOps[k].data(), scalarOps[k].size(), vectorPtrs.data(), rowScalars, 0, 1, base);
+                            rowScalars[2 + k] = base[0];
+                        }
+                        runGridOps(mainOps.data(), mainOps.size(), vectorPtrs.data(), rowScalars, x0, len, base);
+                        std::memcpy(out + r * nx + x0, base, len * sizeof (double));
+                    }
+                }
+            };
+
+            runWorkers(threads, worker);
+
+        } catch (VirtualFPUException &e) {
+            stringstream ss;
+            ss << "Error:" << e.getMessage();
+            throw VirtualFPUException(ss.str());
+        }
+    }
+
+    /**
+     * Gauss-Kronrod 7-15 nodes (QUADPACK qk15): Kronrod abscissae, Kronrod weights and Gauss weights of the even abscissae
+     */
+    static const double GK15_NODES[8] = {
+        0.991455371120812639206854697526329, 0.949107912342758524526189684047851,
+        0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+        0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+        0.207784955007898467600689403773245, 0.000000000000000000000000000000000
+    };
+
+    static const double GK15_WEIGHTS[8] = {
+        0.022935322010529224963732008058970, 0.063092092629978553290700663189204,
+        0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+        0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+        0.204432940075298892414161999234649, 0.209482141084727828012999174891714
+    };
+
+    static const double G7_WEIGHTS[4] = {
+        0.129484966168869693270611432679082, 0.279705391489276667901467771423780,
+        0.381830050505118944950369775488975, 0.417959183673469387755102040816327
+    };
+
+    /**
+     * Subinterval of the adaptive Gauss-Kronrod integration
+     */
+    struct QuadratureInterval {
+        double a;
+        double b;
+        double value;
+        double error;
+    };
+
+    const FusionStats& RPNCompiler::compileFused(const vector<string> &statements) {
+
+        FusedKernel &kernel = *fusedKernel;
+        auto &ops = kernel.ops;
+
+        ops.clear();
+        kernel.scatter.clear();
+        kernel.stats = FusionStats{};
+
+        //the statements are parsed by a compiler knowing the same variables and functions
+        RPNCompiler parser(stackSize, allocator.resource());
+        parser.copyDefinitions(*this);
+
+        //common subexpressions: operation, constant bits or name, operands
+        using Key = std::tuple<Instruction, uint64_t, string, uint32_t, uint32_t>;
+        std::map<Key, uint32_t> known;
+        vector<uint32_t> results;
+        vector<uint32_t> stack;
+
+        auto addOp = [&](Instruction instr, double value, std::string_view name, uint32_t a, uint32_t b) {
+            //x+y and y+x are the same value
+            if ((instr == Instruction::ADD || instr == Instruction::MUL) && b < a) {
+                std::swap(a, b);
+            }
+            const Key key(instr, std::bit_cast<uint64_t>(value), string(name), a, b);
+            const auto it = known.find(key);
+            if (it != known.end()) {
+                return it->second;
+            }
+            FusedOp &op = ops.emplace_back(allocator.resource());
+            op.instr = instr;
+            op.value = value;
+            op.name = name;
+            op.arg[0] = a;
+            op.arg[1] = b;
+            const uint32_t index = static_cast<uint32_t> (ops.size() - 1);
+            known.emplace(key, index);
+            return index;
+        };
+
+        try {
+            for (const string &statement : statements) {
+
+                parser.compile(statement);
+                kernel.stats.instructions += parser.instrVector->size();
+
+                if (!parser.loops->all.empty()) {
+                    throw VirtualFPUException("Error:sum and prod cannot be fused: " + statement);
+                }
+
+                stack.clear();
+                for (const StackItem *item : *parser.instrVector) {
+                    if (item->instr == Instruction::VALUE) {
+                        stack.push_back(item->defVar.empty() ? addOp(Instruction::VALUE, item->value, {}, 0, 0) : addOp(Instruction::VALUE, 0, item->defVar, 0, 0));
+                    } else if (isOperator(item->instr) && item->instr != Instruction::UNARY_MINUS) {
+                        const uint32_t b = stack.back();
+                        stack.pop_back();
+                        stack.back() = addOp(item->instr, 0, {}, stack.back(), b);
+                    } else {
+                        stack.back() = addOp(item->instr, 0, item->defVar, stack.back(), 0);
+                    }
+                }
+                results.push_back(stack.back());
+            }
+        } catch (...) {
+            ops.clear();
+            kernel.stats = FusionStats{};
+            throw;
+        }
+
+        const size_t n = ops.size();
+
+        //outputs of each operation
+        vector<vector<uint32_t>> outputs(n);
+        for (size_t k = 0; k < results.size(); ++k) {
+            outputs[results[k]].push_back(static_cast<uint32_t> (k));
+        }
+        for (size_t i = 0; i < n; ++i) {
+            ops[i].firstOutput = static_cast<uint32_t> (kernel.scatter.size());
+            ops[i].outputs = static_cast<uint32_t> (outputs[i].size());
+            kernel.scatter.insert(kernel.scatter.end(), outputs[i].begin(), outputs[i].end());
+        }
+
+        //last operation reading each result
+        auto arity = [](const FusedOp &op) {
+            return op.instr == Instruction::VALUE ? 0 : (isOperator(op.instr) && op.instr != Instruction::UNARY_MINUS ? 2 : 1);
+        };
+
+        vector<size_t> lastUse(n, 0);
+        for (size_t i = 0; i < n; ++i) {
+            for (int k = 0; k < arity(ops[i]); ++k) {
+                lastUse[ops[i].arg[k]] = i;
+            }
+        }
+
+        //buffers: an operation reuses the buffer of an operand read for the last time, the other buffers are recycled
+        vector<uint32_t> freeBuffers;
+        uint32_t buffers = 0;
+
+        auto allocate = [&]() {
+            if (freeBuffers.empty()) {
+                return buffers++;
+            }
+            const uint32_t b = freeBuffers.back();
+            freeBuffers.pop_back();
+            return b;
+        };
+
+        for (size_t i = 0; i < n; ++i) {
+
+            FusedOp &op = ops[i];
+            const int args = arity(op);
+
+            auto reusable = [&](uint32_t a) {
+                return !ops[a].resident && lastUse[a] == i;
+            };
+
+            if (args == 0) {
+                //constants are filled once and keep their own buffer
+                op.resident = op.name.empty();
+                op.buffer = op.resident ? buffers++ : allocate();
+            } else if (reusable(op.arg[0])) {
+                op.buffer = ops[op.arg[0]].buffer;
+            } else if (args == 2 && (op.instr == Instruction::ADD || op.instr == Instruction::MUL) && reusable(op.arg[1]) && op.arg[0] != op.arg[1]) {
+                std::swap(op.arg[0], op.arg[1]);
+                op.buffer = ops[op.arg[0]].buffer;
+            } else {
+                op.buffer = allocate();
+            }
+
+            for (int k = 0; k < args; ++k) {
+                const uint32_t a = op.arg[k];
+                if (reusable(a) && ops[a].buffer != op.buffer && (k == 0 || a != op.arg[0])) {
+                    freeBuffers.push_back(ops[a].buffer);
+                }
+            }
+
+            //a result nobody reads is written to the outputs and recycled
+            if (lastUse[i] == 0 && !op.resident) {
+                freeBuffers.push_back(op.buffer);
+            }
+        }
+
+        kernel.stats.expressions = statements.size();
+        kernel.stats.operations = n;
+        kernel.stats.buffers = buffers;
+        kernel.scratch.assign(static_cast<size_t> (buffers) * BATCH_BLOCK_SIZE, 0);
+
+        return kernel.stats;
+    }
+
+    void RPNCompiler::evaluateFused(const vector<ColumnBinding> &columns, size_t rows, const vector<double*> &outputs) {
+
+        FusedKernel &kernel = *fusedKernel;
+        auto &ops = kernel.ops;
+        const size_t block = BATCH_BLOCK_SIZE;
+
+        if (ops.empty()) {
+            throw VirtualFPUException("Compile the expressions with compileFused before evaluating");
+        }
+
+        if (outputs.size() != kernel.stats.expressions) {
+            throw VirtualFPUException("evaluateFused requires an output for each expression");
+        }
+
+        double *scratch = kernel.scratch.data();
+
+        //bind the columns, the variables and the functions once for all the rows
+        for (FusedOp &op : ops) {
+            double *buffer = scratch + op.buffer * block;
+            op.column = nullptr;
+            op.fn = nullptr;
+            op.table = nullptr;
+            if (op.instr == Instruction::VALUE && op.name.empty()) {
+                std::fill(buffer, buffer + block, op.value);
+            } else if (op.instr == Instruction::VALUE) {
+                for (const auto &col : columns) {
+                    if (std::string_view(col.name) == std::string_view(op.name)) {
+                        op.column = &col;
+                        break;
+                    }
+                }
+                if (!op.column) {
+                    const auto it = defVars->find(std::string_view(op.name));
+                    if (it == defVars->end()) {
+                        throw VirtualFPUException("Error:Variabile "s + string(op.name) + " is not defined!");
+                    }
+                    op.value = it->second;
+                }
+            } else if (op.instr == Instruction::DEF_FUNCTION) {
+                const auto table = tables->find(std::string_view(op.name));
+                op.table = table == tables->end() ? nullptr : table->second.get();
+                const auto fn = defFunctions->find(std::string_view(op.name));
+                if (fn == defFunctions->end() || !fn->second) {
+                    throw VirtualFPUException("Error:Cannot find custom function "s + string(op.name));
+                }
+                op.fn = &fn->second;
+            }
+        }
+
+        for (size_t row = 0; row < rows; row += block) {
+
+            const size_t len = std::min(block, rows - row);
+
+            for (const FusedOp &op : ops) {
+
+                double *r = scratch + op.buffer * block;
+
+                if (op.instr == Instruction::VALUE) {
+                    if (op.column) {
+                        gatherColumn(*op.column, row, len, r);
+                    } else if (!op.resident) {
+                        //the buffer of a variable can be reused by the operations reading it
+                        std::fill(r, r + len, op.value);
+                    }
+                } else {
+                    const double *a = scratch + ops[op.arg[0]].buffer * block;
+                    if (a != r) {
+                        std::copy(a, a + len, r);
+                    }
+                    if (isOperator(op.instr) && op.instr != Instruction::UNARY_MINUS) {
+                        applyBinaryBlock(op.instr, r, scratch + ops[op.arg[1]].buffer * block, len);
+                    } else if (op.table) {
+                        op.table->evalBlock(r, len);
+                    } else if (op.fn) {
+                        for (size_t j = 0; j < len; ++j) r[j] = (*op.fn)(r[j]);
+                    } else {
+                        functions->unary[static_cast<size_t> (op.instr)].block(r, len);
+                    }
+                }
+
+                for (uint32_t k = 0; k < op.outputs; ++k) {
+                    scatterColumn(r, row, len, outputs[kernel.scatter[op.firstOutput + k]], 0);
+                }
+            }
+        }
+    }
+
+    const FusionStats& RPNCompiler::getFusionStats() const noexcept {
+        return fusedKernel->stats;
+    }
+
+    /**
+     * C++ literal of a constant, exact (shortest representation read back as the same double)
+     */
+    static string cppLiteral(double value) {
+        if (std::isnan(value)) {
+            return "std::numeric_limits<double>::quiet_NaN()";
+        }
+        if (std::isinf(value)) {
+            return value > 0 ? "std::numeric_limits<double>::infinity()" : "(-std::numeric_limits<double>::infinity())";
+        }
+        char buffer[32];
+        const auto r = std::to_chars(buffer, buffer + sizeof (buffer), value);
+        string literal(buffer, r.ptr);
+        if (literal.find_first_of(".e") == string::npos) {
+            literal += ".0";
+        }
+        return std::signbit(value) ? "(" + literal + ")" : literal;
+    }
+
+    string RPNCompiler::generateCpp(const string &function, const vector<string> &parameters) const {
+
+        if (!instrVector || instrVector->empty()) {
+            throw VirtualFPUException("Compile an expression before generating code");
+        }
+
+        //variables and custom functions of the expression and of its loops
+        std::set<string> variables;
+        std::set<string> externs;
+
+        auto collect = [&](const std::pmr::vector<StackItem*> &rpn) {
+            for (const StackItem *si : rpn) {
+                if (si->instr == Instruction::VALUE && !si->defVar.empty() && si->defVar[0] != '#') {
+                    variables.emplace(si->defVar);
+                } else if (si->instr == Instruction::DEF_FUNCTION) {
+                    externs.emplace(si->defVar);
+                }
+            }
+        };
+
+        collect(*instrVector);
+
+        for (const Loop *loop : loops->all) {
+            for (const Loop::Block *block : {&loop->from, &loop->to, &loop->body, &loop->invariant}) {
+                collect(block->rpn);
+            }
+        }
+
+        const vector<string> params = parameters.empty() ? vector<string>(variables.begin(), variables.end()) : parameters;
+
+        stringstream src;
+
+        for (const string &fn : externs) {
+            src << "extern double " << fn << "(double);\n";
+        }
+        if (!externs.empty()) {
+            src << "\n";
+        }
+
+        src << "double " << function << "(";
+        for (size_t i = 0; i < params.size(); ++i) {
+            src << (i ? ", " : "") << "double " << params[i];
+        }
+        src << ") {\n";
+
+        //the variables which are not parameters keep their current value
+        for (const string &var : variables) {
+            if (std::find(params.begin(), params.end(), var) == params.end()) {
+                const auto it = defVars->find(std::string_view(var));
+                if (it == defVars->end()) {
+                    throw VirtualFPUException("Error:Variabile " + var + " is not defined!");
+                }
+                src << "    const double " << var << " = " << cppLiteral(it->second) << ";\n";
+            }
+        }
+
+        size_t temps = 0;
+
+        //SSA translation of RPN instructions, the local slots of the loops are named s<slot>_: the generated
+        //names end with an underscore, not allowed in the identifiers, so they do not hide the variables
+        auto emit = [&](const std::pmr::vector<StackItem*> &rpn, const string &indent) {
+
+            vector<string> stack;
+
+            auto instrAt = [&rpn](size_t i) {
+                return i < rpn.size() ? rpn[i]->instr : Instruction::VALUE;
+            };
+
+            auto isAddSub = [](Instruction instr) {
+                return instr == Instruction::ADD || instr == Instruction::SUB;
+            };
+
+            //factors of a product contracted with the next addition, as by the peephole pass (see buildOps):
+            //c a b MUL ADD -> fma(a,b,c) and a b MUL x ADD -> fma(a,b,x)
+            std::pair<string, string> factors;
+            size_t product = string::npos;
+
+            for (size_t i = 0; i < rpn.size(); ++i) {
+
+                const StackItem *si = rpn[i];
+                string expr;
+
+                if (si->instr == Instruction::VALUE) {
+                    if (si->defVar.empty()) {
+                        stack.push_back(cppLiteral(si->value));
+                    } else if (si->defVar[0] == '#') {
+                        stack.push_back("s" + string(si->defVar.substr(1)) + "_");
+                    } else {
+                        stack.push_back(string(si->defVar));
+                    }
+                    continue;
+                } else if (fusedMultiplyAdd && si->instr == Instruction::MUL
+                        && (isAddSub(instrAt(i + 1)) || (instrAt(i + 1) == Instruction::VALUE && isAddSub(instrAt(i + 2))))) {
+                    factors.second = stack.back();
+                    stack.pop_back();
+                    factors.first = stack.back();
+                    product = stack.size() - 1;
+                    continue;
+                } else if (isAddSub(si->instr) && product != string::npos) {
+                    const string x = stack.back();
+                    stack.pop_back();
+                    const string &c = stack.back();
+                    const bool add = si->instr == Instruction::ADD;
+                    if (product == stack.size()) {
+                        //the product is the second operand: c+a*b, c-a*b
+                        expr = "std::fma(" + (add ? factors.first : "-" + factors.first) + ", " + factors.second + ", " + c + ")";
+                    } else {
+                        //the product is the first operand: a*b+x, a*b-x
+                        expr = "std::fma(" + factors.first + ", " + factors.second + ", " + (add ? x : "-" + x) + ")";
+                    }
+                    product = string::npos;
+                } else if (isOperator(si->instr) && si->instr != Instruction::UNARY_MINUS) {
+                    const string b = stack.back();
+                    stack.pop_back();
+                    const string &a = stack.back();
+                    switch (si->instr) {
+                        case Instruction::POW:
+                            expr = "std::pow(" + a + ", " + b + ")";
+                            break;
+                        case Instruction::LT:
+                        case Instruction::GT:
+                        case Instruction::LE:
+                        case Instruction::GE:
+                        case Instruction::EQ:
+                        case Instruction::NE:
+                            expr = a + " " + symToStr.at(si->instr) + " " + b + " ? 1.0 : 0.0";
+                            break;
+                        default:
+                            expr = a + " " + symToStr.at(si->instr) + " " + b;
+                            break;
+                    }
+                } else {
+                    const string &a = stack.back();
+                    switch (si->instr) {
+                        case Instruction::UNARY_MINUS:
+                            expr = "-" + a;
+                            break;
+                        case Instruction::SIGN:
+                            expr = a + " > 0 ? 1.0 : (" + a + " < 0 ? -1.0 : 0.0)";
+                            break;
+                        case Instruction::ABS:
+                            expr = "std::fabs(" + a + ")";
+                            break;
+                        case Instruction::DEF_FUNCTION:
+                            expr = string(si->defVar) + "(" + a + ")";
+                            break;
+                        default:
+                            expr = "std::" + symToStr.at(si->instr) + "(" + a + ")";
+                            break;
+                    }
+                }
+
+                //the result replaces the first operand
+                stack.back() = "t" + std::to_string(temps++) + "_";
+                src << indent << "const double " << stack.back() << " = " << expr << ";\n";
+            }
+
+            return stack;
+        };
+
+        //the loops are evaluated in the same order as by evaluate
+        std::function<void(const std::pmr::vector<Loop*>&, const string&) > emitLoops = [&](const std::pmr::vector<Loop*> &list, const string &indent) {
+            for (const Loop *loop : list) {
+                const string from = emit(loop->from.rpn, indent).back();
+                const string to = emit(loop->to.rpn, indent).back();
+                emitLoops(loop->before, indent);
+                const vector<string> hoisted = emit(loop->invariant.rpn, indent);
+                for (size_t k = 0; k < hoisted.size(); ++k) {
+                    src << indent << "const double s" << loop->hoisted[k] << "_ = " << hoisted[k] << ";\n";
+                }
+                const string result = "s" + std::to_string(loop->result) + "_";
+                const string k = "k" + std::to_string(loop->index) + "_";
+                src << indent << "double " << result << " = " << (loop->product ? "1.0" : "0.0") << ";\n";
+                src << indent << "if (std::isfinite(" << from << ") && std::isfinite(" << to << ")) {\n";
+                src << indent << "    for (double " << k << " = 0; " << k << " < std::floor(" << to << " - " << from << ") + 1; ++" << k << ") {\n";
+                src << indent << "        const double s" << loop->index << "_ = " << from << " + " << k << ";\n";
+                emitLoops(loop->inner, indent + "        ");
+                const string value = emit(loop->body.rpn, indent + "        ").back();
+                src << indent << "        " << result << (loop->product ? " *= " : " += ") << value << ";\n";
+                src << indent << "    }\n";
+                src << indent << "} else {\n";
+                src << indent << "    " << result << " = std::numeric_limits<double>::quiet_NaN();\n";
+                src << indent << "}\n";
+            }
+        };
+
+        emitLoops(loops->top, "    ");
+
+        const vector<string> stack = emit(*instrVector, "    ");
+
+        src << "    return " << stack.back() << ";\n}\n";
+
+        return src.str();
+    }
+
+    IntegrationResult RPNCompiler::integrate(const string &var, double a, double b, QuadratureRule rule, double absTolerance, double relTolerance, size_t maxEvaluations) {
+
+        if (!instrVector || instrVector->empty()) {
+            throw VirtualFPUException("Compile an expression before evaluating");
+        }
+
+        if (!std::isfinite(a) || !std::isfinite(b)) {
+            throw VirtualFPUException("Integration limits must be finite");
+        }
+
+        IntegrationResult result{0.0, 0.0, 0, 0, true};
+
+        if (a == b) {
+            return result;
+        }
+
+        if (a > b) {
+            result = integrate(var, b, a, rule, absTolerance, relTolerance, maxEvaluations);
+            result.value = -result.value;
+            return result;
+        }
+
+        std::pmr::vector<double> nodes(allocator);
+        std::pmr::vector<double> values(allocator);
+
+        auto evaluateNodes = [&]() {
+            values.resize(nodes.size());
+            evaluateBatch({
+                {var, nodes.data()}
+            }, nodes.size(), values.data());
+            result.evaluations += nodes.size();
+            ++result.batches;
+        };
+
+        if (rule == QuadratureRule::GAUSS_KRONROD) {
+
+            std::pmr::vector<QuadratureInterval> pending(allocator);
+            std::pmr::vector<QuadratureInterval> next(allocator);
+
+            pending.push_back({a, b, 0.0, 0.0});
+
+            double acceptedValue = 0.0;
+            double acceptedError = 0.0;
+
+            while (!pending.empty()) {
+
+                //all the nodes of the refinement level are evaluated as one batch
+                nodes.clear();
+                for (const auto &iv : pending) {
+                    const double c = 0.5 * (iv.a + iv.b);
+                    const double h = 0.5 * (iv.b - iv.a);
+                    for (int k = 0; k < 7; ++k) {
+                        nodes.push_back(c - h * GK15_NODES[k]);
+                        nodes.push_back(c + h * GK15_NODES[k]);
+                    }
+                    nodes.push_back(c);
+                }
+
+                evaluateNodes();
+
+                double levelValue = 0.0;
+
+                for (size_t i = 0; i < pending.size(); ++i) {
+                    auto &iv = pending[i];
+                    const double *f = values.data() + i * 15;
+                    const double h = 0.5 * (iv.b - iv.a);
+                    double kronrod = GK15_WEIGHTS[7] * f[14];
+                    double gauss = G7_WEIGHTS[3] * f[14];
+                    for (int k = 0; k < 7; ++k) {
+                        const double pair = f[2 * k] + f[2 * k + 1];
+                        kronrod += GK15_WEIGHTS[k] * pair;
+                        if (k & 1) {
+                            gauss += G7_WEIGHTS[k / 2] * pair;
+                        }
+                    }
+                    iv.value = kronrod * h;
+                    iv.error = std::fabs((kronrod - gauss) * h);
+                    levelValue += iv.value;
+                }
+
+                const double total = acceptedValue + levelValue;
+
+                if (!std::isfinite(total)) {
+                    result.value = total;
+                    result.errorEstimate = std::numeric_limits<double>::quiet_NaN();
+                    result.converged = false;
+                    return result;
+                }
+
+                const double tolerance = std::max(absTolerance, relTolerance * std::fabs(total));
+
+                auto accurate = [&](const QuadratureInterval & iv) {
+                    const double mid = 0.5 * (iv.a + iv.b);
+                    //the tolerance is distributed proportionally to the length of the subinterval
+                    return iv.error <= tolerance * (iv.b - iv.a) / (b - a) || mid <= iv.a || mid >= iv.b;
+                };
+
+                const size_t splits = std::count_if(pending.begin(), pending.end(), [&](const QuadratureInterval & iv) {
+                    return !accurate(iv);
+                });
+
+                //when the evaluations budget is exhausted the current estimates are kept
+                const bool refine = result.evaluations + splits * 2 * 15 <= maxEvaluations;
+
+                if (splits && !refine) {
+                    result.converged = false;
+                }
+
+                next.clear();
+
+                for (const auto &iv : pending) {
+                    if (!refine || accurate(iv)) {
+                        acceptedValue += iv.value;
+                        acceptedError += iv.error;
+                    } else {
+                        const double mid = 0.5 * (iv.a + iv.b);
+                        next.push_back({iv.a, mid, 0.0, 0.0});
+                        next.push_back({mid, iv.b, 0.0, 0.0});
+                    }
+                }
+
+                pending.swap(next);
+            }
+
+            result.value = acceptedValue;
+            result.errorEstimate = acceptedError;
+
+        } else {
+
+            //tanh-sinh: x=tanh(pi/2*sinh(t)), each level halves the step adding the odd nodes
+            const double halfPi = 1.5707963267948966;
+            const double tMax = 3.5;
+            const double center = 0.5 * (a + b);
+            const double half = 0.5 * (b - a);
+            const int maxLevel = 12;
+
+            std::pmr::vector<double> weights(allocator);
+
+            double sum = 0.0;
+            double previous = 0.0;
+
+            for (int level = 0; level <= maxLevel; ++level) {
+
+                const double h = std::ldexp(1.0, -level);
+                const int kmax = static_cast<int> (tMax / h);
+
+                nodes.clear();
+                weights.clear();
+
+                for (int k = (level == 0 ? 0 : 1); k <= kmax; k += (level == 0 ? 1 : 2)) {
+                    const double t = k * h;
+                    const double u = halfPi * std::sinh(t);
+                    const double cu = std::cosh(u);
+                    const double w = halfPi * std::cosh(t) / (cu * cu) * half;
+                    //distance from the endpoints computed without cancellation: 1-tanh(u)=exp(-u)/cosh(u)
+                    const double d = half * std::exp(-u) / cu;
+
+                    if (k == 0) {
+                        nodes.push_back(center);
+                        weights.push_back(w);
+                        continue;
+                    }
+
+                    const double right = b - d;
+                    const double left = a + d;
+
+                    if (right > a && right < b) {
+                        nodes.push_back(right);
+                        weights.push_back(w);
+                    }
+                    if (left > a && left < b) {
+                        nodes.push_back(left);
+                        weights.push_back(w);
+                    }
+                }
+
+                if (result.evaluations + nodes.size() > maxEvaluations) {
+                    result.converged = false;
+                    break;
+                }
+
+                evaluateNodes();
+
+                for (size_t i = 0; i < nodes.size(); ++i) {
+                    sum += weights[i] * values[i];
+                }
+
+                const double estimate = sum * h;
+
+                result.value = estimate;
+
+                if (!std::isfinite(estimate)) {
+                    result.errorEstimate = std::numeric_limits<double>::quiet_NaN();
+                    result.converged = false;
+                    return result;
+                }
+
+                if (level > 0) {
+                    result.errorEstimate = std::fabs(estimate - previous);
+                    if (level >= 3 && result.errorEstimate <= std::max(absTolerance, relTolerance * std::fabs(estimate))) {
+                        return result;
+                    }
+                }
+
+                previous = estimate;
+
+                if (level == maxLevel) {
+                    result.converged = false;
+                }
+            }
+        }
+
+        return result;
+    }
+
+    double RPNCompiler::evaluateUnary(double operand, const StackItem * operation) {
+        const UnaryKernel &fn = functions->unary[static_cast<size_t> (operation->instr)];
+        if (!fn.scalar) {
+            const auto sym = symToStr.find(operation->instr);
+            throwError("Cannot find the built-in one arg function "s + (sym != symToStr.end() ? sym->second : "<?>"));
+            return 0.0;
+        }
+        return fn.scalar(operand);
+    }
+
+    double RPNCompiler::evaluateCustomFn(double operand, const StackItem * operation) {
+
+        const auto fn = defFunctions->find(std::string_view(operation->defVar));
+        if (fn == defFunctions->end() || !fn->second) {
+            throwError("Cannot find custom function "s + string(operation->defVar));
+        }
+        return fn->second(operand);
+    }
+
+    double RPNCompiler::getValue(const StackItem * operand) {
+
+        if (operand->defVar.empty()) {
+            return operand->value;
+        }
+
+        const double *value = findOperand(operand->defVar);
+
+        if (!value) {
+            throwError(string("Variabile ") + string(operand->defVar) + string(" is not defined!"));
+        }
+
+        return *value;
+    }
+
+    double RPNCompiler::evaluateOperation(double op1, double op2, const StackItem * operation) {
+
+        switch (operation->instr) {
+            case Instruction::ADD:
+                return op1 + op2;
+            case Instruction::SUB:
+            case Instruction::UNARY_MINUS:
+
+                return op1 - op2;
+
+            case Instruction::MUL:
+
+                return op1 * op2;
+
+                break;
+            case Instruction::DIV:
+                return op1 / op2;
+            case Instruction::POW:
+                return functions->pow(op1, op2);
+            case Instruction::LT:
+                return op1 < op2 ? 1.0 : 0.0;
+            case Instruction::GT:
+                return op1 > op2 ? 1.0 : 0.0;
+            case Instruction::LE:
+                return op1 <= op2 ? 1.0 : 0.0;
+            case Instruction::GE:
+                return op1 >= op2 ? 1.0 : 0.0;
+            case Instruction::EQ:
+                return op1 == op2 ? 1.0 : 0.0;
+            case Instruction::NE:
+                return op1 != op2 ? 1.0 : 0.0;
+            default:
+                throwError("Unsupported function for two operands");
+                return 0.0;
+        }
+
+    }
+
+    size_t RPNCompiler::getStackSize() const {
+        return stackSize;
+    }
+
+    size_t RPNCompiler::stackLength() const {
+        return instrVector->size();
+    }
+
+    size_t RPNCompiler::getInstructionCount() const {
+        return instrVector->size();
+    }
+
+    size_t RPNCompiler::getMaxStackDepth() const {
+        return maxStackDepth;
+    }
+
+    bool RPNCompiler::stackIsEmpty() const {
+        return instrVector->empty();
+    }
+
+    void RPNCompiler::clearStack() {
+
+        if (instrVector && instrVector->size() > 0) {
+
+            for (StackItem *item : *instrVector) {
+                deleteItem(item);
+            }
+
+            instrVector->clear();
+        }
+
+        if (loops) {
+            for (Loop *loop : loops->all) {
+                for (Loop::Block *block : {&loop->from, &loop->to, &loop->body, &loop->invariant}) {
+                    for (StackItem *item : block->rpn) {
+                        deleteItem(item);
+                    }
+                }
+                allocator.delete_object(loop);
+            }
+            loops->all.clear();
+            loops->top.clear();
+            loops->slots.clear();
+            loops->scope.clear();
+            loops->target = &loops->top;
+        }
+
+        if (program) {
+            program->clear();
+        }
+
+        if (registerProgram) {
+            registerProgram->clear();
+        }
+
+        if (surrogate) {
+            surrogate->clear();
+        }
+
+        //a new expression starts again from the interpreter
+        if (tiering) {
+            if (tiering->promoted) {
+                backend = Backend::STACK;
+            }
+            tiering->restart();
+        }
+
+        programResolved = false;
+        peepholeStats = PeepholeStats{};
+        registerAllocation = RegisterAllocation{};
+        registerResult = nullptr;
+        maxStackDepth = 0;
+    }
+
+    string RPNCompiler::getRPNStack() const {
+
+        ostringstream ss;
+
+        for (auto it = instrVector->begin(); it != instrVector->end(); it++) {
+
+            StackItem* instr = *it;
+
+            StackItem& t = (*instr);
+
+            ss << t << ',';
+
+        }
+
+        return ss.str();
+    }
+
+    vector<string> RPNCompiler::getVariables() const {
+
+        vector<string> vars;
+
+        auto add = [&vars](const std::pmr::vector<StackItem*> &rpn) {
+            for (const StackItem *item : rpn) {
+                //the local slots of the loops are not variables
+                if (item->instr == Instruction::VALUE && !item->defVar.empty() && item->defVar[0] != '#') {
+                    string name(item->defVar);
+                    if (std::find(vars.begin(), vars.end(), name) == vars.end()) {
+                        vars.push_back(name);
+                    }
+                }
+            }
+        };
+
+        for (const Loop *loop : loops->all) {
+            for (const Loop::Block *block : {&loop->from, &loop->to, &loop->body, &loop->invariant}) {
+                add(block->rpn);
+            }
+        }
+
+        add(*instrVector);
+
+        return vars;
+    }
+
+    double RPNCompiler::queryOutputRegister() const {
+        return output;
+    }
+
+    void RPNCompiler::validateIndentifier(const string &name) {
+        if (name == "") {
+            throwError(string("Identifier name not set"));
+        }
+
+        if (name.find(' ') != string::npos) throw VirtualFPUException("Invalid identifier name "s + name + ":space is not allowed."s);
+
+        const size_t lu = name.length();
+
+        if (!isalpha(name[0])) {
+            throwError(string("Variabile name must start with a letter."));
+        }
+
+        for (size_t i = 0; i < lu; i++) {
+
+            if (!isalnum((name[i]))) {
+                throwError(string("Invalid variabile name:" + name));
+            }
+        }
+
+    }
+
+    void RPNCompiler::defineVar(const string &name, double value) {
+
+        validateIndentifier(name);
+
+        if (!defVars->contains(std::string_view(name)) && defFunctions->contains(std::string_view(name))) {
+            throw VirtualFPUException("Variable name "s + name + " conflicts with an already defined function");
+        }
+
+        const auto it = defVars->find(std::string_view(name));
+
+        if (it != defVars->end()) {
+            it->second = value;
+        } else {
+            defVars->emplace(name, value);
+        }
+    }
+
+    void RPNCompiler::undefVar(const string & name) {
+
+        const auto it = defVars->find(std::string_view(name));
+
+        if (it != defVars->end()) {
+            defVars->erase(it);
+            if (tiering) {
+                tiering->variable = nullptr;
+            }
+            programResolved = false;
+        }
+    }
+
+    /**
+     * Direct-mapped cache of a memoized custom function, keyed by the bits of the argument
+     */
+    struct RPNCompiler::MemoCache {
+        std::function<double(double) > fn;
+        std::pmr::vector<uint64_t> keys;
+        std::pmr::vector<double> values;
+        std::pmr::vector<uint8_t> filled;
+        unsigned shift;
+        size_t hits = 0;
+        size_t misses = 0;
+        mutable std::mutex mutex;
+
+        MemoCache(std::function<double(double) > fn, size_t size, std::pmr::memory_resource *resource) : fn(std::move(fn)), keys(resource), values(resource), filled(resource) {
+            const size_t capacity = std::bit_ceil(std::max<size_t>(size, 1));
+            keys.resize(capacity);
+            values.resize(capacity);
+            filled.resize(capacity);
+            shift = 64 - std::countr_zero(capacity);
+        }
+
+        double operator()(double x) {
+            const uint64_t key = std::bit_cast<uint64_t> (x);
+            //Fibonacci hashing spreads the arguments differing only in the low mantissa bits
+            const size_t slot = shift == 64 ? 0 : static_cast<size_t> ((key * 0x9E3779B97F4A7C15ull) >> shift);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (filled[slot] && keys[slot] == key) {
+                    ++hits;
+                    return values[slot];
+                }
+                ++misses;
+            }
+            //the function is called out of the lock, so recursive and slow functions do not block the other threads
+            const double y = fn(x);
+            std::lock_guard<std::mutex> lock(mutex);
+            keys[slot] = key;
+            values[slot] = y;
+            filled[slot] = 1;
+            return y;
+        }
+    };
+
+    void RPNCompiler::defineFunction(const string &name, std::function<double(double) > fn) {
+        defineFunction(name, std::move(fn), false);
+    }
+
+    void RPNCompiler::defineFunction(const string &name, std::function<double(double) > fn, bool memoize, size_t cacheSize) {
+        validateIndentifier(name);
+
+        if (!defFunctions->contains(std::string_view(name)) && defVars->contains(std::string_view(name))) {
+            throw VirtualFPUException("Function name "s + name + " conflicts with an already defined variable");
+        }
+
+        const auto it = defFunctions->find(std::string_view(name));
+
+        const auto memo = memoCaches->find(std::string_view(name));
+        if (memo != memoCaches->end()) {
+            memoCaches->erase(memo);
+        }
+
+        const auto table = tables->find(std::string_view(name));
+        if (table != tables->end()) {
+            tables->erase(table);
+        }
+
+        if (memoize && fn) {
+            auto cache = std::allocate_shared<MemoCache>(std::pmr::polymorphic_allocator<MemoCache>(allocator.resource()), std::move(fn), cacheSize, allocator.resource());
+            memoCaches->emplace(name, cache);
+            fn = [cache](double x) {
+                return (*cache)(x);
+            };
+        }
+
+        if (it != defFunctions->end()) {
+            it->second = std::move(fn);
+        } else {
+            defFunctions->emplace(name, std::move(fn));
+        }
+
+        surrogate->clear();
+        if (tiering) {
+            tiering->cancel();
+        }
+        programResolved = false;
+
+    }
+
+    void RPNCompiler::undefFunction(const string &name) {
+        const auto it = defFunctions->find(std::string_view(name));
+
+        if (it != defFunctions->end()) {
+            defFunctions->erase(it);
+            const auto memo = memoCaches->find(std::string_view(name));
+            if (memo != memoCaches->end()) {
+                memoCaches->erase(memo);
+            }
+            const auto table = tables->find(std::string_view(name));
+            if (table != tables->end()) {
+                tables->erase(table);
+            }
+            surrogate->clear();
+            if (tiering) {
+                tiering->cancel();
+            }
+            programResolved = false;
+        }
+    }
+
+    MemoStats RPNCompiler::getMemoStats(const string &name) const {
+
+        const auto it = memoCaches->find(std::string_view(name));
+
+        if (it == memoCaches->end()) {
+            throw VirtualFPUException("Function "s + name + " is not memoized");
+        }
+
+        const MemoCache &cache = *it->second;
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        return MemoStats{cache.hits, cache.misses, cache.keys.size()};
+    }
+
+    void RPNCompiler::defineTable(const string &name, const vector<double> &xs, const vector<double> &ys, Interpolation mode) {
+
+        const size_t n = xs.size();
+
+        if (n != ys.size()) {
+            throw VirtualFPUException("Table "s + name + ": the number of knots and values differ");
+        }
+
+        if (n < (mode == Interpolation::LINEAR ? 2u : 3u)) {
+            throw VirtualFPUException("Table "s + name + ": not enough knots");
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            if (!std::isfinite(xs[i]) || !std::isfinite(ys[i]) || (i > 0 && !(xs[i] > xs[i - 1]))) {
+                throw VirtualFPUException("Table "s + name + ": the knots must be finite and strictly increasing");
+            }
+        }
+
+        auto table = std::allocate_shared<Table>(std::pmr::polymorphic_allocator<Table>(allocator.resource()), allocator.resource());
+        table->mode = mode;
+        table->xs.assign(xs.begin(), xs.end());
+        table->segments = n - 1;
+        table->lo = xs[0];
+        table->hi = xs[n - 1];
+        table->stride = mode == Interpolation::LINEAR ? 2 : 4;
+        table->coef.resize(table->segments * table->stride);
+
+        const double step = (xs[n - 1] - xs[0]) / (n - 1);
+        table->uniform = true;
+        for (size_t i = 1; i < n && table->uniform; ++i) {
+            table->uniform = std::fabs(xs[i] - (xs[0] + i * step)) <= 1e-12 * (xs[n - 1] - xs[0]);
+        }
+        table->invStep = 1 / step;
+
+        if (!table->uniform) {
+            table->buildGuide();
+        }
+
+        if (mode == Interpolation::LINEAR) {
+            for (size_t i = 0; i < n - 1; ++i) {
+                table->coef[2 * i] = ys[i];
+                table->coef[2 * i + 1] = (ys[i + 1] - ys[i]) / (xs[i + 1] - xs[i]);
+            }
+        } else {
+            //natural cubic spline: second derivatives m with m[0]=m[n-1]=0, tridiagonal system solved by the Thomas algorithm
+            vector<double> m(n, 0.0), c(n, 0.0), d(n, 0.0);
+            for (size_t i = 1; i < n - 1; ++i) {
+                const double h0 = xs[i] - xs[i - 1];
+                const double h1 = xs[i + 1] - xs[i];
+                const double rhs = 6 * ((ys[i + 1] - ys[i]) / h1 - (ys[i] - ys[i - 1]) / h0);
+                const double diag = 2 * (h0 + h1) - h0 * c[i - 1];
+                c[i] = h1 / diag;
+                d[i] = (rhs - h0 * d[i - 1]) / diag;
+            }
+            for (size_t i = n - 2; i > 0; --i) {
+                m[i] = d[i] - c[i] * m[i + 1];
+            }
+            for (size_t i = 0; i < n - 1; ++i) {
+                const double h = xs[i + 1] - xs[i];
+                double *k = table->coef.data() + 4 * i;
+                k[0] = ys[i];
+                k[1] = (ys[i + 1] - ys[i]) / h - h * (2 * m[i] + m[i + 1]) / 6;
+                k[2] = m[i] / 2;
+                k[3] = (m[i + 1] - m[i]) / (6 * h);
+            }
+        }
+
+        //the function is used by the paths evaluating custom functions one value at a time
+        defineFunction(name, [table](double x) {
+            return table->eval(x);
+        });
+
+        tables->insert_or_assign(std::pmr::string(name, allocator), std::move(table));
+    }
+
+    void RPNCompiler::defineTable(const string &name, double x0, double x1, const vector<double> &ys, Interpolation mode) {
+
+        const size_t n = ys.size();
+        vector<double> xs(n);
+
+        for (size_t i = 0; i < n; ++i) {
+            xs[i] = n > 1 ? x0 + (x1 - x0) * i / (n - 1) : x0;
+        }
+
+        defineTable(name, xs, ys, mode);
+    }
+
+    bool RPNCompiler::isVarDefined(const string & name) {
+        return defVars->find(std::string_view(name)) != defVars->end();
+    }
+
+    bool RPNCompiler::isFnDefined(const string &name) {
+        return defFunctions->find(std::string_view(name)) != defFunctions->end();
+    }
+
+    double RPNCompiler::getVar(const string & varName) {
+
+        const auto it = defVars->find(std::string_view(varName));
+
+        if (it == defVars->end()) {
+            throwError(string("Variabile ") + varName + string(" is not defined!"));
+        }
+        return it->second;
+
+    }
+
+    void RPNCompiler::clearAllVariables() {
+
+        defVars->clear();
+        if (tiering) {
+            tiering->variable = nullptr;
+        }
+        programResolved = false;
+
+    }
+
+    void RPNCompiler::clearAllCustomFunctions() {
+        defFunctions->clear();
+        memoCaches->clear();
+        tables->clear();
+        surrogate->clear();
+        if (tiering) {
+            tiering->cancel();
+        }
+        programResolved = false;
+    }
+
+    void RPNCompiler::init(size_t stackSize) {
+
+        if (stackSize <= 0) {
+            throwError("Invalid stack size on init");
+        }
+
+        this->stackSize = stackSize;
+        this->maxStackDepth = 0;
+
+        instrVector = allocator.new_object<std::pmr::vector < StackItem*>>();
+
+        executeStack = allocator.new_object<std::pmr::vector<double>>();
 
-            } else if (ch == ' ') {
+        program = allocator.new_object<std::pmr::vector < Op >> ();
 
-                last_num = last_alpha = false;
+        registerProgram = allocator.new_object<std::pmr::vector < RegisterOp >> ();
 
-                //skip
-                ++idx;
-                if (state == 1) {
-                    break;
-                }
-            } else if (isalpha(ch)) {
+        registerFile = allocator.new_object<std::pmr::vector<double>>();
 
-                if (last_num && !last_alpha) {
-                    break;
-                }
+        batchStack = allocator.new_object<std::pmr::vector<double>>();
 
-                last_num = false;
-                last_alpha = isalpha(ch);
+        batchSources = allocator.new_object<std::pmr::vector<const ColumnBinding*>>();
 
-                state = 1;
-                ss << ch;
-                ++idx;
+        defVars = allocator.new_object<VarMap>();
+        defFunctions = allocator.new_object<FnMap>();
 
-            } else if (ch == '.') {
-                last_num = false;
-                last_alpha = false;
+        memoCaches = allocator.new_object<MemoMap>();
 
-                state = 1;
-                ss << ch;
-                ++idx;
-            } else if (isdigit(ch)) {
-                last_num = true;
-                last_alpha = false;
-                state = 1;
-                ss << ch;
-                ++idx;
-            } else {
+        tables = allocator.new_object<TableMap>();
 
-                last_num = false;
-                last_alpha = false;
+        surrogate = allocator.new_object<Surrogate>(allocator.resource());
 
-                //invalid
-                ss << ch;
-                ++idx;
-                break;
+        loops = allocator.new_object<Loops>(allocator.resource());
 
-            }
-        }
+        fusedKernel = allocator.new_object<FusedKernel>(allocator.resource());
 
-        *nextIndex = idx;
-        return ss.str();
     }
 
-    bool RPNCompiler::reduceStack(std::vector<StackItem*> &stack) {
+    void RPNCompiler::throwError(const string & msg) {
+        stringstream ss;
+        ss << msg << " expr:" << last_compiled_statement;
+        throw VirtualFPUException(ss.str());
+    }
 
-        auto lu = stack.size();
-        if (lu > 0) {
-            int i = lu - 1;
-            StackItem *item = stack[i];
-            if (item->instr != Instruction::VALUE) {
-                --i;
-                if (i < 0) {
-                    throwError("Invalid stack:found operation without operand.Reached end of stack");
-                }
-                StackItem *op1 = stack[i];
-                if (op1->instr != Instruction::VALUE) {
-                    throwError("Invalid stack:found operation without operand.");
-                }
-                if (isFunction(item->instr) || item->instr == Instruction::UNARY_MINUS) {
+    ////////////////////// FormulaStore //////////////////////////////////////////////
 
-                    evaluateUnary(op1, item);
-                    op1->defVar = ""s;
-                    delete stack[lu - 1];
-                    stack.pop_back();
-                    return true;
+    struct FormulaStore::Dag {
+        static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
 
-                } else if (item->instr == Instruction::DEF_FUNCTION) {
-                    evaluateCustomFn(op1, item);
-                    op1->defVar = ""s;
-                    delete stack[lu - 1];
-                    stack.pop_back();
-                    return true;
+        /**
+         * Subexpression: an operand (a constant or a name) or an operation applied to the nodes left and right
+         */
+        struct Node {
+            double value;
+            uint32_t left;
+            uint32_t right;
+            uint32_t name;
+            Instruction instr;
 
-                }
-                else {
+            bool operator==(const Node &other) const noexcept {
+                return instr == other.instr && left == other.left && right == other.right && name == other.name
+                        && std::bit_cast<uint64_t>(value) == std::bit_cast<uint64_t>(other.value);
+            }
+        };
+
+        std::pmr::vector<Node> nodes;
+        /**
+         * Open addressing hash table of the nodes (node+1, 0 if empty), at most half full
+         */
+        std::pmr::vector<uint32_t> table;
+        /**
+         * Names of the variables and of the custom functions, each one stored once
+         */
+        std::pmr::map<std::pmr::string, uint32_t, std::less<>> nameIndex;
+        std::pmr::vector<const std::pmr::string*> names;
+        /**
+         * Root node of each formula
+         */
+        std::pmr::vector<uint32_t> roots;
+        /**
+         * Instructions of the formulas compiled one by one and their bytes
+         */
+        size_t instructions;
+        size_t instructionBytes;
+
+        explicit Dag(std::pmr::memory_resource *resource) : nodes(resource), table(64, 0, resource), nameIndex(resource), names(resource), roots(resource),
+        instructions(0), instructionBytes(0) {
+        }
 
-                    switch (item->instr) {
+        static size_t hash(const Node &node) noexcept {
+            uint64_t h = std::bit_cast<uint64_t>(node.value);
+            h = (h ^ (static_cast<uint64_t> (node.left) << 32 | node.right)) * 0x9E3779B97F4A7C15ull;
+            h = (h ^ (h >> 31) ^ (static_cast<uint64_t> (node.name) << 8 | static_cast<uint64_t> (node.instr))) * 0xBF58476D1CE4E5B9ull;
+            return static_cast<size_t> (h ^ (h >> 29));
+        }
 
-                        case Instruction::ADD:
-                        case Instruction::SUB:
-                        case Instruction::DIV:
-                        case Instruction::MUL:
-                        case Instruction::POW:
-                        {
-                            --i;
-                            if (i < 0) {
-                                throwError("Invalid stack:missing second operand");
-                            }
-                            StackItem *op2 = stack[i];
-                            if (op2->instr != Instruction::VALUE) {
-                                throwError("Invalid stack:value expected.");
-                            }
+        /**
+         * @return the node equal to node, added if not stored yet
+         */
+        uint32_t intern(const Node &node) {
 
-                            op2->value = evaluateOperation(op2, op1, item);
-                            op2->defVar = ""s;
+            size_t mask = table.size() - 1;
 
-                            delete stack[lu - 1];
-                            delete stack[lu - 2];
-                            stack.pop_back();
-                            stack.pop_back();
-                        }
-                            return true;
-                        default:
-                            throwError("Unhandled instruction");
-                            return false;
-                            break;
+            for (size_t i = hash(node) & mask;; i = (i + 1) & mask) {
+                if (table[i] == 0) {
+                    if (nodes.size() >= NONE - 1) {
+                        throw VirtualFPUException("Error:The formula store is full");
                     }
+                    nodes.push_back(node);
+                    table[i] = static_cast<uint32_t> (nodes.size());
+                    break;
+                }
+                if (nodes[table[i] - 1] == node) {
+                    return table[i] - 1;
                 }
             }
-        }
 
-        return false;
+            if (2 * nodes.size() > table.size()) {
+                std::pmr::vector<uint32_t> larger(table.size() * 2, 0, table.get_allocator());
+                mask = larger.size() - 1;
+                for (size_t n = 0; n < nodes.size(); ++n) {
+                    size_t i = hash(nodes[n]) & mask;
+                    while (larger[i] != 0) {
+                        i = (i + 1) & mask;
+                    }
+                    larger[i] = static_cast<uint32_t> (n + 1);
+                }
+                table.swap(larger);
+            }
 
-    }//end reduceStack
+            return static_cast<uint32_t> (nodes.size() - 1);
+        }
 
-    double RPNCompiler::evaluate() {
+        uint32_t internName(std::string_view name) {
+            auto it = nameIndex.find(name);
+            if (it == nameIndex.end()) {
+                it = nameIndex.emplace(std::pmr::string(name, nameIndex.get_allocator()), static_cast<uint32_t> (names.size())).first;
+                names.push_back(&it->first);
+            }
+            return it->second;
+        }
+    };
 
+    static bool isBinaryInstruction(Instruction instr) noexcept {
+        switch (instr) {
+            case Instruction::ADD:
+            case Instruction::SUB:
+            case Instruction::MUL:
+            case Instruction::DIV:
+            case Instruction::POW:
+            case Instruction::LT:
+            case Instruction::GT:
+            case Instruction::LE:
+            case Instruction::GE:
+            case Instruction::EQ:
+            case Instruction::NE:
+                return true;
+            default:
+                return false;
+        }
+    }
 
-        if (!instrVector || instrVector->empty()) {
-            throw VirtualFPUException("Compile an expression before evaluating");
+    /**
+     * Constant of an expression, read back by the parser as the same double (no exponent, the sign as unary minus)
+     */
+    static string formulaLiteral(double value) {
+        if (std::isnan(value)) {
+            return "(0/0)";
         }
+        if (std::isinf(value)) {
+            return value > 0 ? "(1/0)" : "(-1/0)";
+        }
+        char buffer[400];
+        const auto r = std::to_chars(buffer, buffer + sizeof (buffer), std::fabs(value), std::chars_format::fixed);
+        const string literal(buffer, r.ptr);
+        return std::signbit(value) ? "(-" + literal + ")" : literal;
+    }
 
-        auto rpnEval = instrVector;
-        auto executeStack = vector<StackItem*>{};
-        try {
-            for (auto it = rpnEval->begin(); it < rpnEval->end(); ++it) {
-                StackItem *si = *it;
-                executeStack.push_back(si->clone());
-                while (reduceStack(executeStack)) {
-                }
-            }
+    FormulaStore::FormulaStore(std::pmr::memory_resource *resource) : allocator(resource), dag(nullptr) {
+        dag = allocator.new_object<Dag>(resource);
+    }
 
-            if (executeStack.size() == 1 && executeStack[0]->instr == Instruction::VALUE) {
+    FormulaStore::~FormulaStore() {
+        allocator.delete_object(dag);
+    }
 
-                double r = executeStack[0]->value;
-                delete executeStack[0];
-                return r;
-            } else {
-                throw VirtualFPUException("Error evaluating expression " + last_compiled_statement);
+    size_t FormulaStore::size() const noexcept {
+        return dag->roots.size();
+    }
+
+    void FormulaStore::expand(size_t formula, std::pmr::vector<uint32_t> &rpn) const {
+
+        if (formula >= dag->roots.size()) {
+            throw VirtualFPUException("Error:Formula " + std::to_string(formula) + " is not in the store");
+        }
+
+        //depth first, a node follows its operands
+        std::pmr::vector<std::pair<uint32_t, bool>> pending(rpn.get_allocator());
+        pending.emplace_back(dag->roots[formula], false);
+
+        while (!pending.empty()) {
+            const auto [n, expanded] = pending.back();
+            pending.pop_back();
+            const Dag::Node &node = dag->nodes[n];
+            if (expanded || node.left == Dag::NONE) {
+                rpn.push_back(n);
+                continue;
             }
-        } catch (VirtualFPUException &e) {
-            stringstream ss;
-            ss << "Error:" << e.getMessage();
-            for (int i = 0; i < executeStack.size(); ++i) {
-                delete executeStack[i];
+            pending.emplace_back(n, true);
+            if (node.right != Dag::NONE) {
+                pending.emplace_back(node.right, false);
             }
-            throw VirtualFPUException(ss.str());
+            pending.emplace_back(node.left, false);
         }
     }
 
-    StackItem * RPNCompiler::evaluateUnary(StackItem *operand, StackItem * operation) {
-        std::function<double(double) > fn = oneArgFunctions[operation->instr];
-        if (!fn) {
-            throwError("Cannot find the built-in one arg function "s + symToStr[operation->instr]);
-            return nullptr;
+    string FormulaStore::toString(size_t formula) const {
+
+        if (formula >= dag->roots.size()) {
+            throw VirtualFPUException("Error:Formula " + std::to_string(formula) + " is not in the store");
         }
-        operand->value = fn(getValue(operand));
-        operand->defVar = "";
-        return operand;
-    }
 
-    StackItem* RPNCompiler::evaluateCustomFn(StackItem *operand, StackItem * operation) {
+        string text;
+
+        //depth first, an operation is written in three steps: before, between and after its operands
+        std::pmr::vector<std::pair<uint32_t, int>> pending(allocator);
+        pending.emplace_back(dag->roots[formula], 0);
 
-        std::function<double(double) > fn = defFunctions->at(operation->defVar);
-        if (!fn) {
-            throwError("Cannot find custom function "s + operation->defVar);
+        while (!pending.empty()) {
+            const auto [n, step] = pending.back();
+            pending.pop_back();
+            const Dag::Node &node = dag->nodes[n];
+
+            if (node.instr == Instruction::VALUE) {
+                text += node.name != Dag::NONE ? std::string_view(*dag->names[node.name]) : std::string_view(formulaLiteral(node.value));
+                continue;
+            }
+
+            if (step == 0) {
+                if (isBinaryInstruction(node.instr)) {
+                    text += '(';
+                } else if (node.instr == Instruction::UNARY_MINUS) {
+                    text += "(-";
+                } else {
+                    text += node.instr == Instruction::DEF_FUNCTION ? std::string_view(*dag->names[node.name]) : std::string_view(symToStr.at(node.instr));
+                    text += '(';
+                }
+                pending.emplace_back(n, node.right != Dag::NONE ? 1 : 2);
+                pending.emplace_back(node.left, 0);
+            } else if (step == 1) {
+                text += symToStr.at(node.instr);
+                pending.emplace_back(n, 2);
+                pending.emplace_back(node.right, 0);
+            } else {
+                text += ')';
+            }
         }
-        operand->value = fn(getValue(operand));
-        operand->defVar = "";
-        return operand;
-    }
 
-    double RPNCompiler::getValue(StackItem * operand) {
-        return operand->defVar.empty() ? operand->value : getVar(operand->defVar);
+        return text;
     }
 
-    double RPNCompiler::evaluateOperation(StackItem *op1, StackItem *op2, StackItem * operation) {
+    StoreFootprint FormulaStore::getFootprint() const {
 
-        switch (operation->instr) {
-            case Instruction::ADD:
-                return getValue(op1) + getValue(op2);
-            case Instruction::SUB:
-            case Instruction::UNARY_MINUS:
+        StoreFootprint footprint{};
 
-                return getValue(op1) - getValue(op2);
+        footprint.formulas = dag->roots.size();
+        footprint.nodes = dag->nodes.size();
+        footprint.instructions = dag->instructions;
+        footprint.names = dag->names.size();
+        footprint.instructionBytes = dag->instructionBytes;
 
-            case Instruction::MUL:
+        //a name is a node of the map (about four pointers besides its pair) and a pointer of names
+        const size_t sso = std::pmr::string().capacity();
+        size_t nameBytes = 0;
+        for (const auto &[name, index] : dag->nameIndex) {
+            nameBytes += sizeof (std::pair<const std::pmr::string, uint32_t>) + 4 * sizeof (void*) + sizeof (const std::pmr::string*)
+                    + (name.capacity() > sso ? name.capacity() + 1 : 0);
+        }
 
-                return getValue(op1) * getValue(op2);
+        footprint.bytes = sizeof (Dag) + dag->nodes.capacity() * sizeof (Dag::Node) + dag->table.capacity() * sizeof (uint32_t)
+                + dag->roots.capacity() * sizeof (uint32_t) + nameBytes;
+        footprint.ratio = static_cast<double> (footprint.instructionBytes) / static_cast<double> (footprint.bytes);
 
-                break;
-            case Instruction::DIV:
-                return getValue(op1) / getValue(op2);
-            case Instruction::POW:
-                return pow(getValue(op1), getValue(op2));
-            default:
-                throwError("Unsupported function for two operands");
-                return 0.0;
+        return footprint;
+    }
+
+    size_t RPNCompiler::intern(FormulaStore &store) const {
+
+        if (!instrVector || instrVector->empty()) {
+            throw VirtualFPUException("Compile an expression before interning it");
         }
 
-    }
+        if (!loops->all.empty()) {
+            throw VirtualFPUException("Error:Expressions with sum or prod cannot be interned");
+        }
 
-    size_t RPNCompiler::getStackSize() const {
-        return instrVector->size();
-    }
+        FormulaStore::Dag &dag = *store.dag;
+        const size_t sso = std::pmr::string().capacity();
+        size_t nameBytes = 0;
 
-    size_t RPNCompiler::stackLength() const {
-        return instrVector->size();
-    }
+        std::pmr::vector<uint32_t> operands(allocator);
 
-    bool RPNCompiler::stackIsEmpty() const {
-        return instrVector->empty();
-    }
+        for (const StackItem *item : *instrVector) {
 
-    void RPNCompiler::clearStack() {
+            FormulaStore::Dag::Node node{0, FormulaStore::Dag::NONE, FormulaStore::Dag::NONE, FormulaStore::Dag::NONE, item->instr};
 
-        if (instrVector && instrVector->size() > 0) {
+            if (item->instr != Instruction::VALUE) {
+                if (isBinaryInstruction(item->instr)) {
+                    node.right = operands.back();
+                    operands.pop_back();
+                }
+                node.left = operands.back();
+                operands.pop_back();
+            }
 
-            for (int i = 0; i < instrVector->size(); ++i) {
-                delete instrVector->at(i);
+            if (!item->defVar.empty()) {
+                node.name = dag.internName(item->defVar);
+                nameBytes += item->defVar.capacity() > sso ? item->defVar.capacity() + 1 : 0;
+            } else if (item->instr == Instruction::VALUE) {
+                node.value = item->value;
             }
 
-            instrVector->clear();
+            operands.push_back(dag.intern(node));
         }
+
+        dag.roots.push_back(operands.back());
+        dag.instructions += instrVector->size();
+        dag.instructionBytes += instrVector->size() * (sizeof (StackItem*) + sizeof (StackItem)) + program->size() * sizeof (Op) + nameBytes;
+
+        return dag.roots.size() - 1;
     }
 
-    string RPNCompiler::getRPNStack() const {
+    RPNCompiler& RPNCompiler::compile(const FormulaStore &store, size_t formula) {
 
-        ostringstream ss;
+        const string statement = store.toString(formula);
 
-        for (vector<StackItem*>::iterator it = instrVector->begin(); it != instrVector->end(); it++) {
+        clearStack();
 
-            StackItem* instr = *it;
+        last_compiled_statement = statement;
 
-            StackItem& t = (*instr);
+        try {
 
-            ss << t << ',';
+            std::pmr::vector<uint32_t> rpn(allocator);
+            store.expand(formula, rpn);
 
-        }
+            for (uint32_t n : rpn) {
+                const FormulaStore::Dag::Node &node = store.dag->nodes[n];
+                StackItem *s = newItem();
+                instrVector->push_back(s);
+                s->instr = node.instr;
+                s->value = node.value;
+                if (node.name != FormulaStore::Dag::NONE) {
+                    s->defVar = *store.dag->names[node.name];
+                }
+            }
 
-        return ss.str();
-    }
+            Diagnostic error;
+            maxStackDepth = verifyProgram(error);
 
-    double RPNCompiler::queryOutputRegister() const {
-        return output;
-    }
+            if (maxStackDepth == 0) {
+                throwError(error.message());
+            }
 
-    void RPNCompiler::validateIndentifier(const string &name) {
-        if (name == "") {
-            throwError(string("Identifier name not set"));
+            executeStack->resize(maxStackDepth);
+
+            buildProgram();
+
+        } catch (...) {
+            clearStack();
+            throw;
         }
 
-        if (name.find(' ') != string::npos) throw VirtualFPUException("Invalid identifier name "s + name + ":space is not allowed."s);
+        return *this;
+    }
 
-        const size_t lu = name.length();
+    ////////////////////// EvaluationQueue //////////////////////////////////////////////
 
-        if (!isalpha(name[0])) {
-            throwError(string("Variabile name must start with a letter."));
-        }
+    const size_t EvaluationQueue::LATENCY_SAMPLES;
 
-        for (size_t i = 0; i < lu; i++) {
+    using QueueClock = std::chrono::steady_clock;
 
-            if (!isalnum((name[i]))) {
-                throwError(string("Invalid variabile name:" + name));
+    /**
+     * Requests of an expression: a column of values for each variable and the promises of the rows
+     */
+    struct QueueBatch {
+        vector<vector<double>> columns;
+        vector<std::promise<double>> results;
+        vector<QueueClock::time_point> submitted;
+
+        void clear() {
+            for (auto &column : columns) {
+                column.clear();
             }
+            results.clear();
+            submitted.clear();
         }
+    };
 
-    }
+    /**
+     * Compiled expression of the queue
+     */
+    struct QueueGroup {
+        RPNCompiler fpu;
+        /**
+         * variables of the expression, in the order of the columns
+         */
+        vector<string> variables;
+        /**
+         * requests waiting for the worker (guarded by the queue mutex)
+         */
+        QueueBatch pending;
+        /**
+         * requests taken by the worker (touched only by the worker)
+         */
+        QueueBatch work;
+        vector<double> out;
+
+        explicit QueueGroup(std::pmr::memory_resource *resource) : fpu(resource) {
+        }
+    };
 
-    void RPNCompiler::defineVar(const string &name, double value) {
+    struct EvaluationQueue::State {
+        size_t maxBatchSize;
+        std::chrono::microseconds maxLatency;
+        std::pmr::memory_resource *resource;
+
+        mutable std::mutex mutex;
+        std::condition_variable wakeup;
+        std::map<string, QueueGroup, std::less<>> groups;
+        size_t pendingCount = 0;
+        QueueClock::time_point oldest;
+        bool flushRequested = false;
+        bool stopped = false;
+
+        size_t submitted = 0;
+        /**
+         * counted before the futures are fulfilled: a producer reading the statistics after get sees its requests
+         */
+        std::atomic<size_t> completed{0};
+        std::atomic<size_t> batches{0};
+        vector<double> latencies;
+        size_t latencyCount = 0;
+
+        std::thread worker;
+    };
 
-        validateIndentifier(name);
+    EvaluationQueue::EvaluationQueue(size_t maxBatchSize, std::chrono::microseconds maxLatency, std::pmr::memory_resource *resource) : allocator(resource), state(nullptr) {
 
-        if (!defVars->contains(name) && defFunctions->contains(name)) {
-            throw VirtualFPUException("Variable name "s + name + " conflicts with an already defined function");
+        if (maxBatchSize == 0) {
+            throw VirtualFPUException("Invalid batch size of the evaluation queue");
         }
 
-        (*defVars)[name] = value;
+        state = allocator.new_object<State>();
+        state->maxBatchSize = maxBatchSize;
+        state->maxLatency = maxLatency;
+        state->resource = resource;
+        state->latencies.resize(LATENCY_SAMPLES);
+        state->worker = std::thread(&EvaluationQueue::run, this);
     }
 
-    void RPNCompiler::undefVar(const string & name) {
+    EvaluationQueue::~EvaluationQueue() {
 
-        if (defVars->find(name) != defVars->end()) {
-            defVars->erase(name);
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->stopped = true;
         }
+
+        state->wakeup.notify_one();
+        state->worker.join();
+
+        allocator.delete_object(state);
+        state = nullptr;
     }
 
-    void RPNCompiler::defineFunction(const string &name, std::function<double(double) > fn) {
-        validateIndentifier(name);
+    std::future<double> EvaluationQueue::submit(const string &expression, const vector<std::pair<string, double>> &vars) {
 
-        if (!defFunctions->contains(name) && defVars->contains(name)) {
-            throw VirtualFPUException("Function name "s + name + " conflicts with an already defined variable");
+        std::promise<double> result;
+        std::future<double> future = result.get_future();
+        bool wake;
+
+        try {
+            std::lock_guard<std::mutex> lock(state->mutex);
+
+            auto it = state->groups.find(expression);
+
+            if (it == state->groups.end()) {
+                //first request of the expression: compile it with the variables of the request
+                it = state->groups.try_emplace(expression, state->resource).first;
+                QueueGroup &group = it->second;
+                try {
+                    for (const auto &[name, value] : vars) {
+                        group.fpu.defineVar(name, value);
+                    }
+                    group.fpu.compile(expression);
+                } catch (...) {
+                    state->groups.erase(it);
+                    throw;
+                }
+                group.variables = group.fpu.getVariables();
+                group.pending.columns.resize(group.variables.size());
+                group.work.columns.resize(group.variables.size());
+            }
+
+            QueueGroup &group = it->second;
+            QueueBatch &pending = group.pending;
+
+            for (size_t k = 0; k < group.variables.size(); ++k) {
+                auto v = std::find_if(vars.begin(), vars.end(), [&group, k](const std::pair<string, double> &var) {
+                    return var.first == group.variables[k];
+                });
+                if (v == vars.end()) {
+                    for (size_t j = 0; j < k; ++j) {
+                        pending.columns[j].pop_back();
+                    }
+                    throw VirtualFPUException("Variabile " + group.variables[k] + " is not defined! expr:" + expression);
+                }
+                pending.columns[k].push_back(v->second);
+            }
+
+            pending.submitted.push_back(QueueClock::now());
+            pending.results.push_back(std::move(result));
+
+            if (state->pendingCount++ == 0) {
+                state->oldest = pending.submitted.back();
+            }
+            ++state->submitted;
+
+            //the worker waits for the first request, then for a full batch or the latency bound
+            wake = state->pendingCount == 1 || state->pendingCount == state->maxBatchSize;
+
+        } catch (...) {
+            result.set_exception(std::current_exception());
+            return future;
         }
 
-        (*defFunctions)[name] = fn;
+        if (wake) {
+            state->wakeup.notify_one();
+        }
 
+        return future;
     }
 
-    void RPNCompiler::undefFunction(const string &name) {
-        if (defFunctions->find(name) != defFunctions->end()) {
-            defFunctions->erase(name);
+    void EvaluationQueue::flush() {
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->flushRequested = true;
         }
+        state->wakeup.notify_one();
     }
 
-    bool RPNCompiler::isVarDefined(const string & name) {
-        return defVars->find(name) != defVars->end();
-    }
+    /**
+     * Evaluate the requests taken from a group in batches of maxBatchSize rows,
+     * the latencies of the requests are appended to latencies, the batches and the requests are counted before fulfilling the futures
+     */
+    static void evaluateGroup(QueueGroup &group, size_t maxBatchSize, vector<double> &latencies, std::atomic<size_t> &batches, std::atomic<size_t> &completed) {
 
-    bool RPNCompiler::isFnDefined(const string &name) {
-        return defFunctions->find(name) != defFunctions->end();
-    }
+        QueueBatch &work = group.work;
+        const size_t rows = work.results.size();
+        vector<ColumnBinding> bindings(group.variables.size());
 
-    double RPNCompiler::getVar(const string & varName) {
+        group.out.resize(std::min(rows, maxBatchSize));
 
-        if (!defVars->count(varName)) {
-            throwError(string("Variabile ") + varName + string(" is not defined!"));
+        for (size_t first = 0; first < rows; first += maxBatchSize) {
+
+            const size_t count = std::min(maxBatchSize, rows - first);
+
+            for (size_t k = 0; k < bindings.size(); ++k) {
+                bindings[k] = ColumnBinding{group.variables[k], work.columns[k].data() + first};
+            }
+
+            batches.fetch_add(1, std::memory_order_relaxed);
+            completed.fetch_add(count, std::memory_order_relaxed);
+
+            try {
+                group.fpu.evaluateBatch(bindings, count, group.out.data());
+                for (size_t r = 0; r < count; ++r) {
+                    work.results[first + r].set_value(group.out[r]);
+                }
+            } catch (...) {
+                for (size_t r = 0; r < count; ++r) {
+                    work.results[first + r].set_exception(std::current_exception());
+                }
+            }
+
+            const auto now = QueueClock::now();
+            for (size_t r = 0; r < count; ++r) {
+                latencies.push_back(std::chrono::duration<double, std::micro>(now - work.submitted[first + r]).count());
+            }
         }
-        return defVars->at(varName);
 
+        work.clear();
     }
 
-    void RPNCompiler::clearAllVariables() {
+    void EvaluationQueue::run() {
 
-        defVars->clear();
+        State &s = *state;
+        vector<QueueGroup*> work;
+        vector<double> latencies;
 
-    }
+        std::unique_lock<std::mutex> lock(s.mutex);
 
-    void RPNCompiler::clearAllCustomFunctions() {
-        defFunctions->clear();
-    }
+        while (true) {
 
-    void RPNCompiler::init(size_t stackSize) {
+            s.wakeup.wait(lock, [&s]() {
+                return s.stopped || s.flushRequested || s.pendingCount > 0;
+            });
 
-        if (stackSize <= 0) {
-            throwError("Invalid stack size on init");
-        }
+            if (s.pendingCount == 0) {
+                s.flushRequested = false;
+                if (s.stopped) {
+                    break;
+                }
+                continue;
+            }
+
+            //micro-batching: wait for more requests until the batch is full or the oldest request is late
+            s.wakeup.wait_until(lock, s.oldest + s.maxLatency, [&s]() {
+                return s.stopped || s.flushRequested || s.pendingCount >= s.maxBatchSize;
+            });
+
+            //take the pending requests, the producers keep filling the other buffers of the groups
+            work.clear();
+            for (auto &[expression, group] : s.groups) {
+                if (!group.pending.results.empty()) {
+                    std::swap(group.pending, group.work);
+                    work.push_back(&group);
+                }
+            }
+            s.pendingCount = 0;
+            s.flushRequested = false;
 
-        instrVector = new vector<StackItem*>();
+            lock.unlock();
 
+            latencies.clear();
+            for (QueueGroup *group : work) {
+                evaluateGroup(*group, s.maxBatchSize, latencies, s.batches, s.completed);
+            }
 
-        defVars = new map<string, double>();
-        defFunctions = new map<string, std::function<double(double) >>();
+            lock.lock();
 
+            for (double latency : latencies) {
+                s.latencies[s.latencyCount++ % LATENCY_SAMPLES] = latency;
+            }
+        }
     }
 
-    void RPNCompiler::throwError(const string & msg) {
-        stringstream ss;
-        ss << msg << " expr:" << last_compiled_statement;
-        throw VirtualFPUException(ss.str());
+    QueueStats EvaluationQueue::getStats() const {
+
+        std::lock_guard<std::mutex> lock(state->mutex);
+
+        QueueStats stats{};
+        stats.submitted = state->submitted;
+        stats.completed = state->completed.load(std::memory_order_relaxed);
+        stats.batches = state->batches.load(std::memory_order_relaxed);
+        stats.meanBatchSize = stats.batches ? static_cast<double> (stats.completed) / stats.batches : 0;
+
+        const size_t n = std::min(state->latencyCount, LATENCY_SAMPLES);
+        if (n > 0) {
+            vector<double> sorted(state->latencies.begin(), state->latencies.begin() + n);
+            std::sort(sorted.begin(), sorted.end());
+            stats.latencyP50 = sorted[(n - 1) / 2];
+            stats.latencyP99 = sorted[static_cast<size_t> (std::ceil(0.99 * n)) - 1];
+            stats.latencyMax = sorted.back();
+        }
+
+        return stats;
     }
 
 }; //end namespace
\ No newline at end of file
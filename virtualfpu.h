@@ -41,6 +41,15 @@
 #include <vector>
 #include <iostream>
 #include <functional>
+#include <cstdint>
+#include <exception>
+#include <atomic>
+#include <string_view>
+#include <memory_resource>
+#include <memory>
+#include <future>
+#include <chrono>
+#include <span>
 
 namespace virtualfpu {
 
@@ -50,7 +59,8 @@ namespace virtualfpu {
      * Available operators and functions
      */
     enum class Instruction {
-        VALUE, PAR_OPEN, PAR_CLOSE, UNARY_MINUS, ADD, SUB, MUL, DIV, POW,DEF_FUNCTION, SQRT, SIN, COS, TAN, ASIN, ACOS, ATAN, ABS, EXP, LOG, LOG10, LOG2, SINH, COSH, TANH, ASINH, ACOSH, ATANH, SIGN
+        VALUE, PAR_OPEN, PAR_CLOSE, UNARY_MINUS, ADD, SUB, MUL, DIV, POW,DEF_FUNCTION, SQRT, SIN, COS, TAN, ASIN, ACOS, ATAN, ABS, EXP, LOG, LOG10, LOG2, SINH, COSH, TANH, ASINH, ACOSH, ATANH, SIGN,
+        LT, GT, LE, GE, EQ, NE
     };
 
     class VirtualFPUException : public std::exception {
@@ -75,9 +85,20 @@ namespace virtualfpu {
      * RPN stack item
      */
     struct StackItem {
-        Instruction instr;
-        double value;
-        string defVar;
+        using allocator_type = std::pmr::polymorphic_allocator<>;
+
+        Instruction instr = Instruction::VALUE;
+        double value = 0;
+        std::pmr::string defVar;
+
+        StackItem() = default;
+
+        /**
+         * Create an item whose variable/function name is allocated from the allocator resource
+         */
+        explicit StackItem(const allocator_type& alloc);
+
+        StackItem(const StackItem& other, const allocator_type& alloc);
 
         /**
          Converte da stringa ad operatore
@@ -92,221 +113,2088 @@ namespace virtualfpu {
     ostream& operator<<(ostream& s, const StackItem& item);
 
     /**
-     * Mathematical expressions compiler and evaluator.
-     * Converta the expression in a RPN (Reverse Polish Notation) before evaluation
+     * Memory resource that counts the allocations forwarded to an upstream resource.
+     * Useful to check that the compiler does not allocate after a warm up, e.g.
+     * CountingMemoryResource counter;
+     * RPNCompiler fpu(&counter);
+     * fpu.compile("x*2");
+     * fpu.evaluate();
+     * auto n=counter.allocations();
+     * fpu.evaluate(); //counter.allocations() is still n
      */
-    class RPNCompiler {
+    class CountingMemoryResource : public std::pmr::memory_resource {
     public:
 
-        static const size_t DEFAULT_STACK_SIZE = 1024;
+        explicit CountingMemoryResource(std::pmr::memory_resource *upstream = std::pmr::get_default_resource());
 
+        /**
+         * Number of allocate calls
+         */
+        size_t allocations() const noexcept;
 
+        /**
+         * Number of deallocate calls
+         */
+        size_t deallocations() const noexcept;
 
+        /**
+         * Bytes currently allocated (allocated - deallocated)
+         */
+        size_t bytesInUse() const noexcept;
 
+        /**
+         * Total bytes requested since the creation or the last reset
+         */
+        size_t bytesAllocated() const noexcept;
 
         /**
-         * Create the compiler using a predefined RPN stack size 
-         * 
+         * Reset the counters (the bytes in use are not affected)
          */
-        RPNCompiler(size_t stackSize);
+        void reset() noexcept;
+
+    protected:
+
+        void* do_allocate(size_t bytes, size_t alignment) override;
+
+        void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+
+    private:
+
+        std::pmr::memory_resource *upstream;
+        std::atomic<size_t> allocCount{0};
+        std::atomic<size_t> deallocCount{0};
+        std::atomic<size_t> totalBytes{0};
+        std::atomic<size_t> inUseBytes{0};
+
+    };
+
+    /**
+     * Latency histogram with power of two buckets: bucket i counts the latencies below 2^i nanoseconds
+     * (and not counted by the previous bucket), the last bucket counts the longer latencies
+     */
+    struct LatencyHistogram {
+        static const size_t BUCKETS = 36;
 
+        size_t counts[BUCKETS];
         /**
-         * Create the compiler using the DEFAULT_STACK_SIZE
+         * latencies counted
          */
-        RPNCompiler();
+        size_t count;
+        /**
+         * sum of the latencies in nanoseconds
+         */
+        size_t sumNs;
 
-        virtual ~RPNCompiler();
+        /**
+         * @return upper bound in nanoseconds of bucket i (not for the last bucket)
+         */
+        static double upperBoundNs(size_t i) noexcept {
+            return static_cast<double> (size_t(1) << i);
+        }
 
         /**
-         * Compile a mathematical expression.
-         * After the compilation a RPN stack is created internally and the evaluate method can be used to evalute the expression
-         * @param statement example "4*(2.3*sin(1/(1+4.56)))/8, expressions can use user defined variable see the method defineVar
+         * @return upper bound in nanoseconds of the bucket containing the p-th percentile (0 < p <= 100),
+         * infinity in the last bucket, 0 if there are no latencies
          */
-        RPNCompiler& compile(const string& statement);
+        double percentileNs(double p) const noexcept;
+    };
 
+    /**
+     * Metrics collected by a MetricsRegistry
+     */
+    struct MetricsSnapshot {
         /**
-         * Evaluate the expression.Before calling this method the expression must be compiled using the compile method
-         * @return 
+         * calls of compile, and the calls failed with an exception
          */
-        double evaluate();
+        size_t compiles;
+        size_t compileErrors;
+        LatencyHistogram compileLatency;
+        /**
+         * calls of evaluate, and the calls failed with an exception
+         */
+        size_t evaluations;
+        size_t evaluateErrors;
+        /**
+         * latency of one evaluation every MetricsRegistry::getSampling()
+         */
+        LatencyHistogram evaluateLatency;
+        /**
+         * rows evaluated by evaluateBatch
+         */
+        size_t batchRows;
+        /**
+         * allocations of the compilers using the memory resource of the registry (see CountingMemoryResource)
+         */
+        size_t allocations;
+        size_t deallocations;
+        size_t bytesAllocated;
+        size_t bytesInUse;
+    };
+
+    /**
+     * Operational metrics of a set of compilers (see RPNCompiler::setMetrics), shared by many threads.
+     * Each thread updates its own shard of counters with relaxed atomics, the shards are added up by snapshot.
+     * The latency of compile is measured on every call, the latency of evaluate on one call every sampling calls;
+     * the evaluations of a compiler are published at each sampled call and when its metrics are changed or it is destroyed.
+     * Example:
+     * MetricsRegistry metrics;
+     * RPNCompiler fpu(metrics.getMemoryResource());
+     * fpu.setMetrics(&metrics);
+     * ...
+     * cout << metrics.toPrometheus();
+     */
+    class MetricsRegistry {
+    public:
 
+        static const unsigned DEFAULT_SAMPLING = 64;
 
         /**
-         * Max stack size
-         * @return 
+         * Counters of the threads are spread over SHARDS shards
          */
-        size_t getStackSize() const;
+        static const size_t SHARDS = 16;
 
         /**
-         * Actual number of instructions inside the internal stack
-         * @return 
+         * @param sampling an evaluation every sampling is timed (at least 1)
+         * @param upstream memory resource allocating for the compilers using getMemoryResource
          */
-        size_t stackLength() const;
+        explicit MetricsRegistry(unsigned sampling = DEFAULT_SAMPLING, std::pmr::memory_resource *upstream = std::pmr::get_default_resource());
+
+        virtual ~MetricsRegistry();
+
+        MetricsRegistry(const MetricsRegistry&) = delete;
+
+        MetricsRegistry& operator=(const MetricsRegistry&) = delete;
 
         /**
-         * Checks if the instructions stack is empty
+         * @return the memory resource counting the allocations reported by snapshot
          */
-        bool stackIsEmpty() const;
+        std::pmr::memory_resource* getMemoryResource() noexcept;
 
+        unsigned getSampling() const noexcept;
 
         /**
-         * Clear the instructions stack.After calling this method an expression must be compiled again before evaluating
-         * @return 
+         * @return the sum of the counters of all the threads (thread safe)
          */
-        void clearStack();
+        MetricsSnapshot snapshot() const;
 
+        /**
+         * @return the metrics as a JSON object
+         */
+        string toJson() const;
 
         /**
-         * @return the RPN (Reverse Polish Notation) of the expression
+         * @return the metrics in the Prometheus text exposition format, latencies in seconds
+         * @param prefix prefix of the metric names
          */
-        string getRPNStack() const;
+        string toPrometheus(const string &prefix = "virtualfpu") const;
 
+        /**
+         * Reset the counters (the bytes in use are not affected)
+         */
+        void reset() noexcept;
 
-        double queryOutputRegister() const;
+        void recordCompile(std::chrono::nanoseconds latency, bool failed) noexcept;
 
         /**
-         * Define a custom variable.The variable can be used in the mathematical expression.
-         * This method may be used to change the current value of an already defined variable.
-         * If the variable was already defined before compilation, the expression can be evaluated using the new value
-         * without compiling the expression again.
-         * @param value variable value
-         * @param name variable name
-         * Example:
-         * defineVar("pi",3.1415);
-         * compile("cos(p1/2)")
+         * Record evaluations, the last one timed
          */
-        void defineVar(const string &name, double value);
+        void recordEvaluations(size_t count, std::chrono::nanoseconds latency) noexcept;
 
         /**
-         * Undefine an existing custom variable
+         * Record evaluations not timed
          */
-        void undefVar(const string &name);
+        void recordEvaluations(size_t count) noexcept;
+
+        void recordEvaluateError() noexcept;
 
+        void recordBatch(size_t rows, bool failed) noexcept;
+
+    private:
+
+        struct Shard;
+
+        CountingMemoryResource counter;
+
+        std::pmr::polymorphic_allocator<> allocator;
+
+        unsigned sampling;
+
+        Shard *shards;
+
+        Shard& shard() noexcept;
+
+    };
+
+    /**
+     * Binds a variable to an array of values (a column) for batch evaluation
+     */
+    struct ColumnBinding {
         /**
-         * Define a custom function
-         * @param name function name identified
-         * @param fn the function
+         * variable name
          */
-        void defineFunction(const string &name, std::function<double(double) > fn);
+        string name;
+        /**
+         * first value, the column must contain at least the number of evaluated rows
+         */
+        const double *data;
+        /**
+         * distance in bytes between two consecutive values, 0 for contiguous values.
+         * Allows to bind a field of an array of structs without copying it (see bindField)
+         */
+        size_t stride = 0;
+    };
 
-        void undefFunction(const string &name);
+    /**
+     * Bind a double field of an array of records to a variable
+     * Example:
+     * struct Particle {double x,y,energy;};
+     * std::vector<Particle> p;
+     * fpu.evaluateBatch({bindField("x",p.data(),&Particle::x),bindField("y",p.data(),&Particle::y)},p.size(),&p[0].energy,sizeof(Particle));
+     * @param name variable name
+     * @param records first record
+     * @param field the field bound to the variable
+     */
+    template<typename T>
+    ColumnBinding bindField(const string &name, const T *records, double T::*field) {
+        return ColumnBinding{name, &(records->*field), sizeof (T)};
+    }
+
+    /**
+     * Column of raw doubles (native byte order) stored in a file, optionally preceded by a header.
+     * The file is memory mapped with a sequential access hint and never read into memory:
+     * the pages already evaluated are released (see release) so the resident memory does not depend on the size of the file.
+     * Memory mapped columns are available on POSIX systems.
+     */
+    class MappedColumn {
+    public:
 
         /**
-         * Check if a variable is defined
+         * @param path column file
+         * @param headerBytes bytes skipped at the beginning of the file, a multiple of sizeof(double) to keep the values aligned
          */
-        bool isVarDefined(const string &name);
+        explicit MappedColumn(const string &path, size_t headerBytes = 0);
+
+        virtual ~MappedColumn();
+
+        MappedColumn(const MappedColumn&) = delete;
+
+        MappedColumn& operator=(const MappedColumn&) = delete;
 
         /**
-         * Chack if is a custom defined function
-         * @param name
-         * @return 
+         * @return number of values
          */
-        bool isFnDefined(const string &name);
+        size_t size() const noexcept;
 
         /**
-         * Get the actual value of a custom defined variable
-         * @param varName the variable symbol
-         * @return the current value
+         * @return first value
          */
-        double getVar(const string &varName);
+        const double* data() const noexcept;
 
         /**
-         * Undefine all custom variables
+         * Bind the column to a variable
          */
-        void clearAllVariables();
-        
+        ColumnBinding bind(const string &name) const;
+
         /**
-         * Undefine all custom define functions
+         * Hint that the values [row,row+count) will be read soon
          */
-        void clearAllCustomFunctions();
+        void willNeed(size_t row, size_t count) const noexcept;
 
+        /**
+         * Release the pages of the values before row, they will not be read again
+         */
+        void release(size_t row) noexcept;
 
-        const string& getLastCompiledStatement();
+    private:
 
+        const char *mapped;
+        size_t mappedSize;
+        size_t headerBytes;
+        size_t released;
+    };
 
-    protected:
+    /**
+     * Destination of the values computed by RPNCompiler::evaluateMapped
+     */
+    class ColumnSink {
+    public:
 
+        virtual ~ColumnSink() = default;
 
         /**
-         * Internal instruction stack
+         * @return storage for the next count values
          */
-        vector<StackItem*> *instrVector;
+        virtual double* reserve(size_t count) = 0;
 
         /**
-         * User defined variables
+         * The count values of the storage returned by reserve have been written
          */
-        map<string, double> *defVars;
+        virtual void commit(size_t count) = 0;
+    };
+
+    /**
+     * Sink writing a memory mapped column file of a known number of values: the values are computed
+     * directly in the mapping and the pages already written are flushed and released
+     */
+    class MappedColumnSink : public ColumnSink {
+    public:
 
         /**
-         * User defined functions
+         * Create (or truncate) the column file
+         * @param path column file
+         * @param rows number of values
+         * @param header bytes written at the beginning of the file, a multiple of sizeof(double) to keep the values aligned
          */
-        map<string, std::function<double(double) >> *defFunctions;
+        MappedColumnSink(const string &path, size_t rows, const string &header = {});
+
+        virtual ~MappedColumnSink();
+
+        MappedColumnSink(const MappedColumnSink&) = delete;
+
+        MappedColumnSink& operator=(const MappedColumnSink&) = delete;
+
+        double* reserve(size_t count) override;
+
+        void commit(size_t count) override;
 
         /**
-         * Current evaluation output
+         * @return values written
          */
-        double output;
+        size_t size() const noexcept;
 
-        string getToken(const string& statement, int fromIndex, int *nextIndex);
+    private:
 
-        double toDouble(const string& token);
+        char *mapped;
+        size_t mappedSize;
+        size_t headerBytes;
+        size_t rows;
+        size_t written;
+        size_t released;
+    };
 
-        bool isNumber(const string& token);
+    /**
+     * Sink writing the values as raw doubles to a stream (a file, a pipe, a socket...)
+     */
+    class StreamColumnSink : public ColumnSink {
+    public:
 
-        bool isOperator(const string& token);
+        explicit StreamColumnSink(std::ostream &out, std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+        double* reserve(size_t count) override;
+
+        void commit(size_t count) override;
+
+    private:
+
+        std::ostream &out;
+        std::pmr::vector<double> buffer;
+    };
 
-        bool isOperator(const Instruction instr);
+    /**
+     * Reduction applied by RPNCompiler::reduce
+     */
+    enum class Reduction {
+        SUM, MIN, MAX, MEAN
+    };
 
+    /**
+     * Result of a reduction
+     */
+    struct ReductionResult {
         /**
-         * Check if the token is a function such as sin, cos
-         * @param token
-         * @return 
+         * reduced value (NaN if no row has been reduced)
          */
-        bool isFunction(const string& token);
+        double value;
+        /**
+         * number of rows reduced (rows evaluated to NaN are not reduced)
+         */
+        size_t count;
+        /**
+         * number of rows evaluated to NaN
+         */
+        size_t nanCount;
+        /**
+         * number of rows evaluated to +Inf or -Inf
+         */
+        size_t infCount;
+    };
 
-        bool isFunction(const Instruction& instr);
+    /**
+     * Distribution of a random variable of RPNCompiler::monteCarlo
+     */
+    enum class Distribution {
+        /**
+         * uniform in [a,b)
+         */
+        UNIFORM,
+        /**
+         * normal with mean a and standard deviation b
+         */
+        NORMAL,
+        /**
+         * exponential of a normal with mean a and standard deviation b
+         */
+        LOGNORMAL
+    };
 
-        bool isFunction(const StackItem* item);
+    /**
+     * Variable of the expression drawn from a distribution, e.g. {"x", Distribution::NORMAL, 0, 1}
+     */
+    struct RandomVariable {
+        string name;
+        Distribution distribution;
+        double a;
+        double b;
+    };
 
-        bool isCustomFunction(const StackItem* item);
+    /**
+     * Quantile sketch with relative accuracy: the values are counted in buckets growing geometrically and
+     * a quantile is returned within accuracy*|value| of the exact one.
+     * Merging adds the counts, so the sketch does not depend on the order of the values and of the merges
+     */
+    class QuantileSketch {
+    public:
 
-        void validateIndentifier(const string &name);
+        static constexpr double DEFAULT_ACCURACY = 0.01;
 
-        /**       
-         * @return a lower value means a lower precedence
-         */
-        int getOperatorPrecedence(const Instruction& instr) noexcept;
+        explicit QuantileSketch(double accuracy = DEFAULT_ACCURACY);
 
-        static bool isBuiltinFunction(const Instruction& instr) noexcept;
+        /**
+         * Count a finite value (NaN and infinite values are ignored)
+         */
+        void add(double value);
 
-    private:
+        /**
+         * Add the values of a sketch with the same accuracy
+         */
+        void merge(const QuantileSketch &other);
 
-        const int TK_NIL = 0;
-        const int TK_NUM = 1;
-        const int TK_OPERATOR = 2;
-        const int TK_FUNCTION = 3;
-        const int TK_OPEN_BRK = 4;
-        const int TK_CLOSE_BRK = 5;
-        const int TK_OTHER = 255;
+        /**
+         * @param q quantile in [0,1], 0.5 is the median
+         * @return the estimated quantile, NaN if the sketch is empty
+         */
+        double quantile(double q) const;
 
-        string last_compiled_statement;
+        /**
+         * @return the values counted
+         */
+        size_t count() const noexcept;
 
-        void init(size_t stackSize);
+        double getAccuracy() const noexcept;
 
-        StackItem* evaluateUnary(StackItem *operand, StackItem *operation);
+    private:
 
-        StackItem* evaluateCustomFn(StackItem *operand, StackItem *operation);
+        /**
+         * Counts of consecutive buckets starting from the bucket offset
+         */
+        struct Buckets {
+            int offset = 0;
+            vector<uint64_t> counts;
 
-        double evaluateOperation(StackItem *op1, StackItem *op2, StackItem *operation);
+            void add(int index, uint64_t n);
+        };
 
-        bool reduceStack(std::vector<StackItem*> &stack);
+        double accuracy;
+        double gamma;
+        double logGamma;
+        /**
+         * buckets of the positive values and of the absolute value of the negative ones
+         */
+        Buckets positive;
+        Buckets negative;
+        uint64_t zeros;
+        size_t total;
+        double min;
+        double max;
 
-        double getValue(StackItem *operand);
+        int bucketOf(double magnitude) const;
 
-        void addImpliedMul(stack<StackItem*> &temp, const int last);
-        void addItemToTempStack(StackItem *item, stack<StackItem*> &stack, const int last);
+        double valueOf(int bucket) const;
+    };
 
-        void throwError(const string &msg);
+    /**
+     * Statistics of a Monte Carlo simulation, computed over the samples evaluated to a finite value
+     */
+    struct MonteCarloResult {
+        /**
+         * samples evaluated to a finite value
+         */
+        size_t count;
+        /**
+         * samples evaluated to NaN
+         */
+        size_t nanCount;
+        /**
+         * samples evaluated to +Inf or -Inf
+         */
+        size_t infCount;
+        double mean;
+        /**
+         * unbiased sample variance
+         */
+        double variance;
+        /**
+         * standard error of the mean
+         */
+        double standardError;
+        double min;
+        double max;
+        QuantileSketch quantiles;
+    };
+
+    /**
+     * Axis of a sampling grid: count values evenly spaced from min to max (both included)
+     */
+    struct GridAxis {
+        /**
+         * variable bound to the axis
+         */
+        string var;
+        double min;
+        double max;
+        size_t count;
+    };
+
+    /**
+     * Quadrature rule used by RPNCompiler::integrate
+     */
+    enum class QuadratureRule {
+        /**
+         * adaptive bisection with the Gauss-Kronrod 7-15 rule, suited for smooth integrands
+         */
+        GAUSS_KRONROD,
+        /**
+         * tanh-sinh (double exponential) rule, suited for integrands with endpoint singularities
+         */
+        TANH_SINH
+    };
+
+    /**
+     * Result of a numerical integration
+     */
+    struct IntegrationResult {
+        /**
+         * integral estimate
+         */
+        double value;
+        /**
+         * estimated absolute error
+         */
+        double errorEstimate;
+        /**
+         * number of evaluations of the integrand
+         */
+        size_t evaluations;
+        /**
+         * number of batch evaluations (one for each refinement level)
+         */
+        size_t batches;
+        /**
+         * false if the tolerance was not reached within the evaluations budget or the integrand is not finite
+         */
+        bool converged;
+    };
+
+    /**
+     * Accuracy of the built-in transcendental functions (see RPNCompiler::setAccuracy).
+     * Errors are measured against the correctly rounded result.
+     */
+    enum class Accuracy {
+        /**
+         * the C library functions (default)
+         */
+        EXACT,
+        /**
+         * inlined range-reduced polynomials for exp, log, log2, log10, sin and cos, vectorized by evaluateBatch:
+         * max error 1 ULP for exp and log, 2 ULP for log2 and log10, 3 ULP for sin and cos.
+         * The other functions, subnormal results and |x| >= 4e5 for sin and cos use the C library
+         */
+        ACCURATE,
+        /**
+         * low degree polynomials for exp, log, log2, log10, sin, cos, sinh, cosh, tanh and pow:
+         * max relative error 1e-7 (absolute error for sin and cos).
+         * pow uses exp(b*log(a)) for a positive base and |b| <= 50.
+         * The other functions and the arguments out of the polynomial domains use the C library
+         */
+        FAST
+    };
+
+    /**
+     * Fusions done by the peephole pass of the compiler (see RPNCompiler::getPeepholeStats)
+     */
+    struct PeepholeStats {
+        /**
+         * instructions of the RPN program
+         */
+        size_t rpnInstructions;
+        /**
+         * instructions dispatched by evaluate after the fusions
+         */
+        size_t programInstructions;
+        /**
+         * constants fused into the operation using them (x*2, x^2, 2*3)
+         */
+        size_t immediateOperands;
+        /**
+         * variables fused into the operation using them (x*y)
+         */
+        size_t variableOperands;
+        /**
+         * multiplications fused with the following addition or subtraction into a std::fma
+         */
+        size_t fusedMultiplyAdds;
+    };
+
+    /**
+     * Interpreter used by evaluate
+     */
+    enum class Backend {
+        /**
+         * stack machine running the RPN program with the peephole superinstructions (default)
+         */
+        STACK,
+        /**
+         * register machine: the program is lowered into three-address code over virtual registers,
+         * allocated by linear scan onto a file of 16 registers (the values exceeding it are spilled).
+         * Constants and variables are read in place, so only the operations are dispatched.
+         * The results are bit-identical to the STACK backend
+         */
+        REGISTER
+    };
+
+    /**
+     * Register allocation of the REGISTER backend (see RPNCompiler::getRegisterAllocation)
+     */
+    struct RegisterAllocation {
+        /**
+         * instructions of the three-address code
+         */
+        size_t instructions;
+        /**
+         * virtual registers (one for each intermediate result)
+         */
+        size_t virtualRegisters;
+        /**
+         * registers of the register file used by the program
+         */
+        size_t registers;
+        /**
+         * virtual registers spilled out of the register file
+         */
+        size_t spills;
+    };
+
+    /**
+     * Interpolation of a table (see RPNCompiler::defineTable)
+     */
+    enum class Interpolation {
+        /**
+         * piecewise linear
+         */
+        LINEAR,
+        /**
+         * natural cubic spline (zero second derivative at the ends)
+         */
+        CUBIC_SPLINE
+    };
+
+    /**
+     * Counters of the cache of a memoized custom function (see RPNCompiler::defineFunction)
+     */
+    struct MemoStats {
+        /**
+         * calls answered by the cache
+         */
+        size_t hits;
+        /**
+         * calls of the function
+         */
+        size_t misses;
+        /**
+         * entries of the cache
+         */
+        size_t capacity;
+
+        double hitRate() const noexcept {
+            return hits + misses ? static_cast<double> (hits) / (hits + misses) : 0;
+        }
+    };
+
+    /**
+     * Polynomial surrogate of an expression of one variable (see RPNCompiler::compileTabulated)
+     */
+    struct SurrogateInfo {
+        /**
+         * polynomial pieces (0 if the expression is not tabulated)
+         */
+        size_t intervals;
+        /**
+         * Chebyshev coefficients of each piece
+         */
+        unsigned coefficients;
+        /**
+         * evaluations of the exact expression compared with the surrogate
+         */
+        size_t samples;
+        /**
+         * largest error measured on the samples, |surrogate-exact|/max(1,|exact|)
+         */
+        double maxError;
+    };
+
+    /**
+     * Execution tier of a compiled expression (see RPNCompiler::setTiering)
+     */
+    enum class Tier {
+        /**
+         * stack machine (Backend::STACK)
+         */
+        INTERPRETER,
+        /**
+         * register machine (Backend::REGISTER)
+         */
+        REGISTER,
+        /**
+         * piecewise polynomial of the only variable of the expression (see RPNCompiler::compileTabulated)
+         */
+        TABULATED
+    };
+
+    /**
+     * Evaluations of a compiled expression promoting it to the next execution tier (0 never promotes)
+     */
+    struct TieringPolicy {
+        size_t registerThreshold = 10000;
+        /**
+         * The expressions of one variable are tabulated over the range of the values evaluated so far:
+         * the results are approximated within tabulateTolerance, so the tier is disabled by default
+         */
+        size_t tabulateThreshold = 0;
+        double tabulateTolerance = 1e-12;
+        /**
+         * tabulate on a background thread, evaluating the expression with the previous tier meanwhile
+         * (the custom functions must be thread safe)
+         */
+        bool background = false;
+    };
+
+    /**
+     * Kernel of several expressions evaluated together (see RPNCompiler::compileFused)
+     */
+    struct FusionStats {
+        /**
+         * expressions of the kernel
+         */
+        size_t expressions;
+        /**
+         * RPN instructions of the expressions
+         */
+        size_t instructions;
+        /**
+         * operations of the kernel, each common subexpression is computed once
+         */
+        size_t operations;
+        /**
+         * blocks of scratch values used by the kernel
+         */
+        size_t buffers;
+    };
+
+    /**
+     * Errors reported by RPNCompiler::tryCompile and RPNCompiler::tryEvaluate
+     */
+    enum class ErrorCode {
+        NONE,
+        EMPTY_EXPRESSION,
+        CONSECUTIVE_NUMBERS,
+        INVALID_BRACKET,
+        EMPTY_BRACKETS,
+        INVALID_OPERATOR,
+        UNEXPECTED_OPERATOR,
+        INVALID_FUNCTION_SEQUENCE,
+        INVALID_TOKEN,
+        INVALID_NUMBER,
+        UNCLOSED_BRACKET,
+        MISSING_OPERAND,
+        MISSING_ARGUMENT,
+        UNHANDLED_INSTRUCTION,
+        NOT_REDUCIBLE,
+        STACK_OVERFLOW,
+        NOT_COMPILED,
+        UNDEFINED_VARIABLE,
+        UNDEFINED_FUNCTION,
+        /**
+         * sum or prod without the arguments (index, from, to, expression)
+         */
+        INVALID_LOOP,
+        /**
+         * a custom function threw an exception (see Diagnostic::cause)
+         */
+        FUNCTION_FAILED
+    };
+
+    /**
+     * Error of a compilation or an evaluation. The diagnostic does not allocate:
+     * the message is formatted only when requested
+     */
+    struct Diagnostic {
+        static const size_t NO_POSITION = SIZE_MAX;
+
+        /**
+         * Characters of the token kept by the diagnostic (longer tokens are truncated)
+         */
+        static const size_t MAX_TOKEN = 31;
+
+        ErrorCode code = ErrorCode::NONE;
+        /**
+         * index of the character of the expression where the error was found (NO_POSITION if not known)
+         */
+        size_t position = NO_POSITION;
+        /**
+         * stack slots required and available for STACK_OVERFLOW
+         */
+        size_t required = 0;
+        size_t available = 0;
+        /**
+         * exception thrown by a custom function for FUNCTION_FAILED
+         */
+        std::exception_ptr cause;
+
+        Diagnostic() = default;
+
+        Diagnostic(ErrorCode code, size_t position = NO_POSITION, std::string_view token = {}) noexcept;
+
+        /**
+         * @return the token (or the variable, the function) of the error
+         */
+        std::string_view getToken() const noexcept;
+
+        /**
+         * @return the message of the exception thrown by compile or evaluate for the same error
+         */
+        string message() const;
+
+    private:
+
+        char token[MAX_TOKEN + 1] = {};
+        size_t tokenLength = 0;
+    };
+
+    /**
+     * A value or the error preventing it (see RPNCompiler::tryCompile)
+     */
+    template<typename T>
+    class Result {
+    public:
+
+        Result(T value) noexcept : val(value) {
+        }
+
+        Result(const Diagnostic &error) noexcept : val(), err(error) {
+        }
+
+        bool hasValue() const noexcept {
+            return err.code == ErrorCode::NONE;
+        }
+
+        explicit operator bool() const noexcept {
+            return hasValue();
+        }
+
+        /**
+         * @return the value, throws a VirtualFPUException with the message of the error if there is no value
+         */
+        const T& value() const {
+            if (!hasValue()) {
+                throw VirtualFPUException(err.message());
+            }
+            return val;
+        }
+
+        T valueOr(T fallback) const noexcept {
+            return hasValue() ? val : fallback;
+        }
+
+        const T& operator*() const noexcept {
+            return val;
+        }
+
+        const Diagnostic& error() const noexcept {
+            return err;
+        }
+
+    private:
+
+        T val;
+        Diagnostic err;
+    };
+
+    struct BulkCompilation;
+
+    class FormulaStore;
+
+    /**
+     * Mathematical expressions compiler and evaluator.
+     * Converta the expression in a RPN (Reverse Polish Notation) before evaluation
+     */
+    class RPNCompiler {
+    public:
+
+        static const size_t DEFAULT_STACK_SIZE = 1024;
+
+        /**
+         * Entries of the cache of a memoized custom function
+         */
+        static const size_t DEFAULT_MEMO_CACHE_SIZE = 4096;
+
+        /**
+         * Number of rows evaluated together by evaluateBatch
+         */
+        static const size_t BATCH_BLOCK_SIZE = 256;
+
+        /**
+         * Rows of the chunks of evaluateMapped
+         */
+        static const size_t DEFAULT_CHUNK_ROWS = 1 << 16;
+
+        /**
+         * Number of rows folded into a partial result by reduce (the partial results are combined pairwise)
+         */
+        static const size_t REDUCTION_SEGMENT_SIZE = 16 * BATCH_BLOCK_SIZE;
+
+        /**
+         * Number of grid rows of a tile sampled by sampleGrid (a tile is BATCH_BLOCK_SIZE values wide)
+         */
+        static const size_t GRID_TILE_ROWS = 16;
+
+
+
+
+
+        /**
+         * Create the compiler using a predefined RPN stack size 
+         * @param resource memory resource used for all the internal allocations (instructions, variables, evaluation stack)
+         */
+        RPNCompiler(size_t stackSize, std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+        /**
+         * Create the compiler using the DEFAULT_STACK_SIZE
+         */
+        RPNCompiler();
+
+        /**
+         * Create the compiler using the DEFAULT_STACK_SIZE and allocating from a custom memory resource,
+         * for example a std::pmr::monotonic_buffer_resource released in one shot after use.
+         * The resource must outlive the compiler.
+         */
+        explicit RPNCompiler(std::pmr::memory_resource *resource);
+
+        virtual ~RPNCompiler();
+
+        /**
+         * Compile a mathematical expression.
+         * After the compilation a RPN stack is created internally and the evaluate method can be used to evalute the expression.
+         * The RPN program is verified once and its maximum stack depth is computed: an expression requiring more
+         * than getStackSize() stack slots is rejected.
+         * sum(i,from,to,expression) and prod(i,from,to,expression) evaluate the expression for i=from,from+1,...<=to
+         * in a loop of the evaluator, the subexpressions not depending on i are evaluated once
+         * (unless a function or a variable named sum or prod is defined, which keeps its meaning).
+         * @param statement example "4*(2.3*sin(1/(1+4.56)))/8, expressions can use user defined variable see the method defineVar
+         */
+        RPNCompiler& compile(const string& statement);
+
+        /**
+         * Compile a mathematical expression without throwing on syntax errors.
+         * An invalid expression is reported by the error of the result without allocations or exceptions,
+         * the compiler is left without expression as after a failed compile
+         * @param statement expression to compile
+         * @return the compiler, or the syntax error
+         * Example:
+         * auto r = fpu.tryCompile("2*(x+");
+         * if (!r) cout << r.error().position << ' ' << r.error().message();
+         */
+        Result<RPNCompiler*> tryCompile(const string& statement);
+
+        /**
+         * Compile many expressions in parallel, each one into a new compiler knowing the variables, the functions,
+         * the tables and the settings of this compiler. This compiler is only read and must not be modified until compileAll returns.
+         * The new compilers allocate from the default memory resource
+         * @param statements expressions to compile
+         * @param threads number of threads (0 uses the available hardware threads)
+         * @return a compiler (or the error) for each expression
+         * Example:
+         * BulkCompilation all = fpu.compileAll(formulas);
+         * if (all.compilers[i]) y = all.compilers[i]->evaluate();
+         */
+        BulkCompilation compileAll(std::span<const string> statements, unsigned threads = 0) const;
+
+        /**
+         * Add the compiled expression to a store shared by many compilers: the subexpressions and the names
+         * already in the store are not stored again. Expressions with sum or prod cannot be interned
+         * @return the formula, compiled back by compile(store, formula)
+         * Example:
+         * FormulaStore store;
+         * size_t f = fpu.compile("x*2+sin(y)").intern(store);
+         * double v = fpu.compile(store, f).evaluate();
+         */
+        size_t intern(FormulaStore &store) const;
+
+        /**
+         * Compile a formula of a store (see intern) without parsing it.
+         * The store is only read: many compilers can compile from the same store at the same time
+         * @param store store of the formula
+         * @param formula formula returned by intern
+         */
+        RPNCompiler& compile(const FormulaStore &store, size_t formula);
+
+        /**
+         * Set the accuracy tier and compile a mathematical expression
+         * @param statement expression to compile
+         * @param accuracy accuracy of the built-in functions
+         */
+        RPNCompiler& compile(const string& statement, Accuracy accuracy);
+
+        /**
+         * Select the interpreter used by evaluate and compile a mathematical expression
+         * @param statement expression to compile
+         * @param backend interpreter of the compiled program
+         */
+        RPNCompiler& compile(const string& statement, Backend backend);
+
+        /**
+         * Compile an expression of one variable and replace it, from lo to hi, with piecewise Chebyshev polynomials.
+         * The range is bisected until each piece matches the exact expression within the tolerance,
+         * |surrogate-exact| <= tolerance*max(1,|exact|), on dense samples of the piece.
+         * evaluate and the batch methods then cost a few multiply-adds for any number of functions in the expression,
+         * out of the range (and in sampleGrid) the exact expression is evaluated.
+         * The surrogate is dropped when another expression is compiled, the accuracy is changed or a custom function is redefined
+         * @param statement expression to compile, the only variable must be var (already defined)
+         * @param var the variable
+         * @param lo start of the range
+         * @param hi end of the range
+         * @param tolerance error allowed (greater than 0)
+         * Example:
+         * fpu.defineVar("t",0);
+         * fpu.compileTabulated("exp(-t)*tanh(3*t)+log(1+t)","t",0,1,1e-12);
+         */
+        RPNCompiler& compileTabulated(const string& statement, const string& var, double lo, double hi, double tolerance);
+
+        /**
+         * @return the surrogate of the expression compiled by compileTabulated
+         */
+        const SurrogateInfo& getSurrogateInfo() const noexcept;
+
+        /**
+         * Count the evaluations of each compiled expression and promote the hot expressions through the execution tiers.
+         * The count restarts when an expression is compiled
+         * Example:
+         * fpu.setTiering(TieringPolicy{1000, 100000, 1e-12, true});
+         */
+        void setTiering(const TieringPolicy &policy);
+
+        /**
+         * Stop counting the evaluations, the current tier is kept
+         */
+        void disableTiering() noexcept;
+
+        /**
+         * @return the tier evaluating the compiled expression
+         */
+        Tier getTier() const noexcept;
+
+        /**
+         * @return evaluations of the compiled expression counted by the tiering
+         */
+        size_t getEvaluationCount() const noexcept;
+
+        /**
+         * Set the accuracy of the built-in functions used by all the evaluation methods.
+         * The compiled program is kept: the setting is applied from the next evaluation.
+         */
+        void setAccuracy(Accuracy accuracy) noexcept;
+
+        /**
+         * @return the accuracy of the built-in functions (EXACT by default)
+         */
+        Accuracy getAccuracy() const noexcept;
+
+        /**
+         * Contract a multiplication followed by an addition or a subtraction into a single std::fma
+         * when the expression is compiled (disabled by default).
+         * The result is rounded once, so it can differ in the last bit from the separate operations,
+         * and it is faster only on targets with a hardware FMA instruction.
+         * sampleGrid evaluates the operations separately.
+         */
+        void setFusedMultiplyAdd(bool enabled);
+
+        /**
+         * @return true if multiplications and additions are contracted into std::fma
+         */
+        bool getFusedMultiplyAdd() const noexcept;
+
+        /**
+         * @return the fusions done by the peephole pass on the compiled expression
+         */
+        const PeepholeStats& getPeepholeStats() const noexcept;
+
+        /**
+         * Select the interpreter used by evaluate (STACK by default).
+         * The batch methods and sampleGrid always run the stack program on blocks of rows
+         */
+        void setBackend(Backend backend);
+
+        /**
+         * @return the interpreter used by evaluate
+         */
+        Backend getBackend() const noexcept;
+
+        /**
+         * @return the register allocation of the compiled expression (empty with the STACK backend)
+         */
+        const RegisterAllocation& getRegisterAllocation() const noexcept;
+
+        /**
+         * Evaluate the expression.Before calling this method the expression must be compiled using the compile method
+         * @return 
+         */
+        double evaluate();
+
+        /**
+         * Evaluate the expression without throwing: a missing expression, an undefined variable or function,
+         * or an exception thrown by a custom function are reported by the error of the result
+         */
+        Result<double> tryEvaluate();
+
+        /**
+         * Evaluate the expression for each row of a set of columns.
+         * Rows are processed in blocks of BATCH_BLOCK_SIZE: every instruction is applied to a whole block at once.
+         * Variables not bound to a column use their current value (see defineVar).
+         * @param columns variables bound to the input columns
+         * @param rows number of rows to evaluate
+         * @param out output array, must contain at least rows values
+         * Example:
+         * fpu.defineVar("x",0);
+         * fpu.compile("x^2+1");
+         * fpu.evaluateBatch({{"x",xs.data()}},xs.size(),ys.data());
+         */
+        void evaluateBatch(const vector<ColumnBinding> &columns, size_t rows, double *out);
+
+        /**
+         * Evaluate the expression for each row of a set of columns writing the results to a strided output
+         * @param columns variables bound to the input columns
+         * @param rows number of rows to evaluate
+         * @param out first output value
+         * @param outStride distance in bytes between two output values (0 for contiguous values)
+         */
+        void evaluateBatch(const vector<ColumnBinding> &columns, size_t rows, double *out, size_t outStride);
+
+        /**
+         * Evaluate the expression for each row of memory mapped columns larger than the memory.
+         * The rows are evaluated in chunks of chunkRows: the next chunk of each column is prefetched
+         * and the pages of the chunks already evaluated are released, so the resident memory is bounded
+         * by the chunk size whatever the size of the columns.
+         * Variables not bound to a column use their current value (see defineVar).
+         * @param columns variables bound to the column files, all the columns must have the same size
+         * @param sink destination of the results
+         * @param chunkRows rows evaluated for each chunk
+         * @return number of evaluated rows
+         * Example:
+         * MappedColumn x("x.bin"), y("y.bin");
+         * MappedColumnSink r("r.bin", x.size());
+         * fpu.compile("sqrt(x^2+y^2)");
+         * fpu.evaluateMapped({{"x",&x},{"y",&y}}, r);
+         */
+        size_t evaluateMapped(const vector<std::pair<string, MappedColumn*>> &columns, ColumnSink &sink, size_t chunkRows = DEFAULT_CHUNK_ROWS);
+
+        /**
+         * Evaluate the expression for each row of a set of columns and reduce the results without storing them.
+         * Rows evaluated to NaN are skipped and counted.
+         * The rows are split in segments of REDUCTION_SEGMENT_SIZE rows reduced independently and combined pairwise in
+         * a fixed order, so the result is the same for any number of threads.
+         * @param op the reduction
+         * @param columns variables bound to the input columns
+         * @param rows number of rows to evaluate
+         * @param threads number of threads (0 uses the available hardware threads)
+         * Example:
+         * auto r=fpu.reduce(Reduction::MAX,{{"x",xs.data()}},xs.size());
+         */
+        ReductionResult reduce(Reduction op, const vector<ColumnBinding> &columns, size_t rows, unsigned threads = 1);
+
+        /**
+         * Evaluate the expression for samples of random variables and compute the statistics of the results.
+         * The samples are drawn in blocks by a counter based generator (Philox4x32-10): sample i of a variable depends only
+         * on the seed, on i and on the position of the variable, and the segments of REDUCTION_SEGMENT_SIZE samples
+         * are combined in a fixed order, so the result is the same for any number of threads.
+         * The other variables of the expression keep their value.
+         * @param variables random variables of the expression
+         * @param samples number of samples
+         * @param seed key of the generator
+         * @param threads number of threads (0 uses the available hardware threads)
+         * @param quantileAccuracy relative accuracy of the quantiles
+         * Example:
+         * fpu.compile("s*exp(-0.5*v^2+v*z)");
+         * auto r=fpu.monteCarlo({{"z",Distribution::NORMAL,0,1}},10000000,42,0);
+         * double p99=r.quantiles.quantile(0.99);
+         */
+        MonteCarloResult monteCarlo(const vector<RandomVariable> &variables, size_t samples, uint64_t seed = 0, unsigned threads = 1,
+                double quantileAccuracy = QuantileSketch::DEFAULT_ACCURACY);
+
+        /**
+         * Evaluate the compiled expression as a predicate for each row and collect the indices of the selected rows.
+         * A row is selected when the expression is not zero and not NaN, comparison operators (< > <= >= == !=) return 1 or 0.
+         * @param columns variables bound to the input columns
+         * @param rows number of rows to evaluate
+         * @param selection receives the indices of the selected rows in ascending order (cleared before the evaluation)
+         * @return number of selected rows
+         * Example:
+         * fpu.compile("(x>0)*(y<=2)");
+         * fpu.select({{"x",xs.data()},{"y",ys.data()}},xs.size(),sel);
+         */
+        size_t select(const vector<ColumnBinding> &columns, size_t rows, vector<size_t> &selection);
+
+        /**
+         * Evaluate the compiled expression as a predicate for each row and set a bit for each selected row.
+         * Bit i%64 of bitmap[i/64] is set when row i is selected.
+         * @param bitmap receives (rows+63)/64 words
+         * @return number of selected rows
+         */
+        size_t selectBitmap(const vector<ColumnBinding> &columns, size_t rows, vector<uint64_t> &bitmap);
+
+        /**
+         * Evaluate the expression only for the selected rows (see select)
+         * @param columns variables bound to the input columns
+         * @param selection indices of the rows to evaluate
+         * @param out output array, out[k] is the result for the row selection[k]
+         */
+        void evaluateSelected(const vector<ColumnBinding> &columns, const vector<size_t> &selection, double *out);
+
+        /**
+         * Sample the expression over a 2D grid.
+         * The grid is processed in tiles distributed over the threads, subexpressions depending only on x are computed once
+         * for the whole grid and subexpressions not depending on x once for each row (custom functions are assumed to be pure).
+         * @param x axis of the columns
+         * @param y axis of the rows
+         * @param out output buffer of x.count*y.count values, out[j*x.count+i] is the value at (x_i,y_j)
+         * @param threads number of threads (0 uses the available hardware threads)
+         * Example:
+         * fpu.compile("sin(x)*cos(y)");
+         * fpu.sampleGrid({"x",0,1,4096},{"y",0,1,4096},heatmap.data(),0);
+         */
+        void sampleGrid(const GridAxis &x, const GridAxis &y, double *out, unsigned threads = 1);
+
+        /**
+         * Sample the expression over a 3D grid, out[(k*y.count+j)*x.count+i] is the value at (x_i,y_j,z_k)
+         */
+        void sampleGrid(const GridAxis &x, const GridAxis &y, const GridAxis &z, double *out, unsigned threads = 1);
+
+        /**
+         * Compile several expressions into a single kernel evaluated by evaluateFused.
+         * The subexpressions common to the expressions (same operation on the same operands) are computed once.
+         * The expression compiled by compile is not affected, the variables must be defined as for compile
+         * @param statements the expressions
+         * @return the operations of the kernel
+         * Example:
+         * fpu.compileFused({"sqrt(x^2+y^2)","atan(y/x)","x^2+y^2+z"});
+         * fpu.evaluateFused({{"x",xs.data()},{"y",ys.data()},{"z",zs.data()}},rows,{r.data(),theta.data(),s.data()});
+         */
+        const FusionStats& compileFused(const vector<string> &statements);
+
+        /**
+         * Evaluate the expressions of the kernel in one pass over the rows: each block of rows is loaded once
+         * and the value of every expression is written to its output.
+         * Variables not bound to a column use their current value (see defineVar).
+         * @param columns variables bound to the input columns
+         * @param rows number of rows to evaluate
+         * @param outputs an output array of at least rows values for each expression, in the order of compileFused
+         */
+        void evaluateFused(const vector<ColumnBinding> &columns, size_t rows, const vector<double*> &outputs);
+
+        /**
+         * @return the kernel compiled by compileFused
+         */
+        const FusionStats& getFusionStats() const noexcept;
+
+        /**
+         * Translate the compiled expression to the source of a C++ function computing the same values
+         * with the exact functions of the standard library (see Accuracy::EXACT).
+         * Each instruction becomes an assignment to a constant, in the order of the interpreter.
+         * Custom functions (and tables) are declared extern double name(double) and must be linked with the function.
+         * The source uses <cmath> and <limits>, included once before the functions (as by virtualfpu --transpile).
+         * With setFusedMultiplyAdd(true) the multiply-adds contracted by the interpreter are written as std::fma.
+         * Build the generated code with -ffp-contract=off to keep the results identical to the interpreter
+         * @param function name of the generated function
+         * @param parameters parameters of the function, the other variables are replaced by their current value.
+         * All the variables of the expression (in alphabetical order) when empty
+         * @return the declarations and the definition of double function(double parameter, ...)
+         * Example:
+         * fpu.compile("sqrt(x^2+y^2)*k");
+         * string src=fpu.generateCpp("radius",{"x","y"});
+         */
+        string generateCpp(const string &function, const vector<string> &parameters = {}) const;
+
+        /**
+         * Integrate the compiled expression with respect to a variable.
+         * All the nodes of a refinement level are evaluated as one batch, the other variables keep their current value.
+         * @param var integration variable
+         * @param a lower limit
+         * @param b upper limit
+         * @param rule quadrature rule
+         * @param absTolerance absolute tolerance
+         * @param relTolerance tolerance relative to the integral estimate (the larger of the two tolerances is used)
+         * @param maxEvaluations maximum number of evaluations of the integrand
+         * Example:
+         * fpu.defineVar("x",0);
+         * fpu.compile("exp(-x^2)");
+         * auto r=fpu.integrate("x",0,1);
+         */
+        IntegrationResult integrate(const string &var, double a, double b, QuadratureRule rule = QuadratureRule::GAUSS_KRONROD,
+                double absTolerance = 1e-10, double relTolerance = 1e-10, size_t maxEvaluations = 1000000);
+
+
+        /**
+         * Max stack size
+         * @return 
+         */
+        size_t getStackSize() const;
+
+        /**
+         * Actual number of instructions inside the internal stack
+         * @return 
+         */
+        size_t stackLength() const;
+
+        /**
+         * Number of instructions of the compiled program (same as stackLength)
+         */
+        size_t getInstructionCount() const;
+
+        /**
+         * Maximum number of evaluation stack slots used by the compiled program (0 if nothing is compiled)
+         */
+        size_t getMaxStackDepth() const;
+
+        /**
+         * Checks if the instructions stack is empty
+         */
+        bool stackIsEmpty() const;
+
+
+        /**
+         * Clear the instructions stack.After calling this method an expression must be compiled again before evaluating
+         * @return 
+         */
+        void clearStack();
+
+
+        /**
+         * @return the RPN (Reverse Polish Notation) of the expression
+         */
+        string getRPNStack() const;
+
+        /**
+         * @return the names of the variables referenced by the compiled expression (without duplicates)
+         */
+        vector<string> getVariables() const;
+
+
+        double queryOutputRegister() const;
+
+        /**
+         * Define a custom variable.The variable can be used in the mathematical expression.
+         * This method may be used to change the current value of an already defined variable.
+         * If the variable was already defined before compilation, the expression can be evaluated using the new value
+         * without compiling the expression again.
+         * @param value variable value
+         * @param name variable name
+         * Example:
+         * defineVar("pi",3.1415);
+         * compile("cos(p1/2)")
+         */
+        void defineVar(const string &name, double value);
+
+        /**
+         * Undefine an existing custom variable
+         */
+        void undefVar(const string &name);
+
+        /**
+         * Define a custom function
+         * @param name function name identified
+         * @param fn the function
+         */
+        void defineFunction(const string &name, std::function<double(double) > fn);
+
+        /**
+         * Define a custom function, optionally memoized.
+         * A memoized function must be pure: its results are kept in a direct-mapped cache keyed by the bits
+         * of the argument, an entry is replaced by the next argument mapped to it.
+         * The cache is thread safe and is dropped when the function is redefined or undefined
+         * @param name function name identified
+         * @param fn the function
+         * @param memoize true to cache the results of the function
+         * @param cacheSize entries of the cache (rounded up to a power of two)
+         */
+        void defineFunction(const string &name, std::function<double(double) > fn, bool memoize, size_t cacheSize = DEFAULT_MEMO_CACHE_SIZE);
+
+        /**
+         * @return the counters of the cache of a memoized function
+         */
+        MemoStats getMemoStats(const string &name) const;
+
+        /**
+         * Define a function interpolating a table of values, evaluated natively by the interpreter
+         * and by blocks in the batch methods (no std::function call for each value).
+         * Equally spaced knots are detected: the segment of an argument is computed instead of searched.
+         * Out of the table the values at the ends are kept.
+         * @param name function name
+         * @param xs knots, finite and strictly increasing (at least 2, 3 for CUBIC_SPLINE)
+         * @param ys values at the knots
+         * @param mode interpolation
+         */
+        void defineTable(const string &name, const vector<double> &xs, const vector<double> &ys, Interpolation mode = Interpolation::LINEAR);
+
+        /**
+         * Define a function interpolating values at equally spaced knots from x0 to x1
+         */
+        void defineTable(const string &name, double x0, double x1, const vector<double> &ys, Interpolation mode = Interpolation::LINEAR);
+
+        void undefFunction(const string &name);
+
+        /**
+         * Check if a variable is defined
+         */
+        bool isVarDefined(const string &name);
+
+        /**
+         * Chack if is a custom defined function
+         * @param name
+         * @return 
+         */
+        bool isFnDefined(const string &name);
+
+        /**
+         * Get the actual value of a custom defined variable
+         * @param varName the variable symbol
+         * @return the current value
+         */
+        double getVar(const string &varName);
+
+        /**
+         * Undefine all custom variables
+         */
+        void clearAllVariables();
+        
+        /**
+         * Undefine all custom define functions
+         */
+        void clearAllCustomFunctions();
+
+
+        const string& getLastCompiledStatement();
+
+        /**
+         * @return the memory resource used by the compiler
+         */
+        std::pmr::memory_resource* getMemoryResource() const noexcept;
+
+        /**
+         * Record the operations of the compiler in a registry (nullptr to stop recording, the default)
+         */
+        void setMetrics(MetricsRegistry *metrics);
+
+        MetricsRegistry* getMetrics() const noexcept;
+
+
+    protected:
+
+        using VarMap = std::pmr::map<std::pmr::string, double, std::less<>>;
+
+        using FnMap = std::pmr::map<std::pmr::string, std::function<double(double) >, std::less<>>;
+
+        using TempStack = stack<StackItem*, std::pmr::vector<StackItem*>>;
+
+        /**
+         * Allocator bound to the memory resource
+         */
+        std::pmr::polymorphic_allocator<> allocator;
+
+        /**
+         * Internal instruction stack
+         */
+        std::pmr::vector<StackItem*> *instrVector;
+
+        /**
+         * Evaluation stack (kept between evaluations to avoid allocations)
+         */
+        std::pmr::vector<double> *executeStack;
+
+        /**
+         * Batch evaluation stack (maxStackDepth blocks of BATCH_BLOCK_SIZE values)
+         */
+        std::pmr::vector<double> *batchStack;
+
+        /**
+         * Column bound to each instruction during batch evaluation (nullptr if not bound)
+         */
+        std::pmr::vector<const ColumnBinding*> *batchSources;
+
+        /**
+         * User defined variables
+         */
+        VarMap *defVars;
+
+        /**
+         * User defined functions
+         */
+        FnMap *defFunctions;
+
+        struct MemoCache;
+
+        using MemoMap = std::pmr::map<std::pmr::string, std::shared_ptr<MemoCache>, std::less<>>;
+
+        /**
+         * Caches of the memoized functions
+         */
+        MemoMap *memoCaches;
+
+        struct Table;
+
+        using TableMap = std::pmr::map<std::pmr::string, std::shared_ptr<Table>, std::less<>>;
+
+        /**
+         * Tables defined by defineTable (also defined as custom functions)
+         */
+        TableMap *tables;
+
+        /**
+         * Current evaluation output
+         */
+        double output;
+
+        /**
+         * Max evaluation stack slots
+         */
+        size_t stackSize;
+
+        /**
+         * Stack slots required by the compiled program
+         */
+        size_t maxStackDepth;
+
+        /**
+         * Accuracy tier of the built-in functions
+         */
+        Accuracy accuracy;
+
+        /**
+         * Contract multiplications and additions into std::fma
+         */
+        bool fusedMultiplyAdd;
+
+        /**
+         * Interpreter used by evaluate
+         */
+        Backend backend;
+
+        string getToken(const string& statement, int fromIndex, int *nextIndex);
+
+        double toDouble(const string& token);
+
+        /**
+         * @return false if the token is not a number
+         */
+        static bool toDouble(const string& token, double &value) noexcept;
+
+        bool isNumber(const string& token);
+
+        bool isOperator(const string& token);
+
+        static bool isOperator(const Instruction instr);
+
+        /**
+         * Check if the instruction is a comparison operator (< > <= >= == !=)
+         */
+        static bool isComparison(const Instruction instr);
+
+        /**
+         * Check if the token is a function such as sin, cos
+         * @param token
+         * @return 
+         */
+        bool isFunction(const string& token);
+
+        bool isFunction(const Instruction& instr);
+
+        bool isFunction(const StackItem* item);
+
+        bool isCustomFunction(const StackItem* item);
+
+        void validateIndentifier(const string &name);
+
+        /**       
+         * @return a lower value means a lower precedence
+         */
+        int getOperatorPrecedence(const Instruction& instr) noexcept;
+
+        static bool isBuiltinFunction(const Instruction& instr) noexcept;
+
+    private:
+
+        const int TK_NIL = 0;
+        const int TK_NUM = 1;
+        const int TK_OPERATOR = 2;
+        const int TK_FUNCTION = 3;
+        const int TK_OPEN_BRK = 4;
+        const int TK_CLOSE_BRK = 5;
+        const int TK_OTHER = 255;
+
+        string last_compiled_statement;
+
+        void init(size_t stackSize);
+
+        /**
+         * Parse the statement into the RPN program recording the metrics
+         * @return false if the statement is not valid (error is set)
+         */
+        bool compileStatement(const string& statement, Diagnostic &error);
+
+        bool parseStatement(const string& statement, Diagnostic &error);
+
+        /**
+         * Convert the tokens of the statement to RPN, appending them to the instructions
+         * @return false if the statement is not valid (error is set)
+         */
+        bool parseTokens(const string& statement, Diagnostic &error);
+
+        /**
+         * evaluate without recording metrics
+         */
+        double evaluateProgram();
+
+        MetricsRegistry *metrics;
+
+        /**
+         * Evaluations not published to the metrics yet
+         */
+        unsigned metricsPending;
+
+        void publishMetrics() noexcept;
+
+        /**
+         * Copy the variables, the functions, the tables and the settings of another compiler to a new compiler
+         */
+        void copyDefinitions(const RPNCompiler &other);
+
+        struct Op;
+
+        /**
+         * Program evaluated by evaluate and by the batch methods: the RPN program with the
+         * operands and the multiply-add sequences fused into superinstructions
+         */
+        std::pmr::vector<Op> *program;
+
+        PeepholeStats peepholeStats;
+
+        /**
+         * True when the operands of the program point to the current variables and functions
+         */
+        bool programResolved;
+
+        /**
+         * Operands and custom functions of the program not defined when the program was resolved
+         */
+        size_t unresolvedOperands;
+
+        /**
+         * Peephole pass: build the program from the RPN instructions
+         */
+        void buildProgram();
+
+        void buildOps(const std::pmr::vector<StackItem*> &rpn, std::pmr::vector<Op> &ops);
+
+        /**
+         * Point the operands of the program to the variables and the custom functions
+         */
+        void resolveProgram();
+
+        /**
+         * @return the operands and custom functions of the operations not defined
+         */
+        size_t resolveOps(std::pmr::vector<Op> &ops);
+
+        /**
+         * Run operations on the stack machine
+         * @return the value on the bottom of the stack
+         */
+        double runOps(const std::pmr::vector<Op> &ops, double *stack);
+
+        /**
+         * @return the error of the first operand not defined (and not bound to a column when sources is given)
+         */
+        Diagnostic findUnresolved(const std::pmr::vector<const ColumnBinding*> *sources) const;
+
+        /**
+         * Throw the error of the first operand not defined (see findUnresolved)
+         */
+        void reportUnresolved(const std::pmr::vector<const ColumnBinding*> *sources);
+
+        /**
+         * Apply a binary operation to two blocks of values (a = a op b)
+         */
+        void applyBinaryBlock(Instruction instr, double *a, const double *b, size_t len);
+
+        struct RegisterOp;
+
+        /**
+         * Three-address code of the REGISTER backend, lowered from the program
+         */
+        std::pmr::vector<RegisterOp> *registerProgram;
+
+        /**
+         * Registers and spill slots of the REGISTER backend
+         */
+        std::pmr::vector<double> *registerFile;
+
+        /**
+         * Location of the result of the three-address code: a register, or an operand of the program
+         * for an expression without operations
+         */
+        const double *registerResult;
+
+        RegisterAllocation registerAllocation;
+
+        /**
+         * Lower the program into three-address code and allocate its registers
+         */
+        void buildRegisterProgram();
+
+        /**
+         * Point the arguments of the three-address code to the registers and to the resolved operands of the program
+         */
+        void resolveRegisterProgram();
+
+        double evaluateRegisters();
+
+        struct Surrogate;
+
+        /**
+         * Piecewise polynomial replacing the compiled expression (see compileTabulated)
+         */
+        Surrogate *surrogate;
+
+        /**
+         * Fit the surrogate of the compiled expression of var over [lo,hi]
+         * @param at the worst point if the expression cannot be fitted
+         * @param cancelled stops the fit when set (by another thread)
+         * @return false if the expression cannot be fitted within the tolerance
+         */
+        bool fitSurrogate(const string &var, double lo, double hi, double tolerance, double &at, const std::atomic<bool> *cancelled = nullptr);
+
+        struct Tiering;
+
+        /**
+         * Evaluation counter and pending promotion (nullptr if tiering is disabled)
+         */
+        Tiering *tiering;
+
+        /**
+         * Count an evaluation and promote the expression when a threshold is reached
+         */
+        void countEvaluation();
+
+        struct Loop;
+        struct Loops;
+
+        /**
+         * sum and prod loops of the compiled expression, evaluated before the program into local slots
+         */
+        Loops *loops;
+
+        /**
+         * Parse sum(index,from,to,expression) or prod(...) with the bracket at position open,
+         * appending the operand reading its result to the instructions
+         * @return the position after the closing bracket, 0 if the loop is not valid (error is set)
+         */
+        size_t parseLoop(const string &statement, size_t open, bool product, Diagnostic &error);
+
+        /**
+         * Move the invariant subexpressions and loops of the body of a loop out of its iterations
+         */
+        void hoistInvariants(Loop &loop);
+
+        /**
+         * Evaluate the loops, in order, into their slots
+         */
+        void runLoops(const std::pmr::vector<Loop*> &list);
+
+        /**
+         * Evaluate the loops once for all the rows of a batch, they cannot use the variables bound to the rows
+         */
+        void evaluateLoopsForRows(const vector<std::string_view> &bound);
+
+        /**
+         * @return true if an expression of a loop uses the variable
+         */
+        bool loopsReference(std::string_view name) const;
+
+        /**
+         * @return the variable, or the local slot of a loop, of an operand (nullptr if not defined)
+         */
+        const double* findOperand(std::string_view name) const;
+
+        struct FusedOp;
+        struct FusedKernel;
+
+        /**
+         * Kernel of the expressions compiled by compileFused
+         */
+        FusedKernel *fusedKernel;
+
+        struct FunctionTable;
+
+        /**
+         * Built-in functions of the current accuracy tier
+         */
+        const FunctionTable *functions;
+
+        static const FunctionTable* functionTable(Accuracy accuracy);
+
+        StackItem* newItem();
+
+        void deleteItem(StackItem *item);
+
+        double evaluateUnary(double operand, const StackItem *operation);
+
+        double evaluateCustomFn(double operand, const StackItem *operation);
+
+        double evaluateOperation(double op1, double op2, const StackItem *operation);
+
+        /**
+         * Check the stack effect of the RPN program
+         * @return the stack slots required, 0 if the program is not valid (error is set)
+         */
+        size_t verifyProgram(Diagnostic &error);
+
+        void bindColumns(const vector<ColumnBinding> &columns);
+
+        void evaluateBlock(size_t row, size_t len, double *scratch, const size_t *rowIndex = nullptr);
+
+        /**
+         * Apply an operation or function to the top of a block evaluation stack
+         */
+        void applyBlock(const StackItem *si, double *scratch, size_t &sp, size_t len);
+
+        struct GridOp;
+
+        void runGridOps(const GridOp *ops, size_t count, const double * const *vectors, const double *scalars, size_t offset, size_t len, double *scratch);
+
+        void sampleGrid(const GridAxis *axes, size_t dims, double *out, unsigned threads);
+
+        double getValue(const StackItem *operand);
+
+        void addImpliedMul(TempStack &temp, const int last);
+        void addItemToTempStack(StackItem *item, TempStack &stack, const int last);
+
+        void throwError(const string &msg);
+
+    };
+
+    /**
+     * Expressions compiled by RPNCompiler::compileAll
+     */
+    struct BulkCompilation {
+        /**
+         * compiler of each expression, nullptr if the expression is not valid
+         */
+        vector<std::unique_ptr<RPNCompiler>> compilers;
+        /**
+         * error of each expression (ErrorCode::NONE if compiled)
+         */
+        vector<Diagnostic> errors;
+        /**
+         * expressions not compiled
+         */
+        size_t failed;
+    };
+
+    /**
+     * Memory used by a FormulaStore compared with the RPN instructions of its formulas (see FormulaStore::getFootprint)
+     */
+    struct StoreFootprint {
+        size_t formulas;
+        /**
+         * distinct subexpressions stored
+         */
+        size_t nodes;
+        /**
+         * RPN instructions of the formulas compiled one by one
+         */
+        size_t instructions;
+        /**
+         * distinct variable and function names
+         */
+        size_t names;
+        /**
+         * bytes of the nodes, of the hash table, of the names and of the formulas
+         */
+        size_t bytes;
+        /**
+         * bytes of the RPN instructions of the formulas compiled one by one (items, names and operations of the program)
+         */
+        size_t instructionBytes;
+        /**
+         * instructionBytes/bytes
+         */
+        double ratio;
+    };
+
+    /**
+     * Store of formulas sharing their subexpressions (hash-consing): every distinct subexpression is a node
+     * stored once, a formula is the root node of a DAG. Formulas generated from the same templates share most
+     * of their nodes, e.g. 200k formulas can be kept resident and compiled when they are needed:
+     * FormulaStore store;
+     * for (const string &f : formulas) ids.push_back(fpu.compile(f).intern(store));
+     * cout << store.getFootprint().ratio;
+     * fpu.compile(store, ids[i]).evaluate();
+     * Interning is not thread safe, the formulas can be compiled from many threads when none is interned.
+     */
+    class FormulaStore {
+    public:
+
+        explicit FormulaStore(std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+        virtual ~FormulaStore();
+
+        FormulaStore(const FormulaStore&) = delete;
+
+        FormulaStore& operator=(const FormulaStore&) = delete;
+
+        /**
+         * @return the formulas interned
+         */
+        size_t size() const noexcept;
+
+        /**
+         * @return the expression of a formula, fully bracketed
+         */
+        string toString(size_t formula) const;
+
+        StoreFootprint getFootprint() const;
+
+    private:
+
+        friend class RPNCompiler;
+
+        struct Dag;
+
+        std::pmr::polymorphic_allocator<> allocator;
+
+        Dag *dag;
+
+        /**
+         * Append the nodes of a formula in RPN order (the shared subexpressions are repeated)
+         */
+        void expand(size_t formula, std::pmr::vector<uint32_t> &rpn) const;
+
+    };
+
+    /**
+     * Statistics of an EvaluationQueue
+     */
+    struct QueueStats {
+        /**
+         * requests submitted
+         */
+        size_t submitted;
+        /**
+         * requests fulfilled with a value or an exception
+         */
+        size_t completed;
+        /**
+         * batches evaluated (one for each expression drained from the queue)
+         */
+        size_t batches;
+        /**
+         * mean number of requests of a batch
+         */
+        double meanBatchSize;
+        /**
+         * latency percentiles in microseconds, from submit to the fulfilment of the future,
+         * over the last EvaluationQueue::LATENCY_SAMPLES requests
+         */
+        double latencyP50;
+        double latencyP99;
+        double latencyMax;
+    };
+
+    /**
+     * Asynchronous evaluation queue shared by many producer threads.
+     * A worker thread drains the queue, groups the pending requests by expression, evaluates every group
+     * with evaluateBatch and fulfils the futures.
+     * The queue is drained when maxBatchSize requests are pending or when the oldest request waited maxLatency.
+     * An expression is compiled once, with the variables of the first request submitting it;
+     * every request must give a value to all the variables of its expression.
+     * Example:
+     * EvaluationQueue queue;
+     * auto r = queue.submit("sqrt(x^2+y^2)", {{"x", 3}, {"y", 4}});
+     * double d = r.get(); //5
+     */
+    class EvaluationQueue {
+    public:
+
+        static const size_t DEFAULT_MAX_BATCH_SIZE = 1024;
+
+        /**
+         * Number of latencies kept for the percentiles of getStats
+         */
+        static const size_t LATENCY_SAMPLES = 65536;
+
+        /**
+         * @param maxBatchSize pending requests draining the queue without waiting for maxLatency
+         * @param maxLatency maximum wait of a request before the queue is drained
+         * @param resource memory resource used by the compilers of the expressions
+         */
+        explicit EvaluationQueue(size_t maxBatchSize = DEFAULT_MAX_BATCH_SIZE, std::chrono::microseconds maxLatency = std::chrono::microseconds(100),
+                std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+        /**
+         * Evaluate the pending requests and stop the worker
+         */
+        virtual ~EvaluationQueue();
+
+        EvaluationQueue(const EvaluationQueue&) = delete;
+
+        EvaluationQueue& operator=(const EvaluationQueue&) = delete;
+
+        /**
+         * Submit an evaluation (thread safe)
+         * @param expression expression to evaluate
+         * @param vars values of the variables of the expression
+         * @return the result, or the exception thrown compiling or evaluating the expression
+         */
+        std::future<double> submit(const string &expression, const vector<std::pair<string, double>> &vars);
+
+        /**
+         * Drain the queue without waiting for the latency bound
+         */
+        void flush();
+
+        QueueStats getStats() const;
+
+    private:
+
+        struct State;
+
+        std::pmr::polymorphic_allocator<> allocator;
+
+        State *state;
+
+        /**
+         * Worker loop
+         */
+        void run();
 
     };
 